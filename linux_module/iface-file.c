@@ -11,6 +11,7 @@
 #include <linux/uaccess.h>
 #include <linux/module.h>
 #include <linux/uio.h>
+#include <linux/falloc.h>
 
 #include "palacios.h"
 #include "mm.h"
@@ -529,6 +530,69 @@ palacios_file_writev(void     * file_ptr,
 
 
 
+static int
+palacios_file_sync(void * file_ptr)
+{
+    struct palacios_file * pfile = (struct palacios_file *)file_ptr;
+    int ret = 0;
+
+    ret = vfs_fsync(pfile->filp, 1);
+
+    if (ret != 0) {
+	ERROR("fsync of %s failed (ret=%d)\n", pfile->path, ret);
+    }
+
+    return ret;
+}
+
+
+static int
+palacios_file_fallocate(struct palacios_file * pfile,
+			int                    mode,
+			loff_t                 offset,
+			loff_t                 length)
+{
+    int ret = 0;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,18,0)
+    ret = do_fallocate(pfile->filp, mode, offset, length);
+#else
+    ret = vfs_fallocate(pfile->filp, mode, offset, length);
+#endif
+
+    if (ret != 0) {
+	DEBUG("fallocate (mode=%x) of %s for %lld bytes at offset %lld failed (ret=%d)\n", 
+	      mode, pfile->path, length, offset, ret);
+	return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+palacios_file_discard(void   * file_ptr,
+		      loff_t   offset,
+		      loff_t   length)
+{
+    return palacios_file_fallocate(file_ptr, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+}
+
+
+static int
+palacios_file_zero(void   * file_ptr,
+		   loff_t   offset,
+		   loff_t   length)
+{
+#ifdef FALLOC_FL_ZERO_RANGE
+    return palacios_file_fallocate(file_ptr, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, length);
+#else
+    return -1;
+#endif
+}
+
+
+
 static struct v3_file_hooks palacios_file_hooks = {
 	.mkdir          = palacios_file_mkdir,
 	.size		= palacios_file_size,
@@ -537,7 +601,10 @@ static struct v3_file_hooks palacios_file_hooks = {
 	.read		= palacios_file_read,
 	.write		= palacios_file_write,
 	.readv          = palacios_file_readv,
-	.writev         = palacios_file_writev
+	.writev         = palacios_file_writev,
+	.sync           = palacios_file_sync,
+	.discard        = palacios_file_discard,
+	.zero           = palacios_file_zero
 };
 
 
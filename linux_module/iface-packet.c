@@ -25,6 +25,12 @@
 #include "vm.h"
 #include "mm.h"
 
+/* Frames received from the host nic in one pass of the receive thread */
+#define PACKET_RECV_BATCH V3_NET_MAX_BATCH
+
+/* Bytes of a frame looked at to find its receiver before receiving it in place */
+#define PACKET_PEEK_LEN 128
+
 /* there is one for each host nic */
 struct raw_interface {
     char eth_dev[126];  /* host nic name "eth0" ... */
@@ -60,12 +66,13 @@ static inline int hash_eq(uintptr_t key1, uintptr_t key2) {
 
 
 static int 
-recv_pkt(struct socket * raw_sock, 
-	 unsigned char * pkt, 
-	 unsigned int    len) 
+__recv_pkt(struct socket * raw_sock, 
+	   struct iovec  * iov, 
+	   unsigned int    iovlen, 
+	   unsigned int    len,
+	   int             flags) 
 {
     struct msghdr msg;
-    struct iovec  iov;
     mm_segment_t  oldfs;
     unsigned int  size  = 0;
     
@@ -73,16 +80,13 @@ recv_pkt(struct socket * raw_sock,
 	return -1;
     }
 
-    iov.iov_base = pkt;
-    iov.iov_len  = len;
-    
-    msg.msg_flags      = 0;
+    msg.msg_flags      = flags;
     msg.msg_name       = NULL;
     msg.msg_namelen    = 0;
     msg.msg_control    = NULL;
     msg.msg_controllen = 0;
-    msg.msg_iov        = &iov;
-    msg.msg_iovlen     = 1;
+    msg.msg_iov        = iov;
+    msg.msg_iovlen     = iovlen;
     msg.msg_control    = NULL;
     
     oldfs = get_fs();
@@ -93,6 +97,36 @@ recv_pkt(struct socket * raw_sock,
     return size;
 }
 
+static int 
+recv_pkt(struct socket * raw_sock, 
+	 unsigned char * pkt, 
+	 unsigned int    len,
+	 int             nonblocking) 
+{
+    struct iovec iov;
+
+    iov.iov_base = pkt;
+    iov.iov_len  = len;
+
+    return __recv_pkt(raw_sock, &iov, 1, len, (nonblocking ? MSG_DONTWAIT : 0));
+}
+
+/* Look at the head of the next frame without dequeuing it, returns the full frame length */
+static int 
+peek_pkt(struct socket * raw_sock, 
+	 unsigned char * hdr, 
+	 unsigned int    len,
+	 int             nonblocking) 
+{
+    struct iovec iov;
+
+    iov.iov_base = hdr;
+    iov.iov_len  = len;
+
+    return __recv_pkt(raw_sock, &iov, 1, len, 
+		      MSG_PEEK | MSG_TRUNC | (nonblocking ? MSG_DONTWAIT : 0));
+}
+
 
 static int 
 init_socket(struct raw_interface * iface, 
@@ -159,37 +193,43 @@ is_broadcast_ethaddr(const unsigned char * addr)
     return (ret == 0xff);
 }
 
-static int 
-packet_recv_thread( void * arg ) 
+/* Hand a run of unicast frames for one receiver over in a single call if it takes batches */
+static void
+deliver_frames(struct v3_packet    * recver_state, 
+	       struct v3_net_frame * frames, 
+	       int                   num_frames)
 {
-    struct raw_interface * iface        = (struct raw_interface *)arg;
-    unsigned char        * pkt          = NULL;
-    struct v3_packet     * recver_state = NULL;
-    int size;
+    int i = 0;
 
-    pkt = (unsigned char *)palacios_kmalloc(ETHERNET_PACKET_LEN, GFP_KERNEL);
-    
-    if (!pkt) {
-	ERROR("Unable to allocate packet in vnet receive thread\n");
-	return -1;
+    if (recver_state->input_batch) {
+	recver_state->input_batch(recver_state, frames, num_frames);
+	return;
     }
 
-    v3_lnx_printk("Palacios Raw Packet Bridge: Staring receiving on ethernet device %s\n", 
-		  iface->eth_dev);
+    for (i = 0; i < num_frames; i++) {
+	recver_state->input(recver_state, frames[i].buf, frames[i].len);
+    }
+}
 
-    while (!kthread_should_stop()) {
-	size = recv_pkt(iface->raw_sock, pkt, ETHERNET_PACKET_LEN);
-	
-	if (size < 0) {
-	    ERROR("Palacios raw packet receive error, Server terminated\n");
-	    break;
-	}
+static void
+dispatch_frames(struct raw_interface * iface, 
+		struct v3_net_frame  * frames, 
+		int                    num_frames)
+{
+    struct v3_packet * recver_state = NULL;
+    int i;
+    int j;
+
+    for (i = 0; i < num_frames; i = j) {
+	unsigned char * pkt = frames[i].buf;
+
+	j = i + 1;
 
 	if (is_broadcast_ethaddr(pkt)) {
 	    /* Broadcast */
 
 	    list_for_each_entry(recver_state, &(iface->brdcast_recvers), node) {
-		recver_state->input(recver_state, pkt, size);
+		recver_state->input(recver_state, pkt, frames[i].len);
 	    }
 	    
 	} else if(is_multicast_ethaddr(pkt)) {
@@ -198,11 +238,157 @@ packet_recv_thread( void * arg )
 	} else {
 	    recver_state = (struct v3_packet *)palacios_htable_search(iface->mac_to_recver,
 								      (uintptr_t)pkt);
+
+	    /* Batch up the following frames for the same receiver */
+	    while ((j < num_frames) && 
+		   !is_multicast_ethaddr(frames[j].buf) && 
+		   (memcmp(frames[j].buf, pkt, ETH_ALEN) == 0)) {
+		j++;
+	    }
+
 	    if (recver_state != NULL) {
-		recver_state->input(recver_state, pkt, size);
+		deliver_frames(recver_state, &(frames[i]), j - i);
+	    }
+	}
+    }
+}
+
+static int
+has_zero_copy_recver(struct raw_interface * iface) 
+{
+    struct v3_packet * recver_state = NULL;
+
+    list_for_each_entry(recver_state, &(iface->brdcast_recvers), node) {
+	if (recver_state->rx_map) {
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+/* 
+ * Receive a peeked unicast frame straight into the guest buffers of its receiver.
+ * Returns -1 if the frame has to take the copying path instead.
+ */
+static int
+recv_zero_copy(struct raw_interface * iface, 
+	       unsigned char        * hdr, 
+	       unsigned int           hdr_len, 
+	       unsigned int           len, 
+	       struct v3_net_frame  * pending, 
+	       int                  * num_pending)
+{
+    struct v3_packet   * recver_state = NULL;
+    struct v3_net_rx_map map;
+    struct iovec         iov[V3_NET_MAX_IOV];
+    int size = 0;
+    int i    = 0;
+
+    if ((hdr_len < ETH_ALEN) || is_multicast_ethaddr(hdr)) {
+	return -1;
+    }
+
+    recver_state = (struct v3_packet *)palacios_htable_search(iface->mac_to_recver, (uintptr_t)hdr);
+
+    if ((recver_state == NULL) || (recver_state->rx_map == NULL)) {
+	return -1;
+    }
+
+    /* Keep the frames already queued for the guest in order */
+    if (*num_pending > 0) {
+	dispatch_frames(iface, pending, *num_pending);
+	*num_pending = 0;
+    }
+
+    if (recver_state->rx_map(recver_state, hdr, hdr_len, len, &map) != 0) {
+	return -1;
+    }
+
+    for (i = 0; i < map.num_iov; i++) {
+	iov[i].iov_base = map.iov[i].buf;
+	iov[i].iov_len  = map.iov[i].len;
+    }
+
+    size = __recv_pkt(iface->raw_sock, iov, map.num_iov, len, MSG_DONTWAIT);
+
+    recver_state->rx_complete(recver_state, &map, (size < 0) ? 0 : size);
+
+    return 0;
+}
+
+static int 
+packet_recv_thread( void * arg ) 
+{
+    struct raw_interface * iface        = (struct raw_interface *)arg;
+    unsigned char        * pkts         = NULL;
+    unsigned char          hdr[PACKET_PEEK_LEN];
+    struct v3_net_frame    frames[PACKET_RECV_BATCH];
+    int num_frames = 0;
+    int zero_copy  = 0;
+    int nonblocking;
+    int size;
+    int n;
+
+    pkts = (unsigned char *)palacios_kmalloc(ETHERNET_PACKET_LEN * PACKET_RECV_BATCH, GFP_KERNEL);
+    
+    if (!pkts) {
+	ERROR("Unable to allocate packet in vnet receive thread\n");
+	return -1;
+    }
+
+    v3_lnx_printk("Palacios Raw Packet Bridge: Staring receiving on ethernet device %s\n", 
+		  iface->eth_dev);
+
+    while (!kthread_should_stop()) {
+	zero_copy   = has_zero_copy_recver(iface);
+	num_frames  = 0;
+	nonblocking = 0;
+	size        = 0;
+
+	/* Block for the first frame, then pick up whatever else is already queued */
+	for (n = 0; n < PACKET_RECV_BATCH; n++) {
+	    unsigned char * pkt = pkts + (num_frames * ETHERNET_PACKET_LEN);
+
+	    if (zero_copy) {
+		size = peek_pkt(iface->raw_sock, hdr, PACKET_PEEK_LEN, nonblocking);
+
+		if (size < 0) {
+		    break;
+		}
+
+		nonblocking = 1;
+
+		if (recv_zero_copy(iface, hdr, (size < PACKET_PEEK_LEN) ? size : PACKET_PEEK_LEN, 
+				   size, frames, &num_frames) == 0) {
+		    continue;
+		}
+
+		pkt = pkts + (num_frames * ETHERNET_PACKET_LEN);
 	    }
+
+	    size = recv_pkt(iface->raw_sock, pkt, ETHERNET_PACKET_LEN, nonblocking);
+
+	    if (size < 0) {
+		break;
+	    }
+
+	    frames[num_frames].buf = pkt;
+	    frames[num_frames].len = size;
+	    num_frames++;
+
+	    nonblocking = 1;
+	}
+
+	if ((size < 0) && (nonblocking == 0)) {
+	    ERROR("Palacios raw packet receive error, Server terminated\n");
+	    break;
 	}
+
+	dispatch_frames(iface, frames, num_frames);
     }
+
+    palacios_kfree(pkts);
     
     return 0;
 }
@@ -316,22 +502,16 @@ palacios_packet_connect(struct v3_packet * packet,
 }
 
 static int
-palacios_packet_send(struct v3_packet * packet, 
-		     unsigned char    * pkt, 
-		     unsigned int       len) 
+__packet_send(struct raw_interface * iface, 
+	      unsigned char        * pkt, 
+	      unsigned int           len,
+	      int                    flags) 
 {
-    struct raw_interface * iface = (struct raw_interface *)packet->host_packet_data;
     struct msghdr msg;
     struct iovec  iov;
     mm_segment_t  oldfs;
     int size = 0;
 	
-    if ( (iface->inited   == 0) || 
-	 (iface->raw_sock == NULL) ) {
-	ERROR("Palacios Packet Interface: Send fails due to inapproriate interface\n");
-	return -1;
-    }
-	
     iov.iov_base = (void *)pkt;
     iov.iov_len  = (__kernel_size_t)len;
 
@@ -341,7 +521,7 @@ palacios_packet_send(struct v3_packet * packet,
     msg.msg_controllen = 0;
     msg.msg_name       = NULL;
     msg.msg_namelen    = 0;
-    msg.msg_flags      = 0;
+    msg.msg_flags      = flags;
 
     oldfs = get_fs();
     set_fs(KERNEL_DS);
@@ -351,6 +531,52 @@ palacios_packet_send(struct v3_packet * packet,
     return size;
 }
 
+static int
+palacios_packet_send(struct v3_packet * packet, 
+		     unsigned char    * pkt, 
+		     unsigned int       len) 
+{
+    struct raw_interface * iface = (struct raw_interface *)packet->host_packet_data;
+	
+    if ( (iface->inited   == 0) || 
+	 (iface->raw_sock == NULL) ) {
+	ERROR("Palacios Packet Interface: Send fails due to inapproriate interface\n");
+	return -1;
+    }
+
+    return __packet_send(iface, pkt, len, 0);
+}
+
+static int
+palacios_packet_send_batch(struct v3_packet    * packet, 
+			   struct v3_net_frame * frames, 
+			   uint32_t              num_frames) 
+{
+    struct raw_interface * iface = (struct raw_interface *)packet->host_packet_data;
+    int flags = 0;
+    int sent  = 0;
+    int i     = 0;
+	
+    if ( (iface->inited   == 0) || 
+	 (iface->raw_sock == NULL) ) {
+	ERROR("Palacios Packet Interface: Send fails due to inapproriate interface\n");
+	return -1;
+    }
+
+    for (i = 0; i < num_frames; i++) {
+#ifdef MSG_BATCH
+	/* Tell the stack more frames follow, as sendmmsg() does */
+	flags = (i < (num_frames - 1)) ? MSG_BATCH : 0;
+#endif
+
+	if (__packet_send(iface, frames[i].buf, frames[i].len, flags) >= 0) {
+	    sent++;
+	}
+    }
+
+    return sent;
+}
+
 
 static void
 palacios_packet_close(struct v3_packet * packet) 
@@ -368,6 +594,7 @@ static struct v3_packet_hooks palacios_packet_hooks = {
     .connect = palacios_packet_connect,
     .send    = palacios_packet_send,
     .close   = palacios_packet_close,
+    .send_batch = palacios_packet_send_batch,
 };
 
 static int 
@@ -374,6 +374,25 @@ palacios_sleep_cpu(unsigned int us)
     return;
 }
 
+/* The state is set before the check, so a wakeup after it makes schedule() return */
+void
+palacios_sleep_cpu_until(unsigned int us, int (*done)(void * arg), void * arg)
+{
+    set_current_state(TASK_INTERRUPTIBLE);
+
+    if (!done(arg)) {
+	if (us) {
+	    unsigned int uspj    = 1000000U/HZ;
+	    unsigned int jiffies = (us / uspj) + ( (us % uspj) != 0 ) ;  // ceiling 
+	    schedule_timeout(jiffies);
+	} else {
+	    schedule();
+	}
+    }
+
+    __set_current_state(TASK_RUNNING);
+}
+
 void 
 palacios_wakeup_cpu(void * thread)
 {
@@ -458,6 +477,7 @@ static struct v3_os_hooks palacios_os_hooks = {
 	.yield_to_pid           = NULL,
 	.yield_to_thread        = NULL,
 	.sleep_cpu		= palacios_sleep_cpu,
+	.sleep_cpu_until	= palacios_sleep_cpu_until,
 	.wakeup_cpu		= palacios_wakeup_cpu,
 	.save_fpu               = palacios_save_fpu,
 	.restore_fpu            = palacios_restore_fpu,
@@ -29,6 +29,9 @@
 
 #define VNET_YIELD_TIME_USEC 1000
 
+/* Received datagrams are packed into the pool until less than a maximum sized one fits */
+#define VNET_RX_POOL_SIZE (2 * MAX_PACKET_LEN)
+
 struct vnet_link {
     uint32_t dst_ip;
     uint16_t dst_port;
@@ -265,7 +268,8 @@ static int
 _udp_send(struct socket      * sock, 
 	  struct sockaddr_in * addr,
 	  unsigned char      * buf,  
-	  int                  len) 
+	  int                  len,
+	  int                  flags) 
 {
     struct msghdr msg;
     struct iovec  iov;
@@ -280,7 +284,7 @@ _udp_send(struct socket      * sock,
     iov.iov_base       = buf;
     iov.iov_len        = len;
 
-    msg.msg_flags      = 0;
+    msg.msg_flags      = flags;
     msg.msg_name       = addr;
     msg.msg_namelen    = sizeof(struct sockaddr_in);
     msg.msg_control    = NULL;
@@ -335,41 +339,45 @@ _udp_recv(struct socket      * sock,
     return size;
 }
 
-/* send packets to VNET core */
-static int 
-send_to_palacios(unsigned char * buf, 
-		 int             len,
-		 int             link_id)
+/* fill in a packet for the VNET core */
+static void 
+init_palacios_pkt(struct v3_vnet_pkt * pkt,
+		  unsigned char      * buf, 
+		  int                  len,
+		  int                  link_id)
 {
-    struct v3_vnet_pkt pkt;
-
-    pkt.size     = len;
-    pkt.src_type = LINK_EDGE;
-    pkt.src_id   = link_id;
-    memcpy(pkt.header, buf, ETHERNET_HEADER_LEN);
-    pkt.data     = buf;
+    pkt->size     = len;
+    pkt->src_type = LINK_EDGE;
+    pkt->src_id   = link_id;
+    memcpy(pkt->header, buf, ETHERNET_HEADER_LEN);
+    pkt->data     = buf;
 
     if (net_debug >= 2) {
 
     	DEBUG("VNET Lnx Bridge: send pkt to VNET core (size: %d, src_id: %d, src_type: %d)\n", 
-	      pkt.size,  pkt.src_id, pkt.src_type);
+	      pkt->size,  pkt->src_id, pkt->src_type);
 
     	if (net_debug >= 4) {
-	    print_hex_dump(NULL, "pkt_data: ", 0, 20, 20, pkt.data, pkt.size, 0);
+	    print_hex_dump(NULL, "pkt_data: ", 0, 20, 20, pkt->data, pkt->size, 0);
     	}
     }
+}
 
-    vnet_brg_s.stats.pkt_to_vmm++;
+/* send packets to VNET core */
+static int 
+send_to_palacios(struct v3_vnet_pkt * pkts, 
+		 int                  num_pkts)
+{
+    vnet_brg_s.stats.pkt_to_vmm += num_pkts;
 
-    return v3_vnet_send_pkt(&pkt, NULL);
+    return v3_vnet_send_pkts(pkts, num_pkts, NULL);
 }
 
 
 /* send packet to extern network */
 static int 
-bridge_send_pkt(struct v3_vm_info  * vm, 
-		struct v3_vnet_pkt * pkt, 
-		void               * private_data) 
+__bridge_send_pkt(struct v3_vnet_pkt * pkt, 
+		  int                  flags) 
 {
     struct vnet_link * link = NULL;
 
@@ -392,7 +400,7 @@ bridge_send_pkt(struct v3_vm_info  * vm,
 
 	switch (link->sock_proto) {
 	    case UDP:
- 	    	_udp_send(link->sock, &(link->sock_addr), pkt->data, pkt->size);
+ 	    	_udp_send(link->sock, &(link->sock_addr), pkt->data, pkt->size, flags);
 		vnet_brg_s.stats.pkt_to_phy++;
 		break;
 	    case TCP:
@@ -416,6 +424,35 @@ bridge_send_pkt(struct v3_vm_info  * vm,
     return 0;
 }
 
+static int 
+bridge_send_pkt(struct v3_vm_info  * vm, 
+		struct v3_vnet_pkt * pkt, 
+		void               * private_data) 
+{
+    return __bridge_send_pkt(pkt, 0);
+}
+
+static int 
+bridge_send_pkts(struct v3_vm_info   * vm, 
+		 struct v3_vnet_pkt ** pkts, 
+		 uint32_t              num_pkts,
+		 void                * private_data) 
+{
+    int flags = 0;
+    int i     = 0;
+
+    for (i = 0; i < num_pkts; i++) {
+#ifdef MSG_BATCH
+	/* Tell the stack more datagrams follow, as sendmmsg() does */
+	flags = (i < (num_pkts - 1)) ? MSG_BATCH : 0;
+#endif
+
+	__bridge_send_pkt(pkts[i], flags);
+    }
+
+    return num_pkts;
+}
+
 
 static int 
 init_vnet_serv(void) 
@@ -476,16 +513,19 @@ init_vnet_serv(void)
 static int 
 _udp_server(void * arg)
 {
-    unsigned char     * pkt      = NULL;
+    unsigned char     * pool     = NULL;
     struct vnet_link  * link     = NULL;
     struct sockaddr_in  pkt_addr;
-    int len = 0;
+    struct v3_vnet_pkt  pkts[VNET_MAX_BATCH];
+    int num_pkts = 0;
+    int offset   = 0;
+    int len      = 0;
 
     INFO("Palacios VNET Bridge: UDP receiving server ..... \n");
 
-    pkt = palacios_kmalloc(MAX_PACKET_LEN, GFP_KERNEL);
+    pool = palacios_kmalloc(VNET_RX_POOL_SIZE, GFP_KERNEL);
 
-    if (pkt == NULL) { 
+    if (pool == NULL) { 
 	ERROR("Unable to allocate packet in VNET UDP Server\n");
 	return -1;
     }
@@ -494,7 +534,7 @@ _udp_server(void * arg)
     while (!kthread_should_stop()) {
 
 	/* This is a NONBLOCKING receive */
-    	len = _udp_recv(vnet_brg_s.serv_sock, &pkt_addr, pkt, MAX_PACKET_LEN, 1); 
+    	len = _udp_recv(vnet_brg_s.serv_sock, &pkt_addr, pool + offset, MAX_PACKET_LEN, 1); 
 
 
 	/*
@@ -505,6 +545,14 @@ _udp_server(void * arg)
 	     (len == -EWOULDBLOCK) ||
 	     (len == -EINTR) ) { 
 
+	    /* Deliver what we have before going idle */
+	    if (num_pkts > 0) {
+		send_to_palacios(pkts, num_pkts);
+		num_pkts = 0;
+		offset   = 0;
+		continue;
+	    }
+
 	    palacios_yield_cpu_timed(VNET_YIELD_TIME_USEC);
 	    continue;
 	}
@@ -526,12 +574,22 @@ _udp_server(void * arg)
 	link->stats.rx_bytes          += len;
 	link->stats.rx_pkts           += 1;
 
-	send_to_palacios(pkt, len, link->idx);
+	init_palacios_pkt(&(pkts[num_pkts]), pool + offset, len, link->idx);
+
+	num_pkts++;
+	offset += len;
+
+	if ((num_pkts == VNET_MAX_BATCH) || 
+	    ((offset + MAX_PACKET_LEN) > VNET_RX_POOL_SIZE)) {
+	    send_to_palacios(pkts, num_pkts);
+	    num_pkts = 0;
+	    offset   = 0;
+	}
     }
 
     INFO("VNET Server: UDP thread exiting\n");
 
-    palacios_kfree(pkt);
+    palacios_kfree(pool);
 
     return 0;
 }
@@ -596,8 +654,9 @@ vnet_bridge_init(void)
 
     vnet_brg_s.serv_thread = kthread_run(_rx_server, NULL, "vnet_brgd");
 
-    bridge_ops.input = bridge_send_pkt;
-    bridge_ops.poll  = NULL;
+    bridge_ops.input       = bridge_send_pkt;
+    bridge_ops.poll        = NULL;
+    bridge_ops.input_batch = bridge_send_pkts;
 	
     if (v3_vnet_add_bridge(NULL, &bridge_ops, HOST_LNX_BRIDGE, NULL) < 0) {
 	WARNING("VNET LNX Bridge: Fails to register bridge to VNET core");
@@ -5,6 +5,7 @@
 
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/moduleparam.h>
 #include <linux/spinlock.h>
 #include <linux/gfp.h>
 #include <linux/sched.h>
@@ -20,6 +21,12 @@
 #include "linux-exts.h"
 
 
+/* Host cores for the VNET TX flush workers */
+static int vnet_cpus[V3_CONFIG_MAX_CPUS];
+static int num_vnet_cpus = 0;
+module_param_array(vnet_cpus, int, &num_vnet_cpus, 0644);
+MODULE_PARM_DESC(vnet_cpus, "Comma-delimited list of CPUs to run VNET polling threads on, one thread each");
+
 
 
 static void 
@@ -36,6 +43,40 @@ host_kthread_sleep(long timeout)
     return;
 }
 
+static void 
+host_kthread_sleep_until(long    timeout, 
+			 int   (*done)(void * arg), 
+			 void  * arg)
+{
+    // A wake_up_process() after this point makes schedule() return at once
+    set_current_state(TASK_INTERRUPTIBLE);
+
+    if (!done(arg)) {
+	if (timeout <= 0) {
+	    schedule();
+	} else {
+	    schedule_timeout(timeout);
+	}
+    }
+
+    __set_current_state(TASK_RUNNING);
+}
+
+static void *
+host_start_kthread_on_cpu(int    cpu, 
+			  int  (*fn)(void * arg), 
+			  void * arg, 
+			  char * thread_name)
+{
+    void * thread = palacios_create_thread_on_cpu(cpu, fn, arg, thread_name);
+
+    if (thread) {
+	palacios_start_thread(thread);
+    }
+
+    return thread;
+}
+
 static void 
 host_kthread_wakeup(void * thread)
 {
@@ -168,6 +209,8 @@ extern void   palacios_free(void * addr);
 extern void * palacios_vaddr_to_paddr(void * vaddr);
 extern void * palacios_paddr_to_vaddr(void * paddr);
 extern void   palacios_yield_cpu(void);
+extern void * palacios_create_thread_on_cpu(int cpu_id, int (*fn)(void * arg), void * arg, char * thread_name);
+extern void   palacios_start_thread(void * thread);
 extern void * palacios_mutex_alloc(void);
 extern void   palacios_mutex_free(void * mutex);
 extern void   palacios_mutex_lock(void * mutex, int must_spin);
@@ -181,7 +224,9 @@ static struct vnet_host_hooks vnet_host_hooks = {
     .timer_reset	        = host_reset_timer,
 
     .thread_start 	        = palacios_start_kernel_thread,
+    .thread_start_on_cpu        = host_start_kthread_on_cpu,
     .thread_sleep  	        = host_kthread_sleep,
+    .thread_sleep_until         = host_kthread_sleep_until,
     .thread_wakeup	        = host_kthread_wakeup,
     .thread_stop	        = host_kthread_stop,
     .thread_should_stop	        = host_kthread_should_stop,
@@ -207,7 +252,7 @@ static struct vnet_host_hooks vnet_host_hooks = {
 static int 
 vnet_init( void ) 
 {
-    init_vnet(&vnet_host_hooks);
+    init_vnet(&vnet_host_hooks, vnet_cpus, num_vnet_cpus);
 	
     vnet_bridge_init();
     vnet_ctrl_init();
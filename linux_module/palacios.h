@@ -47,6 +47,9 @@
 #define V3_VM_KEYBOARD_EVENT     142   /* Send a scan scode to the VM's virtual keyboard             */
 #define V3_VM_STREAM_CONNECT     145   /* Connect to a VM's named data stream                        */
 
+#define V3_VM_TELEMETRY_EXITS    146   /* Read per exit latency histograms for a VCPU                */
+#define V3_VM_TELEMETRY_TRACE    147   /* Drain a VCPU's exit trace ring                             */
+
 
 
 #define V3_VM_XPMEM_CONNECT      12000
@@ -74,6 +77,18 @@ struct v3_core_move_cmd {
     unsigned short pcore_id;
 } __attribute__((packed));
 
+struct v3_telemetry_cmd {
+    unsigned int       core;
+    unsigned int       max_entries;  /* Capacity of buf in entries */
+    unsigned int       num_entries;  /* Entries returned in buf */
+    unsigned int       rsvd;
+    unsigned long long exit_cnt;
+    unsigned long long guest_cycles;
+    unsigned long long host_cycles;
+    unsigned long long lost;         /* Trace records dropped because the ring overflowed */
+    unsigned long long buf;          /* User buffer of v3_telem_exit_stats or v3_telem_record entries */
+} __attribute__((packed));
+
 struct v3_chkpt_info {
     char store[128];
     char url[256];
@@ -22,6 +22,7 @@
 
 #include <palacios/vmm.h>
 #include <palacios/vmm_host_events.h>
+#include <palacios/vmm_telemetry.h>
 
 #include "palacios.h"
 #include "vm.h"
@@ -156,6 +157,84 @@ static void free_guest_ctrls(struct v3_guest * guest) {
 extern struct class * v3_class;
 
 
+#ifdef V3_CONFIG_TELEMETRY
+
+#define MAX_TELEMETRY_RECS 65536
+
+static long vm_telemetry_ioctl(struct v3_guest * guest, unsigned int ioctl, unsigned long arg) {
+    struct v3_telemetry_cmd cmd;
+    struct v3_telem_core_stats stats;
+    void __user * argp = (void __user *)arg;
+    void * buf = NULL;
+    unsigned int entry_size = 0;
+    unsigned int max_entries = 0;
+    int ret = 0;
+
+    memset(&cmd, 0, sizeof(struct v3_telemetry_cmd));
+
+    if (copy_from_user(&cmd, argp, sizeof(struct v3_telemetry_cmd))) {
+	ERROR("Could not copy telemetry command from user space\n");
+	return -EFAULT;
+    }
+
+    if (ioctl == V3_VM_TELEMETRY_EXITS) {
+	entry_size  = sizeof(struct v3_telem_exit_stats);
+	max_entries = V3_TELEM_MAX_EXITS;
+    } else {
+	entry_size  = sizeof(struct v3_telem_record);
+	max_entries = MAX_TELEMETRY_RECS;
+    }
+
+    if (cmd.max_entries < max_entries) {
+	max_entries = cmd.max_entries;
+    }
+
+    if (max_entries > 0) {
+	buf = vmalloc(max_entries * entry_size);
+
+	if (!buf) {
+	    ERROR("Could not allocate telemetry buffer\n");
+	    return -ENOMEM;
+	}
+    }
+
+    if (ioctl == V3_VM_TELEMETRY_EXITS) {
+	ret = v3_get_telemetry_exits(guest->v3_ctx, cmd.core, buf, max_entries);
+    } else {
+	ret = v3_get_telemetry_records(guest->v3_ctx, cmd.core, buf, max_entries);
+    }
+
+    if ((ret < 0) || (v3_get_telemetry_core(guest->v3_ctx, cmd.core, &stats) == -1)) {
+	ERROR("Could not read telemetry for core %d\n", cmd.core);
+	vfree(buf);
+	return -EFAULT;
+    }
+
+    cmd.num_entries  = ret;
+    cmd.exit_cnt     = stats.exit_cnt;
+    cmd.guest_cycles = stats.guest_cycles;
+    cmd.host_cycles  = stats.host_cycles;
+    cmd.lost         = stats.lost;
+
+    if ((ret > 0) && (copy_to_user((void __user *)(uintptr_t)cmd.buf, buf, ret * entry_size))) {
+	ERROR("Could not copy telemetry to user space\n");
+	vfree(buf);
+	return -EFAULT;
+    }
+
+    vfree(buf);
+
+    if (copy_to_user(argp, &cmd, sizeof(struct v3_telemetry_cmd))) {
+	ERROR("Could not copy telemetry command to user space\n");
+	return -EFAULT;
+    }
+
+    return 0;
+}
+
+#endif
+
+
 static long v3_vm_ioctl(struct file * filp,
 			unsigned int ioctl, unsigned long arg) {
 
@@ -327,6 +406,12 @@ static long v3_vm_ioctl(struct file * filp,
 
 	    break;
 	}
+#ifdef V3_CONFIG_TELEMETRY
+	case V3_VM_TELEMETRY_EXITS:
+	case V3_VM_TELEMETRY_TRACE: {
+	    return vm_telemetry_ioctl(guest, ioctl, arg);
+	}
+#endif
 	default: {
 	    struct vm_ctrl * ctrl = get_ctrl(guest, ioctl);
 
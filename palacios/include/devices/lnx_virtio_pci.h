@@ -23,6 +23,8 @@
 
 #ifdef __V3VEE__
 
+#include <palacios/vmm_mem.h>
+#include <devices/pci.h>
 
 /* PCI Vendor IDs (from Qemu) */
 #define VIRTIO_VENDOR_ID              0x1af4 // Redhat/Qumranet
@@ -56,6 +58,19 @@
 #define VIRTIO_STATUS_PORT            18
 #define VIRTIO_ISR_PORT               19
 
+/* Only present while MSI-X is enabled, the device specific config follows them */
+#define VIRTIO_MSI_CONFIG_VECTOR_PORT 20
+#define VIRTIO_MSI_QUEUE_VECTOR_PORT  22
+#define VIRTIO_MSI_CONFIG_SIZE        4
+
+#define VIRTIO_MSI_NO_VECTOR          0xffff
+
+/* MSI-X layout shared by the virtio devices, the table and PBA share a single page in BAR 1 */
+#define VIRTIO_MSIX_BAR               1
+#define VIRTIO_MSIX_CAP_OFFSET        0x40
+#define VIRTIO_MSIX_PBA_OFFSET        0x800
+#define VIRTIO_MSIX_ENTRY_SIZE        16
+
 #define VIRTIO_PAGE_SHIFT             12
 
 
@@ -81,6 +96,10 @@
 #define VIRTIO_ISR_CFG_CHANGED   0x2
 
 
+/* Transport feature bits */
+#define VIRTIO_RING_F_EVENT_IDX  29
+
+
 
 /* The virtio configuration space is a hybrid io/memory mapped model 
  * All IO is done via IO port accesses
@@ -158,6 +177,243 @@ struct virtio_queue {
 };
 
 
+/* With VIRTIO_RING_F_EVENT_IDX the guest publishes the used index it wants an interrupt at
+ * after the avail ring, and we publish the avail index we want a kick at after the used ring */
+static inline uint16_t * 
+vring_used_event(struct virtio_queue * queue) 
+{
+    return &(queue->avail->ring[queue->queue_size]);
+}
+
+static inline uint16_t * 
+vring_avail_event(struct virtio_queue * queue) 
+{
+    return (uint16_t *)&(queue->used->ring[queue->queue_size]);
+}
+
+/* True if event_idx lies in [old_idx, new_idx), i.e. the other side asked to be notified */
+static inline int 
+vring_need_event(uint16_t event_idx, 
+		 uint16_t new_idx, 
+		 uint16_t old_idx) 
+{
+    return ((uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx));
+}
+
+static inline void 
+vring_mb(void) 
+{
+    __asm__ __volatile__ ("mfence" : : : "memory");
+}
+
+
+/* 
+ * Device writes into guest memory do not fault, so they are logged for dirty tracking here:
+ *  the used ring (including the avail event) whenever it is updated, 
+ *  and the writable buffers of a descriptor chain before it is returned
+ */
+static inline void 
+vring_used_dirty(struct v3_vm_info   * vm, 
+		 struct virtio_queue * queue) 
+{
+    v3_mark_range_dirty(vm, queue->ring_used_addr, 
+			sizeof(struct vring_used) + 
+			(sizeof(struct vring_used_elem) * queue->queue_size) + 
+			sizeof(uint16_t));
+}
+
+/* For devices that modify a descriptor in place */
+static inline void 
+vring_desc_dirty(struct v3_vm_info   * vm, 
+		 struct virtio_queue * queue, 
+		 struct vring_desc   * desc) 
+{
+    v3_mark_range_dirty(vm, queue->ring_desc_addr + ((addr_t)desc - (addr_t)(queue->desc)), 
+			sizeof(struct vring_desc));
+}
+
+static inline void 
+vring_chain_dirty(struct v3_vm_info   * vm, 
+		  struct virtio_queue * queue, 
+		  uint16_t              desc_idx) 
+{
+    int i = 0;
+
+    // Bounded by the ring size in case the guest handed us a looping chain
+    for (i = 0; i < queue->queue_size; i++) {
+	struct vring_desc * desc = &(queue->desc[desc_idx % queue->queue_size]);
+
+	if (desc->flags & VIRTIO_WR_ONLY_FLAG) {
+	    v3_mark_range_dirty(vm, desc->addr_gpa, desc->length);
+	}
+
+	if ((desc->flags & VIRTIO_NEXT_FLAG) == 0) {
+	    break;
+	}
+
+	desc_idx = desc->next;
+    }
+}
+
+
+/* Guest memory spanned by the descriptor, available and used rings */
+static inline uint64_t 
+vring_mem_size(struct virtio_queue * queue) 
+{
+    return (queue->ring_used_addr - queue->ring_desc_addr) + 
+	sizeof(struct vring_used) + 
+	(sizeof(struct vring_used_elem) * queue->queue_size) + 
+	sizeof(uint16_t);
+}
+
+/* 
+ * Backs the rings and the buffers the guest made available since cur_avail_idx, 
+ *  so lookups under the device's locks or from its IO threads find them allocated and restored.
+ *  This can sleep, so it runs on the exit path before any of the device's locks are taken.
+ */
+static inline int 
+vring_populate(struct v3_vm_info   * vm, 
+	       struct virtio_queue * queue) 
+{
+    uint16_t num_avail = 0;
+    int i = 0;
+    int j = 0;
+
+    if ((queue->avail == NULL) || (queue->queue_size == 0)) {
+	return 0;
+    }
+
+    if (v3_populate_gpa_range(vm, queue->ring_desc_addr, vring_mem_size(queue)) == -1) {
+	return -1;
+    }
+
+    num_avail = queue->avail->index - queue->cur_avail_idx;
+
+    // The device reports a guest that runs ahead of the ring
+    if (num_avail > queue->queue_size) {
+	num_avail = queue->queue_size;
+    }
+
+    for (i = 0; i < num_avail; i++) {
+	uint16_t desc_idx = queue->avail->ring[(uint16_t)(queue->cur_avail_idx + i) % queue->queue_size];
+
+	for (j = 0; j < queue->queue_size; j++) {
+	    struct vring_desc * desc = &(queue->desc[desc_idx % queue->queue_size]);
+
+	    if (v3_populate_gpa_range(vm, desc->addr_gpa, desc->length) == -1) {
+		return -1;
+	    }
+
+	    if ((desc->flags & VIRTIO_NEXT_FLAG) == 0) {
+		break;
+	    }
+
+	    desc_idx = desc->next;
+	}
+    }
+
+    return 0;
+}
+
+/* For paths that cannot sleep, -1 until the rings are backed. The memory thread populates them meanwhile */
+static inline int 
+vring_try_populate(struct v3_vm_info   * vm, 
+		   struct virtio_queue * queue) 
+{
+    return v3_try_populate_gpa_range(vm, queue->ring_desc_addr, vring_mem_size(queue));
+}
+
+/* For paths that cannot sleep, -1 until every buffer in the chain is backed */
+static inline int 
+vring_chain_try_populate(struct v3_vm_info   * vm, 
+			 struct virtio_queue * queue, 
+			 uint16_t              desc_idx) 
+{
+    int ret = 0;
+    int i   = 0;
+
+    for (i = 0; i < queue->queue_size; i++) {
+	struct vring_desc * desc = &(queue->desc[desc_idx % queue->queue_size]);
+
+	if (v3_try_populate_gpa_range(vm, desc->addr_gpa, desc->length) == -1) {
+	    ret = -1;
+	}
+
+	if ((desc->flags & VIRTIO_NEXT_FLAG) == 0) {
+	    break;
+	}
+
+	desc_idx = desc->next;
+    }
+
+    return ret;
+}
+
+/* 
+ * Supplies the MSI-X capability when the PCI layer scans a device's config space.
+ *  Everything else is left to the cached header.
+ */
+static inline int 
+virtio_msix_cfg_read(uint16_t   num_vectors,
+		     uint32_t   reg_num,
+		     void     * dst,
+		     uint_t     length)
+{
+    uint8_t cap[12];
+    int i = 0; 
+
+    memset(cap, 0, sizeof(cap));
+
+    cap[0]                 = PCI_CAP_MSIX;
+    *(uint16_t *)(cap + 2) = num_vectors - 1;                                /* table size */
+    *(uint32_t *)(cap + 4) = 0                      | VIRTIO_MSIX_BAR;       /* table offset */
+    *(uint32_t *)(cap + 8) = VIRTIO_MSIX_PBA_OFFSET | VIRTIO_MSIX_BAR;       /* PBA offset */
+
+    for (i = 0; i < length; i++) {
+	uint32_t  reg  = reg_num + i;
+	uint8_t * byte = (uint8_t *)dst + i;
+
+	if (reg == 0x06) {
+	    // Capabilities list present
+	    *byte |= 0x10;
+	} else if (reg == 0x34) {
+	    *byte  = VIRTIO_MSIX_CAP_OFFSET;
+	} else if ((reg >= VIRTIO_MSIX_CAP_OFFSET) && (reg < VIRTIO_MSIX_CAP_OFFSET + sizeof(cap))) {
+	    *byte  = cap[reg - VIRTIO_MSIX_CAP_OFFSET];
+	}
+    }
+
+    return 0;
+}
+
+/* Tracks the guest enabling MSI-X, disabling it falls back to the legacy interrupt line */
+static inline void 
+virtio_msix_cmd_update(struct pci_device * pci_dev,
+		       pci_cmd_t           cmd,
+		       int               * msix_enabled)
+{
+    if (cmd == PCI_CMD_MSIX_ENABLE) {
+	*msix_enabled = 1;
+    } else if (cmd == PCI_CMD_MSIX_DISABLE) {
+	*msix_enabled = 0;
+	pci_dev->irq_type = IRQ_INTX;
+    }
+}
+
+/* The MSI-X table is mapped straight into the guest */
+static inline void 
+virtio_msix_init_bar(struct v3_pci_bar * bar,
+		     void              * table_page)
+{
+    bar->type              = PCI_BAR_MEM32;
+    bar->num_pages         = 1;
+    bar->mem_read          = NULL;
+    bar->mem_write         = NULL;
+    bar->default_base_addr = 0xffffffff;
+    bar->host_base_addr    = (addr_t)table_page;
+}
+
+
 
 #endif
 
@@ -39,6 +39,14 @@ ssize_t v3_file_write(v3_file_t file, uint8_t * buf, size_t len, loff_t off);
 ssize_t v3_file_writev(v3_file_t file, v3_iov_t * iov_arr, int iov_len, loff_t off);
 ssize_t v3_file_readv(v3_file_t file, v3_iov_t * iov_arr, int iov_len, loff_t off);
 
+/* These return -1 if the host does not support the operation */
+int v3_file_sync(v3_file_t file);
+int v3_file_discard(v3_file_t file, loff_t off, loff_t len);
+int v3_file_zero(v3_file_t file, loff_t off, loff_t len);
+
+/* Returns 1 if the host can flush files to stable storage */
+int v3_file_can_sync(void);
+
 #endif
 
 #define FILE_OPEN_MODE_READ	  (0x1 << 0)
@@ -73,6 +81,15 @@ struct v3_file_hooks {
 		      int        iov_len, 
 		      loff_t     offset);
 
+    /* Optional: flush written data to stable storage */
+    int (*sync)(void * fd);
+
+    /* Optional: deallocate a range, which then reads back as zeros */
+    int (*discard)(void * fd, loff_t offset, loff_t length);
+
+    /* Optional: zero a range without transferring the data */
+    int (*zero)(void * fd, loff_t offset, loff_t length);
+
 };
 
 
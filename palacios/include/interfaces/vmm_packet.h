@@ -33,6 +33,14 @@ struct v3_packet {
     char dev_mac[ETH_ALEN];
     int (*input)(struct v3_packet * packet, uint8_t * buf, uint32_t len);
 
+    /* Optional: receive up to V3_NET_MAX_BATCH frames at once */
+    int (*input_batch)(struct v3_packet * packet, struct v3_net_frame * frames, uint32_t num_frames);
+
+    /* Optional: receive straight into guest buffers, see v3_packet_enable_zero_copy() */
+    int (*rx_map)(struct v3_packet * packet, uint8_t * hdr, uint32_t hdr_len, uint32_t len, 
+		  struct v3_net_rx_map * map);
+    int (*rx_complete)(struct v3_packet * packet, struct v3_net_rx_map * map, uint32_t len);
+
     struct list_head node;
 };
 
@@ -42,9 +50,17 @@ struct v3_packet {
 struct v3_packet * v3_packet_connect(struct v3_vm_info * vm, const char * host_nic,
 				     const char * mac,
 				     int (*input)(struct v3_packet * packet, uint8_t * buf, uint32_t len),
+				     int (*input_batch)(struct v3_packet * packet, struct v3_net_frame * frames, uint32_t num_frames),
 				     void * guest_packet_data);
 
 int v3_packet_send(struct v3_packet * packet, uint8_t * buf, uint32_t len);
+int v3_packet_send_batch(struct v3_packet * packet, struct v3_net_frame * frames, uint32_t num_frames);
+
+void v3_packet_enable_zero_copy(struct v3_packet * packet, 
+				int (*rx_map)(struct v3_packet * packet, uint8_t * hdr, uint32_t hdr_len, 
+					      uint32_t len, struct v3_net_rx_map * map),
+				int (*rx_complete)(struct v3_packet * packet, struct v3_net_rx_map * map, 
+						   uint32_t len));
 void v3_packet_close(struct v3_packet * packet);
 
 #endif
@@ -53,6 +69,9 @@ struct v3_packet_hooks {
     int (*connect)(struct v3_packet * packet, const char * host_nic, void * host_vm_data);
     int (*send)(struct v3_packet * packet, uint8_t * buf, uint32_t len);
     void (*close)(struct v3_packet * packet);
+
+    /* Optional: returns the number of frames sent */
+    int (*send_batch)(struct v3_packet * packet, struct v3_net_frame * frames, uint32_t num_frames);
 };
 
 extern void V3_Init_Packet(struct v3_packet_hooks * hooks);
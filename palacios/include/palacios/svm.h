@@ -36,6 +36,12 @@
 #define CPUID_SVM_REV_AND_FEATURE_IDS          0x8000000a
 #define CPUID_SVM_REV_AND_FEATURE_IDS_edx_svml 0x00000004
 #define CPUID_SVM_REV_AND_FEATURE_IDS_edx_np   0x00000001
+#define CPUID_SVM_REV_AND_FEATURE_IDS_edx_flush_by_asid 0x00000040
+
+/* VMCB TLB_CONTROL values */
+#define SVM_TLB_FLUSH_NOTHING                  0x0
+#define SVM_TLB_FLUSH_ALL                      0x1
+#define SVM_TLB_FLUSH_GUEST                    0x3  /* Only the entries tagged with the guest's ASID */
 
 #define EFER_MSR_svm_enable                    0x00001000
 
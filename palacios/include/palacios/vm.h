@@ -29,8 +29,11 @@ struct v3_cfg_tree;
 #include <palacios/vmm_types.h>
 #include <palacios/vmm_mem.h>
 #include <palacios/vmm_mem_hook.h>
+#include <palacios/vmm_decode_cache.h>
 #include <palacios/vmm_io.h>
 #include <palacios/vmm_shadow_paging.h>
+#include <palacios/vmm_direct_paging.h>
+#include <palacios/vmm_asid.h>
 #include <palacios/vmm_intr.h>
 #include <palacios/vmm_excp.h>
 #include <palacios/vmm_dev_mgr.h>
@@ -45,6 +48,7 @@ struct v3_cfg_tree;
 #include <palacios/vmm_timeout.h>
 #include <palacios/vmm_fw_cfg.h>
 #include <palacios/vmm_fpu.h>
+#include <palacios/vmm_halt.h>
 
 #include <palacios/vmm_checkpoint.h>
 
@@ -76,6 +80,7 @@ struct v3_core_info {
     v3_paging_mode_t        shdw_pg_mode;
     struct v3_shdw_pg_state shdw_pg_state;
     addr_t                  direct_map_pt;
+    struct v3_asid_state    asid_state;     /* TLB tag (ASID/VPID) this core runs with */
     
 
     union {
@@ -87,6 +92,10 @@ struct v3_core_info {
 	} __attribute__((packed));
     } __attribute__((packed));
 
+    /* Direct map permissions were reduced, flush the TLB before entry. 
+     * Other cores set it, so it is kept out of the flags and cleared with an atomic exchange */
+    uint32_t                flush_direct_map;
+
 
     struct v3_intr_core_state intr_core_state;  /* Per-Core Interrupt state */
     struct v3_excp_state      excp_state;       /* Per-core Exception state */
@@ -108,6 +117,8 @@ struct v3_core_info {
     void    * vmm_data;
 
     uint64_t  yield_start_cycle;
+
+    struct v3_core_halt_state halt_state;
     
     uint64_t  num_exits;
     uint64_t  brk_exit;
@@ -155,8 +166,10 @@ struct v3_vm_info {
     uint32_t                  mem_align;
     struct v3_mem_map         mem_map;
     struct v3_mem_hooks       mem_hooks;
+    struct v3_decode_cache    decode_cache;
 
     struct v3_shdw_impl_state shdw_impl;
+    struct v3_nested_pts      nested_pts;
 
     struct v3_io_map          io_map;
     struct v3_msr_map         msr_map;
@@ -170,6 +183,8 @@ struct v3_vm_info {
     struct v3_time            time_state;
     uint64_t                  yield_cycle_period;  
 
+    struct v3_halt_state      halt_state;
+
     struct v3_host_events     host_event_hooks;
     struct v3_intr_routers    intr_routers;
 
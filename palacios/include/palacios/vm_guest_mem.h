@@ -61,6 +61,30 @@ int v3_hva_to_gpa(struct v3_core_info * core, addr_t host_va, addr_t * guest_pa)
 int v3_gpa_to_hva(struct v3_core_info * core, addr_t guest_pa, addr_t * host_va);
 
 
+/* 
+ * Translation cache for device data paths that keep translating the same guest memory
+ * (virtio rings and buffers). Each entry maps a 2MB (or 4KB) span backed by a single region,
+ * and is tagged with the memory map generation so any change to the map invalidates it.
+ * Lookups are lock free and may run concurrently. A zeroed cache is empty.
+ */
+#define V3_GPA_CACHE_ENTRIES 128
+
+struct v3_gpa_cache_entry {
+    uint32_t seq;        /* Odd while the entry is being filled */
+    uint32_t map_gen;
+    addr_t   gpa;
+    addr_t   size;
+    addr_t   hva;
+};
+
+struct v3_gpa_cache {
+    struct v3_gpa_cache_entry entries[V3_GPA_CACHE_ENTRIES];
+};
+
+// guest_pa -> (cache) -> host_va, falling back to v3_gpa_to_hva()
+int v3_gpa_to_hva_cached(struct v3_core_info * core, struct v3_gpa_cache * cache, addr_t guest_pa, addr_t * host_va);
+
+
 // Look up the address in the guests page tables.. This can cause multiple calls that translate
 //     ------------------------------------------------
 //     |                                              |
@@ -105,6 +129,10 @@ int v3_hva_to_gva(struct v3_core_info * core, addr_t host_va, addr_t  * guest_va
 
 
 
+// Backs lazily allocated guest memory before the accesses below, this can sleep
+int v3_populate_gva_range(struct v3_core_info * core, addr_t gva, size_t count);
+
+
 size_t v3_read_gva(struct v3_core_info * core,  addr_t gva, size_t count,  uint8_t * dest);
 size_t v3_read_gpa(struct v3_core_info * core,  addr_t gpa, size_t count,  uint8_t * dest);
 size_t v3_write_gva(struct v3_core_info * core, addr_t gva, size_t count,  uint8_t * src);
@@ -279,6 +279,17 @@ struct v3_core_info;
         }                                               \
     }  while (0)                                        \
 
+/* Sleeps unless done(arg) holds, wakeups between the check and the sleep are not lost */
+#define V3_SleepUntil(usec, done, arg)					\
+    do {								\
+	extern struct v3_os_hooks * os_hooks;				\
+	if ((os_hooks) && (os_hooks)->sleep_cpu_until) {		\
+	    (os_hooks)->sleep_cpu_until(usec, done, arg);		\
+	} else if (!(done)(arg)) {					\
+	    V3_Sleep(usec);						\
+	}								\
+    } while (0)								\
+
 #define V3_Wakeup(cpu)					\
     do {						\
 	extern struct v3_os_hooks * os_hooks;		\
@@ -371,6 +382,7 @@ struct v3_os_hooks {
     void (*yield_to_pid)(unsigned int pid, unsigned int tid);  /* Optional: If not set, will default to regular yield */
     void (*yield_to_thread)(void * thread);                    /* Optional: If not set, will default to regular yield */
     void (*sleep_cpu)(unsigned int usec);
+    void (*sleep_cpu_until)(unsigned int usec, int (*done)(void * arg), void * arg); /* Optional: If not set, will check done and then sleep */
     void (*wakeup_cpu)(void *cpu);
 
     void (*save_fpu)(void);
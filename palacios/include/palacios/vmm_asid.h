@@ -0,0 +1,56 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#ifndef __VMM_ASID_H__
+#define __VMM_ASID_H__
+
+#ifdef __V3VEE__
+
+#include <palacios/vmm_types.h>
+
+/* 
+ * TLB tags (SVM ASIDs / VMX VPIDs) are handed out per physical CPU.
+ *  Each CPU hands out tags in order and, when it runs out, starts a new generation 
+ *  and flushes its whole TLB. A core keeps its tag for as long as it stays on the 
+ *  same CPU in the same generation, so a core that is migrated (v3_move_vm_core) 
+ *  or that outlives a generation just picks up a fresh tag on its next entry.
+ *  Tags are never freed, they are reclaimed by the next generation.
+ */
+struct v3_asid_state {
+    uint32_t asid;
+    uint32_t cpu;
+    uint64_t generation;                  /* 0 = never assigned */
+};
+
+
+struct v3_core_info;
+
+/* Called on each CPU when it is initialized, max_asid is the largest usable tag */
+void v3_init_asid_pool(int cpu_id, uint32_t max_asid);
+
+/* 
+ * Must be called on the CPU that is about to run the core, with interrupts disabled.
+ *  Returns 1 if the core was given a new tag, 0 if it kept its old one.
+ *  *flush_all is set when the CPU started a new generation and every tag must be flushed.
+ */
+int v3_update_asid(struct v3_core_info * core, int * flush_all);
+
+#endif // ! __V3VEE__
+
+#endif
@@ -45,6 +45,7 @@ int v3_bitmap_check(struct v3_bitmap * bitmap, int index);
 
 int v3_bitmap_count(struct v3_bitmap * bitmap);
 int v3_bitmap_copy(struct v3_bitmap * dst, struct v3_bitmap * src);
+int v3_bitmap_drain(struct v3_bitmap * dst, struct v3_bitmap * src);
 
 #endif
 
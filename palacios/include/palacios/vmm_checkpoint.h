@@ -12,6 +12,10 @@
 #ifdef __V3VEE__
 
 
+#define V3_CHKPT_MAX_XFER_THREADS 16
+
+struct chkpt_restore;
+
 struct v3_chkpt_state {
 
     struct list_head   block_list;
@@ -19,6 +23,17 @@ struct v3_chkpt_state {
 
     uint32_t  num_blocks;
     size_t    block_size;
+
+    /* Host CPUs of the worker threads that stream guest memory (<checkpoint xfer_cpus="..."/>) */
+    uint32_t  num_xfer_threads;
+    int       xfer_cpus[V3_CHKPT_MAX_XFER_THREADS];
+
+    /* Store duplicate guest pages as references (<checkpoint dedup="enable"/>) */
+    uint8_t   dedup_pages;
+
+    /* Restore guest memory on demand after the VM resumes (<checkpoint restore="lazy"/>) */
+    uint8_t                lazy_restore;
+    struct chkpt_restore * restore;      /* In progress lazy restore */
 };
 
 
@@ -32,10 +47,19 @@ typedef int (*v3_chkpt_load_fn)(char * name, void * buf, size_t size, void * pri
 
 int v3_checkpoint_register(struct v3_vm_info * vm, char * name, v3_chkpt_save_fn save, v3_chkpt_load_fn load, size_t size, void * priv_data);
 int v3_checkpoint_register_nocopy(struct v3_vm_info * vm, char * name, uint8_t * buf, size_t size);
+int v3_checkpoint_register_guest_mem(struct v3_vm_info * vm, char * name, uint8_t * buf, size_t size);
 
 int v3_chkpt_save_vm(struct v3_vm_info * vm, char * store, char * url);
 int v3_chkpt_load_vm(struct v3_vm_info * vm, char * store, char * url);
 
+/* Stops a lazy restore, any guest memory not restored yet is left as is */
+int v3_chkpt_cancel_restore(struct v3_vm_info * vm);
+
+#ifdef V3_CONFIG_LIVE_MIGRATION
+int v3_chkpt_send_vm(struct v3_vm_info * vm, char * store, char * url);
+int v3_chkpt_receive_vm(struct v3_vm_info * vm, char * store, char * url);
+#endif
+
 int v3_init_chkpt(struct v3_vm_info * vm);
 int v3_deinit_chkpt(struct v3_vm_info * vm);
 
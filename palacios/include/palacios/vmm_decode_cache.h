@@ -0,0 +1,56 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#ifndef __VMM_DECODE_CACHE_H
+#define __VMM_DECODE_CACHE_H
+
+#ifdef __V3VEE__
+
+#include <palacios/vmm_types.h>
+
+/* 
+ * Instructions that trap over and over (MMIO accesses to hooked memory, control register moves)
+ *  are only decoded once per VM. Entries are found by the host physical address of the 
+ *  instruction and the CPU mode, and the instruction bytes are compared on each hit, 
+ *  so code that the guest (or a device) rewrites is simply decoded again.
+ *  A hit recomputes the register dependent operands with v3_decode_refresh().
+ *
+ *  <decode_cache entries="256" />     (0 disables the cache)
+ */
+struct v3_decode_entry;
+
+struct v3_decode_cache {
+    struct v3_decode_entry * entries;
+    uint32_t                 num_entries;    /* Power of 2 */
+};
+
+
+struct v3_vm_info;
+struct v3_core_info;
+struct x86_instr;
+
+int v3_init_decode_cache(struct v3_vm_info * vm);
+int v3_deinit_decode_cache(struct v3_vm_info * vm);
+
+/* Fetches and decodes the instruction at the core's RIP */
+int v3_decode_rip(struct v3_core_info * core, struct x86_instr * instr);
+
+#endif // ! __V3VEE__
+
+#endif
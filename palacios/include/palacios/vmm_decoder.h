@@ -83,6 +83,25 @@ struct x86_prefixes {
 } __attribute__((packed));
 
 
+/* 
+ * How the address of a memory operand was formed from the guest registers, 
+ * as recorded by decoders that implement v3_decode_refresh()
+ */
+struct x86_mem_ref {
+    uint8_t  valid      : 1;
+    uint8_t  mask_base  : 1;   // Base register is masked to the address width
+    uint8_t  mask_index : 1;   // Index register is masked to the address width
+    uint8_t  str_op     : 1;   // Only the base (rSI/rDI) register, masked to the address width
+    uint8_t  rsvd       : 4;
+
+    sint8_t  base;             // x86 register number, -1 if none
+    sint8_t  index;            // x86 register number, -1 if none
+    uint8_t  scale;
+    uint8_t  seg;              // v3_seg_type_t
+    addr_t   disp;
+} __attribute__((packed));
+
+
 struct x86_instr {
     struct x86_prefixes  prefixes;
     uint8_t              instr_length;
@@ -93,6 +112,9 @@ struct x86_instr {
     struct x86_operand   third_operand;
     addr_t               str_op_length;
     addr_t               is_str_op;
+
+    struct x86_mem_ref   src_ref;
+    struct x86_mem_ref   dst_ref;
 };
 
 
@@ -119,6 +141,14 @@ int v3_deinit_decoder(struct v3_core_info * core);
  */
 int v3_decode(struct v3_core_info * core, addr_t instr_ptr, struct x86_instr * instr);
 
+/* 
+ * Recomputes the parts of a decoded instruction that depend on register values
+ * (memory operand addresses and string op counts) from core's current state.
+ * Register operands are left alone.
+ * Returns -1 if the decoder cannot do this, and the instruction must be decoded again
+ */
+int v3_decode_refresh(struct v3_core_info * core, struct x86_instr * instr);
+
 /* 
  * Encodes an instruction
  * All addresses in arguments are in the host address space
@@ -115,6 +115,12 @@ int v3_dev_hook_io(struct vm_device   * dev,
 int v3_dev_unhook_io(struct vm_device   * dev,
 		     uint16_t            port);
 
+/* Adds bulk REP INS/OUTS handlers to a port the device has hooked (see v3_hook_io_port_string) */
+int v3_dev_hook_io_string(struct vm_device   * dev,
+			  uint16_t            port,
+			  int (*read_string)(struct v3_core_info * core, uint16_t port, void * dst, uint_t length, uint_t count, void * priv_data),
+			  int (*write_string)(struct v3_core_info * core, uint16_t port, void * src, uint_t length, uint_t count, void * priv_data));
+
 
 int v3_dev_hook_msr(struct vm_device * dev, 
 		    uint32_t           msr,
@@ -165,6 +171,27 @@ struct v3_dev_blk_ops {
     int (*write)(uint8_t * buf, uint64_t lba, uint64_t num_bytes, void * private_data);
     int (*readv)(v3_iov_t * iov_arr, uint32_t iov_len, uint64_t lba, void * private_data);
     int (*writev)(v3_iov_t * iov_arr, uint32_t iov_len, uint64_t lba, void * private_data);
+
+    /* Optional asynchronous versions of readv/writev. 
+     *   The backend calls done() exactly once when the request finishes, from any context, 
+     *   with the value readv/writev would have returned. The iov array stays valid until then.
+     *   A return of -1 means the request was not queued, and done() will not be called
+     */
+    int (*readv_async)(v3_iov_t * iov_arr, uint32_t iov_len, uint64_t lba, 
+		       void (*done)(int ret, void * done_data), void * done_data, 
+		       void * private_data);
+    int (*writev_async)(v3_iov_t * iov_arr, uint32_t iov_len, uint64_t lba, 
+			void (*done)(int ret, void * done_data), void * done_data, 
+			void * private_data);
+
+    /* Optional cache and space management. Frontends only advertise what is implemented.
+     *   flush:        make all completed writes stable
+     *   discard:      the range is no longer needed, its contents become undefined
+     *   write_zeroes: the range must read back as zeros
+     */
+    int (*flush)(void * private_data);
+    int (*discard)(uint64_t lba, uint64_t num_bytes, void * private_data);
+    int (*write_zeroes)(uint64_t lba, uint64_t num_bytes, void * private_data);
 };
 
 
@@ -175,14 +202,42 @@ struct v3_dev_net_ops_cfg{
     int poll;  /* need poll? */
 };
 
+struct v3_net_gso;
+struct v3_net_frame;
+struct v3_net_rx_map;
+
 struct v3_dev_net_ops {
     /* Backend implemented functions */
     int (*send)(uint8_t * buf, uint32_t len, void * private_data);
 
+    /* Optional: backend accepts oversized frames and partial checksums described by gso. 
+     * Frontends segment and checksum in software when this is not set */
+    int (*send_gso)(uint8_t * buf, uint32_t len, struct v3_net_gso * gso, void * private_data);
+
+    /* Optional: send up to V3_NET_MAX_BATCH frames at once, returns the number sent. 
+     * The frames only need to stay valid until the call returns */
+    int (*send_batch)(struct v3_net_frame * frames, uint32_t num_frames, void * private_data);
+
+    /* Optional: for backends that poll (config.poll), TX frames are waiting to be polled */
+    int (*kick)(void * private_data);
+
     /* Frontend implemented functions */
     int (*recv)(uint8_t * buf, uint32_t len, void * frnt_data);
     int (*poll)(int quote, void * frnt_data);
 
+    /* Optional: frontend accepts oversized frames described by gso */
+    int (*recv_gso)(uint8_t * buf, uint32_t len, struct v3_net_gso * gso, void * frnt_data);
+
+    /* Optional: deliver several frames with a single guest notification, returns the number delivered */
+    int (*recv_batch)(struct v3_net_frame * frames, uint32_t num_frames, void * frnt_data);
+
+    /* Optional zero copy receive. rx_map reserves guest buffers for a frame of len bytes, 
+     * whose first hdr_len bytes are in hdr, and returns them in map->iov. 
+     * The backend writes the frame there and must then call rx_complete with the bytes written, 
+     * or 0 to give the buffers back */
+    int (*rx_map)(uint8_t * hdr, uint32_t hdr_len, uint32_t len, struct v3_net_rx_map * map, void * frnt_data);
+    int (*rx_complete)(struct v3_net_rx_map * map, uint32_t len, void * frnt_data);
+
     /* This is ugly... */
     struct v3_dev_net_ops_cfg config;
 };
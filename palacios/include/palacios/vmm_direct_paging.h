@@ -25,6 +25,28 @@
 
 #include <palacios/vmm_mem.h>
 #include <palacios/vmm_paging.h>
+#include <palacios/vmm_lock.h>
+
+
+/* 
+ * On 64 bit hosts the nested paging cores of a VM share a single nested page table (EPT on VMX),
+ *  so each guest page is only faulted in once. A core switches to a private table the first
+ *  time it maps a page that other cores see through a different (core specific) memory region.
+ */
+struct v3_nested_pts {
+    addr_t        root;     /* Shared root, in the format loaded into the VMCB/VMCS (0 until created) */
+    v3_mutex_t  * lock;     /* Serializes updates to the shared table (faults may allocate, so this can sleep) */
+};
+
+
+int v3_init_nested_pts(struct v3_vm_info * vm);
+int v3_deinit_nested_pts(struct v3_vm_info * vm);
+
+int v3_init_nested_pt_core(struct v3_core_info * core);
+int v3_nested_pt_is_shared(struct v3_core_info * core);
+uint32_t v3_get_nested_page_size(struct v3_core_info * core, addr_t gpa);
+
+int v3_prefault_nested_pts(struct v3_vm_info * vm);
 
 int v3_init_passthrough_pts(struct v3_core_info * core);
 int v3_free_passthrough_pts(struct v3_core_info * core);
@@ -39,6 +61,9 @@ int v3_activate_passthrough_pt(struct v3_core_info * core);
 
 int v3_invalidate_passthrough_addr(struct v3_core_info * core, addr_t inv_addr);
 int v3_invalidate_nested_addr(struct v3_core_info * core, addr_t inv_addr);
+int v3_invalidate_nested_range(struct v3_vm_info * vm, addr_t start, addr_t end);
+
+int v3_write_protect_nested_pts(struct v3_vm_info * vm);
 
 #endif // ! __V3VEE__
 
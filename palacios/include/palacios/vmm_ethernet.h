@@ -36,6 +36,46 @@
 extern int net_debug;
 #endif
 
+/* Offload state attached to a frame, mirrors the virtio net header */
+#define V3_NET_GSO_NONE         0
+#define V3_NET_GSO_TCPV4        1
+#define V3_NET_GSO_TCPV6        4
+#define V3_NET_GSO_ECN          0x80
+
+#define V3_NET_F_NEEDS_CSUM     1   /* Checksum from csum_start to the end and store at csum_start + csum_offset */
+#define V3_NET_F_DATA_VALID     2   /* Checksums have already been verified */
+
+struct v3_net_gso {
+    uint8_t  flags;
+    uint8_t  gso_type;
+    uint16_t hdr_len;       /* Ethernet + IP + TCP headers */
+    uint16_t gso_size;      /* Payload bytes per segment */
+    uint16_t csum_start;
+    uint16_t csum_offset;
+} __attribute__((packed));
+
+/* One frame of a batch passed between network frontends and backends */
+#define V3_NET_MAX_BATCH        32
+
+struct v3_net_frame {
+    uint8_t * buf;
+    uint32_t  len;
+};
+
+/* Guest receive buffers reserved for a backend to write one frame into directly */
+#define V3_NET_MAX_IOV          20
+
+struct v3_net_rx_map {
+    struct v3_net_frame iov[V3_NET_MAX_IOV];
+    uint32_t            num_iov;
+
+    /* Owned by the frontend */
+    void     * queue;
+    uint8_t  * hdr;
+    uint16_t   avail_idx;
+    uint16_t   num_bufs;
+};
+
 struct nic_statistics {
     uint64_t tx_pkts;
     uint64_t tx_bytes;
@@ -231,6 +271,28 @@ static inline uint32_t v3_crc32(uint32_t crc, uint8_t *buf, int size)
     return crc ^ ~0U;
 }
 
+
+/* Software offload for backends that need wire sized, fully checksummed frames 
+ * xmit is called once per resulting frame, scratch must hold the largest of them 
+ * (hdr_len + gso_size, or the whole frame when only a checksum is needed). 
+ * Returns the number of frames transmitted, or -1 on error 
+ */
+int v3_net_gso_xmit(uint8_t * pkt, uint32_t len, struct v3_net_gso * gso,
+		    uint8_t * scratch, uint32_t scratch_len,
+		    int (*xmit)(uint8_t * buf, uint32_t len, void * private_data), 
+		    void * private_data);
+
+/* Completes a partial checksum in place */
+int v3_net_finish_csum(uint8_t * pkt, uint32_t len, struct v3_net_gso * gso);
+
+/* Fills in gso for an oversized TCP frame (e.g. coalesced by the host) so it can be 
+ * handed to a frontend as a single frame. Returns -1 if the frame cannot be described */
+int v3_net_gso_probe(uint8_t * pkt, uint32_t len, uint32_t mtu, struct v3_net_gso * gso);
+
+/* Hash of a frame's IP addresses, protocol and TCP/UDP ports. 
+ * Symmetric, so both directions of a flow hash to the same value. Non IP frames hash to 0 */
+uint32_t v3_net_flow_hash(uint8_t * pkt, uint32_t len);
+
 #endif
 
 #endif
@@ -23,12 +23,37 @@
 
 #ifdef __V3VEE__
 
+#include <palacios/vmm_types.h>
+
+/* 
+ * A halted core sleeps until an interrupt is queued for it, or its next timer event is due.
+ *  Before sleeping it can spin for an adaptive window, which grows when halts 
+ *  are short enough to be caught by spinning, and shrinks when they are not.
+ *
+ *  <halt poll_us="50" max_sleep_us="10000" />
+ */
+struct v3_halt_state {
+    uint64_t max_poll_cycles;     /* Upper bound of the spin window (host cycles), 0 disables spinning */
+    uint32_t max_sleep_usec;      /* Longest single sleep, bounds a wakeup lost to the host */
+};
+
+struct v3_core_halt_state {
+    volatile int halted;          /* Core is asleep waiting for an interrupt */
+    uint64_t     poll_cycles;     /* Current spin window (host cycles) */
+};
+
+
 #include <palacios/vm.h>
 #include <palacios/vmm.h>
 
 
+int v3_init_halt(struct v3_vm_info * vm);
+
 int v3_handle_halt(struct v3_core_info * core);
 
+/* Kicks a core out of HLT, safe to call whether or not it is halted */
+void v3_wakeup_core(struct v3_core_info * core);
+
 #endif // ! __V3VEE__
 
 #endif
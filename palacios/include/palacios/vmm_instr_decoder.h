@@ -529,6 +529,34 @@ get_instr_segment(struct v3_core_info * core,
         })
 
 
+/* Records how a memory operand's address was formed, for v3_decode_refresh() */
+static inline void 
+set_mem_ref(struct x86_instr   * instr, 
+	    struct x86_operand * operand, 
+	    int base,  int mask_base, 
+	    int index, int mask_index, int scale, 
+	    addr_t disp, v3_seg_type_t seg) 
+{
+    struct x86_mem_ref * ref = NULL;
+
+    if (operand == &(instr->src_operand)) {
+	ref = &(instr->src_ref);
+    } else if (operand == &(instr->dst_operand)) {
+	ref = &(instr->dst_ref);
+    } else {
+	return;
+    }
+
+    ref->valid      = 1;
+    ref->base       = base;
+    ref->mask_base  = mask_base;
+    ref->index      = index;
+    ref->mask_index = mask_index;
+    ref->scale      = scale;
+    ref->disp       = disp;
+    ref->seg        = seg;
+}
+
 
 static int 
 decode_rm_operand16(struct v3_core_info  * core,
@@ -543,6 +571,7 @@ decode_rm_operand16(struct v3_core_info  * core,
     uint8_t           * instr_cursor = modrm_instr;
 
     addr_t        base_addr = 0;
+    addr_t        disp      = 0;
     modrm_mode_t  mod_mode  = 0;
 
     //  PrintDebug("ModRM mod=%d\n", modrm->mod);
@@ -609,10 +638,12 @@ decode_rm_operand16(struct v3_core_info  * core,
 
 
 	if (mod_mode == DISP8) {
- 	    base_addr    += *(sint8_t *)instr_cursor;
+	    disp          = *(sint8_t *)instr_cursor;
+ 	    base_addr    += disp;
 	    instr_cursor += 1;
 	} else if (mod_mode == DISP16) {
-	    base_addr    += *(sint16_t *)instr_cursor;
+	    disp          = *(sint16_t *)instr_cursor;
+	    base_addr    += disp;
 	    instr_cursor += 2;
 	}
     
@@ -622,6 +653,19 @@ decode_rm_operand16(struct v3_core_info  * core,
 	
 	operand->operand = ADDR_MASK(get_addr_linear(core, base_addr, seg), 
 				     get_addr_width(core, instr));
+
+	{
+	    // BX/BP/SI/DI combinations, by rm. The second register is masked
+	    static const sint8_t rm_base[8]  = {3, 3, 5, 5, 6, 7, 5, 3};
+	    static const sint8_t rm_index[8] = {6, 7, 6, 7, -1, -1, -1, -1};
+
+	    if ((modrm->rm == 6) && (modrm->mod == 0)) {
+		set_mem_ref(instr, operand, -1, 0, -1, 0, 1, disp, seg);
+	    } else {
+		set_mem_ref(instr, operand, rm_base[modrm->rm], (modrm->rm >= 4), 
+			    rm_index[modrm->rm], 1, 1, disp, seg);
+	    }
+	}
     }
 
 
@@ -643,8 +687,12 @@ decode_rm_operand32(struct v3_core_info * core,
     struct modrm_byte * modrm        = (struct modrm_byte *)modrm_instr;
 
     addr_t       base_addr    = 0;
+    addr_t       disp         = 0;
     modrm_mode_t mod_mode     = 0;
     uint_t       has_sib_byte = 0;
+    int          ref_base     = -1;
+    int          ref_index    = -1;
+    int          ref_scale    = 1;
 
 
     *reg_code = modrm->reg;
@@ -706,12 +754,26 @@ decode_rm_operand32(struct v3_core_info * core,
 		break;
 	}
 
+	if ((has_sib_byte == 0) && ((modrm->rm != 5) || (modrm->mod != 0))) {
+	    ref_base = modrm->rm;
+	}
+
 	if (has_sib_byte) {
 	    struct sib_byte * sib = (struct sib_byte *)(instr_cursor);
 	    int scale             = 0x1 << sib->scale;
 
 	    instr_cursor += 1;
 
+	    // The index is taken as is, the base is masked. A disp32 only SIB drops both
+	    if ((sib->base == 5) && (modrm->mod == 0)) {
+		ref_base  = -1;
+		ref_index = -1;
+	    } else {
+		ref_base  = sib->base;
+		ref_index = (sib->index == 4) ? -1 : sib->index;
+		ref_scale = scale;
+	    }
+
 	    switch (sib->index) {
 		case 0:
 		    base_addr = gprs->rax;
@@ -778,10 +840,12 @@ decode_rm_operand32(struct v3_core_info * core,
 
 
 	if (mod_mode == DISP8) {
-	    base_addr    += *(sint8_t *)instr_cursor;
+	    disp          = *(sint8_t *)instr_cursor;
+	    base_addr    += disp;
 	    instr_cursor += 1;
 	} else if (mod_mode == DISP32) {
-	    base_addr    += *(sint32_t *)instr_cursor;
+	    disp          = *(sint32_t *)instr_cursor;
+	    base_addr    += disp;
 	    instr_cursor += 4;
 	}
     
@@ -791,6 +855,8 @@ decode_rm_operand32(struct v3_core_info * core,
 
 	operand->operand = ADDR_MASK(get_addr_linear(core, base_addr, seg), 
 				     get_addr_width(core, instr));
+
+	set_mem_ref(instr, operand, ref_base, has_sib_byte, ref_index, 0, ref_scale, disp, seg);
     }
 
 
@@ -813,8 +879,12 @@ decode_rm_operand64(struct v3_core_info  * core,
     struct modrm_byte * modrm        = (struct modrm_byte *)modrm_instr;
 
     addr_t       base_addr    = 0;
+    addr_t       disp         = 0;
     modrm_mode_t mod_mode     = 0;
     uint_t       has_sib_byte = 0;
+    int          ref_base     = -1;
+    int          ref_index    = -1;
+    int          ref_scale    = 1;
 
 
     instr_cursor += 1;
@@ -854,6 +924,10 @@ decode_rm_operand64(struct v3_core_info  * core,
 	    has_sib_byte = 1;
 	} else {
 	    rm_val |= (instr->prefixes.rex_rm << 3);
+
+	    if ((rm_val != 5) || (modrm->mod != 0)) {
+		ref_base = rm_val;
+	    }
 	    
 	    switch (rm_val) {
 		case 0:
@@ -922,6 +996,16 @@ decode_rm_operand64(struct v3_core_info  * core,
 
 	    instr_cursor += 1;
 
+	    // A disp32 only SIB drops the index as well
+	    if ((base_val == 5) && (modrm->mod == 0)) {
+		ref_base  = -1;
+		ref_index = -1;
+	    } else {
+		ref_base  = base_val;
+		ref_index = (index_val == 4) ? -1 : index_val;
+		ref_scale = scale;
+	    }
+
 	    switch (index_val) {
 		case 0:
 		    base_addr = gprs->rax;
@@ -1036,10 +1120,12 @@ decode_rm_operand64(struct v3_core_info  * core,
 
 
 	if (mod_mode == DISP8) {
-	    base_addr    += *(sint8_t *)instr_cursor;
+	    disp          = *(sint8_t *)instr_cursor;
+	    base_addr    += disp;
 	    instr_cursor += 1;
 	} else if (mod_mode == DISP32) {
-	    base_addr    += *(sint32_t *)instr_cursor;
+	    disp          = *(sint32_t *)instr_cursor;
+	    base_addr    += disp;
 	    instr_cursor += 4;
 	}
     
@@ -1051,6 +1137,8 @@ decode_rm_operand64(struct v3_core_info  * core,
 
 	operand->operand = ADDR_MASK(get_addr_linear(core, base_addr, seg), 
 				     get_addr_width(core, instr));
+
+	set_mem_ref(instr, operand, ref_base, 0, ref_index, 0, ref_scale, disp, seg);
     }
 
 
@@ -46,6 +46,16 @@ int v3_hook_io_port(struct v3_vm_info * vm, uint16_t port,
 
 int v3_unhook_io_port(struct v3_vm_info * vm, uint16_t port);
 
+/* 
+ * Optional bulk handlers for string I/O (REP INS/OUTS) on an already hooked port.
+ *  They are handed up to count elements of length bytes, contiguous and in ascending order 
+ *  (a transfer is split at guest page boundaries), and return the number of elements they consumed. 
+ *  Anything left over is passed through the port's read/write handler one element at a time.
+ */
+int v3_hook_io_port_string(struct v3_vm_info * vm, uint16_t port, 
+			   int (*read_string)(struct v3_core_info * core, uint16_t port, void * dst, uint_t length, uint_t count, void * priv_data),
+			   int (*write_string)(struct v3_core_info * core, uint16_t port, void * src, uint_t length, uint_t count, void * priv_data));
+
 
 
 
@@ -59,6 +69,10 @@ struct v3_io_hook {
     // Writes data from the IO port (OUT, OUTS)
     int (*write)(struct v3_core_info * core, uint16_t port, void * src, uint_t length, void * priv_data);
 
+    // Optional, reads/writes several elements at once (REP INS, REP OUTS)
+    int (*read_string)(struct v3_core_info * core, uint16_t port, void * dst, uint_t length, uint_t count, void * priv_data);
+    int (*write_string)(struct v3_core_info * core, uint16_t port, void * src, uint_t length, uint_t count, void * priv_data);
+
     void * priv_data;
   
     struct rb_node tree_node;
@@ -75,6 +89,22 @@ struct v3_io_map {
 struct v3_io_hook * v3_get_io_hook(struct v3_vm_info * vm, uint16_t port);
 
 
+/* 
+ * Used by the INS/OUTS exit handlers.
+ *  Returns how many elements starting at guest_va fit before the end of the page 
+ *  or before the address register (offset, masked by the address size) wraps around.
+ */
+uint_t v3_io_string_count(addr_t guest_va, addr_t offset, uint64_t mask, 
+			  uint_t length, uint64_t max_count, int direction);
+
+/* Transfers count elements between a port and a host contiguous buffer, hook may be NULL.
+ *  dst_gpa is where dst maps in the guest, the pages written are logged for dirty tracking */
+int v3_io_read_string(struct v3_core_info * core, struct v3_io_hook * hook, uint16_t port, 
+		      uint8_t * dst, addr_t dst_gpa, uint_t length, uint_t count, int direction);
+int v3_io_write_string(struct v3_core_info * core, struct v3_io_hook * hook, uint16_t port, 
+		       uint8_t * src, uint_t length, uint_t count, int direction);
+
+
 void v3_print_io_map(struct v3_vm_info * vm);
 
 void v3_refresh_io_map(struct v3_vm_info * vm);
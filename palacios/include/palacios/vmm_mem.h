@@ -30,6 +30,8 @@
 #include <palacios/vmm_paging.h>
 #include <palacios/vmm_rbtree.h>
 #include <palacios/vmm_list.h>
+#include <palacios/vmm_lock.h>
+#include <palacios/vmm_bitmap.h>
 
 struct v3_core_info;
 struct v3_vm_info;
@@ -94,10 +96,18 @@ struct v3_mem_region {
 
 
 
+struct v3_mem_reserve {
+    int      numa_id;
+    int      num_blocks;
+    addr_t * blocks;                         /* reserve_depth entries */
+};
+
+
 /*
  * There are two layers of memory regions in Palacios
- * -- The base regions are fixed sized blocks preallocated at initialization time
- *        and cover the entirety of the guest's physical memory 
+ * -- The base regions are fixed sized blocks that cover the entirety of the guest's physical memory 
+ *        They are either preallocated at initialization time (the default), 
+ *        or populated by the guest's first page fault on them when the memory map is configured with alloc="lazy"
  * 
  * -- A red-black tree of overlay regions that supersede the base regions and 
  *        and can be created at any time
@@ -107,6 +117,30 @@ struct v3_mem_map {
 
     uint32_t               num_base_blocks;  /* Number of base regions spanning guest's physical mem */
     struct v3_mem_region * base_regions;     /* A pointer to an array of fixed size base regions     */
+
+    uint8_t                lazy_alloc;       /* Base regions are allocated on demand                 */
+    uint8_t                prefault;         /* Nested page tables are filled in before launch       */
+    v3_mutex_t           * populate_lock;    /* Serializes on demand allocation of base regions      */
+
+    v3_spinlock_t          reserve_lock;     /* Protects the reserves, region_state, and the publishing of host_addr */
+    int                    reserve_depth;    /* Blocks each reserve is refilled to (reserve="N", one per core by default) */
+    int                    num_reserves;
+    struct v3_mem_reserve * reserves;        /* Zeroed blocks for lookups that cannot sleep, per NUMA node */
+    uint8_t              * region_state;     /* Work left for the memory thread, per base region     */
+
+    void                 * mem_thread;       /* Refills the reserves and populates regions for lookups */
+    int                    mem_thread_kick;
+    int                    mem_thread_stop;
+    int                    mem_thread_active;
+
+    uint8_t                track_dirty;      /* Guest writes to base memory are being logged         */
+    struct v3_bitmap       dirty_pages;      /* One bit per 4KB page of base memory                  */
+
+    /* Fills in a base region's contents when it is populated (lazy checkpoint restore) */
+    int                  (*populate_fn)(struct v3_vm_info * vm, struct v3_mem_region * region, void * priv);
+    void                 * populate_priv;
+
+    uint32_t               generation;       /* Bumped whenever a translation may change, see v3_gpa_cache */
 };
 
 
@@ -154,10 +188,79 @@ v3_get_mem_region(struct v3_vm_info * vm,
 		  uint16_t            core_id, 
 		  addr_t              guest_addr);
 
+/* Never sleeps, returns NULL for a lazily allocated region that has not been populated yet 
+ *  and that no reserve block can back. The memory thread then populates it in the background. */
 struct v3_mem_region * 
 v3_get_base_region(struct v3_vm_info * vm, 
 		   addr_t              gpa);
 
+/* Populates the base region holding gpa, this can sleep so call it before taking any spinlocks */
+int 
+v3_populate_base_region(struct v3_vm_info * vm, 
+			addr_t              gpa);
+
+/* Populates every base region overlapping [gpa, gpa + len), for VMM accesses that will look them up 
+ *  later from a context that cannot sleep. This can sleep as well. */
+int 
+v3_populate_gpa_range(struct v3_vm_info * vm, 
+		      addr_t              gpa, 
+		      uint64_t            len);
+
+/* Never sleeps, returns -1 if some of the range is not backed yet, the memory thread then populates it in the background. 
+ *  For paths that cannot sleep and can retry the access later. */
+int 
+v3_try_populate_gpa_range(struct v3_vm_info * vm, 
+			  addr_t              gpa, 
+			  uint64_t            len);
+
+/* Returns the region backing all of [start_gpa, end_gpa) on every core, NULL if there is no single one */
+struct v3_mem_region * 
+v3_get_uniform_region(struct v3_vm_info * vm, 
+		      addr_t              start_gpa, 
+		      addr_t              end_gpa);
+
+/* Forces allocation of any base regions that have not been touched yet */
+int 
+v3_populate_mem_map(struct v3_vm_info * vm);
+
+/* Marks every base region unpopulated, fn is then called to fill each one on the first guest fault or VMM access to it */
+int 
+v3_set_mem_populate_fn(struct v3_vm_info * vm, 
+		       int (*fn)(struct v3_vm_info * vm, struct v3_mem_region * region, void * priv), 
+		       void * priv);
+
+int 
+v3_clear_mem_populate_fn(struct v3_vm_info * vm);
+
+
+/* 
+ * Dirty page tracking (nested paging only)
+ *   Base memory is write protected in the nested page tables, and the first write 
+ *   to each page after tracking starts (or after the last collection) is logged.
+ *   Starting, stopping, and collecting modify every core's page tables, so the VM must be paused
+ */
+int 
+v3_start_dirty_tracking(struct v3_vm_info * vm);
+
+int 
+v3_stop_dirty_tracking(struct v3_vm_info * vm);
+
+/* Moves the logged pages into dirty and rearms tracking */
+int 
+v3_collect_dirty_pages(struct v3_vm_info * vm, 
+		       struct v3_bitmap  * dirty);
+
+void 
+v3_mark_page_dirty(struct v3_vm_info * vm, 
+		   addr_t              gpa);
+
+/* The VMM's own writes to guest memory (device DMA, string I/O) never fault, 
+ * so they must log every page of [gpa, gpa + len) themselves */
+void 
+v3_mark_range_dirty(struct v3_vm_info * vm, 
+		    addr_t              gpa, 
+		    uint64_t            len);
+
 
 uint32_t 
 v3_get_max_page_size(struct v3_core_info * core, 
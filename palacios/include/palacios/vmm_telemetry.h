@@ -20,6 +20,59 @@
 #ifndef __VMM_TELEMETRY_H__
 #define __VMM_TELEMETRY_H__
 
+
+/* 
+ * Exit latencies are binned on a log2 scale with 4 sub-buckets per power of two, 
+ * so every bucket spans at most 25% of its lower bound.
+ * Buckets 0-3 hold exact cycle counts, latencies beyond 2^40 cycles land in the last bucket.
+ */
+#define V3_TELEM_HIST_BUCKETS 160
+
+/* Maximum number of distinct exit reasons tracked per core */
+#define V3_TELEM_MAX_EXITS    128
+
+
+/* Per exit reason summary exported to the host */
+struct v3_telem_exit_stats {
+    uint32_t exit_code;
+    uint32_t cnt;
+    uint64_t handler_cycles;  /* Total cycles spent in the VMM handling this exit */
+    uint64_t guest_cycles;    /* Total cycles spent in the guest preceding this exit */
+    uint64_t max_cycles;
+    uint64_t p50;             /* Percentiles are the upper bound of the matching bucket */
+    uint64_t p99;
+    uint64_t p999;
+    uint32_t hist[V3_TELEM_HIST_BUCKETS];
+} __attribute__((packed));
+
+
+/* Per core summary exported to the host */
+struct v3_telem_core_stats {
+    uint64_t exit_cnt;
+    uint64_t guest_cycles;
+    uint64_t host_cycles;
+    uint64_t lost;            /* Trace records overwritten before they were read */
+} __attribute__((packed));
+
+
+/* A single exit as recorded in the per core trace ring */
+struct v3_telem_record {
+    uint64_t tsc;             /* TSC at VM exit */
+    uint64_t guest_cycles;    /* Cycles in the guest since the previous exit completed */
+    uint64_t host_cycles;     /* Cycles spent handling this exit */
+    uint32_t exit_code;
+    uint32_t vcore;
+} __attribute__((packed));
+
+
+struct v3_vm_info;
+
+int v3_get_telemetry_core(struct v3_vm_info * vm, int vcore, struct v3_telem_core_stats * stats);
+int v3_get_telemetry_exits(struct v3_vm_info * vm, int vcore, struct v3_telem_exit_stats * stats, int max_stats);
+int v3_get_telemetry_records(struct v3_vm_info * vm, int vcore, struct v3_telem_record * recs, int max_recs);
+
+
+
 #ifdef __V3VEE__
 
 
@@ -29,14 +82,18 @@
 #include <palacios/vmm_list.h>
 
 struct v3_core_info;
-struct v3_vm_info;
 
 #ifdef V3_CONFIG_TELEMETRY
 
+struct exit_event;
+struct telem_ring;
+
 struct v3_telemetry_state {
     uint32_t invoke_cnt;
     uint64_t granularity;
 
+    uint32_t ring_size;    /* Trace records per core, 0 disables tracing */
+
     uint64_t prev_tsc;
 
     struct list_head cb_list;
@@ -48,6 +105,16 @@ struct v3_core_telemetry {
     struct rb_root exit_root;
 
     uint64_t vmm_start_tsc;
+    uint64_t vmm_end_tsc;
+
+    uint64_t guest_time;
+    uint64_t host_time;
+
+    /* Exit events in creation order, so the host can read them without walking the tree */
+    uint32_t num_exit_slots;
+    struct exit_event * exit_slots[V3_TELEM_MAX_EXITS];
+
+    struct telem_ring * ring;
 
     struct v3_telemetry_state * vm_telem;
     
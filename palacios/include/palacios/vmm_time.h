@@ -78,9 +78,14 @@ struct vm_core_time {
 #define VM_TIME_TSC_PASSTHROUGH (1 << 1)
 #define VM_TIME_TRAP_RDTSC (1 << 2)
 
+#define V3_TIMER_NO_EVENT ((uint64_t)-1)
+
 struct v3_timer_ops {
     void (*update_timer)(struct v3_core_info * core, uint64_t cpu_cycles, uint64_t cpu_freq, void * priv_data);
     void (*advance_timer)(struct v3_core_info * core, void * private_data);
+
+    /* Optional: guest cycles until the timer next raises an interrupt, V3_TIMER_NO_EVENT if none is pending */
+    uint64_t (*next_event)(struct v3_core_info * core, uint64_t cpu_freq, void * priv_data);
 };
 
 struct v3_timer {
@@ -111,6 +116,10 @@ struct v3_timer * v3_add_timer(struct v3_core_info * core, struct v3_timer_ops *
 int v3_remove_timer(struct v3_core_info * core, struct v3_timer * timer);
 void v3_update_timers(struct v3_core_info * core);
 
+/* Guest cycles until the earliest timer event on this core. 
+ * Timers without a next_event op are assumed to need an update within poll_cycles */
+uint64_t v3_get_next_timer_event(struct v3_core_info * core, uint64_t poll_cycles);
+
 // Functions to return the different notions of time in Palacios.
 static inline uint64_t v3_get_host_time(struct vm_core_time *t) {
     uint64_t tmp;
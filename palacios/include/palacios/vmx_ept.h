@@ -150,6 +150,7 @@ typedef struct ept_pte {
 
 int v3_init_ept(struct v3_core_info * core, struct vmx_hw_info * hw_info);
 int v3_handle_ept_fault(struct v3_core_info * core, addr_t fault_addr, struct ept_exit_qual * ept_qual);
+int v3_prefault_ept(struct v3_core_info * core, addr_t gpa);
 
 
 #endif 
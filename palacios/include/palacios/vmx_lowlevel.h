@@ -46,6 +46,8 @@
 #define VMWRITE_OPCODE  ".byte 0x0f,0x79;"
 #define VMXOFF_OPCODE   ".byte 0x0f,0x01,0xc4;"
 #define VMXON_OPCODE    ".byte 0xf3,0x0f,0xc7;" /* reg=/6 */
+#define INVEPT_OPCODE   ".byte 0x66,0x0f,0x38,0x80;"
+#define INVVPID_OPCODE  ".byte 0x66,0x0f,0x38,0x81;"
 
 
 /* Mod/rm definitions for intel registers/memory */
@@ -54,6 +56,19 @@
 #define EAX_06_MODRM    ".byte 0x30;"
 // %eax with /7 reg
 #define EAX_07_MODRM    ".byte 0x38;"
+// %ecx with (%eax)
+#define ECX_EAX_MEM_MODRM ".byte 0x08;"
+
+
+/* INVEPT invalidation types */
+#define INVEPT_SINGLE_CONTEXT  1
+#define INVEPT_ALL_CONTEXT     2
+
+/* INVVPID invalidation types */
+#define INVVPID_INDIVIDUAL_ADDR           0
+#define INVVPID_SINGLE_CONTEXT            1
+#define INVVPID_ALL_CONTEXT               2
+#define INVVPID_SINGLE_CONTEXT_W_GLOBALS  3
 
 
 
@@ -96,6 +111,50 @@ static inline int vmcs_load(addr_t vmcs_ptr) {
     return VMX_SUCCESS;
 }
 
+static inline int vmx_invept(uint64_t type, uint64_t eptp) {
+    struct {
+	uint64_t eptp;
+	uint64_t rsvd;
+    } __attribute__((packed, aligned(16))) invept_desc = {eptp, 0};
+    uint8_t ret_valid = 0;
+    uint8_t ret_invalid = 0;
+
+    __asm__ __volatile__ (
+                INVEPT_OPCODE
+                ECX_EAX_MEM_MODRM
+                "seteb %0;" // fail valid (ZF=1)
+                "setnaeb %1;"  // fail invalid (CF=1)
+                : "=q"(ret_valid), "=q"(ret_invalid)
+                : "a"(&invept_desc), "c"(type), "0"(ret_valid), "1"(ret_invalid)
+                : "memory");
+
+    CHECK_VMXFAIL(ret_valid, ret_invalid);
+
+    return VMX_SUCCESS;
+}
+
+static inline int vmx_invvpid(uint64_t type, uint16_t vpid, addr_t linear_addr) {
+    struct {
+	uint64_t vpid;
+	uint64_t linear_addr;
+    } __attribute__((packed, aligned(16))) invvpid_desc = {vpid, linear_addr};
+    uint8_t ret_valid = 0;
+    uint8_t ret_invalid = 0;
+
+    __asm__ __volatile__ (
+                INVVPID_OPCODE
+                ECX_EAX_MEM_MODRM
+                "seteb %0;" // fail valid (ZF=1)
+                "setnaeb %1;"  // fail invalid (CF=1)
+                : "=q"(ret_valid), "=q"(ret_invalid)
+                : "a"(&invvpid_desc), "c"(type), "0"(ret_valid), "1"(ret_invalid)
+                : "memory");
+
+    CHECK_VMXFAIL(ret_valid, ret_invalid);
+
+    return VMX_SUCCESS;
+}
+
 static inline uint64_t vmcs_store() {
     uint64_t vmcs_ptr = 0;
 
@@ -118,12 +118,21 @@ struct vnet_stat{
 };
 
 
+/* Packets handed to v3_vnet_send_pkts() are forwarded in chunks of this size */
+#define VNET_MAX_BATCH  32
+
 struct v3_vnet_bridge_ops {
     int (*input)(struct v3_vm_info * vm, 
 		 struct v3_vnet_pkt * pkt,
 		 void * private_data);
     void (*poll)(struct v3_vm_info * vm,  
 		 void * private_data);
+
+    /* Optional: receive up to VNET_MAX_BATCH packets at once, returns the number sent */
+    int (*input_batch)(struct v3_vm_info * vm, 
+		       struct v3_vnet_pkt ** pkts,
+		       uint32_t num_pkts,
+		       void * private_data);
 };
 
 #define HOST_LNX_BRIDGE 1
@@ -140,6 +149,7 @@ int v3_vnet_add_route(struct v3_vnet_route route);
 void v3_vnet_del_route(uint32_t route_idx);
 
 int v3_vnet_send_pkt(struct v3_vnet_pkt * pkt, void * private_data);
+int v3_vnet_send_pkts(struct v3_vnet_pkt * pkts, uint32_t num_pkts, void * private_data);
 int v3_vnet_find_dev(uint8_t  * mac);
 int v3_vnet_stat(struct vnet_stat * stats);
 
@@ -154,9 +164,15 @@ struct v3_vnet_dev_ops {
     int (*poll)(struct v3_vm_info * vm,
 		int quote,
 		void * dev_data);
+
+    /* Optional: receive up to VNET_MAX_BATCH packets at once */
+    int (*input_batch)(struct v3_vm_info * vm, 
+		       struct v3_vnet_pkt ** pkts, 
+		       uint32_t num_pkts,
+		       void * dev_data);
 };
 
-int v3_init_vnet(void);	
+int v3_init_vnet(int * worker_cpus, int num_workers);	
 void v3_deinit_vnet(void);
 
 int v3_vnet_add_dev(struct v3_vm_info * info, uint8_t * mac, 
@@ -164,6 +180,10 @@ int v3_vnet_add_dev(struct v3_vm_info * info, uint8_t * mac,
 		    void * priv_data);
 int v3_vnet_del_dev(int dev_id);
 
+/* Wake the device's flush worker to poll it */
+int v3_vnet_kick_dev(int dev_id);
+int v3_vnet_set_dev_cpu(int dev_id, int cpu);
+
 int v3_vnet_query_header(uint8_t src_mac[6], 
 			 uint8_t dest_mac[6],
 			 int     recv,
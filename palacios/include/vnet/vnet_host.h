@@ -40,7 +40,20 @@ struct vnet_host_hooks {
 			  void * arg, 
 			  char * thread_name);
 
+    /* Optional: start a thread bound to a host CPU */
+    void *(*thread_start_on_cpu)(int cpu, 
+				 int (*fn)(void * arg), 
+				 void * arg, 
+				 char * thread_name);
+
     void (*thread_sleep)(long timeout);
+
+    /* Optional: sleep unless done(arg) is true. 
+     * done() must be checked after the thread is marked as sleeping, 
+     * so a thread_wakeup() that races with the check is not lost 
+     */
+    void (*thread_sleep_until)(long timeout, int (*done)(void * arg), void * arg);
+
     void (*thread_wakeup)(void * thread);
     void (*thread_stop)(void * thread);
     int (*thread_should_stop)(void);
@@ -143,6 +156,7 @@ static inline void Vnet_Yield(void){
 
 /* THREAD FUNCTIONS */
 struct vnet_thread * vnet_start_thread(int (*func)(void *), void *arg, char * name);
+struct vnet_thread * vnet_start_thread_on_cpu(int cpu, int (*func)(void *), void *arg, char * name);
 
 static inline void vnet_thread_sleep(long timeout){
     if((host_hooks) && host_hooks->thread_sleep){
@@ -150,6 +164,14 @@ static inline void vnet_thread_sleep(long timeout){
     }
 }
 
+static inline void vnet_thread_sleep_until(long timeout, int (*done)(void * arg), void * arg){
+    if((host_hooks) && host_hooks->thread_sleep_until){
+	host_hooks->thread_sleep_until(timeout, done, arg);
+    } else if (!done(arg)) {
+	vnet_thread_sleep(timeout);
+    }
+}
+
 static inline void vnet_thread_wakeup(struct vnet_thread * thread){
     if((host_hooks) && host_hooks->thread_wakeup){
 	host_hooks->thread_wakeup(thread->host_thread);
@@ -283,7 +305,8 @@ static inline void vnet_unlock_irqrestore(vnet_lock_t lock, vnet_intr_flags_t ir
 #endif
 
 
-void init_vnet(struct vnet_host_hooks * hooks);
+/* The TX flush workers are bound to worker_cpus, or a single unbound one runs if num_workers is 0 */
+void init_vnet(struct vnet_host_hooks * hooks, int * worker_cpus, int num_workers);
 void deinit_vnet(void);
 
 
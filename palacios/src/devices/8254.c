@@ -704,8 +704,45 @@ pit_write_command(struct v3_core_info * core,
 
 
 
+/* Channel 0 raises IRQ 0 when its count runs out, which takes pit_reload cycles per tick */
+static uint64_t 
+pit_next_event(struct v3_core_info * core, 
+	       uint64_t              cpu_freq, 
+	       void                * private_data) 
+{
+    struct pit     * state        = (struct pit *)private_data;
+    struct channel * ch           = &(state->ch_0);
+    uint64_t         oscillations = 0;
+
+    if (ch->run_state == PENDING) {
+	return state->pit_counter;
+    } else if (ch->run_state != RUNNING) {
+	return V3_TIMER_NO_EVENT;
+    }
+
+    // These only interrupt once per programmed count
+    if ( ((ch->op_mode == IRQ_ON_TERM_CNT) || (ch->op_mode == ONE_SHOT)) && 
+	 (ch->output_pin == 1) ) {
+	return V3_TIMER_NO_EVENT;
+    }
+
+    oscillations = ch->counter;
+
+    if (ch->op_mode == SQR_WAVE) {
+	oscillations /= 2;
+    }
+
+    if (oscillations == 0) {
+	return state->pit_counter;
+    }
+
+    return state->pit_counter + ((oscillations - 1) * state->pit_reload);
+}
+
+
 static struct v3_timer_ops timer_ops = {
     .update_timer = pit_update_timer,
+    .next_event   = pit_next_event,
 };
 
 
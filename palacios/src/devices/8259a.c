@@ -267,6 +267,8 @@ pic_raise_intr(struct v3_vm_info * vm,
 	v3_interrupt_cpu(vm, 0, 0);
     }
 
+    v3_wakeup_core(&(vm->cores[0]));
+
     return 0;
 }
 
@@ -545,6 +545,8 @@ add_apic_irq_entry(struct apic_state * apic,
     apic->irq_queue.num_entries++;
 
     v3_spin_unlock_irqrestore(&(apic->irq_queue.lock), flags);
+
+    v3_wakeup_core(apic->core);
   
     return 0;
 }
@@ -1796,6 +1798,35 @@ apic_inject_timer_intr(struct v3_core_info * core,
 
 
 
+/* Returns the log2 of the timer's clock divider, or -1 if it is invalid */
+static int 
+apic_tmr_shift(struct apic_state * apic) 
+{
+    uint8_t tmr_div = *(uint8_t *)&(apic->tmr_div_cfg.val);
+
+    switch (tmr_div) {
+	case APIC_TMR_DIV1:
+	    return 0;
+	case APIC_TMR_DIV2:
+	    return 1;
+	case APIC_TMR_DIV4:
+	    return 2;
+	case APIC_TMR_DIV8:
+	    return 3;
+	case APIC_TMR_DIV16:
+	    return 4;
+	case APIC_TMR_DIV32:
+	    return 5;
+	case APIC_TMR_DIV64:
+	    return 6;
+	case APIC_TMR_DIV128:
+	    return 7;
+	default:
+	    return -1;
+    }
+}
+
+
 static void 
 apic_update_time(struct v3_core_info * core, 
 		 uint64_t              cpu_cycles,
@@ -1812,8 +1843,7 @@ apic_update_time(struct v3_core_info * core,
     uint32_t tmr_ticks = 0;
 #endif
 
-    uint8_t tmr_div  = *(uint8_t *)&(apic->tmr_div_cfg.val);
-    uint_t shift_num = 0;
+    int shift_num = 0;
 
 
     // Check whether this is true:
@@ -1826,36 +1856,12 @@ apic_update_time(struct v3_core_info * core,
 	return;
     }
 
+    shift_num = apic_tmr_shift(apic);
 
-    switch (tmr_div) {
-	case APIC_TMR_DIV1:
-	    shift_num = 0;
-	    break;
-	case APIC_TMR_DIV2:
-	    shift_num = 1;
-	    break;
-	case APIC_TMR_DIV4:
-	    shift_num = 2;
-	    break;
-	case APIC_TMR_DIV8:
-	    shift_num = 3;
-	    break;
-	case APIC_TMR_DIV16:
-	    shift_num = 4;
-	    break;
-	case APIC_TMR_DIV32:
-	    shift_num = 5;
-	    break;
-	case APIC_TMR_DIV64:
-	    shift_num = 6;
-	    break;
-	case APIC_TMR_DIV128:
-	    shift_num = 7;
-	    break;
-	default:
-	    PrintError("apic %u: core %u: Invalid Timer Divider configuration\n",
-		       apic->lapic_id.val, core->vcpu_id);
-	    return;
+    if (shift_num == -1) {
+	PrintError("apic %u: core %u: Invalid Timer Divider configuration\n",
+		   apic->lapic_id.val, core->vcpu_id);
+	return;
     }
 
     tmr_ticks = cpu_cycles >> shift_num;
@@ -1898,8 +1904,40 @@ static struct intr_ctrl_ops intr_ops = {
 };
 
 
+static uint64_t 
+apic_next_event(struct v3_core_info * core, 
+		uint64_t              cpu_freq, 
+		void                * priv_data) 
+{
+    struct apic_dev_state * apic_dev  = (struct apic_dev_state *)(priv_data);
+    struct apic_state     * apic      = &(apic_dev->apics[core->vcpu_id]); 
+    int                     shift_num = 0;
+
+    if ((apic->tmr_init_cnt == 0) || 
+	( (apic->tmr_vec_tbl.tmr_mode == APIC_TMR_ONESHOT) &&
+	  (apic->tmr_cur_cnt          == 0)) ) {
+	return V3_TIMER_NO_EVENT;
+    }
+
+#ifdef V3_CONFIG_APIC_ENQUEUE_MISSED_TMR_IRQS
+    if (apic->missed_ints) {
+	return 0;
+    }
+#endif
+
+    shift_num = apic_tmr_shift(apic);
+
+    if (shift_num == -1) {
+	return V3_TIMER_NO_EVENT;
+    }
+
+    return ((uint64_t)apic->tmr_cur_cnt) << shift_num;
+}
+
+
 static struct v3_timer_ops timer_ops = {
     .update_timer    = apic_update_time,
+    .next_event      = apic_next_event,
 };
 
 
@@ -93,6 +93,18 @@ static int handle_console_write(struct v3_core_info * core, uint16_t port, void
 }
 
 
+// REP OUTSB to the console port
+static int handle_console_write_string(struct v3_core_info * core, uint16_t port, void * src, uint_t length, uint_t count, void * priv_data) {
+    uint_t i = 0;
+
+    for (i = 0; i < count; i++) {
+	handle_console_write(core, port, (uint8_t *)src + (i * length), length, priv_data);
+    }
+
+    return count;
+}
+
+
 static int handle_gen_write(struct v3_core_info * core, uint16_t port, void * src, uint_t length, void * priv_data)  {
     
     switch (length) {
@@ -168,6 +180,7 @@ static int debug_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     ret |= v3_dev_hook_io(dev, BOCHS_INFO_PORT,    NULL, &handle_info_write);
     ret |= v3_dev_hook_io(dev, BOCHS_DEBUG_PORT,   NULL, &handle_debug_write);
     ret |= v3_dev_hook_io(dev, BOCHS_CONSOLE_PORT, NULL, &handle_console_write);
+    ret |= v3_dev_hook_io_string(dev, BOCHS_CONSOLE_PORT, NULL, &handle_console_write_string);
     
     if (ret != 0) {
 	PrintError("Could not hook Bochs Debug IO Ports\n");
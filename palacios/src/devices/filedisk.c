@@ -31,6 +31,8 @@
 struct disk_state {
     uint64_t  capacity; // in bytes
     v3_file_t fd;
+
+    struct v3_dev_blk_ops ops;  // blk_ops, minus what the host cannot do
 };
 
 
@@ -107,7 +109,7 @@ read(uint8_t    * buf,
 	       (uint8_t *)(disk->disk_image + lba), 
 	       buf);
 
-    if ((lba + num_bytes) > disk->capacity) {
+    if ((lba > disk->capacity) || (num_bytes > (disk->capacity - lba))) {
 	PrintError("Out of bounds read: lba=%llu, num_bytes=%llu, capacity=%llu\n",
 		   lba, num_bytes, disk->capacity);
 	return -1;
@@ -130,7 +132,7 @@ write(uint8_t   * buf,
 	       buf, 
 	       (uint8_t *)(disk->disk_image + lba));
 
-    if ((lba + num_bytes) > disk->capacity) {
+    if ((lba > disk->capacity) || (num_bytes > (disk->capacity - lba))) {
 	PrintError("Out of bounds read: lba=%llu, num_bytes=%llu, capacity=%llu\n",
 		   lba, num_bytes, disk->capacity);
 	return -1;
@@ -209,6 +211,90 @@ writev(v3_iov_t * iov_arr,
 
 
 
+static int
+flush(void * private_data)
+{
+    struct disk_state * disk = (struct disk_state *)private_data;
+
+    if (v3_file_sync(disk->fd) != 0) {
+	PrintError("FILEDISK flush failed\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+discard(uint64_t   lba,
+	uint64_t   num_bytes,
+	void     * private_data)
+{
+    struct disk_state * disk = (struct disk_state *)private_data;
+
+    if ((lba > disk->capacity) || (num_bytes > (disk->capacity - lba))) {
+	PrintError("Out of bounds discard: lba=%llu, num_bytes=%llu, capacity=%llu\n",
+		   lba, num_bytes, disk->capacity);
+	return -1;
+    }
+
+    // Discards are advisory, so a host that cannot punch holes just keeps the blocks
+    if (v3_file_discard(disk->fd, lba, num_bytes) != 0) {
+	PrintDebug("Host could not discard %llu bytes at %llu\n", num_bytes, lba);
+    }
+
+    return 0;
+}
+
+
+static int
+write_zeroes(uint64_t   lba,
+	     uint64_t   num_bytes,
+	     void     * private_data)
+{
+    struct disk_state * disk = (struct disk_state *)private_data;
+    uint8_t           * zero_page = NULL;
+    uint64_t            offset    = 0;
+    int                 ret       = 0;
+
+    if ((lba > disk->capacity) || (num_bytes > (disk->capacity - lba))) {
+	PrintError("Out of bounds write zeroes: lba=%llu, num_bytes=%llu, capacity=%llu\n",
+		   lba, num_bytes, disk->capacity);
+	return -1;
+    }
+
+    if (v3_file_zero(disk->fd, lba, num_bytes) == 0) {
+	return 0;
+    }
+
+    // The host cannot zero the range in place, so write it out
+    zero_page = V3_Malloc(PAGE_SIZE_4KB);
+
+    if (zero_page == NULL) {
+	PrintError("Could not allocate zero page\n");
+	return -1;
+    }
+
+    memset(zero_page, 0, PAGE_SIZE_4KB);
+
+    while ((offset < num_bytes) && (ret == 0)) {
+	uint64_t len = num_bytes - offset;
+
+	if (len > PAGE_SIZE_4KB) {
+	    len = PAGE_SIZE_4KB;
+	}
+
+	ret     = write_all(disk->fd, (char *)zero_page, lba + offset, len);
+	offset += len;
+    }
+
+    V3_Free(zero_page);
+
+    return ret;
+}
+
+
+
 static uint64_t 
 get_capacity(void * private_data) 
 {
@@ -224,6 +310,9 @@ static struct v3_dev_blk_ops blk_ops = {
     .write        = write,
     .readv        = readv,
     .writev       = writev,
+    .flush        = flush,
+    .discard      = discard,
+    .write_zeroes = write_zeroes,
     .get_capacity = get_capacity,
 };
 
@@ -304,8 +393,15 @@ disk_init(struct v3_vm_info * vm,
 	     dev_id, path, (addr_t)disk->fd, disk->capacity);
 
 
+    // Don't advertise cache flushes the host cannot perform
+    disk->ops = blk_ops;
+
+    if (!v3_file_can_sync()) {
+	disk->ops.flush = NULL;
+    }
+
     if (v3_dev_connect_blk(vm, v3_cfg_val(frontend_cfg, "tag"), 
-			   &blk_ops, frontend_cfg, disk) == -1) {
+			   &(disk->ops), frontend_cfg, disk) == -1) {
 	PrintError("Could not connect %s to frontend %s\n", 
 		   dev_id, v3_cfg_val(frontend_cfg, "tag"));
 
@@ -482,6 +482,12 @@ dma_read(struct v3_core_info * core,
 
 	PrintDebug("PRD table address = %x\n", channel->dma_prd_addr);
 
+	// Guest memory may not have been allocated or restored yet
+	if (v3_populate_gpa_range(core->vm_info, prd_entry_addr, sizeof(struct ide_dma_prd)) == -1) {
+	    PrintError("Could not populate PRD\n");
+	    return -1;
+	}
+
 	ret = v3_read_gpa(core, prd_entry_addr, sizeof(struct ide_dma_prd), (void *)&prd_entry);
 
 	if (ret != sizeof(struct ide_dma_prd)) {
@@ -503,6 +509,11 @@ dma_read(struct v3_core_info * core,
 	    prd_bytes_left = prd_entry.size;
 	}
 
+	if (v3_populate_gpa_range(core->vm_info, prd_entry.base_addr, prd_bytes_left) == -1) {
+	    PrintError("Could not populate DMA buffer\n");
+	    return -1;
+	}
+
 
 	while (prd_bytes_left > 0) {
 	    uint_t bytes_to_write = 0;
@@ -675,6 +686,12 @@ dma_write(struct v3_core_info * core,
 	
 	PrintDebug("PRD Table address = %x\n", channel->dma_prd_addr);
 
+	// Guest memory may not have been allocated or restored yet
+	if (v3_populate_gpa_range(core->vm_info, prd_entry_addr, sizeof(struct ide_dma_prd)) == -1) {
+	    PrintError("Could not populate PRD\n");
+	    return -1;
+	}
+
 	ret = v3_read_gpa(core, prd_entry_addr, sizeof(struct ide_dma_prd), (void *)&prd_entry);
 
 	if (ret != sizeof(struct ide_dma_prd)) {
@@ -694,6 +711,11 @@ dma_write(struct v3_core_info * core,
 	    prd_bytes_left = prd_entry.size;
 	}
 
+	if (v3_populate_gpa_range(core->vm_info, prd_entry.base_addr, prd_bytes_left) == -1) {
+	    PrintError("Could not populate DMA buffer\n");
+	    return -1;
+	}
+
 	while (prd_bytes_left > 0) {
 	    uint_t bytes_to_write = 0;
 
@@ -1398,6 +1420,107 @@ ide_read_data_port(struct v3_core_info * core,
     return length;
 }
 
+/* 
+ * REP INS/OUTS on the data port. 
+ * The buffer is handed to the single element handlers a sector (or ATAPI block) at a time,
+ *  so sectors are fetched and interrupts raised at the same points as for a word by word transfer.
+ * Whatever does not fit in the current transfer is left to the single element handlers.
+ */
+static int 
+ide_read_data_port_string(struct v3_core_info * core, 
+			  uint16_t              port, 
+			  void                * dst, 
+			  uint_t                length, 
+			  uint_t                count, 
+			  void                * priv_data) 
+{
+    struct ide_internal * ide     = priv_data;
+    struct ide_channel  * channel = get_selected_channel(ide, port);
+    struct ide_drive    * drive   = get_selected_drive(channel);
+    uint8_t             * buf     = (uint8_t *)dst;
+    uint_t                done    = 0;
+
+    while (done < count) {
+	uint_t chunk = 0;
+
+	if (drive->transfer_index >= drive->transfer_length) {
+	    break;
+	}
+
+	if ( (channel->cmd_reg == 0xec) ||
+	     (channel->cmd_reg == 0xa1)) {
+	    chunk = drive->transfer_length - drive->transfer_index;
+	} else if (drive->drive_type == BLOCK_CDROM) {
+	    chunk = ATAPI_BLOCK_SIZE - (drive->transfer_index % ATAPI_BLOCK_SIZE);
+	} else if (drive->drive_type == BLOCK_DISK) {
+	    chunk = HD_SECTOR_SIZE - (drive->transfer_index % HD_SECTOR_SIZE);
+	} else {
+	    break;
+	}
+
+	if (chunk > (drive->transfer_length - drive->transfer_index)) {
+	    chunk = drive->transfer_length - drive->transfer_index;
+	}
+
+	if (chunk > ((count - done) * length)) {
+	    chunk = (count - done) * length;
+	}
+
+	chunk -= (chunk % length);
+
+	if (chunk == 0) {
+	    break;
+	}
+
+	if (ide_read_data_port(core, port, buf, chunk, priv_data) != chunk) {
+	    PrintError("IDE: Could not read %d bytes from data port\n", chunk);
+	    return -1;
+	}
+
+	buf  += chunk;
+	done += chunk / length;
+    }
+
+    return done;
+}
+
+
+static int 
+write_data_port_string(struct v3_core_info * core, 
+		       uint16_t              port, 
+		       void                * src, 
+		       uint_t                length, 
+		       uint_t                count, 
+		       void                * priv_data) 
+{
+    struct ide_internal * ide     = priv_data;
+    struct ide_channel  * channel = get_selected_channel(ide, port);
+    struct ide_drive    * drive   = get_selected_drive(channel);
+    uint_t                chunk   = count * length;
+
+    if (drive->transfer_index >= drive->transfer_length) {
+	return 0;
+    }
+
+    if (chunk > (drive->transfer_length - drive->transfer_index)) {
+	chunk = drive->transfer_length - drive->transfer_index;
+    }
+
+    chunk -= (chunk % length);
+
+    if (chunk == 0) {
+	return 0;
+    }
+
+    if (write_data_port(core, port, src, chunk, priv_data) != chunk) {
+	PrintError("IDE: Could not write %d bytes to data port\n", chunk);
+	return -1;
+    }
+
+    return chunk / length;
+}
+
+
 static int 
 write_port_std(struct v3_core_info * core, 
 	       uint16_t              port, 
@@ -2028,6 +2151,9 @@ ide_init(struct v3_vm_info * vm,
 
     ret |= v3_dev_hook_io(dev, PRI_CTRL_PORT,      &read_port_std,      &write_port_std);
     ret |= v3_dev_hook_io(dev, SEC_CTRL_PORT,      &read_port_std,      &write_port_std);
+
+    ret |= v3_dev_hook_io_string(dev, PRI_DATA_PORT, &ide_read_data_port_string, &write_data_port_string);
+    ret |= v3_dev_hook_io_string(dev, SEC_DATA_PORT, &ide_read_data_port_string, &write_data_port_string);
     ret |= v3_dev_hook_io(dev, SEC_ADDR_REG_PORT,  &read_port_std,      &write_port_std);
     ret |= v3_dev_hook_io(dev, PRI_ADDR_REG_PORT,  &read_port_std,      &write_port_std);
 
@@ -117,6 +117,11 @@ static int get_desc_count(struct virtio_queue * q, int index) {
 static int handle_kick(struct v3_core_info * core, struct virtio_balloon_state * virtio) {
     struct virtio_queue * q = virtio->cur_queue;
 
+    if (vring_populate(core->vm_info, q) == -1) {
+	PrintError("Could not populate balloon queue memory\n");
+	return -1;
+    }
+
     PrintDebug("VIRTIO BALLOON KICK: cur_index=%d (mod=%d), avail_index=%d\n", 
 	       q->cur_avail_idx, q->cur_avail_idx % QUEUE_SIZE, q->avail->index);
 
@@ -166,6 +171,8 @@ static int handle_kick(struct v3_core_info * core, struct virtio_balloon_state *
 
 	q->used->index++;
 	q->cur_avail_idx++;
+
+	vring_used_dirty(core->vm_info, q);
     }
 
     if (!(q->avail->flags & VIRTIO_NO_IRQ_FLAG)) {
@@ -216,6 +223,11 @@ static int virtio_io_write(struct v3_core_info * core, uint16_t port, void * src
 		// round up to next page boundary.
 		virtio->cur_queue->ring_used_addr = (virtio->cur_queue->ring_used_addr + 0xfff) & ~0xfff;
 
+		if (v3_populate_gpa_range(core->vm_info, virtio->cur_queue->ring_desc_addr, vring_mem_size(virtio->cur_queue)) == -1) {
+		    PrintError("Could not populate ring memory\n");
+		    return -1;
+		}
+
 		if (v3_gpa_to_hva(core, virtio->cur_queue->ring_desc_addr, (addr_t *)&(virtio->cur_queue->desc)) == -1) {
 		    PrintError("Could not translate ring descriptor address\n");
 		    return -1;
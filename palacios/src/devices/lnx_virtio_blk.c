@@ -45,6 +45,9 @@
 #define BLK_IN_REQ            0
 #define BLK_OUT_REQ           1
 #define BLK_SCSI_CMD          2
+#define BLK_FLUSH_REQ         4
+#define BLK_DISCARD_REQ       11
+#define BLK_WRITE_ZEROES_REQ  13
 
 #define BLK_BARRIER_FLAG      0x80000000
 
@@ -60,13 +63,21 @@ struct blk_config {
     uint16_t cylinders;
     uint8_t  heads;
     uint8_t  sectors;
-    /*
     uint32_t blk_size;
     uint8_t  phys_block_exp;
     uint8_t  alignment_offset;
     uint16_t min_io_size;
     uint32_t opt_io_size;
-    */
+    uint8_t  writeback;
+    uint8_t  rsvd;
+    uint16_t num_queues;
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
+    uint32_t max_write_zeroes_sectors;
+    uint32_t max_write_zeroes_seg;
+    uint8_t  write_zeroes_may_unmap;
+    uint8_t  rsvd2[3];
 } __attribute__((packed));
 
 
@@ -77,13 +88,30 @@ struct blk_op_hdr {
     uint64_t sector;
 } __attribute__((packed));
 
-#define QUEUE_SIZE 128
+/* Payload of discard and write zeroes requests */
+struct blk_range {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+} __attribute__((packed));
+
+#define QUEUE_SIZE           128     /* Default queue depth */
+#define BLK_MAX_QUEUE_SIZE   1024
+#define BLK_MAX_QUEUES       64
 
 /* Host Feature flags */
 #define VIRTIO_BARRIER       0x01       /* Does host support barriers? */
 #define VIRTIO_SIZE_MAX      0x02       /* Indicates maximum segment size */
 #define VIRTIO_SEG_MAX       0x04       /* Indicates maximum # of segments */
 #define VIRTIO_LEGACY_GEOM   0x10       /* Indicates support of legacy geometry */
+#define VIRTIO_FLUSH         0x200      /* Indicates support of cache flushes */
+#define VIRTIO_MULTI_QUEUE   0x1000     /* Indicates support of multiple request queues */
+#define VIRTIO_DISCARD       0x2000     /* Indicates support of discard */
+#define VIRTIO_WRITE_ZEROES  0x4000     /* Indicates support of write zeroes */
+
+#define BLK_MAX_RANGE_SECTORS 0x400000  /* Largest discard/write zeroes range, 2GB */
+#define BLK_MAX_RANGE_SEGS    32        /* Ranges per discard/write zeroes request */
+#define BLK_DISCARD_ALIGNMENT 8         /* Sectors, matches the host page size */
 
 
 struct virtio_dev_state {
@@ -93,13 +121,84 @@ struct virtio_dev_state {
 };
 
 
+#define BLK_INLINE_SEGS      16   /* Segments held in the request itself, larger requests use iov_ext */
+#define BLK_NOTIFY_BATCH     16   /* Completions posted to the used ring before forcing an interrupt */
+#define BLK_MAX_IO_THREADS   8
+#define BLK_IO_THREAD_SLEEP  1000 /* usecs an idle IO thread sleeps between checks */
+
+struct virtio_blk_state;
+struct blk_queue;
+
+struct blk_io_thread {
+    struct blk_queue * blk_queue;
+    void             * thread;
+    int                idle;        /* Waiting for work, protected by the queue's io_lock */
+};
+
+/* 
+ * In flight requests are indexed by their head descriptor, 
+ *  which the guest cannot reuse until the request is returned in the used ring 
+ */
+struct blk_req {
+    struct blk_queue * blk_queue;
+
+    uint16_t   desc_idx;
+    uint32_t   type;
+    uint64_t   offset;
+    uint32_t   req_len;
+    uint8_t  * status;
+    uint8_t    status_val;
+
+    uint32_t   iov_len;
+    v3_iov_t * iov_arr;
+    v3_iov_t   iov_inline[BLK_INLINE_SEGS];
+    v3_iov_t * iov_ext;                      /* Allocated once, on the first request that needs it */
+
+    struct list_head io_node;                /* Entry on the IO thread queue */
+};
+
+
+/* 
+ * Each request queue is dispatched independently:
+ *  it has its own locks, IO threads, and (with MSI-X) interrupt vector
+ */
+struct blk_queue {
+    struct virtio_blk_state * blk_state;
+    uint16_t                  queue_idx;
+
+    struct virtio_queue       queue;
+    uint16_t                  msix_vector;
+
+    struct shadow_vring_desc * shadow_desc;
+    uint16_t shadow_avail_idx;
+    uint16_t shadow_used_idx;
+
+    struct v3_gpa_cache gpa_cache;   /* Translations of request buffers */
+
+    struct blk_req * reqs;
+
+    v3_spinlock_t    kick_lock;      /* Protects the shadow ring, taken on the IO port exit path */
+
+    v3_spinlock_t    used_lock;      /* Protects the used ring and the counters below */
+    int              in_flight;
+    int              unnotified;     /* Completions the guest has not been interrupted for */
+
+    int              num_io_threads;
+    struct blk_io_thread io_threads[BLK_MAX_IO_THREADS];
+
+    v3_spinlock_t    io_lock;
+    struct list_head io_queue;
+};
+
 
 struct virtio_blk_state {
     struct pci_device     * pci_dev;
     struct blk_config       block_cfg;
     struct virtio_config    virtio_cfg;
 
-    struct virtio_queue     queue;
+    uint16_t                num_queues;
+    uint16_t                queue_size;
+    struct blk_queue      * queues;
 
     struct v3_dev_blk_ops * ops;
 
@@ -112,46 +211,72 @@ struct virtio_blk_state {
 
     struct list_head dev_link;
 
-    struct shadow_vring_desc shadow_desc[QUEUE_SIZE]; 
-    uint16_t shadow_avail_idx;
-    uint16_t shadow_used_idx;
-
     v3_spinlock_t isr_lock;
 
+    /* MSI-X is only offered to guests when there are multiple queues */
+    int                 msix_enabled;
+    uint16_t            config_vector;
+    uint16_t            num_vectors;
+    void              * msix_page;   /* Host physical address of the table page */
+
     /* async IO request queue */
     int    async_enabled;
     int    async_thread_should_stop;
-    void * async_thread;
 
 };
 
 
 
+static void blk_drain(struct virtio_blk_state * blk_state);
+
 static int 
 blk_reset(struct virtio_blk_state * virtio) 
 {
+    int i = 0; 
+
+    // Outstanding requests would complete into rings the guest is free to reuse
+    blk_drain(virtio);
+
+    for (i = 0; i < virtio->num_queues; i++) {
+	struct blk_queue * blk_queue = &(virtio->queues[i]);
 
-    virtio->queue.ring_desc_addr  = 0;
-    virtio->queue.ring_avail_addr = 0;
-    virtio->queue.ring_used_addr  = 0;
-    virtio->queue.pfn             = 0;
-    virtio->queue.cur_avail_idx   = 0;
+	blk_queue->queue.ring_desc_addr  = 0;
+	blk_queue->queue.ring_avail_addr = 0;
+	blk_queue->queue.ring_used_addr  = 0;
+	blk_queue->queue.pfn             = 0;
+	blk_queue->queue.cur_avail_idx   = 0;
+
+	blk_queue->shadow_used_idx       = 0;
+	blk_queue->shadow_avail_idx      = 0;
+	blk_queue->msix_vector           = VIRTIO_MSI_NO_VECTOR;
+    }
 
     virtio->virtio_cfg.status     = 0;
     virtio->virtio_cfg.pci_isr    = 0;
+    virtio->config_vector         = VIRTIO_MSI_NO_VECTOR;
 
-    virtio->shadow_used_idx       = 0;
-    virtio->shadow_avail_idx      = 0;
     return 0;
 }
 
 static void 
-vq_notify(struct virtio_blk_state * blk_state) 
+vq_notify(struct blk_queue * blk_queue)
 {
-    struct virtio_queue * vq = &(blk_state->queue);
+    struct virtio_blk_state * blk_state = blk_queue->blk_state;
+    struct virtio_queue     * vq        = &(blk_queue->queue);
 
     if (!(vq->avail->flags & VIRTIO_NO_IRQ_FLAG)) {
 
+	if (blk_state->msix_enabled) {
+	    if (blk_queue->msix_vector != VIRTIO_MSI_NO_VECTOR) {
+		PrintDebug("virtio_blk raise MSI-X vector %d for queue %d\n",
+			   blk_queue->msix_vector, blk_queue->queue_idx);
+
+		v3_pci_raise_irq(blk_state->virtio_dev->pci_bus, blk_state->pci_dev, blk_queue->msix_vector);
+	    }
+
+	    return;
+	}
+
         v3_spin_lock(&(blk_state->isr_lock));
 	{
 	    if (blk_state->virtio_cfg.pci_isr == 0) {
@@ -172,32 +297,13 @@ vq_notify(struct virtio_blk_state * blk_state)
     }
 }
 
-static inline void 
-vq_complete(struct virtio_blk_state * blk_state, 
-	    uint64_t                  index, 
-	    uint64_t                  req_len)
-{
-    struct virtio_queue * vq = &(blk_state->queue);
-
-    PrintDebug("complete avail_index %llu into used_index %d\n", 
-	       index           % QUEUE_SIZE, 
-	       vq->used->index % QUEUE_SIZE);
-
-    vq->used->ring[vq->used->index % QUEUE_SIZE].id     = vq->avail->ring[index % QUEUE_SIZE];
-    vq->used->ring[vq->used->index % QUEUE_SIZE].length = req_len;
-    vq->used->index++;
-
-    vq_notify(blk_state);
-}
-
-
 static int 
 get_desc_count(struct virtio_queue * q, 
 	       int                   index) 
 {
     struct vring_desc * tmp_desc = &(q->desc[index]);
     int cnt = 1;
-    
+
     while (tmp_desc->flags & VIRTIO_NEXT_FLAG) {
 	tmp_desc = &(q->desc[tmp_desc->next]);
 	cnt++;
@@ -208,19 +314,19 @@ get_desc_count(struct virtio_queue * q,
 
 
 static int 
-fill_shadow_desc_buf(struct v3_core_info     * core, 
-		     struct virtio_blk_state * blk_state, 
-		     int                       avail_idx) 
+fill_shadow_desc_buf(struct v3_core_info * core,
+		     struct blk_queue    * blk_queue,
+		     int                   avail_idx)
 {
-    struct virtio_queue      * q           = &(blk_state->queue);
-    struct shadow_vring_desc * shadow_desc = blk_state->shadow_desc;
+    struct virtio_queue      * q           = &(blk_queue->queue);
+    struct shadow_vring_desc * shadow_desc = blk_queue->shadow_desc;
 
     while (q->cur_avail_idx != avail_idx) {
         struct vring_desc * hdr_desc    = NULL;
         struct vring_desc * buf_desc    = NULL;
         struct vring_desc * status_desc = NULL;
-      
-	uint16_t desc_idx = q->avail->ring[q->cur_avail_idx % QUEUE_SIZE];
+
+	uint16_t desc_idx = q->avail->ring[q->cur_avail_idx % q->queue_size];
         int      desc_cnt = get_desc_count(q, desc_idx);
         int i;
 
@@ -236,9 +342,9 @@ fill_shadow_desc_buf(struct v3_core_info     * core,
         hdr_desc = &(q->desc[desc_idx]);
         memcpy(&shadow_desc[desc_idx], hdr_desc, sizeof(struct vring_desc));
 
-        if (v3_gpa_to_hva(core, hdr_desc->addr_gpa, 
-			  (void *) &(shadow_desc[desc_idx].addr_hva)) == -1) {
-	    
+        if (v3_gpa_to_hva_cached(core, &(blk_queue->gpa_cache), hdr_desc->addr_gpa, 
+				 (void *) &(shadow_desc[desc_idx].addr_hva)) == -1) {
+
             PrintError("Could not translate block header address\n");
             return -1;
         }
@@ -250,8 +356,8 @@ fill_shadow_desc_buf(struct v3_core_info     * core,
             buf_desc = &(q->desc[desc_idx]);
             memcpy(&shadow_desc[desc_idx], buf_desc, sizeof(struct vring_desc));
 
-            if (v3_gpa_to_hva(core, buf_desc->addr_gpa, 
-			      (void *) &shadow_desc[desc_idx].addr_hva) == -1) {
+            if (v3_gpa_to_hva_cached(core, &(blk_queue->gpa_cache), buf_desc->addr_gpa, 
+				     (void *) &shadow_desc[desc_idx].addr_hva) == -1) {
                 PrintError("Could not translate buffer address %d\n", i);
                 return -1;
             }
@@ -263,157 +369,440 @@ fill_shadow_desc_buf(struct v3_core_info     * core,
         status_desc = &(q->desc[desc_idx]);
         memcpy(&shadow_desc[desc_idx], status_desc, sizeof(struct vring_desc));
 
-        if (v3_gpa_to_hva(core, status_desc->addr_gpa, 
-			  (void *)&(shadow_desc[desc_idx].addr_hva)) == -1) {
+        if (v3_gpa_to_hva_cached(core, &(blk_queue->gpa_cache), status_desc->addr_gpa, 
+				 (void *)&(shadow_desc[desc_idx].addr_hva)) == -1) {
             PrintError("Could not translate status address\n");
             return -1;
         }
 
         q->cur_avail_idx            += 1;
-        blk_state->shadow_avail_idx += 1;
+        blk_queue->shadow_avail_idx += 1;
     }
 
     return 0;
 }
 
 
-static int 
-_handle_kick(struct virtio_blk_state * blk_state)
+/* 
+ * Drops an in flight reference, posting req to the used ring if it is not NULL. 
+ *  Interrupts are raised once per batch of completions, 
+ *  or when nothing else is outstanding to trigger one later.
+ */
+static void 
+blk_finish(struct blk_queue * blk_queue,
+	   struct blk_req   * req)
 {
-    struct virtio_queue * q = &(blk_state->queue);
-    uint16_t idx     = 0;
-    uint16_t end_idx = 0;
+    struct virtio_queue * vq     = &(blk_queue->queue);
+    unsigned int          flags  = 0;
+    int                   notify = 0;
 
-    idx     = blk_state->shadow_used_idx;
-    end_idx = blk_state->shadow_avail_idx;
+    flags = v3_spin_lock_irqsave(&(blk_queue->used_lock));
+    {
+	if (req) {
+	    PrintDebug("complete desc %d into used_index %d\n", 
+		       req->desc_idx, vq->used->index % vq->queue_size);
 
+	    vq->used->ring[vq->used->index % vq->queue_size].id     = req->desc_idx;
+	    vq->used->ring[vq->used->index % vq->queue_size].length = req->req_len;
 
-    while (idx != blk_state->shadow_avail_idx) {
-        struct shadow_vring_desc * hdr_desc    = NULL;
-        struct shadow_vring_desc * buf_desc    = NULL;
-        struct shadow_vring_desc * status_desc = NULL;
+	    __asm__ __volatile__ ("":::"memory");
 
-        uint16_t   desc_idx = q->avail->ring[idx % QUEUE_SIZE];
-        int        desc_cnt = get_desc_count(q, desc_idx);
-        uint64_t   req_len  = 0;
-        uint8_t    status   = BLK_STATUS_OK;
-	v3_iov_t * iov_arr  = NULL;
+	    vq->used->index++;
+	    blk_queue->unnotified++;
 
-        struct blk_op_hdr hdr;
-	int ret = 0;
-        int i   = 0; 
+	    vring_used_dirty(blk_queue->blk_state->pci_dev->vm, vq);
+	}
 
-        PrintDebug("%s: shadow_used_idx=%d (mod=%d), shadow_avail_index=%d (mod=%d)\n", 
-		   __func__,
-		   blk_state->shadow_used_idx,  blk_state->shadow_used_idx  % QUEUE_SIZE, 
-		   blk_state->shadow_avail_idx, blk_state->shadow_avail_idx % QUEUE_SIZE);
-        //PrintDebug("Descriptor Count=%d, index=%d\n", desc_cnt, idx % QUEUE_SIZE);
+	blk_queue->in_flight--;
 
-        hdr_desc = &(blk_state->shadow_desc[desc_idx]);
-        // We copy the block op header out because we are going to modify its contents
-        memcpy(&hdr, (void *)hdr_desc->addr_hva, sizeof(struct blk_op_hdr));
-        //PrintDebug("Header Descriptor (ptr=%p) hva=%p, len=%d, flags=%x, next=%d\n", hdr_desc, 
-        //        (void *)(hdr_desc->addr_hva), hdr_desc->length, hdr_desc->flags, hdr_desc->next);	
+	if ( (blk_queue->unnotified > 0) &&
+	     ((blk_queue->in_flight == 0) || (blk_queue->unnotified >= BLK_NOTIFY_BATCH)) ) {
+	    blk_queue->unnotified = 0;
+	    notify = 1;
+	}
+    }
+    v3_spin_unlock_irqrestore(&(blk_queue->used_lock), flags);
 
+    if (notify) {
+	vq_notify(blk_queue);
+    }
+}
 
 
-        //PrintDebug("Blk Op Hdr (ptr=%p) type=%d, sector=%p\n", 
-        //        (void *)hdr_desc->addr_hva, hdr.type, (void *)hdr.sector);
+static void 
+blk_req_done(int    ret, 
+	     void * done_data) 
+{
+    struct blk_req * req = (struct blk_req *)done_data;
 
-        desc_idx = hdr_desc->next;
-	
-	iov_arr = V3_Malloc(sizeof(v3_iov_t) * (desc_cnt - 2));
-	memset(iov_arr, 0,  sizeof(v3_iov_t) * (desc_cnt - 2));
+    if (ret < 0) {
+	PrintError("Block request (type=%d) Error (sector=%llu)\n", 
+		   req->type, req->offset / SECTOR_SIZE);
+	req->status_val = BLK_STATUS_ERR;
+    }
 
-        for (i = 0; i < desc_cnt - 2; i++) {
-            buf_desc = &(blk_state->shadow_desc[desc_idx]);
+    *(req->status) = req->status_val;
 
-	    iov_arr[i].iov_base = (void *)buf_desc->addr_hva;
-	    iov_arr[i].iov_len  = buf_desc->length;
+    // Covers the data of IN requests as well as the status byte
+    vring_chain_dirty(req->blk_queue->blk_state->pci_dev->vm, &(req->blk_queue->queue), req->desc_idx);
+
+    blk_finish(req->blk_queue, req);
+}
 
-            PrintDebug("Buffer Descriptor (ptr=%p) hva=%p, len=%d, flags=%x, next=%d\n", 
-		       buf_desc, 
-		       (void *)(buf_desc->addr_hva), 
-		       buf_desc->length, 
-		       buf_desc->flags, 
-		       buf_desc->next);
 
-            req_len    += buf_desc->length;
-            desc_idx    = buf_desc->next;
+/* Backends without vector ops get one call per segment */
+static int 
+blk_rw_segs(struct virtio_blk_state * blk_state, 
+	    struct blk_req          * req) 
+{
+    struct v3_dev_blk_ops * ops    = blk_state->ops;
+    uint64_t                offset = req->offset;
+    int i = 0;
 
+    for (i = 0; i < req->iov_len; i++) {
+	int ret = 0;
+
+	if (req->type == BLK_IN_REQ) {
+	    ret = ops->read(req->iov_arr[i].iov_base, offset, req->iov_arr[i].iov_len, blk_state->backend_data);
+	} else {
+	    ret = ops->write(req->iov_arr[i].iov_base, offset, req->iov_arr[i].iov_len, blk_state->backend_data);
 	}
 
-	if (hdr.type == BLK_IN_REQ) {
-	    PrintDebug("Issue read\n");
+	if (ret == -1) {
+	    return -1;
+	}
+
+	offset += req->iov_arr[i].iov_len;
+    }
+
+    return 0;
+}
+
+
+/* Applies a discard or write zeroes request to each range in its payload */
+static int 
+blk_exec_ranges(struct virtio_blk_state * blk_state, 
+		struct blk_req          * req) 
+{
+    struct v3_dev_blk_ops * ops      = blk_state->ops;
+    uint64_t                capacity = blk_state->block_cfg.capacity;
+    int num_ranges = 0;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < req->iov_len; i++) {
+	struct blk_range * ranges = (struct blk_range *)req->iov_arr[i].iov_base;
+	int                cnt    = req->iov_arr[i].iov_len / sizeof(struct blk_range);
+
+	if ((req->iov_arr[i].iov_len % sizeof(struct blk_range)) != 0) {
+	    PrintError("Malformed range buffer (len=%lu)\n", (unsigned long)req->iov_arr[i].iov_len);
+	    return -1;
+	}
 
-	    ret = blk_state->ops->readv(iov_arr,
-					desc_cnt - 2,
-					hdr.sector * SECTOR_SIZE,
-					blk_state->backend_data);
+	for (j = 0; j < cnt; j++) {
+	    uint64_t sector      = ranges[j].sector;
+	    uint32_t num_sectors = ranges[j].num_sectors;
+	    int      ret         = 0;
+
+	    // Checked against what is left of the disk, so a huge sector cannot wrap around
+	    if ( (++num_ranges > BLK_MAX_RANGE_SEGS) || 
+		 (num_sectors  > BLK_MAX_RANGE_SECTORS) ||
+		 (sector      >= capacity) ||
+		 (num_sectors  > (capacity - sector)) ) {
+		PrintError("Invalid block range (sector=%llu, num_sectors=%u)\n", sector, num_sectors);
+		return -1;
+	    }
+
+	    PrintDebug("%s %u sectors at sector %llu\n", 
+		       (req->type == BLK_DISCARD_REQ) ? "Discard" : "Zero", num_sectors, sector);
+
+	    if (req->type == BLK_DISCARD_REQ) {
+		ret = ops->discard(sector * SECTOR_SIZE, (uint64_t)num_sectors * SECTOR_SIZE, blk_state->backend_data);
+	    } else {
+		ret = ops->write_zeroes(sector * SECTOR_SIZE, (uint64_t)num_sectors * SECTOR_SIZE, blk_state->backend_data);
+	    }
 
-	    if (ret < 0) {
-		PrintError("Read Error\n");
-		status = BLK_STATUS_ERR;
+	    if (ret == -1) {
+		return -1;
 	    }
-	} else if (hdr.type == BLK_OUT_REQ) {
+	}
+    }
+
+    return 0;
+}
+
+
+static void 
+blk_exec_req(struct blk_req * req) 
+{
+    struct virtio_blk_state * blk_state = req->blk_queue->blk_state;
+    struct v3_dev_blk_ops   * ops       = blk_state->ops;
+    int ret = 0;
+
+    switch (req->type) {
+	case BLK_IN_REQ:
+	    PrintDebug("Issue read\n");
+
+	    if (ops->readv) {
+		ret = ops->readv(req->iov_arr, req->iov_len, req->offset, blk_state->backend_data);
+	    } else {
+		ret = blk_rw_segs(blk_state, req);
+	    }
+	    break;
+	case BLK_OUT_REQ:
 	    PrintDebug("Issue write\n");
 
-	    ret = blk_state->ops->writev(iov_arr,
-					 desc_cnt - 2,
-					 hdr.sector * SECTOR_SIZE,
-					 blk_state->backend_data);
-		
-	    if (ret < 0) {
-		PrintError("Write Error\n");
-		status = BLK_STATUS_ERR;
+	    if (ops->writev) {
+		ret = ops->writev(req->iov_arr, req->iov_len, req->offset, blk_state->backend_data);
+	    } else {
+		ret = blk_rw_segs(blk_state, req);
+	    }
+	    break;
+	case BLK_FLUSH_REQ:
+	    PrintDebug("Issue flush\n");
+	    ret = ops->flush(blk_state->backend_data);
+	    break;
+	case BLK_DISCARD_REQ:
+	case BLK_WRITE_ZEROES_REQ:
+	    ret = blk_exec_ranges(blk_state, req);
+	    break;
+    }
+
+    blk_req_done(ret, req);
+}
+
+
+static int 
+blk_req_supported(struct virtio_blk_state * blk_state, 
+		  uint32_t                  type) 
+{
+    struct v3_dev_blk_ops * ops = blk_state->ops;
+
+    switch (type) {
+	case BLK_IN_REQ:
+	case BLK_OUT_REQ:
+	    return 1;
+	case BLK_FLUSH_REQ:
+	    return (ops->flush != NULL);
+	case BLK_DISCARD_REQ:
+	    return (ops->discard != NULL);
+	case BLK_WRITE_ZEROES_REQ:
+	    return (ops->write_zeroes != NULL);
+	default:
+	    return 0;
+    }
+}
+
+
+/* Hands a request to the backend, completing it immediately if it cannot be issued */
+static void 
+blk_submit_req(struct blk_queue * blk_queue,
+	       struct blk_req   * req)
+{
+    struct virtio_blk_state * blk_state = blk_queue->blk_state;
+    struct v3_dev_blk_ops   * ops       = blk_state->ops;
+    unsigned int              flags     = 0;
+    int                       ret       = 0;
+
+    if (blk_req_supported(blk_state, req->type) == 0) {
+	PrintDebug("Unsupported request type %d\n", req->type);
+	req->status_val = BLK_STATUS_NOT_SUPPORTED;
+	blk_req_done(0, req);
+	return;
+    }
+
+    if ((req->type == BLK_IN_REQ) && (ops->readv_async)) {
+	ret = ops->readv_async(req->iov_arr, req->iov_len, req->offset, 
+			       blk_req_done, req, blk_state->backend_data);
+    } else if ((req->type == BLK_OUT_REQ) && (ops->writev_async)) {
+	ret = ops->writev_async(req->iov_arr, req->iov_len, req->offset, 
+				blk_req_done, req, blk_state->backend_data);
+    } else if (blk_queue->num_io_threads > 0) {
+	struct blk_io_thread * io_thread = NULL;
+	int i = 0;
+
+	flags = v3_spin_lock_irqsave(&(blk_queue->io_lock));
+	{
+	    list_add_tail(&(req->io_node), &(blk_queue->io_queue));
+
+	    // Busy threads pick the request up when they are done, so only one idle thread is needed
+	    for (i = 0; i < blk_queue->num_io_threads; i++) {
+		if (blk_queue->io_threads[i].idle) {
+		    io_thread       = &(blk_queue->io_threads[i]);
+		    io_thread->idle = 0;
+		    break;
+		}
+	    }
+	}
+	v3_spin_unlock_irqrestore(&(blk_queue->io_lock), flags);
+
+	if (io_thread) {
+	    V3_Wakeup(io_thread->thread);
+	}
+    } else {
+	blk_exec_req(req);
+    }
+
+    if (ret == -1) {
+	blk_req_done(-1, req);
+    }
+}
+
+
+/* Builds a request from the descriptor chain starting at desc_idx */
+static struct blk_req * 
+build_req(struct blk_queue * blk_queue,
+	  uint16_t           desc_idx)
+{
+    struct virtio_queue      * q           = &(blk_queue->queue);
+    struct blk_req           * req         = &(blk_queue->reqs[desc_idx]);
+    struct shadow_vring_desc * hdr_desc    = NULL;
+    struct shadow_vring_desc * buf_desc    = NULL;
+    struct shadow_vring_desc * status_desc = NULL;
+    struct blk_op_hdr          hdr;
+    int desc_cnt = get_desc_count(q, desc_idx);
+    int i = 0; 
+
+    hdr_desc = &(blk_queue->shadow_desc[desc_idx]);
+    // We copy the block op header out because we are going to modify its contents
+    memcpy(&hdr, (void *)hdr_desc->addr_hva, sizeof(struct blk_op_hdr));
+
+    req->blk_queue  = blk_queue;
+    req->desc_idx   = desc_idx;
+    req->type       = hdr.type;
+    req->offset     = hdr.sector * SECTOR_SIZE;
+    req->req_len    = 0;
+    req->status_val = BLK_STATUS_OK;
+    req->iov_len    = desc_cnt - 2;
+    req->iov_arr    = req->iov_inline;
+
+    if (req->iov_len > BLK_INLINE_SEGS) {
+	if (req->iov_ext == NULL) {
+	    req->iov_ext = V3_Malloc(sizeof(v3_iov_t) * (q->queue_size - 2));
+
+	    if (req->iov_ext == NULL) {
+		PrintError("Could not allocate iov array (%d segments)\n", req->iov_len);
+		return NULL;
 	    }
-	} else {
-	    PrintDebug("Unsupported\n");
-	    status = BLK_STATUS_NOT_SUPPORTED;
 	}
 
-	V3_Free(iov_arr);
+	req->iov_arr = req->iov_ext;
+    }
 
+    desc_idx = hdr_desc->next;
 
-        status_desc                         = &(blk_state->shadow_desc[desc_idx]);
-        req_len                            += status_desc->length;
-        *((uint8_t *)status_desc->addr_hva) = status;
+    for (i = 0; i < req->iov_len; i++) {
+	buf_desc = &(blk_queue->shadow_desc[desc_idx]);
 
-	/*
-        PrintDebug("Status Descriptor (ptr=%p) hva=%p, len=%d, flags=%x, next=%d\n", status_desc, 
-		   (void *)(status_desc->addr_hva), 
-		   status_desc->length, 
-		   status_desc->flags, 
-		   status_desc->next);
-	*/
+	req->iov_arr[i].iov_base = (void *)buf_desc->addr_hva;
+	req->iov_arr[i].iov_len  = buf_desc->length;
 
-        vq_complete(blk_state, idx, req_len);
+	PrintDebug("Buffer Descriptor (ptr=%p) hva=%p, len=%d, flags=%x, next=%d\n", 
+		   buf_desc, 
+		   (void *)(buf_desc->addr_hva), 
+		   buf_desc->length, 
+		   buf_desc->flags, 
+		   buf_desc->next);
 
-        idx                        += 1;
-        blk_state->shadow_used_idx += 1;
+	req->req_len += buf_desc->length;
+	desc_idx      = buf_desc->next;
     }
 
+    status_desc   = &(blk_queue->shadow_desc[desc_idx]);
+    req->req_len += status_desc->length;
+    req->status   = (uint8_t *)status_desc->addr_hva;
+
+    return req;
+}
+
+
+/* Submits the requests between start_idx and end_idx, which the caller claimed under the kick lock */
+static int 
+_handle_kick(struct blk_queue * blk_queue, 
+	     uint16_t           start_idx, 
+	     uint16_t           end_idx)
+{
+    struct virtio_queue * q     = &(blk_queue->queue);
+    unsigned int          flags = 0;
+
+    while (start_idx != end_idx) {
+        uint16_t         desc_idx = q->avail->ring[start_idx % q->queue_size];
+	struct blk_req * req      = NULL;
+
+        PrintDebug("%s: queue %d start_idx=%d (mod=%d), end_idx=%d (mod=%d)\n",
+		   __func__, blk_queue->queue_idx,
+		   start_idx, start_idx % q->queue_size,
+		   end_idx,   end_idx   % q->queue_size);
+
+        start_idx += 1;
+
+	req = build_req(blk_queue, desc_idx);
+
+	if (req == NULL) {
+	    PrintError("Could not build request for descriptor %d\n", desc_idx);
+	    continue;
+	}
+
+	flags = v3_spin_lock_irqsave(&(blk_queue->used_lock));
+	blk_queue->in_flight++;
+	v3_spin_unlock_irqrestore(&(blk_queue->used_lock), flags);
+
+	blk_submit_req(blk_queue, req);
+    }
+
+    blk_finish(blk_queue, NULL);
+
     return 0;
 }
 
+static int 
+io_thread_woken(void * arg) 
+{
+    struct blk_io_thread * io_thread = (struct blk_io_thread *)arg;
+
+    return (*(volatile int *)&(io_thread->idle) == 0);
+}
+
 static int 
 io_dispatcher(void * arg) 
 {
-    struct virtio_blk_state * blk_state = (struct virtio_blk_state *)arg;
+    struct blk_io_thread    * io_thread = (struct blk_io_thread *)arg;
+    struct blk_queue        * blk_queue = io_thread->blk_queue;
+    struct virtio_blk_state * blk_state = blk_queue->blk_state;
 
-    PrintDebug("Start io_dispatcher\n");
+    PrintDebug("Start io_dispatcher for queue %d\n", blk_queue->queue_idx);
 
     while (blk_state->async_thread_should_stop == 0) {
-        if (blk_state->shadow_used_idx == blk_state->shadow_avail_idx) {
-            v3_yield(NULL, -1);
+	struct blk_req * req   = NULL;
+	unsigned int     flags = 0;
+
+	flags = v3_spin_lock_irqsave(&(blk_queue->io_lock));
+	{
+	    if (!list_empty(&(blk_queue->io_queue))) {
+		req = list_first_entry(&(blk_queue->io_queue), struct blk_req, io_node);
+		list_del(&(req->io_node));
+		io_thread->idle = 0;
+	    } else {
+		io_thread->idle = 1;
+	    }
+	}
+	v3_spin_unlock_irqrestore(&(blk_queue->io_lock), flags);
+
+        if (req == NULL) {
+	    // Woken early by the submitter that clears idle
+            V3_SleepUntil(BLK_IO_THREAD_SLEEP, io_thread_woken, io_thread);
             continue;
         }
 
-        PrintDebug("%s: handle_kick\n", __func__);
-        _handle_kick(blk_state);
+        PrintDebug("%s: issuing request for desc %d\n", __func__, req->desc_idx);
+        blk_exec_req(req);
     }
 
-    blk_state->async_thread = NULL;
+    {
+	unsigned int flags = v3_spin_lock_irqsave(&(blk_queue->io_lock));
+	blk_queue->num_io_threads--;
+	v3_spin_unlock_irqrestore(&(blk_queue->io_lock), flags);
+    }
 
     return 0;
 }
@@ -421,23 +810,91 @@ io_dispatcher(void * arg)
 
 
 static int 
-handle_kick(struct v3_core_info     * core, 
-	    struct virtio_blk_state * blk_state)
+handle_kick(struct v3_core_info * core,
+	    struct blk_queue    * blk_queue)
 {
-    int avail_idx = blk_state->queue.avail->index;
+    int          avail_idx = 0;
+    uint16_t     start_idx = 0;
+    uint16_t     end_idx   = 0;
+    unsigned int flags     = 0;
+    int          ret       = 0;
+
+    // The requests are translated under the kick lock, and completed from the IO threads
+    if (vring_populate(core->vm_info, &(blk_queue->queue)) == -1) {
+	PrintError("Could not populate guest memory for queue %d\n", blk_queue->queue_idx);
+	return -1;
+    }
+
+    avail_idx = blk_queue->queue.avail->index;
 
-    if (fill_shadow_desc_buf(core, blk_state, avail_idx) < 0) {
-        PrintError("fill_shadow_desc_buf failed at index %d\n", avail_idx);
-        return -1;
+    // Hold off completion interrupts until the whole batch is submitted
+    flags = v3_spin_lock_irqsave(&(blk_queue->used_lock));
+    blk_queue->in_flight++;
+    v3_spin_unlock_irqrestore(&(blk_queue->used_lock), flags);
+
+    // Only the ring indices are updated under the lock, submission can sleep
+    flags = v3_spin_lock_irqsave(&(blk_queue->kick_lock));
+    {
+	if (fill_shadow_desc_buf(core, blk_queue, avail_idx) < 0) {
+	    PrintError("fill_shadow_desc_buf failed at index %d\n", avail_idx);
+	    ret = -1;
+	}
+
+	// Claim whatever was translated successfully
+	start_idx = blk_queue->shadow_used_idx;
+	end_idx   = blk_queue->shadow_avail_idx;
+
+	blk_queue->shadow_used_idx = end_idx;
     }
+    v3_spin_unlock_irqrestore(&(blk_queue->kick_lock), flags);
 
-    if (blk_state->async_enabled) {
-        return 0;
-    } else {
-        return _handle_kick(blk_state);
+    _handle_kick(blk_queue, start_idx, end_idx);
+
+    return ret;
+}
+
+
+/* Waits for every submitted request to be returned to the guest */
+static void 
+blk_drain(struct virtio_blk_state * blk_state) 
+{
+    int i = 0; 
+
+    for (i = 0; i < blk_state->num_queues; i++) {
+	while (blk_state->queues[i].in_flight > 0) {
+	    v3_yield(NULL, -1);
+	    __asm__ __volatile__ ("":::"memory");
+	}
+    }
+}
+
+
+/* Returns the queue the guest currently has selected, or NULL if it is out of range */
+static struct blk_queue *
+get_selected_queue(struct virtio_blk_state * blk_state)
+{
+    uint16_t queue_idx = blk_state->virtio_cfg.vring_queue_selector;
+
+    if (queue_idx >= blk_state->num_queues) {
+	return NULL;
+    }
+
+    return &(blk_state->queues[queue_idx]);
+}
+
+
+/* Device config follows the MSI-X vector registers while MSI-X is enabled */
+static inline int
+get_dev_cfg_offset(struct virtio_blk_state * blk_state)
+{
+    if (blk_state->msix_enabled) {
+	return sizeof(struct virtio_config) + VIRTIO_MSI_CONFIG_SIZE;
     }
+
+    return sizeof(struct virtio_config);
 }
 
+
 static int 
 virtio_io_write(struct v3_core_info * core,
 		uint16_t              port, 
@@ -446,6 +903,7 @@ virtio_io_write(struct v3_core_info * core,
 		void                * private_data) 
 {
     struct virtio_blk_state * blk_state = (struct virtio_blk_state *)private_data;
+    struct blk_queue        * blk_queue = NULL;
     int                       port_idx  = port % blk_state->io_range_size;
 
 
@@ -459,49 +917,63 @@ virtio_io_write(struct v3_core_info * core,
 		PrintError("Illegal write length for guest features\n");
 		return -1;
 	    }
-	    
+
 	    blk_state->virtio_cfg.guest_features = *(uint32_t *)src;
 	    PrintDebug("Setting Guest Features to %x\n", blk_state->virtio_cfg.guest_features);
 
 	    break;
 	case VRING_PG_NUM_PORT:
+	    blk_queue = get_selected_queue(blk_state);
+
+	    if (blk_queue == NULL) {
+		PrintError("Virtio Block: Setting page frame of invalid queue %d\n",
+			   blk_state->virtio_cfg.vring_queue_selector);
+		return -1;
+	    }
+
 	    if (length == 4) {
-		addr_t pfn       = *(uint32_t *)src;
-		addr_t page_addr = (pfn << VIRTIO_PAGE_SHIFT);
+		struct virtio_queue * queue     = &(blk_queue->queue);
+		addr_t                pfn       = *(uint32_t *)src;
+		addr_t                page_addr = (pfn << VIRTIO_PAGE_SHIFT);
 
 
-		blk_state->queue.pfn = pfn;
-		
-		blk_state->queue.ring_desc_addr  = page_addr ;
-		blk_state->queue.ring_avail_addr = page_addr + (QUEUE_SIZE * sizeof(struct vring_desc));
-		blk_state->queue.ring_used_addr  = blk_state->queue.ring_avail_addr + sizeof(struct vring_avail) + (QUEUE_SIZE * sizeof(uint16_t));
-		blk_state->queue.ring_used_addr  = (blk_state->queue.ring_used_addr + 0xfff) & ~0xfff;     /*  Round up to the next page boundary */
+		queue->pfn = pfn;
 
+		queue->ring_desc_addr  = page_addr ;
+		queue->ring_avail_addr = page_addr + (queue->queue_size * sizeof(struct vring_desc));
+		queue->ring_used_addr  = queue->ring_avail_addr + sizeof(struct vring_avail) + (queue->queue_size * sizeof(uint16_t));
+		queue->ring_used_addr  = (queue->ring_used_addr + 0xfff) & ~0xfff;     /*  Round up to the next page boundary */
 
-		if (v3_gpa_to_hva(core, blk_state->queue.ring_desc_addr,  (addr_t *)&(blk_state->queue.desc))  == -1) {
+		if (v3_populate_gpa_range(core->vm_info, queue->ring_desc_addr, vring_mem_size(queue)) == -1) {
+		    PrintError("Could not populate ring memory\n");
+		    return -1;
+		}
+
+		if (v3_gpa_to_hva(core, queue->ring_desc_addr,  (addr_t *)&(queue->desc))  == -1) {
 		    PrintError("Could not translate ring descriptor address\n");
 		    return -1;
 		}
 
 
-		if (v3_gpa_to_hva(core, blk_state->queue.ring_avail_addr, (addr_t *)&(blk_state->queue.avail)) == -1) {
+		if (v3_gpa_to_hva(core, queue->ring_avail_addr, (addr_t *)&(queue->avail)) == -1) {
 		    PrintError("Could not translate ring available address\n");
 		    return -1;
 		}
 
 
-		if (v3_gpa_to_hva(core, blk_state->queue.ring_used_addr,  (addr_t *)&(blk_state->queue.used))  == -1) {
+		if (v3_gpa_to_hva(core, queue->ring_used_addr,  (addr_t *)&(queue->used))  == -1) {
 		    PrintError("Could not translate ring used address\n");
 		    return -1;
 		}
 
-		PrintDebug("RingDesc_addr=%p, Avail_addr=%p, Used_addr=%p\n",
-			   (void *)(blk_state->queue.ring_desc_addr),
-			   (void *)(blk_state->queue.ring_avail_addr),
-			   (void *)(blk_state->queue.ring_used_addr));
+		PrintDebug("Queue %d: RingDesc_addr=%p, Avail_addr=%p, Used_addr=%p\n",
+			   blk_queue->queue_idx,
+			   (void *)(queue->ring_desc_addr),
+			   (void *)(queue->ring_avail_addr),
+			   (void *)(queue->ring_used_addr));
 
 		PrintDebug("RingDesc=%p, Avail=%p, Used=%p\n", 
-			   blk_state->queue.desc, blk_state->queue.avail, blk_state->queue.used);
+			   queue->desc, queue->avail, queue->used);
 
 	    } else {
 		PrintError("Illegal write length for page frame number\n");
@@ -509,20 +981,22 @@ virtio_io_write(struct v3_core_info * core,
 	    }
 	    break;
 	case VRING_Q_SEL_PORT:
+	    // Out of range queues report a size of 0, which is how guests probe the queue count
 	    blk_state->virtio_cfg.vring_queue_selector = *(uint16_t *)src;
+	    break;
+	case VRING_Q_NOTIFY_PORT: {
+	    uint16_t queue_idx = *(uint16_t *)src;
 
-	    if (blk_state->virtio_cfg.vring_queue_selector != 0) {
-		PrintError("Virtio Block device only uses 1 queue, selected %d\n", 
-			   blk_state->virtio_cfg.vring_queue_selector);
-		return -1;
+	    if (queue_idx >= blk_state->num_queues) {
+		PrintError("Virtio Block: Kick for invalid queue %d\n", queue_idx);
+		break;
 	    }
 
-	    break;
-	case VRING_Q_NOTIFY_PORT:
-            if (handle_kick(core, blk_state) == -1) {
+            if (handle_kick(core, &(blk_state->queues[queue_idx])) == -1) {
                 PrintError("Could not handle Block Notification\n");
             }
 	    break;
+	}
 	case VIRTIO_STATUS_PORT:
 	    blk_state->virtio_cfg.status = *(uint8_t *)src;
 
@@ -540,6 +1014,33 @@ virtio_io_write(struct v3_core_info * core,
 	    }
             v3_spin_unlock(&(blk_state->isr_lock));
 	    break;
+
+	case VIRTIO_MSI_CONFIG_VECTOR_PORT:
+	case VIRTIO_MSI_QUEUE_VECTOR_PORT: {
+	    uint16_t vector = *(uint16_t *)src;
+
+	    if ((blk_state->msix_enabled == 0) || (length != 2)) {
+		PrintError("Illegal write to MSI-X vector register (len=%d)\n", length);
+		return -1;
+	    }
+
+	    // Unsupported vectors read back as NO_VECTOR, telling the guest to try another layout
+	    if (vector >= blk_state->num_vectors) {
+		vector = VIRTIO_MSI_NO_VECTOR;
+	    }
+
+	    if (port_idx == VIRTIO_MSI_CONFIG_VECTOR_PORT) {
+		blk_state->config_vector = vector;
+	    } else {
+		blk_queue = get_selected_queue(blk_state);
+
+		if (blk_queue != NULL) {
+		    blk_queue->msix_vector = vector;
+		}
+	    }
+
+	    break;
+	}
 	default:
 	    return -1;
 	    break;
@@ -556,14 +1057,32 @@ virtio_io_read(struct v3_core_info * core,
 	       uint_t                length, 
 	       void                * private_data) 
 {
-    struct virtio_blk_state * blk_state = (struct virtio_blk_state *)private_data;
-    int                       port_idx  = port % blk_state->io_range_size;
+    struct virtio_blk_state * blk_state  = (struct virtio_blk_state *)private_data;
+    struct blk_queue        * blk_queue  = get_selected_queue(blk_state);
+    int                       port_idx   = port % blk_state->io_range_size;
+    int                       dev_cfg_offset = get_dev_cfg_offset(blk_state);
 
 
     PrintDebug("VIRTIO BLOCK Read  for port %d (index =%d), length=%d\n", 
 	       port, port_idx, length);
 
 
+    if ( (port_idx >= dev_cfg_offset) &&
+	 (port_idx < (dev_cfg_offset + sizeof(struct blk_config))) ) {
+	int       cfg_offset = port_idx - dev_cfg_offset;
+	uint8_t * cfg_ptr    = (uint8_t *)&(blk_state->block_cfg);
+
+	if (cfg_offset + length > sizeof(struct blk_config)) {
+	    PrintError("Illegal read length for block config (len=%d)\n", length);
+	    return -1;
+	}
+
+	memcpy(dst, cfg_ptr + cfg_offset, length);
+
+	return length;
+    }
+
+
     switch (port_idx) {
 	case HOST_FEATURES_PORT:
 	case HOST_FEATURES_PORT + 1:
@@ -585,7 +1104,11 @@ virtio_io_read(struct v3_core_info * core,
 		return -1;
 	    }
 
-	    memcpy(dst, &(blk_state->queue.pfn), length);
+	    if (blk_queue) {
+		memcpy(dst, &(blk_queue->queue.pfn), length);
+	    } else {
+		memset(dst, 0, length);
+	    }
 	    break;
 	case VRING_SIZE_PORT:
 	case VRING_SIZE_PORT + 1:
@@ -593,8 +1116,12 @@ virtio_io_read(struct v3_core_info * core,
 		PrintError("Illegal read length for vring size (len=%d)\n", length);
 		return -1;
 	    }
-	    
-	    memcpy(dst, &(blk_state->queue.queue_size), length);
+
+	    if (blk_queue) {
+		memcpy(dst, &(blk_queue->queue.queue_size), length);
+	    } else {
+		memset(dst, 0, length);
+	    }
 
 	    break;
 
@@ -611,7 +1138,7 @@ virtio_io_read(struct v3_core_info * core,
             v3_spin_lock(&(blk_state->isr_lock));
 	    {
 		*(uint8_t *)dst = blk_state->virtio_cfg.pci_isr;
-		
+
 		if (blk_state->virtio_cfg.pci_isr == 1) {
 		    blk_state->virtio_cfg.pci_isr = 0;
 		    PrintDebug("Lowering IRQ from Virtio BLOCK...\n");
@@ -625,26 +1152,33 @@ virtio_io_read(struct v3_core_info * core,
 
 	    break;
 
-	default:
-	    if ( (port_idx >= sizeof(struct virtio_config)) && 
-		 (port_idx < (sizeof(struct virtio_config) + sizeof(struct blk_config))) ) {
-		int       cfg_offset = port_idx - sizeof(struct virtio_config);
-		uint8_t * cfg_ptr    = (uint8_t *)&(blk_state->block_cfg);
+	case VIRTIO_MSI_CONFIG_VECTOR_PORT:
+	case VIRTIO_MSI_QUEUE_VECTOR_PORT:
+	    if (length != 2) {
+		PrintError("Illegal read length for MSI-X vector (len=%d)\n", length);
+		return -1;
+	    }
 
-		memcpy(dst, cfg_ptr + cfg_offset, length);
-		
+	    if (port_idx == VIRTIO_MSI_CONFIG_VECTOR_PORT) {
+		*(uint16_t *)dst = blk_state->config_vector;
+	    } else if (blk_queue) {
+		*(uint16_t *)dst = blk_queue->msix_vector;
 	    } else {
-		PrintError("Read of Unhandled Virtio Read. Returning 0\n");
-
-		if (length == 1) {
-		    *(uint8_t  *)dst = 0;
-		} else if (length == 2) {
-		    *(uint16_t *)dst = 0;
-		} else if (length == 4) {
-		    *(uint32_t *)dst = 0;
-		}
+		*(uint16_t *)dst = VIRTIO_MSI_NO_VECTOR;
 	    }
-	  
+	    break;
+
+	default:
+	    PrintError("Read of Unhandled Virtio Read. Returning 0\n");
+
+	    if (length == 1) {
+		*(uint8_t  *)dst = 0;
+	    } else if (length == 2) {
+		*(uint16_t *)dst = 0;
+	    } else if (length == 4) {
+		*(uint32_t *)dst = 0;
+	    }
+
 	    break;
     }
 
@@ -652,6 +1186,68 @@ virtio_io_read(struct v3_core_info * core,
 }
 
 
+static int 
+virtio_cfg_read(struct pci_device * pci_dev,
+		uint32_t            reg_num,
+		void              * dst,
+		uint_t              length,
+		void              * private_data)
+{
+    struct virtio_blk_state * blk_state = (struct virtio_blk_state *)private_data;
+
+    return virtio_msix_cfg_read(blk_state->num_vectors, reg_num, dst, length);
+}
+
+
+static int 
+virtio_cmd_update(struct pci_device * pci_dev,
+		  pci_cmd_t           cmd,
+		  uint64_t            arg,
+		  void              * private_data)
+{
+    struct virtio_blk_state * blk_state = (struct virtio_blk_state *)private_data;
+
+    PrintDebug("Virtio Block: PCI command %d (arg=%llu)\n", cmd, arg);
+
+    virtio_msix_cmd_update(pci_dev, cmd, &(blk_state->msix_enabled));
+
+    return 0;
+}
+
+
+static void 
+free_queues(struct virtio_blk_state * blk_state)
+{
+    int i = 0; 
+    int j = 0;
+
+    for (i = 0; i < blk_state->num_queues; i++) {
+	struct blk_queue * blk_queue = &(blk_state->queues[i]);
+
+	if (blk_queue->reqs) {
+	    for (j = 0; j < blk_state->queue_size; j++) {
+		if (blk_queue->reqs[j].iov_ext) {
+		    V3_Free(blk_queue->reqs[j].iov_ext);
+		}
+	    }
+
+	    V3_Free(blk_queue->reqs);
+	}
+
+	if (blk_queue->shadow_desc) {
+	    V3_Free(blk_queue->shadow_desc);
+	}
+
+	v3_spinlock_deinit(&(blk_queue->kick_lock));
+
+	v3_spinlock_deinit(&(blk_queue->io_lock));
+	v3_spinlock_deinit(&(blk_queue->used_lock));
+    }
+
+    V3_Free(blk_state->queues);
+}
+
+
 static int 
 virtio_free(struct virtio_dev_state * virtio) 
 {
@@ -662,18 +1258,31 @@ virtio_free(struct virtio_dev_state * virtio)
 
     if (!list_empty(&(virtio->dev_list))) {
 	list_for_each_entry_safe(blk_state, tmp, &(virtio->dev_list), dev_link) {
-	    
+	    int i = 0;
+
+	    blk_drain(blk_state);
+
 	    blk_state->async_thread_should_stop = 1;
-	    
-	    while (blk_state->async_thread != NULL) {
-		v3_yield(NULL, -1);
-		__asm__ __volatile__ ("":::"memory");
+
+	    for (i = 0; i < blk_state->num_queues; i++) {
+		while (blk_state->queues[i].num_io_threads > 0) {
+		    v3_yield(NULL, -1);
+		    __asm__ __volatile__ ("":::"memory");
+		}
 	    }
 
 	    // unregister from PCI
-	    
+
 	    list_del(&(blk_state->dev_link));	    
 
+	    if (blk_state->queues) {
+		free_queues(blk_state);
+	    }
+
+	    if (blk_state->msix_page) {
+		V3_FreePages(blk_state->msix_page, 1);
+	    }
+
 	    v3_spinlock_deinit(&(blk_state->isr_lock));
 	    V3_Free(blk_state);
 	}
@@ -696,10 +1305,7 @@ static struct v3_device_ops dev_ops = {
 
 #include <palacios/vmm_checkpoint.h>
 
-struct virtio_blk_chkpt {
-    struct virtio_config virtio_cfg;
-
-    /* Virtio Queue  */
+struct virtio_blk_queue_chkpt {
     uint16_t queue_size;
     uint16_t cur_avail_idx;
     uint64_t ring_desc_addr;
@@ -709,37 +1315,80 @@ struct virtio_blk_chkpt {
 
     uint16_t shadow_avail_idx;
     uint16_t shadow_used_idx;
+} __attribute__((packed));
+
+/* Only saved for multi-queue devices, after the queue array */
+struct virtio_blk_msix_chkpt {
+    uint8_t  enabled;
+    uint16_t config_vector;
+    uint16_t queue_vectors[BLK_MAX_QUEUES];
+    uint8_t  table[(BLK_MAX_QUEUES + 1) * VIRTIO_MSIX_ENTRY_SIZE];
+} __attribute__((packed));
+
+/* A single queue device keeps the original checkpoint layout */
+struct virtio_blk_chkpt {
+    struct virtio_config virtio_cfg;
 
+    struct virtio_blk_queue_chkpt queues[0];
 } __attribute__((packed));
 
 
+static size_t
+get_chkpt_size(struct virtio_blk_state * blk_state)
+{
+    size_t size = sizeof(struct virtio_blk_chkpt);
+
+    size += blk_state->num_queues * sizeof(struct virtio_blk_queue_chkpt);
+
+    if (blk_state->msix_page) {
+	size += sizeof(struct virtio_blk_msix_chkpt);
+    }
+
+    return size;
+}
+
+
 static int 
 virtio_save(char                    * name, 
 	    struct virtio_blk_chkpt * chkpt, 
 	    size_t                    size,
-	    struct virtio_blk_state * blk_state) 
+	    struct virtio_blk_state * blk_state)
 {
-    struct virtio_queue * queue = &(blk_state->queue);
-
-    /* wait for async thread to clear all outstanding requests... */
-    if (blk_state->async_enabled == 1) {
-	PrintError("Checkpointing asynchronous virtio block device is not supported\n");
-	return -1;
-    }
+    int i = 0; 
 
+    /* Outstanding requests have no place in the checkpoint, let them finish */
+    blk_drain(blk_state);
 
     memcpy(&(chkpt->virtio_cfg), &(blk_state->virtio_cfg), sizeof(struct virtio_config));
 
-    chkpt->queue_size       = queue->queue_size;  /* This should be hard-coded... */
-    chkpt->cur_avail_idx    = queue->cur_avail_idx;
-    chkpt->ring_desc_addr   = queue->ring_desc_addr;
-    chkpt->ring_avail_addr  = queue->ring_avail_addr;
-    chkpt->ring_used_addr   = queue->ring_used_addr;
-    chkpt->pfn              = queue->pfn;
-    chkpt->shadow_avail_idx = blk_state->shadow_avail_idx;
-    chkpt->shadow_used_idx  = blk_state->shadow_used_idx;
+    for (i = 0; i < blk_state->num_queues; i++) {
+	struct blk_queue              * blk_queue = &(blk_state->queues[i]);
+	struct virtio_queue           * queue     = &(blk_queue->queue);
+	struct virtio_blk_queue_chkpt * q_chkpt   = &(chkpt->queues[i]);
+
+	q_chkpt->queue_size       = queue->queue_size;
+	q_chkpt->cur_avail_idx    = queue->cur_avail_idx;
+	q_chkpt->ring_desc_addr   = queue->ring_desc_addr;
+	q_chkpt->ring_avail_addr  = queue->ring_avail_addr;
+	q_chkpt->ring_used_addr   = queue->ring_used_addr;
+	q_chkpt->pfn              = queue->pfn;
+	q_chkpt->shadow_avail_idx = blk_queue->shadow_avail_idx;
+	q_chkpt->shadow_used_idx  = blk_queue->shadow_used_idx;
+    }
+
+    if (blk_state->msix_page) {
+	struct virtio_blk_msix_chkpt * msix = (void *)&(chkpt->queues[blk_state->num_queues]);
 
+	msix->enabled       = blk_state->msix_enabled;
+	msix->config_vector = blk_state->config_vector;
 
+	for (i = 0; i < blk_state->num_queues; i++) {
+	    msix->queue_vectors[i] = blk_state->queues[i].msix_vector;
+	}
+
+	memcpy(msix->table, V3_VAddr(blk_state->msix_page),
+	       blk_state->num_vectors * VIRTIO_MSIX_ENTRY_SIZE);
+    }
 
     return 0;
 }
@@ -750,46 +1399,75 @@ static int
 virtio_load(char                    * name, 
 	    struct virtio_blk_chkpt * chkpt, 
 	    size_t                    size,
-	    struct virtio_blk_state * blk_state) 
+	    struct virtio_blk_state * blk_state)
 {
     struct v3_vm_info * vm = blk_state->pci_dev->vm;
-	
-    struct virtio_queue * queue = &(blk_state->queue);
-
-    /* wait for async thread to clear all outstanding requests... */
-    if (blk_state->async_enabled == 1) {
-	PrintError("Checkpointing asynchronous virtio block device is not supported\n");
-	return -1;
-    }
+    int i = 0; 
 
+    blk_drain(blk_state);
 
     memcpy(&(blk_state->virtio_cfg), &(chkpt->virtio_cfg), sizeof(struct virtio_config));
 
-    queue->queue_size       = chkpt->queue_size;  /* This should be hard-coded... */
-    queue->cur_avail_idx    = chkpt->cur_avail_idx;
-    queue->ring_desc_addr   = chkpt->ring_desc_addr;
-    queue->ring_avail_addr  = chkpt->ring_avail_addr;
-    queue->ring_used_addr   = chkpt->ring_used_addr;
-    queue->pfn              = chkpt->pfn;
+    for (i = 0; i < blk_state->num_queues; i++) {
+	struct blk_queue              * blk_queue = &(blk_state->queues[i]);
+	struct virtio_queue           * queue     = &(blk_queue->queue);
+	struct virtio_blk_queue_chkpt * q_chkpt   = &(chkpt->queues[i]);
 
-    blk_state->shadow_avail_idx = chkpt->shadow_avail_idx;
-    blk_state->shadow_used_idx  = chkpt->shadow_used_idx;
+	if (q_chkpt->queue_size != blk_state->queue_size) {
+	    PrintError("Virtio Block: Checkpointed queue size (%d) does not match device (%d)\n",
+		       q_chkpt->queue_size, blk_state->queue_size);
+	    return -1;
+	}
 
-    if (v3_gpa_to_hva(&(vm->cores[0]), queue->ring_desc_addr,  (addr_t *)&(queue->desc))  == -1) {
-	PrintError("Could not translate ring descriptor address\n");
-	return -1;
-    }
+	queue->cur_avail_idx    = q_chkpt->cur_avail_idx;
+	queue->ring_desc_addr   = q_chkpt->ring_desc_addr;
+	queue->ring_avail_addr  = q_chkpt->ring_avail_addr;
+	queue->ring_used_addr   = q_chkpt->ring_used_addr;
+	queue->pfn              = q_chkpt->pfn;
 
-    
-    if (v3_gpa_to_hva(&(vm->cores[0]), queue->ring_avail_addr, (addr_t *)&(queue->avail)) == -1) {
-	PrintError("Could not translate ring available address\n");
-	return -1;
+	blk_queue->shadow_avail_idx = q_chkpt->shadow_avail_idx;
+	blk_queue->shadow_used_idx  = q_chkpt->shadow_used_idx;
+
+	if (queue->pfn == 0) {
+	    // Never set up by the guest
+	    continue;
+	}
+
+	if (v3_gpa_to_hva(&(vm->cores[0]), queue->ring_desc_addr,  (addr_t *)&(queue->desc))  == -1) {
+	    PrintError("Could not translate ring descriptor address\n");
+	    return -1;
+	}
+
+
+	if (v3_gpa_to_hva(&(vm->cores[0]), queue->ring_avail_addr, (addr_t *)&(queue->avail)) == -1) {
+	    PrintError("Could not translate ring available address\n");
+	    return -1;
+	}
+
+
+	if (v3_gpa_to_hva(&(vm->cores[0]), queue->ring_used_addr,  (addr_t *)&(queue->used))  == -1) {
+	    PrintError("Could not translate ring used address\n");
+	    return -1;
+	}
     }
 
+    if (blk_state->msix_page) {
+	struct virtio_blk_msix_chkpt * msix = (void *)&(chkpt->queues[blk_state->num_queues]);
 
-    if (v3_gpa_to_hva(&(vm->cores[0]), queue->ring_used_addr,  (addr_t *)&(queue->used))  == -1) {
-	PrintError("Could not translate ring used address\n");
-	return -1;
+	blk_state->msix_enabled  = msix->enabled;
+	blk_state->config_vector = msix->config_vector;
+
+	for (i = 0; i < blk_state->num_queues; i++) {
+	    blk_state->queues[i].msix_vector = msix->queue_vectors[i];
+	}
+
+	memcpy(V3_VAddr(blk_state->msix_page), msix->table,
+	       blk_state->num_vectors * VIRTIO_MSIX_ENTRY_SIZE);
+
+	// The PCI layer does not restore the interrupt mode
+	if (blk_state->msix_enabled) {
+	    blk_state->pci_dev->irq_type = IRQ_MSIX;
+	}
     }
 
     if (blk_state->virtio_cfg.pci_isr == 1) {
@@ -811,7 +1489,7 @@ register_dev(struct virtio_dev_state * virtio,
     // initialize PCI
     struct pci_device * pci_dev = NULL;
     struct v3_pci_bar   bars[6];
-    int num_ports = sizeof(struct virtio_config) + sizeof(struct blk_config);
+    int num_ports = sizeof(struct virtio_config) + VIRTIO_MSI_CONFIG_SIZE + sizeof(struct blk_config);
     int tmp_ports = num_ports;
     int i;
 
@@ -819,46 +1497,62 @@ register_dev(struct virtio_dev_state * virtio,
 
     // This gets the number of ports, rounded up to a power of 2
     blk_state->io_range_size = 1; // must be a power of 2
-    
+
     while (tmp_ports > 0) {
 	tmp_ports                >>= 1;
 	blk_state->io_range_size <<= 1;
     }
-	
+
     // this is to account for any low order bits being set in num_ports
     // if there are none, then num_ports was already a power of 2 so we shift right to reset it
     if ((num_ports & ((blk_state->io_range_size >> 1) - 1)) == 0) {
 	blk_state->io_range_size >>= 1;
     }
-    
-    
+
+
     for (i = 0; i < 6; i++) {
 	bars[i].type = PCI_BAR_NONE;
     }
-    
+
     PrintDebug("Virtio-BLK io_range_size = %d\n", blk_state->io_range_size);
-    
+
     bars[0].type              = PCI_BAR_IO;
     bars[0].default_base_port = -1;
     bars[0].num_ports         = blk_state->io_range_size;
-    
+
     bars[0].io_read           = virtio_io_read;
     bars[0].io_write          = virtio_io_write;
     bars[0].private_data      = blk_state;
-    
-    pci_dev = v3_pci_register_device(virtio->pci_bus, PCI_STD_DEVICE, 
-				     0, PCI_AUTO_DEV_NUM, 0,
-				     "LNX_VIRTIO_BLK", bars,
-				     NULL, NULL, NULL, NULL, blk_state);
-    
+
+    if (blk_state->msix_page) {
+	virtio_msix_init_bar(&(bars[VIRTIO_MSIX_BAR]), blk_state->msix_page);
+
+	pci_dev = v3_pci_register_device(virtio->pci_bus, PCI_STD_DEVICE,
+					 0, PCI_AUTO_DEV_NUM, 0,
+					 "LNX_VIRTIO_BLK", bars,
+					 NULL, virtio_cfg_read, virtio_cmd_update, NULL, blk_state);
+    } else {
+	pci_dev = v3_pci_register_device(virtio->pci_bus, PCI_STD_DEVICE,
+					 0, PCI_AUTO_DEV_NUM, 0,
+					 "LNX_VIRTIO_BLK", bars,
+					 NULL, NULL, NULL, NULL, blk_state);
+    }
+
     if (!pci_dev) {
 	PrintError("Could not register PCI Device\n");
 	return -1;
     }
 
+    if (blk_state->msix_page) {
+	if (v3_pci_enable_capability(pci_dev, PCI_CAP_MSIX) == -1) {
+	    PrintError("Could not enable MSI-X capability\n");
+	    return -1;
+	}
+    }
+
     blk_state->pci_dev    = pci_dev;
     blk_state->virtio_dev = virtio;
-    
+
     pci_dev->config_header.vendor_id           = VIRTIO_VENDOR_ID;
     pci_dev->config_header.subsystem_vendor_id = VIRTIO_SUBVENDOR_ID;
     pci_dev->config_header.device_id           = VIRTIO_BLOCK_DEV_ID;
@@ -867,18 +1561,37 @@ register_dev(struct virtio_dev_state * virtio,
     pci_dev->config_header.subsystem_id        = VIRTIO_BLOCK_SUBDEVICE_ID;
     pci_dev->config_header.intr_pin            = 1;
     pci_dev->config_header.max_latency         = 1; // ?? (qemu does it...)
-        
+
 
     /* Add backend to list of devices */
     list_add(&(blk_state->dev_link), &(virtio->dev_list));
     blk_state->dev_index = virtio->dev_cnt++;
-    
+
     /* Block configuration */
     blk_state->virtio_cfg.host_features = VIRTIO_SEG_MAX;
-    blk_state->block_cfg.max_seg        = QUEUE_SIZE - 2;
-    // Virtio Block only uses one queue
-    blk_state->queue.queue_size         = QUEUE_SIZE;
+    blk_state->block_cfg.max_seg        = blk_state->queue_size - 2;
+
+    if (blk_state->num_queues > 1) {
+	blk_state->virtio_cfg.host_features |= VIRTIO_MULTI_QUEUE;
+	blk_state->block_cfg.num_queues      = blk_state->num_queues;
+    }
+
+    if (blk_state->ops->flush) {
+	blk_state->virtio_cfg.host_features |= VIRTIO_FLUSH;
+    }
+
+    if (blk_state->ops->discard) {
+	blk_state->virtio_cfg.host_features       |= VIRTIO_DISCARD;
+	blk_state->block_cfg.max_discard_sectors   = BLK_MAX_RANGE_SECTORS;
+	blk_state->block_cfg.max_discard_seg       = BLK_MAX_RANGE_SEGS;
+	blk_state->block_cfg.discard_sector_alignment = BLK_DISCARD_ALIGNMENT;
+    }
 
+    if (blk_state->ops->write_zeroes) {
+	blk_state->virtio_cfg.host_features          |= VIRTIO_WRITE_ZEROES;
+	blk_state->block_cfg.max_write_zeroes_sectors = BLK_MAX_RANGE_SECTORS;
+	blk_state->block_cfg.max_write_zeroes_seg     = BLK_MAX_RANGE_SEGS;
+    }
 
     blk_reset(blk_state);
 
@@ -887,6 +1600,107 @@ register_dev(struct virtio_dev_state * virtio,
 }
 
 
+static int 
+init_queues(struct virtio_blk_state * blk_state)
+{
+    int i = 0; 
+
+    blk_state->queues = V3_Malloc(sizeof(struct blk_queue) * blk_state->num_queues);
+
+    if (blk_state->queues == NULL) {
+	PrintError("Could not allocate virtio block queues\n");
+	return -1;
+    }
+
+    memset(blk_state->queues, 0, sizeof(struct blk_queue) * blk_state->num_queues);
+
+    for (i = 0; i < blk_state->num_queues; i++) {
+	struct blk_queue * blk_queue = &(blk_state->queues[i]);
+
+	blk_queue->blk_state        = blk_state;
+	blk_queue->queue_idx        = i;
+	blk_queue->queue.queue_size = blk_state->queue_size;
+	blk_queue->msix_vector      = VIRTIO_MSI_NO_VECTOR;
+
+	v3_spinlock_init(&(blk_queue->kick_lock));
+	v3_spinlock_init(&(blk_queue->used_lock));
+	v3_spinlock_init(&(blk_queue->io_lock));
+	INIT_LIST_HEAD(&(blk_queue->io_queue));
+
+	blk_queue->shadow_desc = V3_Malloc(sizeof(struct shadow_vring_desc) * blk_state->queue_size);
+	blk_queue->reqs        = V3_Malloc(sizeof(struct blk_req) * blk_state->queue_size);
+
+	if ((blk_queue->shadow_desc == NULL) ||
+	    (blk_queue->reqs        == NULL)) {
+	    PrintError("Could not allocate virtio block queue %d\n", i);
+	    return -1;
+	}
+
+	memset(blk_queue->shadow_desc, 0, sizeof(struct shadow_vring_desc) * blk_state->queue_size);
+	memset(blk_queue->reqs,        0, sizeof(struct blk_req)           * blk_state->queue_size);
+    }
+
+    return 0;
+}
+
+
+/* async="N" issues requests to synchronous backends from N IO threads per queue */
+static int 
+start_io_threads(struct v3_vm_info       * vm,
+		 struct virtio_blk_state * blk_state)
+{
+    int i = 0; 
+    int j = 0;
+
+    if (blk_state->async_enabled > BLK_MAX_IO_THREADS) {
+	blk_state->async_enabled = BLK_MAX_IO_THREADS;
+    }
+
+    if ( (blk_state->async_enabled == 0) ||
+	 ((blk_state->ops->readv_async) && (blk_state->ops->writev_async)) ) {
+	return 0;
+    }
+
+    V3_Print("virtio-blk: creating %d IO threads per queue\n", blk_state->async_enabled);
+
+    for (i = 0; i < blk_state->num_queues; i++) {
+	struct blk_queue * blk_queue = &(blk_state->queues[i]);
+
+	// Queue i is the guest's queue for vCPU i, so keep its IO on the same physical CPU
+	int cpu = vm->cores[i % vm->num_cores].pcpu_id;
+
+	for (j = 0; j < blk_state->async_enabled; j++) {
+	    struct blk_io_thread * io_thread       = NULL;
+	    char                   thread_name[64] = {[0 ... 63] = 0};
+	    void                 * thread          = NULL;
+
+	    snprintf(thread_name, 63, "%s-virtio-blkd-%u-%d-%d", vm->name, blk_state->dev_index, i, j);
+
+	    io_thread = &(blk_queue->io_threads[blk_queue->num_io_threads]);
+
+	    io_thread->blk_queue = blk_queue;
+	    io_thread->idle      = 0;
+
+	    thread = V3_CREATE_THREAD_ON_CPU(cpu, io_dispatcher, io_thread, thread_name);
+
+	    if (thread == NULL) {
+		PrintError("Could not create virtio block IO thread %d for queue %d\n", j, i);
+		break;
+	    }
+
+	    io_thread->thread = thread;
+	    blk_queue->num_io_threads++;
+	}
+
+	for (j = 0; j < blk_queue->num_io_threads; j++) {
+	    V3_START_THREAD(blk_queue->io_threads[j].thread);
+	}
+    }
+
+    return 0;
+}
+
+
 static int 
 connect_fn(struct v3_vm_info     * vm, 
 	   void                  * frontend_data, 
@@ -898,7 +1712,9 @@ connect_fn(struct v3_vm_info     * vm,
     struct virtio_dev_state * virtio    = (struct virtio_dev_state *)frontend_data;
     struct virtio_blk_state * blk_state = (struct virtio_blk_state *)V3_Malloc(sizeof(struct virtio_blk_state));
 
-    char * async_str = v3_cfg_val(cfg, "async");
+    char * async_str      = v3_cfg_val(cfg, "async");
+    char * queues_str     = v3_cfg_val(cfg, "queues");
+    char * queue_size_str = v3_cfg_val(cfg, "queue_size");
 
     if (!blk_state) {
 	PrintError("Cannot allocate in connect\n");
@@ -913,33 +1729,75 @@ connect_fn(struct v3_vm_info     * vm,
 	blk_state->async_enabled = atoi(async_str);
     }
 
-    register_dev(virtio, blk_state);
+    blk_state->num_queues = 1;
+    blk_state->queue_size = QUEUE_SIZE;
 
+    if (queues_str != NULL) {
+	if (strcasecmp(queues_str, "percpu") == 0) {
+	    blk_state->num_queues = vm->num_cores;
+	} else {
+	    blk_state->num_queues = atoi(queues_str);
+	}
+
+	if ((blk_state->num_queues < 1) || (blk_state->num_queues > BLK_MAX_QUEUES)) {
+	    PrintError("Virtio Block: Invalid queue count (%s), must be 1-%d or \"percpu\"\n",
+		       queues_str, BLK_MAX_QUEUES);
+	    V3_Free(blk_state);
+	    return -1;
+	}
+    }
+
+    if (queue_size_str != NULL) {
+	blk_state->queue_size = atoi(queue_size_str);
+
+	// The vring layout requires a power of 2
+	if ( (blk_state->queue_size < 4) ||
+	     (blk_state->queue_size > BLK_MAX_QUEUE_SIZE) ||
+	     (blk_state->queue_size & (blk_state->queue_size - 1)) ) {
+	    PrintError("Virtio Block: Invalid queue size (%s), must be a power of 2 from 4 to %d\n",
+		       queue_size_str, BLK_MAX_QUEUE_SIZE);
+	    V3_Free(blk_state);
+	    return -1;
+	}
+    }
+
+    if (blk_state->num_queues > 1) {
+	// One vector per queue, plus the config change vector
+	blk_state->num_vectors = blk_state->num_queues + 1;
+	blk_state->msix_page   = V3_AllocPages(1);
+
+	if (blk_state->msix_page == NULL) {
+	    PrintError("Could not allocate MSI-X table\n");
+	    V3_Free(blk_state);
+	    return -1;
+	}
+
+	memset(V3_VAddr(blk_state->msix_page), 0, PAGE_SIZE_4KB);
+    }
+
+    if (init_queues(blk_state) == -1) {
+	return -1;
+    }
 
-    v3_spinlock_init(&blk_state->isr_lock);
     blk_state->ops                = ops;
     blk_state->backend_data       = private_data;
-    blk_state->shadow_used_idx    = 0;
-    blk_state->shadow_avail_idx   = 0;
-    blk_state->block_cfg.capacity = ops->get_capacity(private_data) / SECTOR_SIZE;
+
+    register_dev(virtio, blk_state);
 
 
+    v3_spinlock_init(&blk_state->isr_lock);
 
-    PrintDebug("Virtio Capacity = %d -- 0x%p\n", 
-	       (int)(blk_state->block_cfg.capacity), 
-	       (void *)(addr_t)(blk_state->block_cfg.capacity));
+    blk_state->block_cfg.capacity = ops->get_capacity(private_data) / SECTOR_SIZE;
 
 
 
-    if (blk_state->async_enabled) {
-	char thread_name[64] = {[0 ... 63] = 0};
-	
-	V3_Print("virtio-blk: creating IO thread\n");
+    PrintDebug("Virtio Capacity = %d -- 0x%p (%d queues of %d entries)\n",
+	       (int)(blk_state->block_cfg.capacity), 
+	       (void *)(addr_t)(blk_state->block_cfg.capacity),
+	       blk_state->num_queues, blk_state->queue_size);
 
-	snprintf(thread_name, 63, "%s-virtio-blkd-%u", vm->name, blk_state->dev_index);
-	
-        blk_state->async_thread = V3_CREATE_THREAD_ON_CPU(0, io_dispatcher, blk_state, thread_name);
-    }
+
+    start_io_threads(vm, blk_state);
 
 
 #ifdef V3_CONFIG_CHECKPOINT
@@ -951,7 +1809,7 @@ connect_fn(struct v3_vm_info     * vm,
 	v3_checkpoint_register(vm, chkpt_key, 
 			       (v3_chkpt_save_fn)virtio_save,
 			       (v3_chkpt_load_fn)virtio_load,
-			       sizeof(struct virtio_blk_chkpt),
+			       get_chkpt_size(blk_state),
 			       blk_state);
     }
 #endif
@@ -102,6 +102,11 @@ static int get_desc_count(struct virtio_queue * q, int index) {
 static int handle_kick(struct v3_core_info * core, struct virtio_console_state * virtio) {
     struct virtio_queue * q = virtio->cur_queue;
 
+    if (vring_populate(core->vm_info, q) == -1) {
+	PrintError("Could not populate console queue memory\n");
+	return -1;
+    }
+
     PrintDebug("VIRTIO CONSOLE KICK: cur_index=%d (mod=%d), avail_index=%d\n", 
 	       q->cur_avail_idx, q->cur_avail_idx % QUEUE_SIZE, q->avail->index);
 
@@ -143,6 +148,8 @@ static int handle_kick(struct v3_core_info * core, struct virtio_console_state *
 
 	q->used->index++;
 	q->cur_avail_idx++;
+
+	vring_used_dirty(core->vm_info, q);
     }
 
     if (!(q->avail->flags & VIRTIO_NO_IRQ_FLAG)) {
@@ -161,6 +168,11 @@ static uint64_t virtio_input(struct v3_vm_info * vm, uint8_t * buf, uint64_t len
     struct virtio_console_state * cons_state = private_data;
     struct virtio_queue * q = &(cons_state->queue[0]);
     int xfer_len = 0;
+
+    /* Input is not consumed until the memory thread has backed the ring */
+    if (vring_try_populate(vm, q) == -1) {
+	return 0;
+    }
     
    PrintDebug("VIRTIO CONSOLE Handle Input: cur_index=%d (mod=%d), avail_index=%d\n", 
 	       q->cur_avail_idx, q->cur_avail_idx % QUEUE_SIZE, q->avail->index);
@@ -184,6 +196,7 @@ static uint64_t virtio_input(struct v3_vm_info * vm, uint8_t * buf, uint64_t len
        xfer_len = (input_desc->length > len) ? len : input_desc->length;
 
        memcpy(input_buf, buf, xfer_len);
+       v3_mark_range_dirty(vm, input_desc->addr_gpa, input_desc->length);
 
        
        q->used->ring[q->used->index % q->queue_size].id = q->avail->ring[q->cur_avail_idx % q->queue_size];
@@ -191,6 +204,8 @@ static uint64_t virtio_input(struct v3_vm_info * vm, uint8_t * buf, uint64_t len
 
        q->used->index++;
        q->cur_avail_idx++;
+
+       vring_used_dirty(vm, q);
    }
 
 
@@ -243,6 +258,11 @@ static int virtio_io_write(struct v3_core_info * core, uint16_t port, void * src
 		// round up to next page boundary.
 		virtio->cur_queue->ring_used_addr = (virtio->cur_queue->ring_used_addr + 0xfff) & ~0xfff;
 
+		if (v3_populate_gpa_range(core->vm_info, virtio->cur_queue->ring_desc_addr, vring_mem_size(virtio->cur_queue)) == -1) {
+		    PrintError("Could not populate ring memory\n");
+		    return -1;
+		}
+
 		if (v3_gpa_to_hva(core, virtio->cur_queue->ring_desc_addr, (addr_t *)&(virtio->cur_queue->desc)) == -1) {
 		    PrintError("Could not translate ring descriptor address\n");
 		    return -1;
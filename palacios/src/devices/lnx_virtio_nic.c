@@ -64,9 +64,28 @@ static int net_debug = 0;
 #define VIRTIO_NET_F_HOST_UFO   14      /* Host can handle UFO in. */
 #define VIRTIO_NET_F_MRG_RXBUF  15      /* Host can merge receive buffers. */
 #define VIRTIO_NET_F_STATUS     16      /* virtio_net_config.status available */
+#define VIRTIO_NET_F_CTRL_VQ    17      /* Control channel available */
+#define VIRTIO_NET_F_MQ         22      /* Device supports multiqueue with automatic receive steering */
 
-/* Port to get virtio config */
-#define VIRTIO_NET_CONFIG 20  
+/* Control virtqueue commands */
+#define VIRTIO_NET_OK                   0
+#define VIRTIO_NET_ERR                  1
+
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+
+#define NET_MAX_QUEUE_PAIRS  32
+
+/* MSI-X is only exposed with multiple queue pairs */
+
+/* Remembers which queue pair the guest last transmitted a flow on, so replies are received on the same vCPU */
+#define NET_FLOW_TABLE_SIZE  256
+
+/* Interrupt moderation defaults */
+#define NET_COALESCE_USECS   100     /* Max delay of a coalesced interrupt if only a frame count is given */
+#define NET_POLL_ENTER_PPS   10000   /* Switch a TX queue to VMM driven polling above this rate */
+#define NET_POLL_EXIT_PPS    1000    /* and back to guest kicks below this one */
+#define NET_SAMPLE_MS        10      /* Rate sampling period */
 
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
@@ -105,6 +124,12 @@ struct virtio_net_config
 {
     uint8_t  mac[ETH_ALEN]; 	/* VIRTIO_NET_F_MAC */
     uint16_t status;
+    uint16_t max_virtqueue_pairs;	/* VIRTIO_NET_F_MQ */
+} __attribute__((packed));
+
+struct virtio_net_ctrl_hdr {
+    uint8_t class;
+    uint8_t cmd;
 } __attribute__((packed));
 
 struct virtio_dev_state {
@@ -113,6 +138,49 @@ struct virtio_dev_state {
     struct v3_vm_info * vm;
 
     uint8_t mac[ETH_ALEN];
+    uint8_t offload;
+    uint16_t max_pairs;
+
+    uint32_t coalesce_frames;
+    uint32_t coalesce_usecs;
+    uint8_t  adaptive;
+    uint32_t poll_enter_pps;
+    uint32_t poll_exit_pps;
+};
+
+struct virtio_net_state;
+
+struct net_queue {
+    struct virtio_queue vq;
+    uint16_t            msix_vector;
+    uint16_t            pair;
+
+    v3_spinlock_t       lock;
+
+    /* TX: gather buffer for multi-descriptor frames
+     * RX: unused */
+    uint8_t           * buf;
+
+    /* Scratch for software segmentation and checksums */
+    uint8_t           * seg_buf;
+    v3_spinlock_t       buf_lock;
+
+    /* Interrupt moderation, protected by lock */
+    uint16_t            signalled_used;    /* Used index at the last event index check */
+    uint8_t             signalled_valid;
+    uint32_t            irq_pending;       /* Completions the guest has not been interrupted for */
+    uint64_t            irq_pending_tsc;   /* Host TSC of the oldest of them */
+
+    /* TX: guest kicks are suppressed and the queue is drained by polling */
+    uint8_t             polling;
+
+    uint64_t            pkts;              /* Sampled by the moderation timer */
+    uint64_t            last_pkts;
+
+    /* Guest buffers tend to be recycled, so their translations are cached */
+    struct v3_gpa_cache gpa_cache;
+
+    struct virtio_net_state * net_state;
 };
 
 struct virtio_net_state {
@@ -126,96 +194,382 @@ struct virtio_net_state {
 
     uint16_t status;
     
-    struct virtio_queue rx_vq;   	/* idx 0*/
-    struct virtio_queue tx_vq;   	/* idx 1*/
-    struct virtio_queue ctrl_vq;  	/* idx 2*/
+    /* Queue pair n uses virtqueues 2n (rx) and 2n+1 (tx), the control queue follows the last pair */
+    struct net_queue * rx_queues;
+    struct net_queue * tx_queues;
+    struct net_queue   ctrl_queue;
+
+    uint16_t max_pairs;
+    uint16_t active_pairs;
+
+    int      msix_enabled;
+    uint16_t config_vector;
+    uint16_t num_vectors;
+    void   * msix_page;   /* Host physical address of the table page */
+
+    uint8_t  flow_table[NET_FLOW_TABLE_SIZE];   /* pair + 1, 0 if unknown */
 
     uint8_t mergeable_rx_bufs;
+    uint8_t offload;            /* Advertise checksum and TSO offloads */
+
+    /* Interrupt moderation. A frame count of 1 or less interrupts on every completion */
+    uint32_t coalesce_frames;
+    uint64_t coalesce_cycles;
+    uint8_t  adaptive;          /* Switch between guest kicks and VMM polling by packet rate */
+    uint32_t poll_enter_pps;
+    uint32_t poll_exit_pps;
+    uint64_t sample_cycles;
+    uint64_t rx_pkts;           /* RX frames at the last sample */
 
     struct v3_timer       * timer;
     struct nic_statistics   stats;
 
     struct v3_dev_net_ops * net_ops;
 
-    v3_spinlock_t rx_lock;
-    v3_spinlock_t tx_lock;
-
-    uint8_t  tx_notify;
     uint8_t  rx_notify;
 
-    uint32_t tx_pkts;
-    uint32_t rx_pkts;
-
-    uint64_t past_us;
-
     void * backend_data;
     struct virtio_dev_state * virtio_dev;
     struct list_head dev_link;
 };
 
 
+static void 
+reset_queue(struct net_queue * queue, 
+	    uint16_t           queue_size)
+{
+    queue->vq.queue_size      = queue_size;
+    queue->vq.ring_desc_addr  = 0;
+    queue->vq.ring_avail_addr = 0;
+    queue->vq.ring_used_addr  = 0;
+    queue->vq.pfn             = 0;
+    queue->vq.cur_avail_idx   = 0;
+    queue->vq.desc            = NULL;
+    queue->vq.avail           = NULL;
+    queue->vq.used            = NULL;
+
+    queue->msix_vector        = VIRTIO_MSI_NO_VECTOR;
+
+    queue->signalled_used     = 0;
+    queue->signalled_valid    = 0;
+    queue->irq_pending        = 0;
+    queue->irq_pending_tsc    = 0;
+    queue->polling            = 0;
+}
+
 static int 
 virtio_init_state(struct virtio_net_state * virtio) 
 {
-    virtio->rx_vq.queue_size        = RX_QUEUE_SIZE;
-    virtio->tx_vq.queue_size        = TX_QUEUE_SIZE;
-    virtio->ctrl_vq.queue_size      = CTRL_QUEUE_SIZE;
-
-    virtio->rx_vq.ring_desc_addr    = 0;
-    virtio->rx_vq.ring_avail_addr   = 0;
-    virtio->rx_vq.ring_used_addr    = 0;
-    virtio->rx_vq.pfn               = 0;
-    virtio->rx_vq.cur_avail_idx     = 0;
-
-    virtio->tx_vq.ring_desc_addr    = 0;
-    virtio->tx_vq.ring_avail_addr   = 0;
-    virtio->tx_vq.ring_used_addr    = 0;
-    virtio->tx_vq.pfn               = 0;
-    virtio->tx_vq.cur_avail_idx     = 0;
-
-    virtio->ctrl_vq.ring_desc_addr  = 0;
-    virtio->ctrl_vq.ring_avail_addr = 0;
-    virtio->ctrl_vq.ring_used_addr  = 0;
-    virtio->ctrl_vq.pfn             = 0;
-    virtio->ctrl_vq.cur_avail_idx   = 0;
+    int i = 0;
+
+    for (i = 0; i < virtio->max_pairs; i++) {
+	reset_queue(&(virtio->rx_queues[i]), RX_QUEUE_SIZE);
+	reset_queue(&(virtio->tx_queues[i]), TX_QUEUE_SIZE);
+    }
+
+    reset_queue(&(virtio->ctrl_queue), CTRL_QUEUE_SIZE);
 
     virtio->virtio_cfg.pci_isr      = 0;
 
     virtio->mergeable_rx_bufs       = 1;
 
+    /* Only the first pair is used until the guest asks for more */
+    virtio->active_pairs            = 1;
+    virtio->config_vector           = VIRTIO_MSI_NO_VECTOR;
+
+    memset(virtio->flow_table, 0, sizeof(virtio->flow_table));
+
 
     virtio->virtio_cfg.host_features      = 0;	
     virtio->virtio_cfg.host_features     |= (1 << VIRTIO_NET_F_MAC);
+    virtio->virtio_cfg.host_features     |= (1 << VIRTIO_RING_F_EVENT_IDX);
 
     if (virtio->mergeable_rx_bufs) {
 	virtio->virtio_cfg.host_features |= (1 << VIRTIO_NET_F_MRG_RXBUF);
     }
 
-    v3_spinlock_init(&(virtio->rx_lock));
-    v3_spinlock_init(&(virtio->tx_lock));
+    if (virtio->offload) {
+	/* TX: the guest may hand us partially checksummed frames of up to 64KB */
+	virtio->virtio_cfg.host_features |= (1 << VIRTIO_NET_F_CSUM);
+	virtio->virtio_cfg.host_features |= (1 << VIRTIO_NET_F_HOST_TSO4);
+	virtio->virtio_cfg.host_features |= (1 << VIRTIO_NET_F_HOST_TSO6);
+	virtio->virtio_cfg.host_features |= (1 << VIRTIO_NET_F_HOST_ECN);
+
+	/* RX: coalesced frames are passed to the guest as is */
+	virtio->virtio_cfg.host_features |= (1 << VIRTIO_NET_F_GUEST_CSUM);
+	virtio->virtio_cfg.host_features |= (1 << VIRTIO_NET_F_GUEST_TSO4);
+	virtio->virtio_cfg.host_features |= (1 << VIRTIO_NET_F_GUEST_TSO6);
+	virtio->virtio_cfg.host_features |= (1 << VIRTIO_NET_F_GUEST_ECN);
+    }
+
+    if (virtio->max_pairs > 1) {
+	/* The guest enables additional pairs through the control queue */
+	virtio->virtio_cfg.host_features |= (1 << VIRTIO_NET_F_CTRL_VQ);
+	virtio->virtio_cfg.host_features |= (1 << VIRTIO_NET_F_MQ);
+    }
+
+    virtio->net_cfg.max_virtqueue_pairs = virtio->max_pairs;
 
     return 0;
 }
 
+
+/* Maps a virtqueue index to its queue */
+static struct net_queue * 
+get_queue(struct virtio_net_state * virtio, 
+	  uint16_t                  queue_idx)
+{
+    if (queue_idx == (2 * virtio->max_pairs)) {
+	return &(virtio->ctrl_queue);
+    } else if (queue_idx > (2 * virtio->max_pairs)) {
+	return NULL;
+    }
+
+    if (queue_idx % 2) {
+	return &(virtio->tx_queues[queue_idx / 2]);
+    }
+
+    return &(virtio->rx_queues[queue_idx / 2]);
+}
+
+
+/* Device config follows the MSI-X vector registers while MSI-X is enabled */
+static inline int
+get_dev_cfg_offset(struct virtio_net_state * virtio)
+{
+    if (virtio->msix_enabled) {
+	return sizeof(struct virtio_config) + VIRTIO_MSI_CONFIG_SIZE;
+    }
+
+    return sizeof(struct virtio_config);
+}
+
+
+/* Raise the queue's interrupt */
+static void 
+vq_raise_irq(struct virtio_net_state * virtio, 
+	     struct net_queue        * queue)
+{
+    if (virtio->msix_enabled) {
+	if (queue->msix_vector != VIRTIO_MSI_NO_VECTOR) {
+	    v3_pci_raise_irq(virtio->virtio_dev->pci_bus, virtio->pci_dev, queue->msix_vector);
+	}
+
+	return;
+    }
+
+    if (virtio->virtio_cfg.pci_isr == 0) {
+	V3_Net_Print(2, "Virtio NIC: Raising IRQ %d\n",  
+		     virtio->pci_dev->config_header.intr_line);
+
+	virtio->virtio_cfg.pci_isr = 0x1;	
+	v3_pci_raise_irq(virtio->virtio_dev->pci_bus, virtio->pci_dev, 0);
+    }
+}
+
+static inline int 
+guest_has_feature(struct virtio_net_state * virtio, 
+		  int                       feature)
+{
+    return ((virtio->virtio_cfg.guest_features & (1 << feature)) != 0);
+}
+
+/* Check whether the guest wants an interrupt for the completions since the last check.
+ * Called with the queue lock held */
+static int 
+__vq_need_irq(struct virtio_net_state * virtio, 
+	      struct net_queue        * queue)
+{
+    struct virtio_queue * vq      = &(queue->vq);
+    uint16_t              old_idx = queue->signalled_used;
+    uint16_t              new_idx = vq->used->index;
+    int                   valid   = queue->signalled_valid;
+
+    if (!guest_has_feature(virtio, VIRTIO_RING_F_EVENT_IDX)) {
+	return !(vq->avail->flags & VIRTIO_NO_IRQ_FLAG);
+    }
+
+    queue->signalled_used  = new_idx;
+    queue->signalled_valid = 1;
+
+    if (!valid) {
+	return 1;
+    }
+
+    return vring_need_event(*vring_used_event(vq), new_idx, old_idx);
+}
+
+/* Account for completions posted to a queue and apply interrupt coalescing.
+ * Called with the queue lock held, returns 1 if the caller should interrupt the guest */
+static int 
+__vq_complete(struct virtio_net_state * virtio, 
+	      struct net_queue        * queue, 
+	      uint32_t                  completed)
+{
+    vring_used_dirty(virtio->vm, &(queue->vq));
+
+    queue->irq_pending += completed;
+
+    if (queue->irq_pending == 0) {
+	return 0;
+    }
+
+    if ((virtio->coalesce_frames > 1) && 
+	(queue->irq_pending < virtio->coalesce_frames)) {
+	uint64_t now = 0;
+
+	rdtscll(now);
+
+	if (queue->irq_pending_tsc == 0) {
+	    queue->irq_pending_tsc = now;
+	    return 0;
+	}
+
+	if ((now - queue->irq_pending_tsc) < virtio->coalesce_cycles) {
+	    return 0;
+	}
+    }
+
+    queue->irq_pending     = 0;
+    queue->irq_pending_tsc = 0;
+
+    return __vq_need_irq(virtio, queue);
+}
+
+/* Deliver a coalesced interrupt whose deadline has passed */
+static void 
+vq_flush_irq(struct virtio_net_state * virtio, 
+	     struct net_queue        * queue)
+{
+    unsigned long flags = 0;
+    int raise = 0;
+
+    if ((queue->irq_pending == 0) || (queue->vq.used == NULL)) {
+	return;
+    }
+
+    flags = v3_spin_lock_irqsave(&(queue->lock));
+    raise = __vq_complete(virtio, queue, 0);
+    v3_spin_unlock_irqrestore(&(queue->lock), flags);
+
+    if (raise) {
+	vq_raise_irq(virtio, queue);
+    }
+}
+
+static void 
+hdr_to_gso(struct virtio_net_hdr * hdr, 
+	   struct v3_net_gso     * gso)
+{
+    gso->flags       = hdr->flags;
+    gso->gso_type    = hdr->gso_type;
+    gso->hdr_len     = hdr->hdr_len;
+    gso->gso_size    = hdr->gso_size;
+    gso->csum_start  = hdr->csum_start;
+    gso->csum_offset = hdr->csum_offset;
+}
+
+/* Hand a frame to the backend, segmenting and checksumming it in software if the backend 
+ * cannot take it as is. The caller must hold the queue's buf_lock if software offload may be needed */
+static int 
+__tx_one_pkt(struct virtio_net_state * virtio, 
+	     struct net_queue        * txq,
+	     uint8_t                 * buf, 
+	     uint32_t                  len, 
+	     struct v3_net_gso       * gso)
+{
+    if (virtio->active_pairs > 1) {
+	uint32_t hash = v3_net_flow_hash(buf, len);
+
+	virtio->flow_table[hash % NET_FLOW_TABLE_SIZE] = txq->pair + 1;
+    }
+
+    if ((gso->gso_type == VIRTIO_NET_HDR_GSO_NONE) && 
+	!(gso->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+	return virtio->net_ops->send(buf, len, virtio->backend_data);
+    }
+
+    if (virtio->net_ops->send_gso) {
+	return virtio->net_ops->send_gso(buf, len, gso, virtio->backend_data);
+    }
+
+    return v3_net_gso_xmit(buf, len, gso, txq->seg_buf, MAX_PACKET_LEN, 
+			   virtio->net_ops->send, virtio->backend_data);
+}
+
 static int 
 tx_one_pkt(struct v3_core_info     * core, 
 	   struct virtio_net_state * virtio, 
+	   struct net_queue        * txq,
+	   struct virtio_net_hdr   * hdr,
 	   struct vring_desc       * buf_desc) 
 {
-    uint8_t  * buf = NULL;
-    uint32_t   len = buf_desc->length;
+    struct virtio_queue * queue = &(txq->vq);
+    struct v3_net_gso     gso;
+    uint8_t  * buf      = NULL;
+    uint32_t   len      = buf_desc->length;
+    int        use_bufs = 0;
+    unsigned long flags = 0;
+    int ret = 0;
+
+    hdr_to_gso(hdr, &gso);
+
+    /* Large frames arrive split across descriptors (linear part + page frags) */
+    use_bufs = ((buf_desc->flags & VIRTIO_NEXT_FLAG) || 
+		((virtio->net_ops->send_gso == NULL) && 
+		 ((gso.gso_type != VIRTIO_NET_HDR_GSO_NONE) || 
+		  (gso.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))));
+
+    if (!use_bufs) {
+	if (v3_gpa_to_hva_cached(core, &(txq->gpa_cache), buf_desc->addr_gpa, (addr_t *)&(buf)) == -1) {
+	    PrintDebug("Could not translate buffer address\n");
+	    return -1;
+	}
 
-    if (v3_gpa_to_hva(core, buf_desc->addr_gpa, (addr_t *)&(buf)) == -1) {
-	PrintDebug("Could not translate buffer address\n");
-	return -1;
+	ret = __tx_one_pkt(virtio, txq, buf, len, &gso);
+    } else {
+	flags = v3_spin_lock_irqsave(&(txq->buf_lock));
+
+	if (buf_desc->flags & VIRTIO_NEXT_FLAG) {
+	    len = 0;
+
+	    while (1) {
+		if ((len + buf_desc->length > VIRTIO_NET_MAX_BUFSIZE) || 
+		    (v3_gpa_to_hva_cached(core, &(txq->gpa_cache), buf_desc->addr_gpa, (addr_t *)&(buf)) == -1)) {
+		    PrintError("Virtio NIC: Invalid TX descriptor chain\n");
+		    v3_spin_unlock_irqrestore(&(txq->buf_lock), flags);
+		    virtio->stats.tx_dropped++;
+		    return -1;
+		}
+
+		memcpy(txq->buf + len, buf, buf_desc->length);
+		len += buf_desc->length;
+
+		if (!(buf_desc->flags & VIRTIO_NEXT_FLAG)) {
+		    break;
+		}
+
+		buf_desc = &(queue->desc[buf_desc->next]);
+	    }
+
+	    buf = txq->buf;
+	} else if (v3_gpa_to_hva_cached(core, &(txq->gpa_cache), buf_desc->addr_gpa, (addr_t *)&(buf)) == -1) {
+	    PrintDebug("Could not translate buffer address\n");
+	    v3_spin_unlock_irqrestore(&(txq->buf_lock), flags);
+	    return -1;
+	}
+
+	ret = __tx_one_pkt(virtio, txq, buf, len, &gso);
+
+	v3_spin_unlock_irqrestore(&(txq->buf_lock), flags);
     }
     
 #ifdef V3_CONFIG_DEBUG_VIRTIO_NET
-    V3_Print("Virtio-NIC: virtio_tx: size: %d\n", len);
-    v3_hexdump(buf, len, NULL, 0);
+    V3_Print("Virtio-NIC: virtio_tx: size: %d, gso_type: %d, gso_size: %d\n", 
+	     len, gso.gso_type, gso.gso_size);
 #endif
 
-    if (virtio->net_ops->send(buf, len, virtio->backend_data) < 0) {
+    if (ret < 0) {
 	virtio->stats.tx_dropped++;
 	return -1;
     }
@@ -230,7 +584,7 @@ tx_one_pkt(struct v3_core_info     * core,
 /*copy data into ring buffer */
 static inline int 
 copy_data_to_desc(struct v3_core_info     * core, 
-		  struct virtio_net_state * virtio_state, 
+		  struct net_queue        * rxq, 
 		  struct vring_desc       * desc, 
 		  uint8_t                 * buf, 
 		  uint_t                    buf_len,
@@ -239,7 +593,7 @@ copy_data_to_desc(struct v3_core_info     * core,
     uint8_t  * desc_buf = NULL;
     uint32_t   len      = buf_len;
     
-    if (v3_gpa_to_hva(core, desc->addr_gpa, (addr_t *)&(desc_buf)) == -1) {
+    if (v3_gpa_to_hva_cached(core, &(rxq->gpa_cache), desc->addr_gpa, (addr_t *)&(desc_buf)) == -1) {
 	PrintDebug("Could not translate buffer address\n");
 	return -1;
     }
@@ -249,6 +603,7 @@ copy_data_to_desc(struct v3_core_info     * core,
     }
 
     memcpy(desc_buf + dst_offset, buf, len);
+    v3_mark_range_dirty(core->vm_info, desc->addr_gpa + dst_offset, len);
 
     return len;
 }
@@ -269,39 +624,152 @@ get_desc_count(struct virtio_queue * queue,
     return cnt;
 }
 
+/* With event indices the guest ignores the used ring flags and kicks once it passes avail_event. 
+ * Publishing the current index asks for a kick on the next frame, leaving a stale one suppresses them */
 static inline void 
-enable_cb(struct virtio_queue * queue)
+enable_cb(struct virtio_net_state * virtio, 
+	  struct virtio_queue     * queue)
 {
     if (queue->used) {
 	queue->used->flags &= ~ VRING_NO_NOTIFY_FLAG;
+
+	if (guest_has_feature(virtio, VIRTIO_RING_F_EVENT_IDX)) {
+	    *vring_avail_event(queue) = queue->cur_avail_idx;
+	}
+
+	vring_used_dirty(virtio->vm, queue);
     }
 }
 
 static inline void 
-disable_cb(struct virtio_queue * queue) 
+disable_cb(struct virtio_net_state * virtio, 
+	   struct virtio_queue     * queue) 
 {
     if (queue->used) {
 	queue->used->flags |= VRING_NO_NOTIFY_FLAG;
+	vring_used_dirty(virtio->vm, queue);
+    }
+}
+
+/* Frames that can go to the backend straight from guest memory are batched.
+ * Their descriptors are only returned to the guest once the batch has been sent */
+struct tx_batch {
+    struct v3_net_frame frames[V3_NET_MAX_BATCH];
+    uint16_t            ids[V3_NET_MAX_BATCH];    /* Head descriptor of each frame */
+    uint32_t            num;
+};
+
+/* Returns the number of descriptors completed */
+static int 
+flush_tx_batch(struct virtio_net_state * virtio, 
+	       struct net_queue        * txq, 
+	       struct tx_batch         * batch)
+{
+    struct virtio_queue * queue = &(txq->vq);
+    unsigned long flags = 0;
+    int sent = 0;
+    int i = 0;
+
+    if (batch->num == 0) {
+	return 0;
+    }
+
+    sent = virtio->net_ops->send_batch(batch->frames, batch->num, virtio->backend_data);
+
+    if (sent < 0) {
+	PrintError("Virtio NIC: Fails to send packet batch\n");
+	sent = 0;
+    }
+
+    for (i = 0; i < batch->num; i++) {
+	if (i < sent) {
+	    virtio->stats.tx_pkts  += 1;
+	    virtio->stats.tx_bytes += batch->frames[i].len;
+	} else {
+	    virtio->stats.tx_dropped++;
+	}
+    }
+
+    flags = v3_spin_lock_irqsave(&(txq->lock));
+    {
+	for (i = 0; i < batch->num; i++) {
+	    queue->used->ring[queue->used->index % queue->queue_size].id = batch->ids[i];
+	    queue->used->index += 1;
+	}
+    }
+    v3_spin_unlock_irqrestore(&(txq->lock), flags);
+
+    sent = batch->num;
+    batch->num = 0;
+
+    return sent;
+}
+
+/* Queue a frame for a batched send if it needs no gathering or software offload */
+static int 
+tx_batch_pkt(struct v3_core_info     * core, 
+	     struct virtio_net_state * virtio, 
+	     struct net_queue        * txq,
+	     struct tx_batch         * batch,
+	     struct virtio_net_hdr   * hdr,
+	     struct vring_desc       * buf_desc,
+	     uint16_t                  id)
+{
+    struct v3_net_frame * frame = &(batch->frames[batch->num]);
+
+    if ((virtio->net_ops->send_batch == NULL) || 
+	(buf_desc->flags & VIRTIO_NEXT_FLAG) ||
+	(hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE) || 
+	(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+	return -1;
+    }
+
+    if (v3_gpa_to_hva_cached(core, &(txq->gpa_cache), buf_desc->addr_gpa, (addr_t *)&(frame->buf)) == -1) {
+	return -1;
+    }
+
+    frame->len = buf_desc->length;
+
+    if (virtio->active_pairs > 1) {
+	uint32_t hash = v3_net_flow_hash(frame->buf, frame->len);
+
+	virtio->flow_table[hash % NET_FLOW_TABLE_SIZE] = txq->pair + 1;
     }
+
+    batch->ids[batch->num] = id;
+    batch->num++;
+
+    return 0;
 }
 
 static int
 handle_pkt_tx(struct v3_core_info     * core, 
 	      struct virtio_net_state * virtio_state,
+	      struct net_queue        * txq,
 	      int                       quota)
 {
     struct virtio_queue * queue = NULL;
     unsigned long         flags = 0;
+    struct tx_batch       batch;
 
     int pkts_sent = 0;
     int pkts_left = 0;
+    int raise     = 0;
 
-    queue = &(virtio_state->tx_vq);
+    queue = &(txq->vq);
+    batch.num = 0;
 
     if (!queue->ring_avail_addr) {
 	return -1;
     }
 
+    /* Callers that can sleep populate the queue first, the VNET poller cannot 
+     * so frames are left queued until the memory thread has backed them */
+    if (vring_try_populate(virtio_state->vm, queue) == -1) {
+	return 1;
+    }
+
+ again:
     while (1) {
 
 	struct vring_desc * hdr_desc = NULL;
@@ -311,50 +779,69 @@ handle_pkt_tx(struct v3_core_info     * core,
 	uint16_t tmp_idx  = 0;
 	int      desc_cnt = 0;
 	
-	flags = v3_spin_lock_irqsave(&(virtio_state->tx_lock));
+	flags = v3_spin_lock_irqsave(&(txq->lock));
 	{
 	    if ((queue->cur_avail_idx == queue->avail->index) ||
-		((quota >  0) && (pkts_sent  >= quota))) {
+		((quota >  0) && ((pkts_sent + batch.num) >= quota))) {
 		
 		pkts_left = (queue->cur_avail_idx != queue->avail->index);
-		v3_spin_unlock_irqrestore(&(virtio_state->tx_lock), flags);
+		v3_spin_unlock_irqrestore(&(txq->lock), flags);
 		break;
 	    }
 	    
 	    desc_idx = queue->avail->ring[queue->cur_avail_idx % queue->queue_size];
 	    tmp_idx  = queue->cur_avail_idx;
+
+	    if (vring_chain_try_populate(virtio_state->vm, queue, desc_idx) == -1) {
+		pkts_left = 1;
+		v3_spin_unlock_irqrestore(&(txq->lock), flags);
+		break;
+	    }
 	    
 	    queue->cur_avail_idx += 1;
 	}
-	v3_spin_unlock_irqrestore(&(virtio_state->tx_lock), flags);
+	v3_spin_unlock_irqrestore(&(txq->lock), flags);
 
-	desc_cnt = get_desc_count(q, desc_idx);
+	desc_cnt = get_desc_count(queue, desc_idx);
 
-	if (desc_cnt != 2) {
-	    PrintError("VNIC: merged rx buffer not supported, desc_cnt %d\n", desc_cnt);
+	if (desc_cnt < 2) {
+	    PrintError("VNIC: TX frame without data descriptor, desc_cnt %d\n", desc_cnt);
 	}
 
 	hdr_desc = &(queue->desc[desc_idx]);
 
-	if (v3_gpa_to_hva(core, hdr_desc->addr_gpa, &(hdr_addr)) != -1) {
+	if (v3_gpa_to_hva_cached(core, &(txq->gpa_cache), hdr_desc->addr_gpa, &(hdr_addr)) != -1) {
 	    struct virtio_net_hdr_mrg_rxbuf * hdr;
 	    struct vring_desc               * buf_desc;
 
 	    hdr      = (struct virtio_net_hdr_mrg_rxbuf *)hdr_addr;
 	    desc_idx = hdr_desc->next;
 
-	    /* here we assumed that one ethernet pkt is not splitted into multiple buffer */	
+	    /* The header is always in its own descriptor, the frame follows in one or more buffers */	
 	    buf_desc = &(queue->desc[desc_idx]);
 
-	    if (tx_one_pkt(core, virtio_state, buf_desc) == -1) {
+	    if (tx_batch_pkt(core, virtio_state, txq, &batch, &(hdr->hdr), buf_desc, 
+			     queue->avail->ring[tmp_idx % queue->queue_size]) == 0) {
+		if (batch.num == V3_NET_MAX_BATCH) {
+		    pkts_sent += flush_tx_batch(virtio_state, txq, &batch);
+		}
+
+		continue;
+	    }
+
+	    /* Keep frames in order with the ones already batched */
+	    pkts_sent += flush_tx_batch(virtio_state, txq, &batch);
+
+	    if (tx_one_pkt(core, virtio_state, txq, &(hdr->hdr), buf_desc) == -1) {
 	    	PrintError("Virtio NIC: Fails to send packet\n");
 	    }
 
 	} else {
 	    PrintError("Could not translate block header address\n");
+	    pkts_sent += flush_tx_batch(virtio_state, txq, &batch);
 	}
 
-	flags = v3_spin_lock_irqsave(&(virtio_state->tx_lock));
+	flags = v3_spin_lock_irqsave(&(txq->lock));
 	{
 	    queue->used->ring[queue->used->index % queue->queue_size].id = 
 		queue->avail->ring[tmp_idx % queue->queue_size];
@@ -362,18 +849,33 @@ handle_pkt_tx(struct v3_core_info     * core,
 	    queue->used->index += 1;
 	    pkts_sent          += 1;
 	}
-	v3_spin_unlock_irqrestore(&(virtio_state->tx_lock), flags);
+	v3_spin_unlock_irqrestore(&(txq->lock), flags);
+
+    }
+
+    pkts_sent += flush_tx_batch(virtio_state, txq, &batch);
 
+    /* Re-arm the kick, then recheck in case the guest queued a frame before it saw avail_event */
+    if ((pkts_left == 0) && (txq->polling == 0) && 
+	guest_has_feature(virtio_state, VIRTIO_RING_F_EVENT_IDX)) {
+	enable_cb(virtio_state, queue);
+	vring_mb();
+
+	if ((queue->cur_avail_idx != queue->avail->index) && 
+	    ((quota == 0) || (pkts_sent < quota))) {
+	    goto again;
+	}
     }
         
-    if (pkts_sent && !(queue->avail->flags & VIRTIO_NO_IRQ_FLAG)) {
+    if (pkts_sent) {
+	txq->pkts += pkts_sent;
 
-	if (virtio_state->virtio_cfg.pci_isr == 0) {
+	flags = v3_spin_lock_irqsave(&(txq->lock));
+	raise = __vq_complete(virtio_state, txq, pkts_sent);
+	v3_spin_unlock_irqrestore(&(txq->lock), flags);
 
-	    v3_pci_raise_irq(virtio_state->virtio_dev->pci_bus, 
-			     virtio_state->pci_dev, 0);
-	    virtio_state->virtio_cfg.pci_isr   = 0x1;
-	    virtio_state->stats.rx_interrupts += 1;
+	if (raise) {
+	    vq_raise_irq(virtio_state, txq);
 	}
     }
 
@@ -381,6 +883,103 @@ handle_pkt_tx(struct v3_core_info     * core,
 }
 
 
+/* Process control queue commands, only multiqueue configuration is supported */
+static int 
+handle_ctrl(struct v3_core_info     * core, 
+	    struct virtio_net_state * virtio)
+{
+    struct net_queue    * ctrlq = &(virtio->ctrl_queue);
+    struct virtio_queue * queue = &(ctrlq->vq);
+    unsigned long         flags = 0;
+    int                   cmds  = 0;
+    int                   raise = 0;
+
+    if (!queue->ring_avail_addr) {
+	return -1;
+    }
+
+    if (vring_populate(core->vm_info, queue) == -1) {
+	PrintError("Virtio NIC: Could not populate control queue memory\n");
+	return -1;
+    }
+
+    flags = v3_spin_lock_irqsave(&(ctrlq->lock));
+
+    while (queue->cur_avail_idx != queue->avail->index) {
+	struct virtio_net_ctrl_hdr * hdr      = NULL;
+	struct vring_desc          * desc     = NULL;
+	struct vring_desc          * data     = NULL;
+	uint8_t                    * ack      = NULL;
+	uint16_t                     desc_idx = queue->avail->ring[queue->cur_avail_idx % queue->queue_size];
+	uint8_t                      status   = VIRTIO_NET_ERR;
+
+	/* header, command specific data, then the writable ack byte */
+	desc = &(queue->desc[desc_idx]);
+
+	if ((v3_gpa_to_hva(core, desc->addr_gpa, (addr_t *)&(hdr)) == -1) || 
+	    !(desc->flags & VIRTIO_NEXT_FLAG)) {
+	    PrintError("Virtio NIC: Invalid control command\n");
+	    v3_spin_unlock_irqrestore(&(ctrlq->lock), flags);
+	    return -1;
+	}
+
+	desc = &(queue->desc[desc->next]);
+
+	while (desc->flags & VIRTIO_NEXT_FLAG) {
+	    if (data == NULL) {
+		data = desc;
+	    }
+
+	    desc = &(queue->desc[desc->next]);
+	}
+
+	if (v3_gpa_to_hva(core, desc->addr_gpa, (addr_t *)&(ack)) == -1) {
+	    PrintError("Virtio NIC: Could not translate control ack address\n");
+	    v3_spin_unlock_irqrestore(&(ctrlq->lock), flags);
+	    return -1;
+	}
+
+	if ((hdr->class == VIRTIO_NET_CTRL_MQ) && 
+	    (hdr->cmd   == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) && 
+	    (data != NULL) && (data->length >= sizeof(uint16_t))) {
+	    uint16_t * pairs = NULL;
+
+	    if ((v3_gpa_to_hva(core, data->addr_gpa, (addr_t *)&(pairs)) != -1) && 
+		(*pairs >= 1) && (*pairs <= virtio->max_pairs)) {
+		V3_Print("Virtio NIC: Guest enabled %d queue pairs\n", *pairs);
+		virtio->active_pairs = *pairs;
+		status = VIRTIO_NET_OK;
+	    }
+	} else {
+	    PrintError("Virtio NIC: Unsupported control command (class=%d, cmd=%d)\n", 
+		       hdr->class, hdr->cmd);
+	}
+
+	*ack = status;
+	v3_mark_range_dirty(virtio->vm, desc->addr_gpa, sizeof(uint8_t));
+
+	queue->used->ring[queue->used->index % queue->queue_size].id     = desc_idx;
+	queue->used->ring[queue->used->index % queue->queue_size].length = sizeof(uint8_t);
+	queue->used->index++;
+	vring_used_dirty(virtio->vm, queue);
+	queue->cur_avail_idx++;
+	cmds++;
+    }
+
+    if (cmds) {
+	raise = __vq_need_irq(virtio, ctrlq);
+    }
+
+    v3_spin_unlock_irqrestore(&(ctrlq->lock), flags);
+
+    if (raise) {
+	vq_raise_irq(virtio, ctrlq);
+    }
+
+    return 0;
+}
+
+
 static int 
 virtio_setup_queue(struct v3_core_info     * core, 
 		   struct virtio_net_state * virtio_state, 
@@ -398,6 +997,12 @@ virtio_setup_queue(struct v3_core_info     * core,
 
     // round up to next page boundary.
     queue->ring_used_addr = (queue->ring_used_addr + 0xfff) & ~0xfff;
+
+    if (v3_populate_gpa_range(core->vm_info, queue->ring_desc_addr, vring_mem_size(queue)) == -1) {
+        PrintError("Could not populate ring memory\n");
+        return -1;
+    }
+
     if (v3_gpa_to_hva(core, queue->ring_desc_addr, (addr_t *)&(queue->desc)) == -1) {
         PrintError("Could not translate ring descriptor address\n");
 	 return -1;
@@ -430,11 +1035,17 @@ static int virtio_io_write(struct v3_core_info *core,
 {
     struct virtio_net_state * virtio = (struct virtio_net_state *)private_data;
     int port_idx = port % virtio->io_range_size;
+    struct net_queue * queue = NULL;
 
     PrintDebug("VIRTIO NIC %p Write for port %d (index=%d) len=%d, value=%x\n",
 	       private_data, port, port_idx,  
 	       length, *(uint32_t *)src);
 
+    if (port_idx >= get_dev_cfg_offset(virtio)) {
+	PrintError("Virtio NIC: Write to read only device config (index=%d)\n", port_idx);
+	return -1;
+    }
+
     switch (port_idx) {
 	case GUEST_FEATURES_PORT:
 	    if (length != 4) {
@@ -452,34 +1063,31 @@ static int virtio_io_write(struct v3_core_info *core,
 	    addr_t pfn = *(uint32_t *)src;
 	    addr_t page_addr = (pfn << VIRTIO_PAGE_SHIFT);
 	    uint16_t queue_idx = virtio->virtio_cfg.vring_queue_selector;
-	    switch (queue_idx) {
-		case 0:
-		    virtio_setup_queue(core, virtio,
-				       &virtio->rx_vq, 
-				       pfn, page_addr);
-		    break;
-		case 1:
-		    virtio_setup_queue(core, virtio, 
-				       &virtio->tx_vq, 
-				       pfn, page_addr);
-		    if(virtio->tx_notify == 0){
-	 		disable_cb(&virtio->tx_vq);
-    		    }
-		    virtio->status = 1;
-		    break;
-		case 2:
-		    virtio_setup_queue(core, virtio, 
-				       &virtio->ctrl_vq, 
-				       pfn, page_addr);
-		    break;	    
-		default:
-		    break;
+
+	    queue = get_queue(virtio, queue_idx);
+
+	    if (queue == NULL) {
+		break;
+	    }
+
+	    virtio_setup_queue(core, virtio, &(queue->vq), pfn, page_addr);
+
+	    if ((queue_idx < (2 * virtio->max_pairs)) && (queue_idx % 2)) {
+		/* tx queue */
+		if (queue->polling) {
+		    disable_cb(virtio, &(queue->vq));
+		}
+
+		virtio->status = 1;
+	    } else if (queue_idx < (2 * virtio->max_pairs)) {
+		/* RX refill kicks are ignored, so ask the guest not to send them */
+		disable_cb(virtio, &(queue->vq));
 	    }
 	    break;
 		
 	case VRING_Q_SEL_PORT:
 	    virtio->virtio_cfg.vring_queue_selector = *(uint16_t *)src;
-	    if (virtio->virtio_cfg.vring_queue_selector > 2) {
+	    if (virtio->virtio_cfg.vring_queue_selector > (2 * virtio->max_pairs)) {
 		PrintError("Virtio NIC: wrong queue idx: %d\n", 
 			   virtio->virtio_cfg.vring_queue_selector);
 		return -1;
@@ -489,19 +1097,27 @@ static int virtio_io_write(struct v3_core_info *core,
 	case VRING_Q_NOTIFY_PORT: 
 	    {
 		uint16_t queue_idx = *(uint16_t *)src;	   		
-		if (queue_idx == 0){
+		if (queue_idx == (2 * virtio->max_pairs)) {
+		    if (handle_ctrl(core, virtio) < 0) {
+			PrintError("Virtio NIC: Error handling control command\n");
+			return -1;
+		    }
+		} else if (queue_idx > (2 * virtio->max_pairs)) {
+		    PrintError("Virtio NIC: Wrong queue index %d\n", queue_idx);
+		} else if ((queue_idx % 2) == 0) {
 		    /* receive queue refill */
 		    virtio->stats.tx_interrupts ++;
-		} else if (queue_idx == 1){
-		    if (handle_pkt_tx(core, virtio, 0) < 0) {
+		} else {
+		    if (vring_populate(core->vm_info, &(virtio->tx_queues[queue_idx / 2].vq)) == -1) {
+			PrintError("Virtio NIC: Could not populate TX queue memory\n");
+			return -1;
+		    }
+
+		    if (handle_pkt_tx(core, virtio, &(virtio->tx_queues[queue_idx / 2]), 0) < 0) {
 			PrintError("Virtio NIC: Error to handle packet TX\n");
 			return -1;
 		    }
 		    virtio->stats.tx_interrupts ++;
-		} else if (queue_idx == 2){
-		    /* ctrl */
-		} else {
-		    PrintError("Virtio NIC: Wrong queue index %d\n", queue_idx);
 		}	
 		break;		
 	    }
@@ -516,6 +1132,32 @@ static int virtio_io_write(struct v3_core_info *core,
 	case VIRTIO_ISR_PORT:
 	    virtio->virtio_cfg.pci_isr = *(uint8_t *)src;
 	    break;
+
+	case VIRTIO_MSI_CONFIG_VECTOR_PORT:
+	case VIRTIO_MSI_QUEUE_VECTOR_PORT: {
+	    uint16_t vector = *(uint16_t *)src;
+
+	    if (length != 2) {
+		PrintError("Virtio NIC: Illegal write length for MSI-X vector (len=%d)\n", length);
+		return -1;
+	    }
+
+	    // Unsupported vectors read back as NO_VECTOR, telling the guest to try another layout
+	    if (vector >= virtio->num_vectors) {
+		vector = VIRTIO_MSI_NO_VECTOR;
+	    }
+
+	    if (port_idx == VIRTIO_MSI_CONFIG_VECTOR_PORT) {
+		virtio->config_vector = vector;
+	    } else {
+		queue = get_queue(virtio, virtio->virtio_cfg.vring_queue_selector);
+
+		if (queue != NULL) {
+		    queue->msix_vector = vector;
+		}
+	    }
+	    break;
+	}
 		
 	default:
 	    return -1;
@@ -532,9 +1174,22 @@ static int virtio_io_read(struct v3_core_info *core,
     struct virtio_net_state * virtio = (struct virtio_net_state *)private_data;
     int port_idx = port % virtio->io_range_size;
     uint16_t queue_idx = virtio->virtio_cfg.vring_queue_selector;
+    struct net_queue * queue = get_queue(virtio, queue_idx);
+    int cfg_offset = get_dev_cfg_offset(virtio);
 
     PrintDebug("Virtio NIC %p: Read  for port 0x%x (index =%d), length=%d\n", 
 	       private_data, port, port_idx, length);
+
+    if (port_idx >= cfg_offset) {
+	if (port_idx + length > cfg_offset + sizeof(struct virtio_net_config)) {
+	    PrintError("Virtio NIC: Read beyond device config (index=%d, len=%d)\n", port_idx, length);
+	    return -1;
+	}
+
+	memcpy(dst, (uint8_t *)&(virtio->net_cfg) + (port_idx - cfg_offset), length);
+
+	return length;
+    }
 	
     switch (port_idx) {
 	case HOST_FEATURES_PORT:
@@ -550,19 +1205,7 @@ static int virtio_io_read(struct v3_core_info *core,
 		PrintError("Virtio NIC: Illegal read length for page frame number\n");
 		return -1;
 	    }
- 	    switch (queue_idx) {
-	        case 0:
-		    *(uint32_t *)dst = virtio->rx_vq.pfn;
-		    break;
-		case 1:
-		    *(uint32_t *)dst = virtio->tx_vq.pfn;
-		    break;	
-		case 2:
-		    *(uint32_t *)dst = virtio->ctrl_vq.pfn;
-		    break;
-		default:
-		    break;
-	    }
+	    *(uint32_t *)dst = (queue) ? queue->vq.pfn : 0;
 	    break;
 
 	case VRING_SIZE_PORT:
@@ -570,19 +1213,7 @@ static int virtio_io_read(struct v3_core_info *core,
 		PrintError("Virtio NIC: Illegal read length for vring size\n");
 		return -1;
 	    }
-	    switch (queue_idx) {
-	        case 0:
-		    *(uint16_t *)dst = virtio->rx_vq.queue_size;
-		    break;
-		case 1:
-		    *(uint16_t *)dst = virtio->tx_vq.queue_size;
-		    break;	
-		case 2:
-		    *(uint16_t *)dst = virtio->ctrl_vq.queue_size;
-		    break;
-		default:
-		    break;
-	    }
+	    *(uint16_t *)dst = (queue) ? queue->vq.queue_size : 0;
 	    break;
 
 	case VIRTIO_STATUS_PORT:
@@ -603,8 +1234,20 @@ static int virtio_io_read(struct v3_core_info *core,
 
 	    break;
 
-	case VIRTIO_NET_CONFIG ... VIRTIO_NET_CONFIG + ETH_ALEN:
-	    *(uint8_t *)dst = virtio->net_cfg.mac[port_idx-VIRTIO_NET_CONFIG];
+	case VIRTIO_MSI_CONFIG_VECTOR_PORT:
+	case VIRTIO_MSI_QUEUE_VECTOR_PORT:
+	    if (length != 2) {
+		PrintError("Virtio NIC: Illegal read length for MSI-X vector (len=%d)\n", length);
+		return -1;
+	    }
+
+	    if (port_idx == VIRTIO_MSI_CONFIG_VECTOR_PORT) {
+		*(uint16_t *)dst = virtio->config_vector;
+	    } else if (queue) {
+		*(uint16_t *)dst = queue->msix_vector;
+	    } else {
+		*(uint16_t *)dst = VIRTIO_MSI_NO_VECTOR;
+	    }
 	    break;
 
 	default:
@@ -617,165 +1260,581 @@ static int virtio_io_read(struct v3_core_info *core,
 }
 
 
-/* receiving raw ethernet pkt from backend */
-static int virtio_rx(uint8_t * buf, uint32_t size, void * private_data) {
-    struct virtio_net_state * virtio = (struct virtio_net_state *)private_data;
-    struct virtio_queue * q = &(virtio->rx_vq);
+/* Copy one frame into the guest's next RX buffers
+ * Called with the queue lock held, after checking that a buffer is available */
+static int 
+__rx_copy_frame(struct virtio_net_state * virtio, 
+		struct net_queue        * rxq, 
+		uint8_t                 * buf, 
+		uint32_t                  size, 
+		struct virtio_net_hdr   * net_hdr)
+{
+    struct virtio_queue * q = &(rxq->vq);
     struct virtio_net_hdr_mrg_rxbuf hdr;
-    unsigned long flags;
-    uint8_t kick_guest = 0;
+    uint16_t buf_idx;
+    struct vring_desc * buf_desc;
+    uint32_t hdr_len;
+    int      len;
+    uint32_t offset = 0;
 
-    V3_Net_Print(2, "Virtio NIC: virtio_rx: size: %d\n", size);
+    memset(&hdr, 0, sizeof(struct virtio_net_hdr_mrg_rxbuf));
 
-    if (!q->ring_avail_addr) {
-	V3_Net_Print(2, "Virtio NIC: RX Queue not set\n");
-	virtio->stats.rx_dropped ++;
-	
-	return -1;
+    if (net_hdr) {
+	hdr.hdr = *net_hdr;
     }
 
-    memset(&hdr, 0, sizeof(struct virtio_net_hdr_mrg_rxbuf));
+    hdr_len = (virtio->mergeable_rx_bufs)?
+	sizeof(struct virtio_net_hdr_mrg_rxbuf):
+	sizeof(struct virtio_net_hdr);
 
-    flags = v3_spin_lock_irqsave(&(virtio->rx_lock));
+    if(virtio->mergeable_rx_bufs){/* merged buffer */
+	struct vring_desc * hdr_desc;
+	uint16_t old_idx = q->cur_avail_idx;
 
-    if (q->cur_avail_idx != q->avail->index){
-	uint16_t buf_idx;
-	struct vring_desc * buf_desc;
-	uint32_t hdr_len, len;
-	uint32_t offset = 0;
+	buf_idx = q->avail->ring[q->cur_avail_idx % q->queue_size];
+	hdr_desc = &(q->desc[buf_idx]);
 
-	hdr_len = (virtio->mergeable_rx_bufs)?
-	    sizeof(struct virtio_net_hdr_mrg_rxbuf):
-	    sizeof(struct virtio_net_hdr);
+	len = copy_data_to_desc(&(virtio->virtio_dev->vm->cores[0]), 
+				rxq, hdr_desc, buf, size, hdr_len);
+	if(len < 0){
+	    return -1;
+	}
+	offset += len;
 
-	if(virtio->mergeable_rx_bufs){/* merged buffer */
-	    struct vring_desc * hdr_desc;
-	    uint16_t old_idx = q->cur_avail_idx;
+	q->used->ring[q->used->index % q->queue_size].id = q->avail->ring[q->cur_avail_idx % q->queue_size];
+	q->used->ring[q->used->index % q->queue_size].length = hdr_len + offset;
+	q->cur_avail_idx ++;
+	hdr.num_buffers ++;
 
+	while(offset < size) {
 	    buf_idx = q->avail->ring[q->cur_avail_idx % q->queue_size];
-	    hdr_desc = &(q->desc[buf_idx]);
+	    buf_desc = &(q->desc[buf_idx]);
 
 	    len = copy_data_to_desc(&(virtio->virtio_dev->vm->cores[0]), 
-				    virtio, hdr_desc, buf, size, hdr_len);
-	    if(len < 0){
-		goto err_exit;
+				    rxq, buf_desc, buf+offset, size-offset, 0);	
+	    if (len < 0){
+		V3_Net_Print(2, "Virtio NIC: merged buffer, %d buffer size %d\n", 
+			     hdr.num_buffers, len);
+		q->cur_avail_idx = old_idx;
+		return -1;
 	    }
 	    offset += len;
+	    buf_desc->flags &= ~VIRTIO_NEXT_FLAG;
+	    vring_desc_dirty(virtio->vm, q, buf_desc);
+
+	    q->used->ring[(q->used->index + hdr.num_buffers) % q->queue_size].id = q->avail->ring[q->cur_avail_idx % q->queue_size];
+	    q->used->ring[(q->used->index + hdr.num_buffers) % q->queue_size].length = len;
+	    q->cur_avail_idx ++;   
 
-	    q->used->ring[q->used->index % q->queue_size].id = q->avail->ring[q->cur_avail_idx % q->queue_size];
-	    q->used->ring[q->used->index % q->queue_size].length = hdr_len + offset;
-	    q->cur_avail_idx ++;
 	    hdr.num_buffers ++;
+	}
 
-	    while(offset < size) {
-		buf_idx = q->avail->ring[q->cur_avail_idx % q->queue_size];
-		buf_desc = &(q->desc[buf_idx]);
-
-		len = copy_data_to_desc(&(virtio->virtio_dev->vm->cores[0]), 
-					virtio, buf_desc, buf+offset, size-offset, 0);	
-		if (len < 0){
-		    V3_Net_Print(2, "Virtio NIC: merged buffer, %d buffer size %d\n", 
-				 hdr.num_buffers, len);
-		    q->cur_avail_idx = old_idx;
-	      	    goto err_exit;
-		}
-		offset += len;
-		buf_desc->flags &= ~VIRTIO_NEXT_FLAG;
+	copy_data_to_desc(&(virtio->virtio_dev->vm->cores[0]), 
+			  rxq, hdr_desc, (uint8_t *)&hdr, hdr_len, 0);
+	q->used->index += hdr.num_buffers;
+    }else{
+	buf_idx = q->avail->ring[q->cur_avail_idx % q->queue_size];
+	buf_desc = &(q->desc[buf_idx]);
+
+	/* copy header */
+	len = copy_data_to_desc(&(virtio->virtio_dev->vm->cores[0]), 
+				rxq, buf_desc, (uint8_t *)&(hdr.hdr), hdr_len, 0);
+	if(len < (int)hdr_len){
+	    V3_Net_Print(2, "Virtio NIC: rx copy header error %d, hdr_len %d\n", 
+			 len, hdr_len);
+	    return -1;
+	}
 
-		q->used->ring[(q->used->index + hdr.num_buffers) % q->queue_size].id = q->avail->ring[q->cur_avail_idx % q->queue_size];
-		q->used->ring[(q->used->index + hdr.num_buffers) % q->queue_size].length = len;
-		q->cur_avail_idx ++;   
+	len = copy_data_to_desc(&(virtio->virtio_dev->vm->cores[0]), 
+				rxq, buf_desc, buf, size, hdr_len);
+	if(len < 0){
+	    V3_Net_Print(2, "Virtio NIC: rx copy data error %d\n", len);
+	    return -1;
+	}
+	offset += len;
 
-		hdr.num_buffers ++;
+	/* copy rest of data */
+	while(offset < size && 
+	      (buf_desc->flags & VIRTIO_NEXT_FLAG)){
+	    buf_desc = &(q->desc[buf_desc->next]);
+	    len = copy_data_to_desc(&(virtio->virtio_dev->vm->cores[0]), 
+				    rxq, buf_desc, buf+offset, size-offset, 0);	    
+	    if (len < 0) {
+		break;
 	    }
+	    offset += len;
+	}
+	buf_desc->flags &= ~VIRTIO_NEXT_FLAG;
+	vring_desc_dirty(virtio->vm, q, buf_desc);
 
-	    copy_data_to_desc(&(virtio->virtio_dev->vm->cores[0]), 
-			      virtio, hdr_desc, (uint8_t *)&hdr, hdr_len, 0);
-	    q->used->index += hdr.num_buffers;
-	}else{
-	    buf_idx = q->avail->ring[q->cur_avail_idx % q->queue_size];
-	    buf_desc = &(q->desc[buf_idx]);
+	if(offset < size){
+	    V3_Net_Print(2, "Virtio NIC: rx not enough ring buffer, buffer size %d\n", 
+			 len);
+	    return -1;
+	}
 
-	    /* copy header */
-	    len = copy_data_to_desc(&(virtio->virtio_dev->vm->cores[0]), 
-				    virtio, buf_desc, (uint8_t *)&(hdr.hdr), hdr_len, 0);
-	    if(len < hdr_len){
-		V3_Net_Print(2, "Virtio NIC: rx copy header error %d, hdr_len %d\n", 
-			     len, hdr_len);
-		goto err_exit;
+	q->used->ring[q->used->index % q->queue_size].id = q->avail->ring[q->cur_avail_idx % q->queue_size];
+	q->used->ring[q->used->index % q->queue_size].length = size + hdr_len; /* This should be the total length of data sent to guest (header+pkt_data) */
+	q->used->index ++;
+	q->cur_avail_idx ++;
+    }
+
+    rxq->pkts ++;
+    virtio->stats.rx_pkts ++;
+    virtio->stats.rx_bytes += size;
+
+    return 0;
+}
+
+/* receiving raw ethernet pkts from backend 
+ * All frames go to one queue and the guest is interrupted at most once.
+ * Returns the number of frames delivered, -1 if a frame was dropped due to an error */
+static int __virtio_rx(struct virtio_net_state * virtio, 
+		       struct net_queue        * rxq, 
+		       struct v3_net_frame     * frames, 
+		       uint32_t                  num_frames, 
+		       struct virtio_net_hdr   * net_hdr) {
+    struct virtio_queue * q = &(rxq->vq);
+    struct v3_vm_info * vm = virtio->virtio_dev->vm;
+    unsigned long flags;
+    uint8_t kick_guest = 0;
+    int raise = 0;
+    int target_cpu = vm->cores[rxq->pair % vm->num_cores].pcpu_id;
+    int delivered = 0;
+    int errors = 0;
+    uint32_t i = 0;
+
+    V3_Net_Print(2, "Virtio NIC: virtio_rx: %d frames, size: %d\n", num_frames, frames[0].len);
+
+    if (!q->ring_avail_addr) {
+	V3_Net_Print(2, "Virtio NIC: RX Queue not set\n");
+	virtio->stats.rx_dropped += num_frames;
+	
+	return -1;
+    }
+
+    /* Dropped as if the ring were full, until the memory thread has backed it */
+    if (vring_try_populate(vm, q) == -1) {
+	virtio->stats.rx_dropped += num_frames;
+
+	return -1;
+    }
+
+    flags = v3_spin_lock_irqsave(&(rxq->lock));
+
+    for (i = 0; i < num_frames; i++) {
+	if (q->cur_avail_idx == q->avail->index) {
+	    V3_Net_Print(2, "Virtio NIC: Guest RX queue is full\n");
+	    virtio->stats.rx_dropped += (num_frames - i);
+
+	    /* kick guest to refill RX queue, regardless of moderation */
+	    kick_guest = 1;
+	    break;
+	}
+
+	if (__rx_copy_frame(virtio, rxq, frames[i].buf, frames[i].len, net_hdr) == -1) {
+	    virtio->stats.rx_dropped ++;
+	    errors ++;
+	    continue;
+	}
+
+	delivered ++;
+    }
+
+    if (delivered > 0) {
+	raise = __vq_complete(virtio, rxq, delivered);
+    }
+
+    if (kick_guest) {
+	raise = 1;
+
+	rxq->irq_pending = 0;
+	rxq->irq_pending_tsc = 0;
+    }
+
+    v3_spin_unlock_irqrestore(&(rxq->lock), flags);
+
+    if (raise) {
+	vq_raise_irq(virtio, rxq);
+	virtio->stats.rx_interrupts ++;
+    }
+
+    /* notify guest if it is in guest mode, the queue pair is serviced by its matching core */
+    if(raise && (kick_guest || virtio->rx_notify == 1) && 
+	V3_Get_CPU() != target_cpu){
+	v3_interrupt_cpu(vm, target_cpu, 0);
+    }
+
+    if ((delivered == 0) && (errors > 0)) {
+	return -1;
+    }
+
+    return delivered;
+}
+
+/* Pick the RX queue for a frame.
+ * Frames of a flow the guest has transmitted on go back to the same queue pair, 
+ * everything else is spread by flow hash */
+static struct net_queue * 
+select_rx_queue(struct virtio_net_state * virtio, 
+		uint8_t                 * buf, 
+		uint32_t                  size)
+{
+    uint32_t hash = 0;
+    uint8_t  pair = 0;
+
+    if (virtio->active_pairs <= 1) {
+	return &(virtio->rx_queues[0]);
+    }
+
+    hash = v3_net_flow_hash(buf, size);
+    pair = virtio->flow_table[hash % NET_FLOW_TABLE_SIZE];
+
+    if ((pair > 0) && (pair <= virtio->active_pairs)) {
+	return &(virtio->rx_queues[pair - 1]);
+    }
+
+    return &(virtio->rx_queues[hash % virtio->active_pairs]);
+}
+
+static int virtio_rx(uint8_t * buf, uint32_t size, void * private_data) {
+    struct virtio_net_state * virtio = (struct virtio_net_state *)private_data;
+    struct v3_net_frame frame = {buf, size};
+
+    if (__virtio_rx(virtio, select_rx_queue(virtio, buf, size), &frame, 1, NULL) < 0) {
+	return -1;
+    }
+
+    return 0;
+}
+
+/* Receive a batch of frames from the backend, runs of frames for the same queue share an interrupt */
+static int virtio_rx_batch(struct v3_net_frame * frames, uint32_t num_frames, void * private_data) {
+    struct virtio_net_state * virtio = (struct virtio_net_state *)private_data;
+    struct net_queue * rxq = NULL;
+    uint32_t start = 0;
+    uint32_t i = 0;
+    int delivered = 0;
+    int ret = 0;
+
+    while (start < num_frames) {
+	rxq = select_rx_queue(virtio, frames[start].buf, frames[start].len);
+
+	for (i = start + 1; i < num_frames; i++) {
+	    if (select_rx_queue(virtio, frames[i].buf, frames[i].len) != rxq) {
+		break;
 	    }
+	}
 
-	    len = copy_data_to_desc(&(virtio->virtio_dev->vm->cores[0]), 
-				    virtio, buf_desc, buf, size, hdr_len);
-	    if(len < 0){
-		V3_Net_Print(2, "Virtio NIC: rx copy data error %d\n", len);
-		goto err_exit;
+	ret = __virtio_rx(virtio, rxq, &(frames[start]), i - start, NULL);
+
+	if (ret > 0) {
+	    delivered += ret;
+	}
+
+	start = i;
+    }
+
+    return delivered;
+}
+
+/* 
+ * Zero copy receive: reserve the guest buffers a frame of len bytes will need 
+ * and hand their host addresses to the backend, which writes the frame in place.
+ * The buffers are claimed from the avail ring under the queue lock, 
+ * but the lock is not held while the backend fills them.
+ */
+static int 
+virtio_rx_map(uint8_t              * hdr, 
+	      uint32_t               hdr_len, 
+	      uint32_t               len, 
+	      struct v3_net_rx_map * map, 
+	      void                 * private_data)
+{
+    struct virtio_net_state * virtio = (struct virtio_net_state *)private_data;
+    struct net_queue        * rxq    = select_rx_queue(virtio, hdr, hdr_len);
+    struct virtio_queue     * q      = &(rxq->vq);
+    struct v3_core_info     * core   = &(virtio->virtio_dev->vm->cores[0]);
+    struct vring_desc       * desc   = NULL;
+    uint8_t                 * buf    = NULL;
+    unsigned long flags;
+    uint32_t vhdr_len = 0;
+    uint32_t offset   = 0;
+    uint32_t cap      = 0;
+    uint16_t start    = 0;
+
+    if ((!q->ring_avail_addr) || 
+	(vring_try_populate(virtio->vm, q) == -1)) {
+	return -1;
+    }
+
+    vhdr_len = (virtio->mergeable_rx_bufs) ? 
+	sizeof(struct virtio_net_hdr_mrg_rxbuf) : 
+	sizeof(struct virtio_net_hdr);
+
+    map->num_iov  = 0;
+    map->num_bufs = 0;
+
+    flags = v3_spin_lock_irqsave(&(rxq->lock));
+
+    start = q->cur_avail_idx;
+
+    /* Merged buffers take one avail entry each, otherwise the frame goes into one descriptor chain */
+    while (cap < len) {
+	if ((desc == NULL) || virtio->mergeable_rx_bufs) {
+	    if (q->cur_avail_idx == q->avail->index) {
+		goto fail;
 	    }
-	    offset += len;
 
-  	    /* copy rest of data */
-	    while(offset < size && 
-		  (buf_desc->flags & VIRTIO_NEXT_FLAG)){
-	    	buf_desc = &(q->desc[buf_desc->next]);
-	    	len = copy_data_to_desc(&(virtio->virtio_dev->vm->cores[0]), 
-					virtio, buf_desc, buf+offset, size-offset, 0);	    
-	    	if (len < 0) {
-	    	    break;
-	    	}
-		offset += len;
+	    desc = &(q->desc[q->avail->ring[q->cur_avail_idx % q->queue_size]]);
+	    q->cur_avail_idx++;
+	    map->num_bufs++;
+	} else if (desc->flags & VIRTIO_NEXT_FLAG) {
+	    desc = &(q->desc[desc->next]);
+	} else {
+	    goto fail;
+	}
+
+	if (map->num_iov == V3_NET_MAX_IOV) {
+	    goto fail;
+	}
+
+	if (v3_gpa_to_hva_cached(core, &(rxq->gpa_cache), desc->addr_gpa, (addr_t *)&(buf)) == -1) {
+	    goto fail;
+	}
+
+	/* The virtio header leads the first buffer */
+	offset = 0;
+
+	if (map->num_iov == 0) {
+	    if (desc->length < vhdr_len) {
+		goto fail;
 	    }
-	    buf_desc->flags &= ~VIRTIO_NEXT_FLAG;
 
-	    if(offset < size){
-		V3_Net_Print(2, "Virtio NIC: rx not enough ring buffer, buffer size %d\n", 
-			     len);
-		goto err_exit;
+	    map->hdr = buf;
+	    offset   = vhdr_len;
+	}
+
+	map->iov[map->num_iov].buf = buf + offset;
+	map->iov[map->num_iov].len = desc->length - offset;
+	cap += desc->length - offset;
+
+	map->num_iov++;
+    }
+
+    map->queue     = rxq;
+    map->avail_idx = start;
+
+    v3_spin_unlock_irqrestore(&(rxq->lock), flags);
+
+    return 0;
+
+ fail:
+    q->cur_avail_idx = start;
+    v3_spin_unlock_irqrestore(&(rxq->lock), flags);
+
+    return -1;
+}
+
+/* Return the buffers reserved by virtio_rx_map() to the guest, holding len bytes of frame */
+static int 
+virtio_rx_complete(struct v3_net_rx_map * map, 
+		   uint32_t               len, 
+		   void                 * private_data)
+{
+    struct virtio_net_state * virtio = (struct virtio_net_state *)private_data;
+    struct net_queue        * rxq    = (struct net_queue *)map->queue;
+    struct virtio_queue     * q      = &(rxq->vq);
+    struct v3_vm_info       * vm     = virtio->virtio_dev->vm;
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    unsigned long flags;
+    uint32_t vhdr_len   = 0;
+    uint32_t left       = len;
+    uint32_t buf_len    = 0;
+    int      raise      = 0;
+    int      target_cpu = vm->cores[rxq->pair % vm->num_cores].pcpu_id;
+    int      i          = 0;
+
+    vhdr_len = (virtio->mergeable_rx_bufs) ? 
+	sizeof(struct virtio_net_hdr_mrg_rxbuf) : 
+	sizeof(struct virtio_net_hdr);
+
+    flags = v3_spin_lock_irqsave(&(rxq->lock));
+
+    if (len == 0) {
+	virtio->stats.rx_dropped ++;
+
+	if (q->cur_avail_idx == (uint16_t)(map->avail_idx + map->num_bufs)) {
+	    /* Nothing was claimed since, the buffers can just be reused */
+	    q->cur_avail_idx = map->avail_idx;
+	} else {
+	    /* Zero length completions, which the guest discards */
+	    for (i = 0; i < map->num_bufs; i++) {
+		q->used->ring[q->used->index % q->queue_size].id = 
+		    q->avail->ring[(uint16_t)(map->avail_idx + i) % q->queue_size];
+		q->used->ring[q->used->index % q->queue_size].length = 0;
+		q->used->index ++;
 	    }
-		
-	    q->used->ring[q->used->index % q->queue_size].id = q->avail->ring[q->cur_avail_idx % q->queue_size];
-	    q->used->ring[q->used->index % q->queue_size].length = size + hdr_len; /* This should be the total length of data sent to guest (header+pkt_data) */
-	    q->used->index ++;
-	    q->cur_avail_idx ++;
-	} 
-
- 	virtio->stats.rx_pkts ++;
-	virtio->stats.rx_bytes += size;
-    } else {
-	V3_Net_Print(2, "Virtio NIC: Guest RX queue is full\n");
-    	virtio->stats.rx_dropped ++;
 
- 	/* kick guest to refill RX queue */
-	kick_guest = 1;
+	    vring_used_dirty(vm, q);
+	}
+
+	v3_spin_unlock_irqrestore(&(rxq->lock), flags);
+
+	return 0;
     }
 
-    v3_spin_unlock_irqrestore(&(virtio->rx_lock), flags);
+    memset(&hdr, 0, sizeof(struct virtio_net_hdr_mrg_rxbuf));
+    hdr.num_buffers = map->num_bufs;
 
-    if (!(q->avail->flags & VIRTIO_NO_IRQ_FLAG) || kick_guest) {
-	if (virtio->virtio_cfg.pci_isr == 0) {
-	    V3_Net_Print(2, "Virtio NIC: RX Raising IRQ %d\n",  
-			 virtio->pci_dev->config_header.intr_line);
-	    
-	    virtio->virtio_cfg.pci_isr = 0x1;	
-	    v3_pci_raise_irq(virtio->virtio_dev->pci_bus, virtio->pci_dev, 0);
-	    virtio->stats.rx_interrupts ++;
+    memcpy(map->hdr, &hdr, vhdr_len);
+
+    // The backend wrote the frame straight into the reserved buffers
+    for (i = 0; i < map->num_bufs; i++) {
+	vring_chain_dirty(vm, q, q->avail->ring[(uint16_t)(map->avail_idx + i) % q->queue_size]);
+    }
+
+    if (virtio->mergeable_rx_bufs) {
+	for (i = 0; i < map->num_bufs; i++) {
+	    buf_len = (left < map->iov[i].len) ? left : map->iov[i].len;
+	    left   -= buf_len;
+
+	    q->used->ring[(q->used->index + i) % q->queue_size].id = 
+		q->avail->ring[(uint16_t)(map->avail_idx + i) % q->queue_size];
+	    q->used->ring[(q->used->index + i) % q->queue_size].length = 
+		buf_len + ((i == 0) ? vhdr_len : 0);
 	}
+
+	q->used->index += map->num_bufs;
+    } else {
+	q->used->ring[q->used->index % q->queue_size].id = 
+	    q->avail->ring[map->avail_idx % q->queue_size];
+	q->used->ring[q->used->index % q->queue_size].length = len + vhdr_len;
+	q->used->index ++;
     }
 
-    /* notify guest if it is in guest mode */
-    if((kick_guest || virtio->rx_notify == 1) && 
-	V3_Get_CPU() != virtio->virtio_dev->vm->cores[0].pcpu_id){
-	v3_interrupt_cpu(virtio->virtio_dev->vm, 
-			 virtio->virtio_dev->vm->cores[0].pcpu_id, 
-			 0);
+    rxq->pkts ++;
+    virtio->stats.rx_pkts ++;
+    virtio->stats.rx_bytes += len;
+
+    raise = __vq_complete(virtio, rxq, 1);
+
+    v3_spin_unlock_irqrestore(&(rxq->lock), flags);
+
+    if (raise) {
+	vq_raise_irq(virtio, rxq);
+	virtio->stats.rx_interrupts ++;
+
+	if ((virtio->rx_notify == 1) && (V3_Get_CPU() != target_cpu)) {
+	    v3_interrupt_cpu(vm, target_cpu, 0);
+	}
     }
 
     return 0;
+}
 
-err_exit:
-    virtio->stats.rx_dropped ++;
-    v3_spin_unlock_irqrestore(&(virtio->rx_lock), flags);
- 
-    return -1;
+/* Receive an oversized or partially checksummed frame from the backend */
+static int virtio_rx_gso(uint8_t * buf, uint32_t size, struct v3_net_gso * gso, void * private_data) {
+    struct virtio_net_state * virtio = (struct virtio_net_state *)private_data;
+    struct net_queue * rxq = select_rx_queue(virtio, buf, size);
+    struct virtio_net_hdr net_hdr;
+    struct v3_net_frame frame = {buf, size};
+    unsigned long flags;
+    int accept = 1;
+    int ret = 0;
+
+    switch (gso->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+	case VIRTIO_NET_HDR_GSO_NONE:
+	    break;
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+	    accept = guest_has_feature(virtio, VIRTIO_NET_F_GUEST_TSO4);
+	    break;
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+	    accept = guest_has_feature(virtio, VIRTIO_NET_F_GUEST_TSO6);
+	    break;
+	default:
+	    accept = 0;
+	    break;
+    }
+
+    if ((gso->gso_type & VIRTIO_NET_HDR_GSO_ECN) && 
+	!guest_has_feature(virtio, VIRTIO_NET_F_GUEST_ECN)) {
+	accept = 0;
+    }
+
+    if ((gso->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && 
+	!guest_has_feature(virtio, VIRTIO_NET_F_GUEST_CSUM)) {
+	accept = 0;
+    }
+
+    if (accept) {
+	memset(&net_hdr, 0, sizeof(struct virtio_net_hdr));
+
+	/* DATA_VALID is only defined once the guest negotiated GUEST_CSUM */
+	if (guest_has_feature(virtio, VIRTIO_NET_F_GUEST_CSUM)) {
+	    net_hdr.flags   = gso->flags;
+	}
+
+	net_hdr.gso_type    = gso->gso_type;
+	net_hdr.hdr_len     = gso->hdr_len;
+	net_hdr.gso_size    = gso->gso_size;
+	net_hdr.csum_start  = gso->csum_start;
+	net_hdr.csum_offset = gso->csum_offset;
+
+	if (__virtio_rx(virtio, rxq, &frame, 1, &net_hdr) < 0) {
+	    return -1;
+	}
+
+	return 0;
+    }
+
+    /* The guest cannot take this frame as is, deliver wire sized frames instead */
+    flags = v3_spin_lock_irqsave(&(rxq->buf_lock));
+    ret = v3_net_gso_xmit(buf, size, gso, rxq->seg_buf, MAX_PACKET_LEN, 
+			  virtio_rx, virtio);
+    v3_spin_unlock_irqrestore(&(rxq->buf_lock), flags);
+
+    return (ret < 0) ? -1 : 0;
+}
+
+static void 
+free_queues(struct net_queue * queues, 
+	    int                num_queues)
+{
+    int i = 0;
+
+    if (queues == NULL) {
+	return;
+    }
+
+    for (i = 0; i < num_queues; i++) {
+	if (queues[i].buf) {
+	    V3_Free(queues[i].buf);
+	}
+
+	if (queues[i].seg_buf) {
+	    V3_Free(queues[i].seg_buf);
+	}
+    }
+
+    V3_Free(queues);
+}
+
+static void 
+free_net_state(struct virtio_net_state * net_state)
+{
+    if (net_state->timer) {
+	v3_remove_timer(&(net_state->vm->cores[0]), net_state->timer);
+    }
+
+    free_queues(net_state->rx_queues, net_state->max_pairs);
+    free_queues(net_state->tx_queues, net_state->max_pairs);
+
+    if (net_state->msix_page) {
+	V3_FreePages(net_state->msix_page, 1);
+    }
+
+    V3_Free(net_state);
 }
 
 static int virtio_free(struct virtio_dev_state * virtio) {
@@ -788,7 +1847,8 @@ static int virtio_free(struct virtio_dev_state * virtio) {
 	// unregister from PCI
 
 	list_del(&(backend->dev_link));
-	V3_Free(backend);
+
+	free_net_state(backend);
     }
 
     V3_Free(virtio);
@@ -803,12 +1863,54 @@ static struct v3_device_ops dev_ops = {
 
 static int virtio_poll(int quota, void * data){
     struct virtio_net_state * virtio  = (struct virtio_net_state *)data;
+    int pkts_left = 0;
+    int ret = 0;
+    int i = 0;
 
     if (virtio->status) {
+	for (i = 0; i < virtio->active_pairs; i++) {
+	    ret = handle_pkt_tx(&(virtio->vm->cores[0]), virtio, &(virtio->tx_queues[i]), quota);
+
+	    if (ret < 0) {
+		return -1;
+	    }
+
+	    pkts_left |= ret;
 
-	return handle_pkt_tx(&(virtio->vm->cores[0]), virtio, quota);
+	    vq_flush_irq(virtio, &(virtio->tx_queues[i]));
+	    vq_flush_irq(virtio, &(virtio->rx_queues[i]));
+	}
     } 
 
+    return pkts_left;
+}
+
+
+static int 
+virtio_cfg_read(struct pci_device * pci_dev,
+		uint32_t            reg_num,
+		void              * dst,
+		uint_t              length,
+		void              * private_data)
+{
+    struct virtio_net_state * net_state = (struct virtio_net_state *)private_data;
+
+    return virtio_msix_cfg_read(net_state->num_vectors, reg_num, dst, length);
+}
+
+
+static int 
+virtio_cmd_update(struct pci_device * pci_dev,
+		  pci_cmd_t           cmd,
+		  uint64_t            arg,
+		  void              * private_data)
+{
+    struct virtio_net_state * net_state = (struct virtio_net_state *)private_data;
+
+    PrintDebug("Virtio NIC: PCI command %d (arg=%llu)\n", cmd, arg);
+
+    virtio_msix_cmd_update(pci_dev, cmd, &(net_state->msix_enabled));
+
     return 0;
 }
 
@@ -817,7 +1919,7 @@ static int register_dev(struct virtio_dev_state * virtio,
 {
     struct pci_device * pci_dev = NULL;
     struct v3_pci_bar bars[6];
-    int num_ports = sizeof(struct virtio_config);
+    int num_ports = sizeof(struct virtio_config) + VIRTIO_MSI_CONFIG_SIZE + sizeof(struct virtio_net_config);
     int tmp_ports = num_ports;
     int i;
 
@@ -848,17 +1950,33 @@ static int register_dev(struct virtio_dev_state * virtio,
     bars[0].io_read = virtio_io_read;
     bars[0].io_write = virtio_io_write;
     bars[0].private_data = net_state;
-    
-    pci_dev = v3_pci_register_device(virtio->pci_bus, PCI_STD_DEVICE, 
-				     0, PCI_AUTO_DEV_NUM, 0,
-				     "LNX_VIRTIO_NIC", bars,
-				     NULL, NULL, NULL, NULL, net_state);
+
+    if (net_state->msix_page) {
+	virtio_msix_init_bar(&(bars[VIRTIO_MSIX_BAR]), net_state->msix_page);
+
+	pci_dev = v3_pci_register_device(virtio->pci_bus, PCI_STD_DEVICE, 
+					 0, PCI_AUTO_DEV_NUM, 0,
+					 "LNX_VIRTIO_NIC", bars,
+					 NULL, virtio_cfg_read, virtio_cmd_update, NULL, net_state);
+    } else {
+	pci_dev = v3_pci_register_device(virtio->pci_bus, PCI_STD_DEVICE, 
+					 0, PCI_AUTO_DEV_NUM, 0,
+					 "LNX_VIRTIO_NIC", bars,
+					 NULL, NULL, NULL, NULL, net_state);
+    }
     
     if (!pci_dev) {
 	PrintError("Virtio NIC: Could not register PCI Device\n");
 	return -1;
     }
 
+    if (net_state->msix_page) {
+	if (v3_pci_enable_capability(pci_dev, PCI_CAP_MSIX) == -1) {
+	    PrintError("Virtio NIC: Could not enable MSI-X capability\n");
+	    return -1;
+	}
+    }
+
     PrintDebug("Virtio NIC:  registered to PCI bus\n");
     
     pci_dev->config_header.vendor_id = VIRTIO_VENDOR_ID;
@@ -876,6 +1994,14 @@ static int register_dev(struct virtio_dev_state * virtio,
     net_state->virtio_dev = virtio;
 
     memcpy(net_state->net_cfg.mac, virtio->mac, 6);                           
+
+    net_state->offload = virtio->offload;
+
+    net_state->coalesce_frames = virtio->coalesce_frames;
+    net_state->coalesce_cycles = ((uint64_t)virtio->coalesce_usecs * V3_CPU_KHZ()) / 1000;
+    net_state->adaptive = virtio->adaptive;
+    net_state->poll_enter_pps = virtio->poll_enter_pps;
+    net_state->poll_exit_pps = virtio->poll_exit_pps;
 	
     virtio_init_state(net_state);
 
@@ -887,75 +2013,196 @@ static int register_dev(struct virtio_dev_state * virtio,
     return 0;
 }
 
-#if 0
-#define RATE_UPPER_THRESHOLD 10  /* 10000 pkts per second, around 100Mbits */
-#define RATE_LOWER_THRESHOLD 1
-#define PROFILE_PERIOD 10000 /*us*/
+/* Switch a TX queue between guest kicks and VMM polling */
+static void 
+set_tx_polling(struct v3_core_info     * core, 
+	       struct virtio_net_state * net_state, 
+	       struct net_queue        * txq, 
+	       int                       polling)
+{
+    txq->polling = polling;
+
+    if (polling) {
+	disable_cb(net_state, &(txq->vq));
+
+	/* Get the backend's poller going on what is already queued */
+	if (net_state->net_ops->kick) {
+	    net_state->net_ops->kick(net_state->backend_data);
+	}
+
+	return;
+    }
+
+    enable_cb(net_state, &(txq->vq));
+    vring_mb();
+
+    /* Frames queued while kicks were off would otherwise wait for the next one */
+    vring_populate(core->vm_info, &(txq->vq));
+    handle_pkt_tx(core, net_state, txq, 0);
+}
 
+/* 
+ * Runs on every time update of core 0. Delivers coalesced interrupts whose deadline passed,
+ * drains polled TX queues and samples packet rates to pick the notification mode
+ */
 static void virtio_nic_timer(struct v3_core_info * core, 
 			     uint64_t cpu_cycles, uint64_t cpu_freq, 
 			     void * priv_data) {
     struct virtio_net_state * net_state = (struct virtio_net_state *)priv_data;
-    uint64_t period_us;
-    static int profile_ms = 0;
+    uint64_t period_ms = 0;
+    uint64_t rx_pkts = 0;
+    uint64_t rx_rate = 0;
+    int i = 0;
 
     if(!net_state->status){ /* VNIC is not in working status */
 	return;
     }
 
-    period_us = (1000*cpu_cycles)/cpu_freq;
-    net_state->past_us += period_us;
+    for (i = 0; i < net_state->active_pairs; i++) {
+	struct net_queue * txq = &(net_state->tx_queues[i]);
+
+	/* Backends that poll (VNET) normally get here first, this is the backstop. 
+	 * Those that take kicks drain the queue on their own thread instead of this core */
+	if (txq->polling) {
+	    if (net_state->net_ops->kick == NULL) {
+		vring_populate(core->vm_info, &(txq->vq));
+		handle_pkt_tx(core, net_state, txq, net_state->net_ops->config.quote);
+	    } else if ((txq->vq.ring_avail_addr) && 
+		       (txq->vq.avail->index != txq->vq.cur_avail_idx)) {
+		net_state->net_ops->kick(net_state->backend_data);
+	    }
+	}
 
-    if(net_state->past_us > PROFILE_PERIOD){ 
-	uint32_t tx_rate, rx_rate;
-	
-	tx_rate = (net_state->stats.tx_pkts - net_state->tx_pkts)/(net_state->past_us/1000); /* pkts/per ms */
-	rx_rate = (net_state->stats.rx_pkts - net_state->rx_pkts)/(net_state->past_us/1000);
+	vq_flush_irq(net_state, txq);
+	vq_flush_irq(net_state, &(net_state->rx_queues[i]));
+    }
+
+    if ((!net_state->adaptive) || (cpu_freq == 0)) {
+	return;
+    }
 
-	net_state->tx_pkts = net_state->stats.tx_pkts;
-	net_state->rx_pkts = net_state->stats.rx_pkts;
+    net_state->sample_cycles += cpu_cycles;
+    period_ms = net_state->sample_cycles / cpu_freq;
 
-	if(tx_rate > RATE_UPPER_THRESHOLD && net_state->tx_notify == 1){
-	    V3_Print("Virtio NIC: Switch TX to VMM driven mode\n");
-	    disable_cb(&(net_state->tx_vq));
-	    net_state->tx_notify = 0;
-	}
+    if (period_ms < NET_SAMPLE_MS) {
+	return;
+    }
+
+    for (i = 0; i < net_state->active_pairs; i++) {
+	struct net_queue * txq = &(net_state->tx_queues[i]);
+	struct net_queue * rxq = &(net_state->rx_queues[i]);
+	uint64_t tx_rate = ((txq->pkts - txq->last_pkts) * 1000) / period_ms;   /* pkts/s */
+
+	txq->last_pkts = txq->pkts;
+	rx_pkts += rxq->pkts;
 
-	if(tx_rate < RATE_LOWER_THRESHOLD && net_state->tx_notify == 0){
-	    V3_Print("Virtio NIC: Switch TX to Guest  driven mode\n");
-	    enable_cb(&(net_state->tx_vq));
-	    net_state->tx_notify = 1;
+	if ((tx_rate > net_state->poll_enter_pps) && (txq->polling == 0)) {
+	    V3_Net_Print(1, "Virtio NIC: Switch TX queue %d to VMM driven mode\n", i);
+	    set_tx_polling(core, net_state, txq, 1);
+	} else if ((tx_rate < net_state->poll_exit_pps) && (txq->polling == 1)) {
+	    V3_Net_Print(1, "Virtio NIC: Switch TX queue %d to Guest driven mode\n", i);
+	    set_tx_polling(core, net_state, txq, 0);
 	}
+    }
+
+    /* At high rates the guest exits often enough to see interrupts without an IPI */
+    rx_rate = ((rx_pkts - net_state->rx_pkts) * 1000) / period_ms;
+    net_state->rx_pkts = rx_pkts;
+
+    if ((rx_rate > net_state->poll_enter_pps) && (net_state->rx_notify == 1)) {
+	V3_Net_Print(1, "Virtio NIC: Switch RX to VMM None notify mode\n");
+	net_state->rx_notify = 0;
+    } else if ((rx_rate < net_state->poll_exit_pps) && (net_state->rx_notify == 0)) {
+	V3_Net_Print(1, "Virtio NIC: Switch RX to VMM notify mode\n");
+	net_state->rx_notify = 1;
+    }
+
+    net_state->sample_cycles = 0;
+}
 
-	if(rx_rate > RATE_UPPER_THRESHOLD && net_state->rx_notify == 1){
-	    V3_Print("Virtio NIC: Switch RX to VMM None notify mode\n");
-	    net_state->rx_notify = 0;
+/* Only pending coalesced interrupts need the core to wake up */
+static uint64_t 
+virtio_nic_next_event(struct v3_core_info * core, 
+		      uint64_t              cpu_freq, 
+		      void                * priv_data) 
+{
+    struct virtio_net_state * net_state = (struct virtio_net_state *)priv_data;
+    uint64_t next = V3_TIMER_NO_EVENT;
+    uint64_t now  = 0;
+    int i = 0;
+
+    rdtscll(now);
+
+    for (i = 0; i < (2 * net_state->active_pairs); i++) {
+	struct net_queue * queue = (i % 2) ? &(net_state->tx_queues[i / 2]) : &(net_state->rx_queues[i / 2]);
+	uint64_t deadline = queue->irq_pending_tsc + net_state->coalesce_cycles;
+
+	if ((queue->irq_pending == 0) || (queue->irq_pending_tsc == 0)) {
+	    continue;
 	}
 
-	if(rx_rate < RATE_LOWER_THRESHOLD && net_state->rx_notify == 0){
-	    V3_Print("Virtio NIC: Switch RX to VMM notify mode\n");
-	    net_state->rx_notify = 1;
+	if (deadline <= now) {
+	    return 0;
 	}
 
-	net_state->past_us = 0;
+	if ((deadline - now) < next) {
+	    next = deadline - now;
+	}
     }
 
-    profile_ms += period_us/1000;
-    if(profile_ms > 20000){
-	V3_Net_Print(1, "Virtio NIC: TX: Pkt: %lld, Bytes: %lld\n\t\tRX Pkt: %lld. Bytes: %lld\n\t\tDropped: tx %lld, rx %lld\nInterrupts: tx %d, rx %d\nTotal Exit: %lld\n",
-	    	net_state->stats.tx_pkts, net_state->stats.tx_bytes,
-	    	net_state->stats.rx_pkts, net_state->stats.rx_bytes,
-	    	net_state->stats.tx_dropped, net_state->stats.rx_dropped,
-	    	net_state->stats.tx_interrupts, net_state->stats.rx_interrupts,
-	    	net_state->vm->cores[0].num_exits);
-	profile_ms = 0;
-    }
+    return next;
 }
 
 static struct v3_timer_ops timer_ops = {
     .update_timer = virtio_nic_timer,
+    .next_event   = virtio_nic_next_event,
 };
-#endif
+
+static int 
+init_queues(struct virtio_net_state * net_state)
+{
+    int num_pairs = net_state->max_pairs;
+    int i = 0;
+
+    net_state->rx_queues = V3_Malloc(sizeof(struct net_queue) * num_pairs);
+    net_state->tx_queues = V3_Malloc(sizeof(struct net_queue) * num_pairs);
+
+    if (!net_state->rx_queues || !net_state->tx_queues) {
+	return -1;
+    }
+
+    memset(net_state->rx_queues, 0, sizeof(struct net_queue) * num_pairs);
+    memset(net_state->tx_queues, 0, sizeof(struct net_queue) * num_pairs);
+
+    for (i = 0; i < num_pairs; i++) {
+	struct net_queue * rxq = &(net_state->rx_queues[i]);
+	struct net_queue * txq = &(net_state->tx_queues[i]);
+
+	rxq->pair = i;
+	rxq->net_state = net_state;
+	v3_spinlock_init(&(rxq->lock));
+	v3_spinlock_init(&(rxq->buf_lock));
+
+	txq->pair = i;
+	txq->net_state = net_state;
+	v3_spinlock_init(&(txq->lock));
+	v3_spinlock_init(&(txq->buf_lock));
+
+	rxq->seg_buf = V3_Malloc(MAX_PACKET_LEN);
+	txq->buf     = V3_Malloc(VIRTIO_NET_MAX_BUFSIZE);
+	txq->seg_buf = V3_Malloc(MAX_PACKET_LEN);
+
+	if (!rxq->seg_buf || !txq->buf || !txq->seg_buf) {
+	    return -1;
+	}
+    }
+
+    net_state->ctrl_queue.net_state = net_state;
+    v3_spinlock_init(&(net_state->ctrl_queue.lock));
+    v3_spinlock_init(&(net_state->ctrl_queue.buf_lock));
+
+    return 0;
+}
 
 static int connect_fn(struct v3_vm_info * info, 
 		      void * frontend_data, 
@@ -971,23 +2218,61 @@ static int connect_fn(struct v3_vm_info * info,
     }
 
     memset(net_state, 0, sizeof(struct virtio_net_state));
-    register_dev(virtio, net_state);
+
+    net_state->max_pairs = virtio->max_pairs;
+
+    if (init_queues(net_state) == -1) {
+	PrintError("Virtio NIC: Cannot allocate queues\n");
+	free_net_state(net_state);
+	return -1;
+    }
+
+    if (net_state->max_pairs > 1) {
+	/* One vector per virtqueue, plus the config change vector */
+	net_state->num_vectors = (2 * net_state->max_pairs) + 2;
+	net_state->msix_page = V3_AllocPages(1);
+
+	if (net_state->msix_page == NULL) {
+	    PrintError("Virtio NIC: Cannot allocate MSI-X table\n");
+	    free_net_state(net_state);
+	    return -1;
+	}
+
+	memset(V3_VAddr(net_state->msix_page), 0, PAGE_SIZE_4KB);
+    }
+
+    if (register_dev(virtio, net_state) == -1) {
+	free_net_state(net_state);
+	return -1;
+    }
 
     net_state->vm = info;
     net_state->net_ops = ops;
     net_state->backend_data = private_data;
     net_state->virtio_dev = virtio;
     
-    net_state->tx_notify = 1;
     net_state->rx_notify = 1;
-	
-    //net_state->timer = v3_add_timer(&(info->cores[0]), &timer_ops,net_state);
+
+    /* The timer is only needed to expire coalesced interrupts and sample rates */
+    if ((net_state->coalesce_frames > 1) || (net_state->adaptive)) {
+	net_state->timer = v3_add_timer(&(info->cores[0]), &timer_ops, net_state);
+
+	if (net_state->timer == NULL) {
+	    PrintError("Virtio NIC: Cannot add moderation timer, interrupting on every completion\n");
+	    net_state->coalesce_frames = 1;
+	    net_state->adaptive = 0;
+	}
+    }
 
     ops->recv = virtio_rx;
+    ops->recv_gso = virtio_rx_gso;
+    ops->recv_batch = virtio_rx_batch;
+    ops->rx_map = virtio_rx_map;
+    ops->rx_complete = virtio_rx_complete;
     ops->poll = virtio_poll;
     ops->config.frontend_data = net_state;
     ops->config.poll = 1;
-    ops->config.quota = 64;
+    ops->config.quote = 64;
     ops->config.fnt_mac = V3_Malloc(ETH_ALEN);  
     memcpy(ops->config.fnt_mac, virtio->mac, ETH_ALEN);
 
@@ -1000,6 +2285,14 @@ static int virtio_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     char * dev_id = v3_cfg_val(cfg, "ID");
     char macstr[128];
     char * str = v3_cfg_val(cfg, "mac");
+    char * offload_str = v3_cfg_val(cfg, "offload");
+    char * queues_str = v3_cfg_val(cfg, "queues");
+    v3_cfg_tree_t * mod_cfg = v3_cfg_subtree(cfg, "moderation");
+    char * frames_str = v3_cfg_val(mod_cfg, "frames");
+    char * usecs_str = v3_cfg_val(mod_cfg, "usecs");
+    char * adaptive_str = v3_cfg_val(mod_cfg, "adaptive");
+    char * enter_str = v3_cfg_val(mod_cfg, "poll_enter_pps");
+    char * exit_str = v3_cfg_val(mod_cfg, "poll_exit_pps");
     memcpy(macstr, str, strlen(str));
 
     if (pci_bus == NULL) {
@@ -1020,6 +2313,54 @@ static int virtio_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     virtio_state->pci_bus = pci_bus;
     virtio_state->vm = vm;
 
+    /* Checksum and TSO offloads are on unless offload="disable" */
+    virtio_state->offload = !((offload_str) && (strcasecmp(offload_str, "disable") == 0));
+
+    /* queues="N" or queues="percpu" gives the guest that many TX/RX queue pairs */
+    virtio_state->max_pairs = 1;
+
+    if (queues_str != NULL) {
+	int pairs = 0;
+
+	if (strcasecmp(queues_str, "percpu") == 0) {
+	    pairs = vm->num_cores;
+	} else {
+	    pairs = atoi(queues_str);
+	}
+
+	if ((pairs < 1) || (pairs > NET_MAX_QUEUE_PAIRS)) {
+	    PrintError("Virtio NIC: Invalid queue count (%s), must be 1-%d or \"percpu\"\n",
+		       queues_str, NET_MAX_QUEUE_PAIRS);
+	    V3_Free(virtio_state);
+	    return -1;
+	}
+
+	virtio_state->max_pairs = pairs;
+    }
+
+    /* <moderation frames="N" usecs="N" adaptive="on" poll_enter_pps="N" poll_exit_pps="N"/>
+     * Interrupts are held back until frames completions are pending or the oldest is usecs old */
+    virtio_state->coalesce_frames = (frames_str) ? atoi(frames_str) : 1;
+    virtio_state->coalesce_usecs = (usecs_str) ? atoi(usecs_str) : 0;
+
+    if ((virtio_state->coalesce_frames <= 1) && (virtio_state->coalesce_usecs > 0)) {
+	/* Time based coalescing only */
+	virtio_state->coalesce_frames = (uint32_t)-1;
+    } else if ((virtio_state->coalesce_frames > 1) && (virtio_state->coalesce_usecs == 0)) {
+	virtio_state->coalesce_usecs = NET_COALESCE_USECS;
+    }
+
+    virtio_state->adaptive = ((adaptive_str) && (strcasecmp(adaptive_str, "on") == 0));
+    virtio_state->poll_enter_pps = (enter_str) ? atoi(enter_str) : NET_POLL_ENTER_PPS;
+    virtio_state->poll_exit_pps = (exit_str) ? atoi(exit_str) : NET_POLL_EXIT_PPS;
+
+    if (virtio_state->poll_exit_pps > virtio_state->poll_enter_pps) {
+	PrintError("Virtio NIC: poll_exit_pps (%u) must not exceed poll_enter_pps (%u)\n",
+		   virtio_state->poll_exit_pps, virtio_state->poll_enter_pps);
+	V3_Free(virtio_state);
+	return -1;
+    }
+
     if (macstr != NULL && !str2mac(macstr, virtio_state->mac)) {
 	PrintDebug("Virtio NIC: Mac specified %s\n", macstr);
     }else {
@@ -128,6 +128,11 @@ static int handle_cmd_kick(struct v3_core_info * core,
     
     PrintDebug("VNET Bridge: Handling command  queue\n");
 
+    if (vring_populate(core->vm_info, q) == -1) {
+	PrintError("Could not populate command queue memory\n");
+	return -1;
+    }
+
     while (q->cur_avail_idx != q->avail->index) {
 	struct vring_desc * hdr_desc = NULL;
 	struct vring_desc * buf_desc = NULL;
@@ -192,6 +197,7 @@ static int handle_cmd_kick(struct v3_core_info * core,
 
 	xfer_len += status_desc->length;
 	*status_ptr = status;
+	v3_mark_range_dirty(core->vm_info, status_desc->addr_gpa, sizeof(uint8_t));
 
 	PrintDebug("Transferred %d bytes (xfer_len)\n", xfer_len);
 	q->used->ring[q->used->index % QUEUE_SIZE].id = q->avail->ring[q->cur_avail_idx % QUEUE_SIZE];
@@ -199,6 +205,8 @@ static int handle_cmd_kick(struct v3_core_info * core,
 
 	q->used->index++;
 	q->cur_avail_idx++;
+
+	vring_used_dirty(core->vm_info, q);
     }
 
 
@@ -229,6 +237,12 @@ static int vnet_pkt_input_cb(struct v3_vm_info * vm,
 	goto exit;
     }
 
+    /* Dropped as if the ring were full, until the memory thread has backed it */
+    if (vring_try_populate(vm, q) == -1) {
+	vnet_state->pkt_drop ++;
+	goto exit;
+    }
+
     if (q->cur_avail_idx != q->avail->index) {
 	uint16_t pkt_idx = q->avail->ring[q->cur_avail_idx % q->queue_size];
 	struct vring_desc * pkt_desc = NULL;
@@ -247,12 +261,15 @@ static int vnet_pkt_input_cb(struct v3_vm_info * vm,
 	virtio_pkt->link_id = pkt->dst_id;
 	virtio_pkt->pkt_size = pkt->size;
 	memcpy(virtio_pkt->pkt, pkt->data, pkt->size);
+	v3_mark_range_dirty(vm, pkt_desc->addr_gpa, sizeof(struct vnet_bridge_pkt));
 	
 	q->used->ring[q->used->index % q->queue_size].id = q->avail->ring[q->cur_avail_idx % q->queue_size];
 	q->used->ring[q->used->index % q->queue_size].length = sizeof(struct vnet_bridge_pkt); 
 
 	q->used->index++;
 	q->cur_avail_idx++;
+
+	vring_used_dirty(vm, q);
     } else {
 	vnet_state->pkt_drop ++;
     }
@@ -282,11 +299,20 @@ static int do_tx_pkts(struct v3_core_info * core,
 	return -1;
     }
 
+    /* The kick populates the queue first, polling cannot sleep so packets wait for the memory thread */
+    if (vring_try_populate(core->vm_info, q) == -1) {
+	return 0;
+    }
+
     while (q->cur_avail_idx != q->avail->index) {
 	uint16_t desc_idx = q->avail->ring[q->cur_avail_idx % q->queue_size];
 	struct vring_desc * pkt_desc = NULL;
 	struct vnet_bridge_pkt * virtio_pkt = NULL;
 
+	if (vring_chain_try_populate(core->vm_info, q, desc_idx) == -1) {
+	    break;
+	}
+
 	pkt_desc = &(q->desc[desc_idx]);
 	
 	if (v3_gpa_to_hva(core, pkt_desc->addr_gpa, (addr_t *)&(virtio_pkt)) == -1) {
@@ -309,6 +335,8 @@ static int do_tx_pkts(struct v3_core_info * core,
 	q->used->ring[q->used->index % q->queue_size].length = pkt_desc->length; // What do we set this to????
 	q->used->index++;
 
+	vring_used_dirty(core->vm_info, q);
+
 	vnet_state->pkt_sent ++;
 	recvd ++;
 
@@ -340,7 +368,8 @@ static void vnet_virtio_poll(struct v3_vm_info * vm, void * private_data){
 static int handle_rx_queue_kick(struct v3_core_info *core, 
 			  struct virtio_vnet_state * vnet_state) 
 {	
-    return 0;
+    // Refilled buffers are written to when packets arrive, which cannot sleep
+    return vring_populate(core->vm_info, &(vnet_state->queue[RECV_QUEUE]));
 }
 
 static int vnet_virtio_io_write(struct v3_core_info * core, 
@@ -378,6 +407,11 @@ static int vnet_virtio_io_write(struct v3_core_info * core,
 		// round up to next page boundary.
 		vnet_state->cur_queue->ring_used_addr = (vnet_state->cur_queue->ring_used_addr + 0xfff) & ~0xfff;
 
+		if (v3_populate_gpa_range(core->vm_info, vnet_state->cur_queue->ring_desc_addr, vring_mem_size(vnet_state->cur_queue)) == -1) {
+		    PrintError("Could not populate ring memory\n");
+		    return -1;
+		}
+
 		if (v3_gpa_to_hva(core, vnet_state->cur_queue->ring_desc_addr, (addr_t *)&(vnet_state->cur_queue->desc)) == -1) {
 		    PrintError("Could not translate ring descriptor address\n");
 		    return -1;
@@ -404,12 +438,14 @@ static int vnet_virtio_io_write(struct v3_core_info * core,
 		if(vnet_state->queue[RECV_QUEUE].avail != NULL){
 		    vnet_state->ready = 1;
 		    vnet_state->queue[RECV_QUEUE].used->flags |= VRING_NO_NOTIFY_FLAG;
+		    vring_used_dirty(core->vm_info, &(vnet_state->queue[RECV_QUEUE]));
 		}
 
 		//No notify when there is pkt tx from guest
 		//palacios will do the polling
 		if(vnet_state->queue[XMIT_QUEUE].used != NULL){
 		    vnet_state->queue[XMIT_QUEUE].used->flags |= VRING_NO_NOTIFY_FLAG;
+		    vring_used_dirty(core->vm_info, &(vnet_state->queue[XMIT_QUEUE]));
 		}
 	    } else {
 		PrintError("Illegal write length for page frame number\n");
@@ -439,7 +475,8 @@ static int vnet_virtio_io_write(struct v3_core_info * core,
 		    return -1;
 		}
 	    } else if (queue_idx == 1) {
-		if (do_tx_pkts(core, vnet_state) == -1){
+		if ((vring_populate(core->vm_info, &(vnet_state->queue[XMIT_QUEUE])) == -1) || 
+		    (do_tx_pkts(core, vnet_state) == -1)) {
 		    PrintError("Could not handle Virtio VNET TX\n");
 		    return -1;
 		}
@@ -660,6 +697,7 @@ static int dev_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     struct v3_vnet_bridge_ops brg_ops;
     brg_ops.input = vnet_pkt_input_cb;
     brg_ops.poll = vnet_virtio_poll;
+    brg_ops.input_batch = NULL;
 
     V3_Print("Registering Virtio device as vnet bridge\n");
 
@@ -23,6 +23,7 @@
 #include <palacios/vmm_dev_mgr.h>
 #include <palacios/vm_guest_mem.h>
 #include <palacios/vmm_sprintf.h>
+#include <palacios/vmm_ethernet.h>
 #include <interfaces/vmm_packet.h>
 
 #ifndef V3_CONFIG_DEBUG_NIC_BRIDGE
@@ -50,6 +51,15 @@ static int bridge_send(uint8_t * buf, uint32_t len,
     return v3_packet_send(bridge->packet_state, buf, len);
 }
 
+static int bridge_send_batch(struct v3_net_frame * frames, uint32_t num_frames, 
+			     void * private_data) {
+    struct nic_bridge_state * bridge = (struct nic_bridge_state *)private_data;
+
+    PrintDebug("NIC Bridge: send %d pkts\n", num_frames);
+
+    return v3_packet_send_batch(bridge->packet_state, frames, num_frames);
+}
+
 static int packet_input(struct v3_packet * packet_state, uint8_t * pkt, uint32_t size) {
     struct nic_bridge_state * bridge = (struct nic_bridge_state *)packet_state->guest_packet_data;
     
@@ -60,12 +70,76 @@ static int packet_input(struct v3_packet * packet_state, uint8_t * pkt, uint32_t
     }
 #endif
     
+    /* The host may hand us coalesced TCP frames, let the frontend take them whole if it can */
+    if ((size > ETHERNET_PACKET_LEN) && (bridge->net_ops.recv_gso)) {
+	struct v3_net_gso gso;
+
+	if (v3_net_gso_probe(pkt, size, ETHERNET_MTU, &gso) == 0) {
+	    return bridge->net_ops.recv_gso(pkt, size, &gso, 
+					    bridge->net_ops.config.frontend_data);
+	}
+    }
+
     return bridge->net_ops.recv(pkt, 
 				size, 
 				bridge->net_ops.config.frontend_data);
 }
 
 
+static int packet_input_batch(struct v3_packet * packet_state, struct v3_net_frame * frames, uint32_t num_frames) {
+    struct nic_bridge_state * bridge = (struct nic_bridge_state *)packet_state->guest_packet_data;
+    uint32_t i = 0;
+    int delivered = 0;
+
+    PrintDebug("NIC Bridge: recv %d pkts\n", num_frames);
+
+    if (bridge->net_ops.recv_batch) {
+	/* Oversized frames need the GSO path, so only hand over batches of wire sized frames */
+	for (i = 0; i < num_frames; i++) {
+	    if (frames[i].len > ETHERNET_PACKET_LEN) {
+		break;
+	    }
+	}
+
+	if (i == num_frames) {
+	    return bridge->net_ops.recv_batch(frames, num_frames, 
+					      bridge->net_ops.config.frontend_data);
+	}
+    }
+
+    for (i = 0; i < num_frames; i++) {
+	if (packet_input(packet_state, frames[i].buf, frames[i].len) >= 0) {
+	    delivered++;
+	}
+    }
+
+    return delivered;
+}
+
+
+static int packet_rx_map(struct v3_packet * packet_state, uint8_t * hdr, uint32_t hdr_len, 
+			 uint32_t len, struct v3_net_rx_map * map) {
+    struct nic_bridge_state * bridge = (struct nic_bridge_state *)packet_state->guest_packet_data;
+
+    /* Oversized frames still go through packet_input() so they can be split up */
+    if (len > ETHERNET_PACKET_LEN) {
+	return -1;
+    }
+
+    return bridge->net_ops.rx_map(hdr, hdr_len, len, map, 
+				  bridge->net_ops.config.frontend_data);
+}
+
+static int packet_rx_complete(struct v3_packet * packet_state, struct v3_net_rx_map * map, uint32_t len) {
+    struct nic_bridge_state * bridge = (struct nic_bridge_state *)packet_state->guest_packet_data;
+
+    PrintDebug("NIC Bridge: recv pkt size: %d (zero copy)\n", len);
+
+    return bridge->net_ops.rx_complete(map, len, 
+				       bridge->net_ops.config.frontend_data);
+}
+
+
 static int nic_bridge_free(struct nic_bridge_state * bridge) {
     /*TODO: detach from front device */
     
@@ -84,6 +158,7 @@ static int nic_bridge_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     struct nic_bridge_state * bridge = NULL;
     char * dev_id = v3_cfg_val(cfg, "ID");
     char * host_nic;
+    char * zero_copy;
     
     v3_cfg_tree_t * frontend_cfg = v3_cfg_subtree(cfg, "frontend");
     
@@ -92,6 +167,7 @@ static int nic_bridge_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     if(host_nic == NULL) {
 	host_nic = "eth0";
     }
+    zero_copy = v3_cfg_val(hostnic_cfg, "zerocopy");
     
     bridge = (struct nic_bridge_state *)V3_Malloc(sizeof(struct nic_bridge_state));
 
@@ -111,6 +187,7 @@ static int nic_bridge_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     }
     
     bridge->net_ops.send = bridge_send;
+    bridge->net_ops.send_batch = bridge_send_batch;
     bridge->vm = vm;
     
     if (v3_dev_connect_net(vm, v3_cfg_val(frontend_cfg, "tag"), 
@@ -127,12 +204,22 @@ static int nic_bridge_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     bridge->packet_state = v3_packet_connect(vm, host_nic, 
 					     bridge->net_ops.config.fnt_mac, 
 					     packet_input, 
+					     packet_input_batch,
 					     (void *)bridge);
     
     if(bridge->packet_state == NULL){
 	PrintError("NIC-Bridge: Error to connect to host ethernet device\n");
 	return -1;
     }
+
+    if ((zero_copy) && (strcasecmp(zero_copy, "on") == 0)) {
+	if ((bridge->net_ops.rx_map) && (bridge->net_ops.rx_complete)) {
+	    v3_packet_enable_zero_copy(bridge->packet_state, packet_rx_map, packet_rx_complete);
+	} else {
+	    PrintError("NIC-Bridge: Frontend %s does not support zero copy receive\n", 
+		       v3_cfg_val(frontend_cfg, "tag"));
+	}
+    }
     
     return 0;
 }
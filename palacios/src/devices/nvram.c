@@ -890,8 +890,42 @@ nvram_free(struct nvram_internal * nvram_state)
 
 
 
+static uint64_t 
+nvram_next_event(struct v3_core_info * core, 
+		 uint64_t              cpu_freq, 
+		 void                * priv_data) 
+{
+    struct nvram_internal * nvram_state = (struct nvram_internal *)priv_data;
+    struct rtc_stata      * stata       = (struct rtc_stata *)&((nvram_state->mem_state[NVRAM_REG_STAT_A]));
+    struct rtc_statb      * statb       = (struct rtc_statb *)&((nvram_state->mem_state[NVRAM_REG_STAT_B]));
+    uint64_t                next_us     = V3_TIMER_NO_EVENT;
+
+    // Update and alarm interrupts are raised as the seconds roll over
+    if ((statb->ui) || (statb->ai)) {
+	next_us = (nvram_state->us < 1000000) ? (1000000 - nvram_state->us) : 0;
+    }
+
+    if (statb->pi) { 
+	uint64_t periodic_period = 1000000 / (65536 / (0x1 << stata->rate));
+	uint64_t periodic_next   = (nvram_state->pus < periodic_period) ? (periodic_period - nvram_state->pus) : 0;
+
+	if (periodic_next < next_us) {
+	    next_us = periodic_next;
+	}
+    }
+
+    if (next_us == V3_TIMER_NO_EVENT) {
+	return next_us;
+    }
+
+    // cpu freq in khz
+    return (next_us * cpu_freq) / 1000;
+}
+
+
 static struct v3_timer_ops timer_ops = {
     .update_timer = nvram_update_timer,
+    .next_event   = nvram_next_event,
 };
 
 
@@ -56,6 +56,24 @@ handle_gen_write(struct v3_core_info * core,
     return length;
 }
 
+// REP OUTSB to the debug port
+static int 
+handle_gen_write_string(struct v3_core_info * core, 
+			uint16_t              port, 
+			void                * src, 
+			uint_t                length, 
+			uint_t                count, 
+			void                * priv_data)
+{
+    uint_t i = 0;
+
+    for (i = 0; i < count; i++) {
+	handle_gen_write(core, port, (uint8_t *)src + (i * length), length, priv_data);
+    }
+
+    return count;
+}
+
 static int 
 handle_hb_write(struct v3_core_info * core, 
 		uint16_t              port, 
@@ -193,7 +211,8 @@ debug_init(struct v3_vm_info * vm,
 	return -1;
     }
 
-    if (v3_dev_hook_io(dev, DEBUG_PORT1,   NULL, &handle_gen_write) == -1) {
+    if ((v3_dev_hook_io(dev, DEBUG_PORT1,   NULL, &handle_gen_write) == -1) || 
+	(v3_dev_hook_io_string(dev, DEBUG_PORT1, NULL, &handle_gen_write_string) == -1)) {
 	PrintError("Error hooking OS debug IO port\n");
 	v3_remove_device(dev);
 	return -1;
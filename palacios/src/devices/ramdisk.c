@@ -37,7 +37,7 @@ static int read(uint8_t * buf, uint64_t lba, uint64_t num_bytes, void * private_
 
     PrintDebug("Reading %d bytes from %p to %p\n", (uint32_t)num_bytes, (uint8_t *)(disk->disk_image + lba), buf);
 
-    if (lba + num_bytes > disk->capacity) {
+    if ((lba > disk->capacity) || (num_bytes > (disk->capacity - lba))) {
 	PrintError("read out of bounds:  lba=%llu (%p), num_bytes=%llu, capacity=%d (%p)\n", 
 		   lba, (void *)(addr_t)lba, num_bytes, disk->capacity, (void *)(addr_t)disk->capacity);
 	return -1;
@@ -54,7 +54,7 @@ static int write(uint8_t * buf, uint64_t lba, uint64_t num_bytes, void * private
 
     PrintDebug("Writing %d bytes from %p to %p\n", (uint32_t)num_bytes,  buf, (uint8_t *)(disk->disk_image + lba));
 
-    if (lba + num_bytes > disk->capacity) {
+    if ((lba > disk->capacity) || (num_bytes > (disk->capacity - lba))) {
 	PrintError("write out of bounds: lba=%llu (%p), num_bytes=%llu, capacity=%d (%p)\n", 
 		   lba, (void *)(addr_t)lba, num_bytes, disk->capacity, (void *)(addr_t)disk->capacity);
 	return -1;
@@ -67,6 +67,30 @@ static int write(uint8_t * buf, uint64_t lba, uint64_t num_bytes, void * private
 }
 
 
+static int flush(void * private_data) {
+    // Nothing is cached
+    return 0;
+}
+
+
+/* Discarded blocks are zeroed, so reads of them stay deterministic */
+static int write_zeroes(uint64_t lba, uint64_t num_bytes, void * private_data) {
+    struct disk_state * disk = (struct disk_state *)private_data;
+
+    PrintDebug("Zeroing %d bytes at %p\n", (uint32_t)num_bytes, (uint8_t *)(disk->disk_image + lba));
+
+    if ((lba > disk->capacity) || (num_bytes > (disk->capacity - lba))) {
+	PrintError("zero out of bounds: lba=%llu (%p), num_bytes=%llu, capacity=%d (%p)\n", 
+		   lba, (void *)(addr_t)lba, num_bytes, disk->capacity, (void *)(addr_t)disk->capacity);
+	return -1;
+    }
+
+    memset((uint8_t *)(disk->disk_image + lba), 0, num_bytes);
+
+    return 0;
+}
+
+
 static uint64_t get_capacity(void * private_data) {
     struct disk_state * disk = (struct disk_state *)private_data;
 
@@ -79,6 +103,9 @@ static uint64_t get_capacity(void * private_data) {
 static struct v3_dev_blk_ops blk_ops = {
     .read = read, 
     .write = write,
+    .flush = flush,
+    .discard = write_zeroes,
+    .write_zeroes = write_zeroes,
     .get_capacity = get_capacity,
 };
 
@@ -906,12 +906,14 @@ static void rtl8139_rxbuf_write(struct rtl8139_state * nic_state,
 
             if (size > wrap){
                 memcpy((void *)(host_rxbuf + regs->cbr), buf, size-wrap);
+                v3_mark_range_dirty(nic_state->vm, guestpa + regs->cbr, size - wrap);
             }
 
             // reset buffer pointer
             regs->cbr = 0;
 
             memcpy((void *)(host_rxbuf + regs->cbr), buf + (size-wrap), wrap);
+            v3_mark_range_dirty(nic_state->vm, guestpa + regs->cbr, wrap);
 
             regs->cbr = wrap;
 
@@ -920,6 +922,7 @@ static void rtl8139_rxbuf_write(struct rtl8139_state * nic_state,
     }
 
     memcpy((void *)(host_rxbuf + regs->cbr), buf, size);
+    v3_mark_range_dirty(nic_state->vm, guestpa + regs->cbr, size);
 
     regs->cbr += size;
 }
@@ -1010,6 +1013,12 @@ static int rx_one_pkt(struct rtl8139_state * nic_state,
             return -1;
         }
 
+        /* Missed, until the memory thread has backed the buffer */
+        if (v3_try_populate_gpa_range(nic_state->vm, regs->rbstart, rxbufsize) == -1) {
+            ++ regs->mpc;
+            return -1;
+        }
+
         header |= Rx_OK;
         header |= ((len << 16) & 0xffff0000);
 
@@ -1171,7 +1180,13 @@ static int tx_one_packet(struct rtl8139_state * nic_state, int descriptor){
 
     PrintDebug("RTL8139: sending %d bytes from guest memory at 0x%08x\n", txsize, regs->tsad[descriptor]);
 	
-    v3_gpa_to_hva(&(nic_state->vm->cores[0]), (addr_t)pkt_gpa, &hostva);
+    if ((v3_populate_gpa_range(nic_state->vm, pkt_gpa, txsize) == -1) || 
+	(v3_gpa_to_hva(&(nic_state->vm->cores[0]), (addr_t)pkt_gpa, &hostva) == -1)) {
+	PrintError("RTL8139: could not translate descriptor %d buffer (gpa=0x%p)\n", descriptor, (void *)pkt_gpa);
+	nic_state->statistic.tx_dropped ++;
+	return -1;
+    }
+
     pkt = (uchar_t *)hostva;
 
 #ifdef V3_CONFIG_DEBUG_RTL8139
@@ -1310,6 +1325,9 @@ static int rtl8139_mmio_write(struct v3_core_info * core,
 		
 	case RTL8139_RBSTART:
 	    nic_state->regs.rbstart = val;
+
+	    // Frames are received where we cannot sleep, so back the largest buffer (and wrap slack) now
+	    v3_populate_gpa_range(core->vm_info, val, (64 * 1024) + 16 + 1536);
 	    break;
 	case RTL8139_ERBCR:
 	    nic_state->regs.erbcr = val & 0xffff;
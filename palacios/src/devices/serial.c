@@ -498,6 +498,42 @@ static int write_data_port(struct v3_core_info * core, uint16_t port,
 
 
 
+/* REP OUTSB to the data port, the backend gets the whole string in one call */
+static int write_data_port_string(struct v3_core_info * core, uint16_t port, 
+				  void * src, uint_t length, uint_t count, void * priv_data) {
+    struct serial_state * state = priv_data;
+    uint8_t * buf = (uint8_t *)src;
+    struct serial_port * com_port = NULL;
+    uint_t i = 0;
+
+    PrintDebug("String write to Data Port 0x%x (cnt=%d)\n", port, count);
+
+    // Let the single byte path sort out anything unusual
+    if (length != 1) {
+	return 0;
+    }
+
+    com_port = get_com_from_port(state, port);
+
+    if ((com_port == NULL) || (com_port->lcr.dlab == 1)) {
+	return 0;
+    }
+
+    if (com_port->ops) {
+	com_port->ops->output(buf, count, com_port->backend_data);
+    } else {
+	for (i = 0; i < count; i++) {
+	    queue_data(core->vm_info, com_port, &(com_port->tx_buffer), buf[i]);
+	}
+
+	updateIRQ(core->vm_info, com_port);
+    }
+
+    return count;
+}
+
+
+
 static int read_data_port(struct v3_core_info * core, uint16_t port, 
 			  void * dst, uint_t length, void * priv_data) {
     struct serial_state * state = priv_data;
@@ -982,6 +1018,7 @@ static int serial_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     PrintDebug("Serial device attached\n");
 
     ret |= v3_dev_hook_io(dev, COM1_DATA_PORT, &read_data_port, &write_data_port);
+    ret |= v3_dev_hook_io_string(dev, COM1_DATA_PORT, NULL, &write_data_port_string);
     ret |= v3_dev_hook_io(dev, COM1_IRQ_ENABLE_PORT, &read_ctrl_port, &write_ctrl_port);
     ret |= v3_dev_hook_io(dev, COM1_FIFO_CTRL_PORT, &read_ctrl_port, &write_ctrl_port);
     ret |= v3_dev_hook_io(dev, COM1_LINE_CTRL_PORT, &read_ctrl_port, &write_ctrl_port);
@@ -991,6 +1028,7 @@ static int serial_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     ret |= v3_dev_hook_io(dev, COM1_SCRATCH_PORT, &read_ctrl_port, &write_ctrl_port);
 
     ret |= v3_dev_hook_io(dev, COM2_DATA_PORT, &read_data_port, &write_data_port);
+    ret |= v3_dev_hook_io_string(dev, COM2_DATA_PORT, NULL, &write_data_port_string);
     ret |= v3_dev_hook_io(dev, COM2_IRQ_ENABLE_PORT, &read_ctrl_port, &write_ctrl_port);
     ret |= v3_dev_hook_io(dev, COM2_FIFO_CTRL_PORT, &read_ctrl_port, &write_ctrl_port);
     ret |= v3_dev_hook_io(dev, COM2_LINE_CTRL_PORT, &read_ctrl_port, &write_ctrl_port);
@@ -1000,6 +1038,7 @@ static int serial_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     ret |= v3_dev_hook_io(dev, COM2_SCRATCH_PORT, &read_ctrl_port, &write_ctrl_port);
 
     ret |= v3_dev_hook_io(dev, COM3_DATA_PORT, &read_data_port, &write_data_port);
+    ret |= v3_dev_hook_io_string(dev, COM3_DATA_PORT, NULL, &write_data_port_string);
     ret |= v3_dev_hook_io(dev, COM3_IRQ_ENABLE_PORT, &read_ctrl_port, &write_ctrl_port);
     ret |= v3_dev_hook_io(dev, COM3_FIFO_CTRL_PORT, &read_ctrl_port, &write_ctrl_port);
     ret |= v3_dev_hook_io(dev, COM3_LINE_CTRL_PORT, &read_ctrl_port, &write_ctrl_port);
@@ -1009,6 +1048,7 @@ static int serial_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     ret |= v3_dev_hook_io(dev, COM3_SCRATCH_PORT, &read_ctrl_port, &write_ctrl_port);
 
     ret |= v3_dev_hook_io(dev, COM4_DATA_PORT, &read_data_port, &write_data_port);
+    ret |= v3_dev_hook_io_string(dev, COM4_DATA_PORT, NULL, &write_data_port_string);
     ret |= v3_dev_hook_io(dev, COM4_IRQ_ENABLE_PORT, &read_ctrl_port, &write_ctrl_port);
     ret |= v3_dev_hook_io(dev, COM4_FIFO_CTRL_PORT, &read_ctrl_port, &write_ctrl_port);
     ret |= v3_dev_hook_io(dev, COM4_LINE_CTRL_PORT, &read_ctrl_port, &write_ctrl_port);
@@ -44,7 +44,7 @@ static int blk_read(uint8_t * buf, uint64_t lba, uint64_t num_bytes, void * priv
 
     //    PrintDebug("TmpDisk Reading %d bytes to %p (lba=%p)\n", (uint32_t)num_bytes, buf, (void *)(addr_t)lba);
 
-    if (lba + num_bytes > blk->capacity) {
+    if ((lba > blk->capacity) || (num_bytes > (blk->capacity - lba))) {
 	PrintError("TMPDISK Read past end of disk\n");
 	return -1;
     }
@@ -62,7 +62,7 @@ static int blk_write(uint8_t * buf,  uint64_t lba, uint64_t num_bytes, void * pr
 
     //    PrintDebug("TmpDisk Writing %d bytes to %p (lba=%p)\n", (uint32_t)num_bytes, buf, (void *)(addr_t)lba);
 
-    if (lba + num_bytes > blk->capacity) {
+    if ((lba > blk->capacity) || (num_bytes > (blk->capacity - lba))) {
 	PrintError("TMPDISK Write past end of disk\n");
 	return -1;
     }
@@ -73,6 +73,27 @@ static int blk_write(uint8_t * buf,  uint64_t lba, uint64_t num_bytes, void * pr
 }
 
 
+static int blk_flush(void * private_data) {
+    // Nothing is cached
+    return 0;
+}
+
+
+/* Discarded blocks are zeroed, so reads of them stay deterministic */
+static int blk_write_zeroes(uint64_t lba, uint64_t num_bytes, void * private_data) {
+    struct blk_state * blk = (struct blk_state *)private_data;
+
+    if ((lba > blk->capacity) || (num_bytes > (blk->capacity - lba))) {
+	PrintError("TMPDISK Zero past end of disk\n");
+	return -1;
+    }
+
+    memset(blk->blk_space + lba, 0, num_bytes);
+
+    return 0;
+}
+
+
 static int blk_free(struct blk_state * blk) {
     V3_FreePages((void *)blk->blk_base_addr, blk->capacity / 4096);
 
@@ -84,6 +105,9 @@ static int blk_free(struct blk_state * blk) {
 static struct v3_dev_blk_ops blk_ops = {
     .read = blk_read, 
     .write = blk_write, 
+    .flush = blk_flush,
+    .discard = blk_write_zeroes,
+    .write_zeroes = blk_write_zeroes,
     .get_capacity = blk_get_capacity,
 };
 
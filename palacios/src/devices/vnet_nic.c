@@ -62,6 +62,35 @@ static int vnet_nic_send(uint8_t * buf, uint32_t len,
 }
 
 
+/* called by frontend, send a batch of pkts to VNET */
+static int vnet_nic_send_batch(struct v3_net_frame * frames, uint32_t num_frames, 
+			       void * private_data) {
+    struct vnet_nic_state * vnetnic = (struct vnet_nic_state *)private_data;
+    struct v3_vnet_pkt pkts[V3_NET_MAX_BATCH];
+    uint32_t i = 0;
+
+    if (num_frames > V3_NET_MAX_BATCH) {
+	num_frames = V3_NET_MAX_BATCH;
+    }
+
+    for (i = 0; i < num_frames; i++) {
+	pkts[i].size = frames[i].len;
+	pkts[i].src_type = LINK_INTERFACE;
+	pkts[i].src_id = vnetnic->vnet_dev_id;
+	memcpy(pkts[i].header, frames[i].buf, ETHERNET_HEADER_LEN);
+	pkts[i].data = frames[i].buf;
+    }
+
+    V3_Net_Print(2, "VNET-NIC: send %d pkts (src_id: %d)\n", num_frames, vnetnic->vnet_dev_id);
+
+    if (v3_vnet_send_pkts(pkts, num_frames, NULL) == -1) {
+	return -1;
+    }
+
+    return num_frames;
+}
+
+
 /* send pkt to frontend device */
 static int fnt_input(struct v3_vm_info * info, 
 			struct v3_vnet_pkt * pkt, 
@@ -76,6 +105,48 @@ static int fnt_input(struct v3_vm_info * info,
 }
 
 
+/* send a batch of pkts to frontend device */
+static int fnt_input_batch(struct v3_vm_info * info, 
+			   struct v3_vnet_pkt ** pkts, 
+			   uint32_t num_pkts, 
+			   void * private_data){
+    struct vnet_nic_state *vnetnic = (struct vnet_nic_state *)private_data;
+    struct v3_net_frame frames[VNET_MAX_BATCH];
+    uint32_t i = 0;
+    int sent = 0;
+
+    if (vnetnic->net_ops.recv_batch == NULL) {
+	for (i = 0; i < num_pkts; i++) {
+	    if (fnt_input(info, pkts[i], private_data) >= 0) {
+		sent++;
+	    }
+	}
+
+	return sent;
+    }
+
+    for (i = 0; i < num_pkts; i++) {
+	frames[i].buf = pkts[i]->data;
+	frames[i].len = pkts[i]->size;
+    }
+
+    V3_Net_Print(2, "VNET-NIC: receive %d pkts\n", num_pkts);
+
+    sent = vnetnic->net_ops.recv_batch(frames, num_pkts, 
+				       vnetnic->net_ops.config.frontend_data);
+
+    return sent;
+}
+
+
+/* called by frontend when it has TX frames for the VNET polling thread */
+static int vnet_nic_kick(void * private_data) {
+    struct vnet_nic_state * vnetnic = (struct vnet_nic_state *)private_data;
+
+    return v3_vnet_kick_dev(vnetnic->vnet_dev_id);
+}
+
+
 /* poll pkt from frontend device */
 static int fnt_poll(struct v3_vm_info * info,
 			int quote, void * private_data){
@@ -101,12 +172,14 @@ static struct v3_device_ops dev_ops = {
 static struct v3_vnet_dev_ops vnet_dev_ops = {
     .input = fnt_input,
     .poll = fnt_poll,
+    .input_batch = fnt_input_batch,
 };
 
 
 static int vnet_nic_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     struct vnet_nic_state * vnetnic = NULL;
     char * dev_id = v3_cfg_val(cfg, "ID");
+    char * poll_cpu = v3_cfg_val(cfg, "poll_cpu");
     int vnet_dev_id;
 
     v3_cfg_tree_t * frontend_cfg = v3_cfg_subtree(cfg, "frontend");
@@ -128,6 +201,8 @@ static int vnet_nic_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     }
 
     vnetnic->net_ops.send = vnet_nic_send;
+    vnetnic->net_ops.send_batch = vnet_nic_send_batch;
+    vnetnic->net_ops.kick = vnet_nic_kick;
     vnetnic->vm = vm;
 	
     if (v3_dev_connect_net(vm, v3_cfg_val(frontend_cfg, "tag"), 
@@ -151,6 +226,11 @@ static int vnet_nic_init(struct v3_vm_info * vm, v3_cfg_tree_t * cfg) {
     }
     vnetnic->vnet_dev_id = vnet_dev_id;
 
+    /* Poll this NIC from the VNET thread on a given host core */
+    if ((poll_cpu) && (v3_vnet_set_dev_cpu(vnet_dev_id, atoi(poll_cpu)) == -1)) {
+	PrintError("Vnet-nic device %s could not be polled from host CPU %s\n", dev_id, poll_cpu);
+    }
+
     return 0;
 }
 
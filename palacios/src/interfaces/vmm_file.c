@@ -125,3 +125,55 @@ v3_file_writev(v3_file_t   file,
     
     return file_hooks->writev(file, iov_arr, iov_len, off);
 }
+
+
+int
+v3_file_sync(v3_file_t file)
+{
+    V3_ASSERT(file_hooks);
+
+    if (file_hooks->sync == NULL) {
+	return -1;
+    }
+
+    return file_hooks->sync(file);
+}
+
+
+int
+v3_file_can_sync(void)
+{
+    V3_ASSERT(file_hooks);
+
+    return (file_hooks->sync != NULL);
+}
+
+
+int
+v3_file_discard(v3_file_t   file,
+		loff_t      off,
+		loff_t      len)
+{
+    V3_ASSERT(file_hooks);
+
+    if (file_hooks->discard == NULL) {
+	return -1;
+    }
+
+    return file_hooks->discard(file, off, len);
+}
+
+
+int
+v3_file_zero(v3_file_t   file,
+	     loff_t      off,
+	     loff_t      len)
+{
+    V3_ASSERT(file_hooks);
+
+    if (file_hooks->zero == NULL) {
+	return -1;
+    }
+
+    return file_hooks->zero(file, off, len);
+}
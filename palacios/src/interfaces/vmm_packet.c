@@ -35,6 +35,7 @@ struct v3_packet * v3_packet_connect(struct v3_vm_info * vm,
 				     const char * host_nic, 
 				     const char * vm_mac,
 				     int (*input)(struct v3_packet * packet, uint8_t * buf, uint32_t len),
+				     int (*input_batch)(struct v3_packet * packet, struct v3_net_frame * frames, uint32_t num_frames),
 				     void * guest_packet_data) {
     struct v3_packet * packet = NULL;
 
@@ -48,8 +49,11 @@ struct v3_packet * v3_packet_connect(struct v3_vm_info * vm,
 	return NULL;
     }
 
+    memset(packet, 0, sizeof(struct v3_packet));
+
     memcpy(packet->dev_mac, vm_mac, ETH_ALEN);
     packet->input = input;
+    packet->input_batch = input_batch;
     packet->guest_packet_data = guest_packet_data;
     if(packet_hooks->connect(packet, host_nic, vm->host_priv_data) != 0){
 	V3_Free(packet);
@@ -66,6 +70,37 @@ int v3_packet_send(struct v3_packet * packet, uint8_t * buf, uint32_t len) {
     return packet_hooks->send(packet, buf, len);
 }
 
+int v3_packet_send_batch(struct v3_packet * packet, struct v3_net_frame * frames, uint32_t num_frames) {
+    uint32_t i = 0;
+    int sent = 0;
+
+    V3_ASSERT(packet_hooks != NULL);
+    V3_ASSERT(packet_hooks->send != NULL);
+
+    if (packet_hooks->send_batch) {
+	return packet_hooks->send_batch(packet, frames, num_frames);
+    }
+
+    for (i = 0; i < num_frames; i++) {
+	if (packet_hooks->send(packet, frames[i].buf, frames[i].len) >= 0) {
+	    sent++;
+	}
+    }
+
+    return sent;
+}
+
+/* The receive path may already be running, so rx_complete has to be in place before rx_map */
+void v3_packet_enable_zero_copy(struct v3_packet * packet, 
+				int (*rx_map)(struct v3_packet * packet, uint8_t * hdr, uint32_t hdr_len, 
+					      uint32_t len, struct v3_net_rx_map * map),
+				int (*rx_complete)(struct v3_packet * packet, struct v3_net_rx_map * map, 
+						   uint32_t len)) {
+    packet->rx_complete = rx_complete;
+    __asm__ __volatile__ ("" : : : "memory");
+    packet->rx_map = rx_map;
+}
+
 void v3_packet_close(struct v3_packet * packet) {
     V3_ASSERT(packet_hooks != NULL);
     V3_ASSERT(packet_hooks->close != NULL);
@@ -64,6 +64,9 @@ uint32_t v3_last_exit;
 // This is a global pointer to the host's VMCB
 static addr_t host_vmcbs[V3_CONFIG_MAX_CPUS] = { [0 ... V3_CONFIG_MAX_CPUS - 1] = 0};
 
+// Set if the CPUs can flush a single ASID (TLB_CONTROL = 3)
+static int svm_flush_by_asid = 0;
+
 
 
 extern void v3_stgi();
@@ -267,8 +270,8 @@ Init_VMCB_BIOS(vmcb_t              * vmcb,
 	
 	/* JRL: This is a performance killer, and a simplistic solution */
 	/* We need to fix this */
-	ctrl_area->TLB_CONTROL = 1;
-	ctrl_area->guest_ASID  = 1;
+	/* The shadow page tables are not tracked, so the TLB is flushed on every entry (see v3_svm_enter) */
+	ctrl_area->TLB_CONTROL = SVM_TLB_FLUSH_ALL;
 	
 	
 	if (v3_init_passthrough_pts(core) == -1) {
@@ -300,9 +303,8 @@ Init_VMCB_BIOS(vmcb_t              * vmcb,
 
 
     } else if (core->shdw_pg_mode == NESTED_PAGING) {
-	// Flush the TLB on entries/exits
-	ctrl_area->TLB_CONTROL    = 1;
-	ctrl_area->guest_ASID     = 1;
+	// The ASID and TLB flushes are handled on each entry (see v3_svm_enter)
+	ctrl_area->TLB_CONTROL    = SVM_TLB_FLUSH_ALL;
 
 	// Enable Nested Paging
 	ctrl_area->NP_ENABLE      = 1;
@@ -310,7 +312,7 @@ Init_VMCB_BIOS(vmcb_t              * vmcb,
 	PrintDebug("NP_Enable at 0x%p\n", (void *)&(ctrl_area->NP_ENABLE));
 
 	// Set the Nested Page Table pointer
-	if (v3_init_passthrough_pts(core) == -1) {
+	if (v3_init_nested_pt_core(core) == -1) {
 	    PrintError("Could not initialize Nested page tables\n");
 	    return ;
 	}
@@ -681,6 +683,28 @@ v3_svm_enter(struct v3_core_info * core)
     // disable global interrupts for vm state transition
     v3_clgi();
 
+    // Pick up this CPU's ASID for the core, and only flush what changed since the last entry
+    {
+	int flush_all = 0;
+	int flush_map = __sync_lock_test_and_set(&(core->flush_direct_map), 0);
+
+	v3_update_asid(core, &flush_all);
+	guest_ctrl->guest_ASID = core->asid_state.asid;
+
+	if ((flush_all) || (core->shdw_pg_mode != NESTED_PAGING)) {
+	    guest_ctrl->TLB_CONTROL = SVM_TLB_FLUSH_ALL;
+	} else if (flush_map) {
+	    guest_ctrl->TLB_CONTROL = (svm_flush_by_asid) ? SVM_TLB_FLUSH_GUEST : SVM_TLB_FLUSH_ALL;
+	} else {
+	    guest_ctrl->TLB_CONTROL = SVM_TLB_FLUSH_NOTHING;
+	}
+    }
+
+    // The core may have moved from the shared nested page table to a private one
+    if (core->shdw_pg_mode == NESTED_PAGING) {
+	guest_ctrl->N_CR3 = core->direct_map_pt;
+    }
+
     // Update FPU state, this must come before the guest state is serialized back to the VMCS
     v3_fpu_on_entry(core);
 
@@ -1079,6 +1103,17 @@ v3_init_svm_cpu(int cpu_id)
     } else {
 	v3_cpu_types[cpu_id] = V3_SVM_CPU;
     }
+
+    {
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+	// EBX holds the number of ASIDs, ASID 0 is the host's
+	v3_cpuid(CPUID_SVM_REV_AND_FEATURE_IDS, &eax, &ebx, &ecx, &edx);
+
+	svm_flush_by_asid = ((edx & CPUID_SVM_REV_AND_FEATURE_IDS_edx_flush_by_asid) != 0);
+
+	v3_init_asid_pool(cpu_id, (ebx > 1) ? (ebx - 1) : 1);
+    }
 }
 
 
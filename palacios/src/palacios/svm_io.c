@@ -147,7 +147,11 @@ v3_handle_svm_io_ins(struct v3_core_info * core,
     }
     
 
-    if (v3_gva_to_hva(core, get_addr_linear(core, core->rip, V3_SEG_CS), &inst_ptr) == -1) {
+    inst_ptr = get_addr_linear(core, core->rip, V3_SEG_CS);
+
+    // The prefix bytes are read from a single page
+    if ((v3_populate_gva_range(core, PAGE_ADDR(inst_ptr), PAGE_SIZE) == -1) || 
+	(v3_gva_to_hva(core, inst_ptr, &inst_ptr) == -1)) {
 	PrintError("Can't access instruction\n");
 	return -1;
     }
@@ -216,38 +220,44 @@ v3_handle_svm_io_ins(struct v3_core_info * core,
 
     PrintDebug("INS size=%d for %d steps\n", read_size, rep_num);
 
+    // One guest page at a time
     while (rep_num > 0) {
+	addr_t dst_gpa;
 	addr_t host_addr;
+	uint_t count = 0;
 
 	dst_addr = get_addr_linear(core, (core->vm_regs.rdi & mask), theseg);
     
 	//	PrintDebug("Writing 0x%p\n", (void *)dst_addr);
 
-	if (v3_gva_to_hva(core, dst_addr, &host_addr) == -1) {
+	// The page may not have been allocated or restored yet
+	if (v3_populate_gva_range(core, PAGE_ADDR(dst_addr), PAGE_SIZE) == -1) {
+	    PrintError("Could not populate ins destination\n");
+	    return -1;
+	}
+
+	if ((v3_gva_to_gpa(core, dst_addr, &dst_gpa) == -1) || 
+	    (v3_gpa_to_hva(core, dst_gpa, &host_addr) == -1)) {
 	    // either page fault or gpf...
 	    PrintError("Could not convert Guest VA to host VA\n");
 	    return -1;
 	}
 
-	if (hook == NULL) {
-	    PrintDebug("INS operation on unhooked IO port 0x%x - returning zeros\n", io_info->port);
-	    memset((uint8_t *)host_addr, 0, read_size);
-	    
-	} else {
-	    if (hook->read(core, io_info->port, (uint8_t *)host_addr, read_size, hook->priv_data) != read_size) {
-		// not sure how we handle errors.....
-		PrintError("Read Failure for ins on port 0x%x\n", io_info->port);
-		return -1;
-	    }
+	count = v3_io_string_count(dst_addr, core->vm_regs.rdi, mask, read_size, rep_num, direction);
+
+	if (v3_io_read_string(core, hook, io_info->port, (uint8_t *)host_addr, dst_gpa, read_size, count, direction) == -1) {
+	    // not sure how we handle errors.....
+	    PrintError("Read Failure for ins on port 0x%x\n", io_info->port);
+	    return -1;
 	}
     
-	core->vm_regs.rdi += (read_size * direction);
+	core->vm_regs.rdi += ((int)(read_size * count) * direction);
 
 	if (io_info->rep) {
-	    core->vm_regs.rcx--;
+	    core->vm_regs.rcx -= count;
 	}
 
-	rep_num--;
+	rep_num -= count;
     }
 
     return 0;
@@ -349,7 +359,11 @@ v3_handle_svm_io_outs(struct v3_core_info * core,
   
 
 
-    if (v3_gva_to_hva(core, get_addr_linear(core, core->rip, V3_SEG_CS), &inst_ptr) == -1) {
+    inst_ptr = get_addr_linear(core, core->rip, V3_SEG_CS);
+
+    // The prefix bytes are read from a single page
+    if ((v3_populate_gva_range(core, PAGE_ADDR(inst_ptr), PAGE_SIZE) == -1) || 
+	(v3_gva_to_hva(core, inst_ptr, &inst_ptr) == -1)) {
 	PrintError("Can't access instruction\n");
 	return -1;
     }
@@ -383,34 +397,40 @@ v3_handle_svm_io_outs(struct v3_core_info * core,
 
     PrintDebug("OUTS size=%d for %d steps\n", write_size, rep_num);
 
+    // One guest page at a time
     while (rep_num > 0) {
 	addr_t host_addr = 0;
+	uint_t count     = 0;
 
 	dst_addr = get_addr_linear(core, (core->vm_regs.rsi & mask), theseg);
     
+	// The page may not have been allocated or restored yet
+	if (v3_populate_gva_range(core, PAGE_ADDR(dst_addr), PAGE_SIZE) == -1) {
+	    PrintError("Could not populate outs source\n");
+	    return -1;
+	}
+
 	if (v3_gva_to_hva(core, dst_addr, &host_addr) == -1) {
 	    PrintError("Could not translate outs dest addr, either page fault or gpf...\n");
 	    return -1;
 	}
 
-	if (hook == NULL) {
-	    PrintDebug("OUTS operation on unhooked IO port 0x%x - ignored\n", io_info->port);
-	} else {
-	    if (hook->write(core, io_info->port, (char*)host_addr, write_size, hook->priv_data) != write_size) {
-		// not sure how we handle errors.....
-		PrintError("Write Failure for outs on port 0x%x\n", io_info->port);
-		return -1;
-	    }
+	count = v3_io_string_count(dst_addr, core->vm_regs.rsi, mask, write_size, rep_num, direction);
+
+	if (v3_io_write_string(core, hook, io_info->port, (uint8_t *)host_addr, write_size, count, direction) == -1) {
+	    // not sure how we handle errors.....
+	    PrintError("Write Failure for outs on port 0x%x\n", io_info->port);
+	    return -1;
 	}
 	
 
-	core->vm_regs.rsi += write_size * direction;
+	core->vm_regs.rsi += ((int)(write_size * count) * direction);
 
 	if (io_info->rep) {
-	    core->vm_regs.rcx--;
+	    core->vm_regs.rcx -= count;
 	}
 
-	rep_num--;
+	rep_num -= count;
     }
 
     return 0;
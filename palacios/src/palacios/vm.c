@@ -30,6 +30,7 @@
 #include <palacios/vmm_xed.h>
 #include <palacios/vmm_direct_paging.h>
 #include <palacios/vmm_barrier.h>
+#include <palacios/vmm_halt.h>
 #include <palacios/vmm_debug.h>
 #include <palacios/vmm_dev_mgr.h>
 
@@ -322,6 +323,12 @@ v3_init_vm(struct v3_vm_info * vm)
     v3_init_ext_manager(vm);
 
     v3_init_barrier(vm);
+    v3_init_halt(vm);
+
+    if (v3_init_nested_pts(vm) == -1) {
+	PrintError("Could not initialize nested page table state\n");
+	return -1;
+    }
 
     // Initialize the memory map
     if (v3_init_mem_map(vm) == -1) {
@@ -331,6 +338,11 @@ v3_init_vm(struct v3_vm_info * vm)
 
     v3_init_mem_hooks(vm);
 
+    if (v3_init_decode_cache(vm) == -1) {
+	PrintError("Could not initialize decode cache\n");
+	return -1;
+    }
+
     if (v3_init_shdw_impl(vm) == -1) {
 	PrintError("VM initialization error in shadow implementaion\n");
 	return -1;
@@ -385,14 +397,20 @@ v3_free_vm_internal(struct v3_vm_info * vm)
     v3_remove_hypercall(vm, YIELD_TO_PID_HCALL);
     v3_remove_hypercall(vm, YIELD_TO_CORE_HCALL);
 
+#ifdef V3_CONFIG_CHECKPOINT
+    /* The restore thread must be stopped before guest memory goes away */
+    v3_chkpt_cancel_restore(vm);
+#endif
 
     v3_deinit_dev_mgr(vm);
 
     v3_deinit_time_vm(vm);
 
+    v3_deinit_decode_cache(vm);
     v3_deinit_mem_hooks(vm);
     v3_delete_mem_map(vm);
     v3_deinit_shdw_impl(vm);
+    v3_deinit_nested_pts(vm);
 
     v3_deinit_ext_manager(vm);
     v3_deinit_intr_routers(vm);
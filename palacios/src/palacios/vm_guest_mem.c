@@ -178,6 +178,105 @@ v3_gpa_to_hva(struct v3_core_info * core,
 }
 
 
+static inline void 
+gpa_cache_barrier(void) 
+{
+    __asm__ __volatile__ ("" : : : "memory");
+}
+
+
+/* Finds the largest span around gpa that translates linearly on every core */
+static addr_t 
+gpa_cache_span(struct v3_vm_info * vm, 
+	       addr_t              gpa, 
+	       addr_t            * span_gpa, 
+	       addr_t            * span_hva) 
+{
+    addr_t sizes[2] = {PAGE_SIZE_2MB, PAGE_SIZE_4KB};
+    int i = 0;
+
+    for (i = 0; i < 2; i++) {
+	addr_t                 start = gpa & ~(sizes[i] - 1);
+	struct v3_mem_region * reg   = v3_get_uniform_region(vm, start, start + sizes[i]);
+
+	// Regions with their own translation may not be linear
+	if ((reg == NULL) || (reg->flags.alloced == 0) || (reg->translate)) {
+	    continue;
+	}
+
+	if (v3_hpa_to_hva(reg->host_addr + (start - reg->guest_start), span_hva) == 0) {
+	    *span_gpa = start;
+	    return sizes[i];
+	}
+    }
+
+    return 0;
+}
+
+
+int 
+v3_gpa_to_hva_cached(struct v3_core_info * core, 
+		     struct v3_gpa_cache * cache, 
+		     addr_t                gpa, 
+		     addr_t              * hva) 
+{
+    struct v3_vm_info         * vm      = core->vm_info;
+    struct v3_gpa_cache_entry * entry   = &(cache->entries[(gpa >> 21) % V3_GPA_CACHE_ENTRIES]);
+    uint32_t                    map_gen = vm->mem_map.generation;
+    uint32_t                    seq     = entry->seq;
+    addr_t                      span_gpa = 0;
+    addr_t                      span_hva = 0;
+    addr_t                      size     = 0;
+
+    gpa_cache_barrier();
+
+    if (((seq & 1) == 0) && 
+	(entry->map_gen == map_gen) && 
+	((gpa - entry->gpa) < entry->size)) {
+	addr_t tmp = entry->hva + (gpa - entry->gpa);
+
+	gpa_cache_barrier();
+
+	// The entry was not refilled under us
+	if (entry->seq == seq) {
+	    *hva = tmp;
+	    return 0;
+	}
+    }
+
+    if (v3_gpa_to_hva(core, gpa, hva) == -1) {
+	return -1;
+    }
+
+    size = gpa_cache_span(vm, gpa, &span_gpa, &span_hva);
+
+    if (size == 0) {
+	return 0;
+    }
+
+    // Only one filler at a time, losers just don't cache
+    seq = entry->seq;
+
+    if ((seq & 1) || (!__sync_bool_compare_and_swap(&(entry->seq), seq, seq + 1))) {
+	return 0;
+    }
+
+    gpa_cache_barrier();
+
+    // Tagged with the generation read before the lookup, so a racing map change invalidates it
+    entry->map_gen = map_gen;
+    entry->gpa     = span_gpa;
+    entry->size    = size;
+    entry->hva     = span_hva;
+
+    gpa_cache_barrier();
+
+    entry->seq = seq + 2;
+
+    return 0;
+}
+
+
 int 
 v3_gva_to_gpa(struct v3_core_info * core, 
 	      addr_t                gva, 
@@ -334,6 +433,48 @@ v3_gva_to_hva(struct v3_core_info * core,
 }
 
 
+/* 
+ * Populates the guest memory behind [gva, gva + count), page by page since it need not be contiguous. 
+ *  The guest's page tables are walked through the usual lookups, they are backed already if the guest has used them. 
+ *  This can sleep, so it is only for exit handlers that will access the range later on.
+ */
+int 
+v3_populate_gva_range(struct v3_core_info * core, 
+		      addr_t                gva, 
+		      size_t                count) 
+{
+    addr_t cursor = gva;
+
+    if (core->vm_info->mem_map.lazy_alloc == 0) {
+	return 0;
+    }
+
+    if (core->mem_mode == PHYSICAL_MEM) {
+	return v3_populate_gpa_range(core->vm_info, gva, count);
+    }
+
+    while (count > 0) {
+	uint32_t dist_to_pg_edge = (PAGE_ADDR(cursor) + PAGE_SIZE) - cursor;
+	size_t   bytes_to_pop    = (dist_to_pg_edge > count) ? count : dist_to_pg_edge;
+	addr_t   guest_pa        = 0;
+
+	if (v3_gva_to_gpa(core, cursor, &guest_pa) != 0) {
+	    // Left for the access itself to report
+	    return 0;
+	}
+
+	if (v3_populate_gpa_range(core->vm_info, guest_pa, bytes_to_pop) == -1) {
+	    return -1;
+	}
+
+	count  -= bytes_to_pop;
+	cursor += bytes_to_pop;
+    }
+
+    return 0;
+}
+
+
 /* !! Currently not implemented !! */
 int 
 v3_hva_to_gva(struct v3_core_info * core, 
@@ -457,16 +598,19 @@ v3_write_gva(struct v3_core_info * core,
     while (count > 0) {
 	uint32_t dist_to_pg_edge = (PAGE_ADDR(cursor) + PAGE_SIZE) - cursor;
 	size_t   bytes_to_copy   = (dist_to_pg_edge > count) ? count : dist_to_pg_edge;
+	addr_t   guest_pa        = 0;
 	addr_t   host_addr       = 0;
 
     
-	if (v3_gva_to_hva(core, cursor, &host_addr) != 0) {
+	if ((v3_gva_to_gpa(core, cursor, &guest_pa) != 0) || 
+	    (v3_gpa_to_hva(core, guest_pa, &host_addr) != 0)) {
 	    PrintDebug("Invalid GVA(%p)->HVA lookup\n", (void *)cursor);
 	    return bytes_written;
 	}
     
     
 	memcpy((void *)host_addr, src + bytes_written, bytes_to_copy);
+	v3_mark_range_dirty(core->vm_info, guest_pa, bytes_to_copy);
     
 	bytes_written += bytes_to_copy;
 	count         -= bytes_to_copy;
@@ -502,6 +646,7 @@ v3_write_gpa(struct v3_core_info * core,
 
 
 	memcpy((void *)host_addr, src + bytes_written, bytes_to_copy);
+	v3_mark_range_dirty(core->vm_info, cursor, bytes_to_copy);
 
 	bytes_written += bytes_to_copy;
 	count         -= bytes_to_copy;
@@ -26,6 +26,7 @@
 #include <palacios/vmm_sprintf.h>
 #include <palacios/vmm_extensions.h>
 #include <palacios/vmm_timeout.h>
+#include <palacios/vmm_halt.h>
 #include <palacios/vmm_options.h>
 
 #include <interfaces/vmm_numa.h>
@@ -691,6 +692,13 @@ v3_start_vm(struct v3_vm_info * vm,
     V3_Print("V3 --  Starting VM (%u cores)\n", vm->num_cores);
     V3_Print("CORE 0 RIP=%p\n",                 (void *)(addr_t)(vm->cores[0].rip));
 
+    // Build the nested page tables now, instead of taking an exit for every page
+    if (vm->mem_map.prefault) {
+	if (v3_prefault_nested_pts(vm) == -1) {
+	    PrintError("Could not prefault nested page tables\n");
+	    return -1;
+	}
+    }
 
     op_lock_acquire();
     {
@@ -1243,10 +1251,18 @@ v3_interrupt_cpu(struct v3_vm_info * vm,
 		 int                 vector) 
 {
     extern struct v3_os_hooks * os_hooks;
+    int i = 0;
 
     if ((os_hooks) && (os_hooks)->interrupt_cpu) {
 	(os_hooks)->interrupt_cpu(vm, logical_cpu, vector);
     }
+
+    // A core sleeping in HLT is not running on the CPU to take the interrupt
+    for (i = 0; i < vm->num_cores; i++) {
+	if (vm->cores[i].pcpu_id == logical_cpu) {
+	    v3_wakeup_core(&(vm->cores[i]));
+	}
+    }
 }
 
 
@@ -0,0 +1,80 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#include <palacios/vmm_asid.h>
+#include <palacios/vm.h>
+#include <palacios/vmm.h>
+
+
+/* Only ever touched by the CPU it belongs to, with interrupts disabled */
+struct asid_pool {
+    uint32_t next_asid;
+    uint32_t max_asid;
+    uint64_t generation;
+};
+
+static struct asid_pool asid_pools[V3_CONFIG_MAX_CPUS];
+
+
+void 
+v3_init_asid_pool(int cpu_id, uint32_t max_asid) 
+{
+    struct asid_pool * pool = &(asid_pools[cpu_id]);
+
+    /* Tag 0 belongs to the host. 
+     * Start out exhausted so the first core to run here starts a new generation 
+     *   and flushes whatever an earlier user of the CPU left behind 
+     */
+    pool->max_asid   = max_asid;
+    pool->next_asid  = max_asid + 1;
+    pool->generation = 1;
+
+    PrintDebug("CPU %d: %u TLB tags available\n", cpu_id, max_asid);
+}
+
+
+int 
+v3_update_asid(struct v3_core_info * core, int * flush_all) 
+{
+    struct v3_asid_state * state = &(core->asid_state);
+    uint32_t               cpu   = V3_Get_CPU();
+    struct asid_pool     * pool  = &(asid_pools[cpu]);
+
+    *flush_all = 0;
+
+    if ((state->cpu == cpu) && 
+	(state->generation == pool->generation)) {
+	return 0;
+    }
+
+    if (pool->next_asid > pool->max_asid) {
+	pool->generation++;
+	pool->next_asid = 1;
+	*flush_all = 1;
+    }
+
+    state->asid       = pool->next_asid++;
+    state->cpu        = cpu;
+    state->generation = pool->generation;
+
+    PrintDebug("Core %d assigned TLB tag %u on CPU %u (generation %llu)\n", 
+	       core->vcpu_id, state->asid, cpu, state->generation);
+
+    return 1;
+}
@@ -168,3 +168,27 @@ v3_bitmap_copy(struct v3_bitmap * dst,
     
     return 0;
 }
+
+
+/* Moves the contents of src into dst, leaving src empty */
+int 
+v3_bitmap_drain(struct v3_bitmap * dst, 
+		struct v3_bitmap * src) 
+{
+    int      num_bytes = (src->num_bits / 8) + ((src->num_bits % 8) != 0);
+    uint32_t flags     = 0;
+
+    if (src->num_bits != dst->num_bits) {
+        PrintError("src and dst must be the same size.\n");
+	return -1;    
+    }
+
+    flags = v3_spin_lock_irqsave(&(src->lock));
+    {
+	memcpy(dst->bits, src->bits, num_bytes);
+	memset(src->bits, 0, num_bytes);
+    }
+    v3_spin_unlock_irqrestore(&(src->lock), flags);
+    
+    return 0;
+}
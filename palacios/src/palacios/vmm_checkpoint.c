@@ -51,7 +51,9 @@ struct chkpt_block {
 	uint32_t flags;
 	struct {
 	    uint32_t   zero_copy : 1;
-	    uint32_t   rsvd      : 31;
+	    uint32_t   guest_mem : 1;   /* Block is a span of guest physical memory */
+	    uint32_t   dedup     : 1;   /* Store identical guest pages only once */
+	    uint32_t   rsvd      : 29;
 	} __attribute__((packed));
     } __attribute__((packed));
 
@@ -65,6 +67,8 @@ struct chkpt_block {
 struct chkpt_interface {
     char name[CHKPT_KEY_LEN];
 
+    int    concurrent;   /* save_block/load_block may be called from several threads at once */
+
     void * (*open_chkpt)(struct v3_vm_info * vm, char * url, chkpt_mode_t mode);
     int    (*close_chkpt)(void * store_data);
     
@@ -235,6 +239,44 @@ v3_init_chkpt(struct v3_vm_info * vm)
     chkpt_state->num_blocks  = 0;
     chkpt_state->block_size  = 0;
 
+    chkpt_state->num_xfer_threads = 0;
+    chkpt_state->dedup_pages      = 0;
+    chkpt_state->lazy_restore     = 0;
+    chkpt_state->restore          = NULL;
+
+    {
+	v3_cfg_tree_t * chkpt_cfg = v3_cfg_subtree(vm->cfg_data->cfg, "checkpoint");
+	char          * cpus_str  = v3_cfg_val(chkpt_cfg, "xfer_cpus");
+	char          * dedup_str = v3_cfg_val(chkpt_cfg, "dedup");
+	char          * rstr_str  = v3_cfg_val(chkpt_cfg, "restore");
+
+	if ((dedup_str) && (strcasecmp(dedup_str, "enable") == 0)) {
+	    chkpt_state->dedup_pages = 1;
+	}
+
+	if ((rstr_str) && (strcasecmp(rstr_str, "lazy") == 0)) {
+	    chkpt_state->lazy_restore = 1;
+	} else if ((rstr_str) && (strcasecmp(rstr_str, "eager") != 0)) {
+	    PrintError("Invalid checkpoint restore mode (%s), using eager restore\n", rstr_str);
+	}
+
+	while ((cpus_str) && (*cpus_str != 0) && 
+	       (chkpt_state->num_xfer_threads < V3_CHKPT_MAX_XFER_THREADS)) {
+	    chkpt_state->xfer_cpus[chkpt_state->num_xfer_threads++] = atoi(cpus_str);
+
+	    cpus_str = strchr(cpus_str, ',');
+
+	    if (cpus_str) {
+		cpus_str++;
+	    }
+	}
+
+	if (chkpt_state->num_xfer_threads > 0) {
+	    V3_Print("Checkpoint memory transfers will use %d worker threads\n", 
+		     chkpt_state->num_xfer_threads);
+	}
+    }
+
     v3_checkpoint_register(vm, "HEADER", header_save, header_load, HEADER_BUF_SIZE, NULL);
 
     return 0;
@@ -248,6 +290,8 @@ v3_deinit_chkpt(struct v3_vm_info * vm)
     struct chkpt_block * block = NULL;
     struct chkpt_block * tmp   = NULL;
 
+    v3_chkpt_cancel_restore(vm);
+
     list_for_each_entry_safe(block, tmp, &(chkpt_state->block_list), node) {
 	list_del(&(block->node));
 	V3_Free(block);
@@ -306,11 +350,12 @@ v3_checkpoint_register(struct v3_vm_info * vm,
     return 0;
 }
 
-int 
-v3_checkpoint_register_nocopy(struct v3_vm_info * vm, 
-			      char              * name, 
-			      uint8_t           * buf,
-			      size_t              size) 
+static int 
+register_nocopy(struct v3_vm_info * vm, 
+		char              * name, 
+		uint8_t           * buf,
+		size_t              size, 
+		int                 guest_mem) 
 {
     struct v3_chkpt_state * chkpt_state = &(vm->chkpt_state);
     struct chkpt_block    * block       = NULL;
@@ -335,6 +380,7 @@ v3_checkpoint_register_nocopy(struct v3_vm_info * vm,
     
     block->block_ptr = buf;
     block->zero_copy = 1;
+    block->guest_mem = guest_mem;
     block->size      = size;
     
     if (v3_htable_insert(chkpt_state->block_table, (addr_t)block->name, (addr_t)block) == 0) {
@@ -349,6 +395,24 @@ v3_checkpoint_register_nocopy(struct v3_vm_info * vm,
     return 0;
 }
 
+int 
+v3_checkpoint_register_nocopy(struct v3_vm_info * vm, 
+			      char              * name, 
+			      uint8_t           * buf,
+			      size_t              size) 
+{
+    return register_nocopy(vm, name, buf, size, 0);
+}
+
+int 
+v3_checkpoint_register_guest_mem(struct v3_vm_info * vm, 
+				 char              * name, 
+				 uint8_t           * buf,
+				 size_t              size) 
+{
+    return register_nocopy(vm, name, buf, size, 1);
+}
+
 
 static int 
 chkpt_close(struct v3_chkpt * chkpt) 
@@ -400,6 +464,262 @@ chkpt_open(struct v3_vm_info * vm,
     return chkpt;
 }
 
+static int 
+xfer_buf(struct v3_chkpt * chkpt, 
+	 chkpt_mode_t      mode,
+	 char            * name, 
+	 void            * buf, 
+	 size_t            size,
+	 int               guest_mem) 
+{
+    struct chkpt_block block;
+
+    memset(&block, 0, sizeof(struct chkpt_block));
+
+    strncpy(block.name, name, CHKPT_KEY_LEN - 1);
+    block.zero_copy = 1;
+    block.block_ptr = buf;
+    block.size      = size;
+
+    if (guest_mem) {
+	block.guest_mem = 1;
+	block.dedup     = chkpt->vm->chkpt_state.dedup_pages;
+    }
+
+    if (mode == SAVE) {
+	return chkpt->interface->save_block(&block, chkpt->store_data);
+    } 
+
+    return chkpt->interface->load_block(&block, chkpt->store_data);
+}
+
+
+
+/* 
+ * Bulk guest memory is moved by a pool of worker threads, one per configured host CPU.
+ *  Each job is a contiguous buffer stored under its own name, 
+ *  and workers pull jobs off the shared list until it is empty.
+ *  Stores that cannot handle concurrent requests are driven from the calling thread.
+ */
+struct xfer_job {
+    char      name[CHKPT_KEY_LEN];
+    uint8_t * buf;
+    size_t    size;
+};
+
+/* 
+ * The pool is shared with the workers, and freed by whoever drops the last reference, 
+ *  so a worker that is still unlocking it never touches freed memory.
+ */
+struct xfer_pool {
+    struct v3_chkpt * chkpt;
+    chkpt_mode_t      mode;
+
+    struct xfer_job * jobs;
+    int               num_jobs;
+
+    v3_spinlock_t     lock;
+    int               refs;
+    int               next_job;
+    int               active_threads;
+    int               error;
+};
+
+
+static void 
+put_xfer_pool(struct xfer_pool * pool) 
+{
+    uint64_t flags = 0;
+    int      last  = 0;
+
+    flags = v3_spin_lock_irqsave(&(pool->lock));
+    last  = (--pool->refs == 0);
+    v3_spin_unlock_irqrestore(&(pool->lock), flags);
+
+    if (last) {
+	v3_spinlock_deinit(&(pool->lock));
+	V3_Free(pool);
+    }
+}
+
+
+static int 
+xfer_worker(void * arg) 
+{
+    struct xfer_pool * pool  = arg;
+    uint64_t           flags = 0;
+
+    while (1) {
+	struct xfer_job * job = NULL;
+
+	flags = v3_spin_lock_irqsave(&(pool->lock));
+	{
+	    if ((pool->next_job < pool->num_jobs) && (pool->error == 0)) {
+		job = &(pool->jobs[pool->next_job++]);
+	    }
+	}
+	v3_spin_unlock_irqrestore(&(pool->lock), flags);
+
+	if (job == NULL) {
+	    break;
+	}
+
+	if (xfer_buf(pool->chkpt, pool->mode, job->name, job->buf, job->size, 1) == -1) {
+	    PrintError("Error transferring (%s)\n", job->name);
+
+	    flags = v3_spin_lock_irqsave(&(pool->lock));
+	    pool->error = 1;
+	    v3_spin_unlock_irqrestore(&(pool->lock), flags);
+	}
+    }
+
+    flags = v3_spin_lock_irqsave(&(pool->lock));
+    pool->active_threads--;
+    v3_spin_unlock_irqrestore(&(pool->lock), flags);
+
+    put_xfer_pool(pool);
+
+    return 0;
+}
+
+
+static int 
+xfer_jobs(struct v3_chkpt * chkpt, 
+	  chkpt_mode_t      mode, 
+	  struct xfer_job * jobs, 
+	  int               num_jobs) 
+{
+    struct v3_chkpt_state * chkpt_state = &(chkpt->vm->chkpt_state);
+    struct xfer_pool      * pool        = NULL;
+    uint64_t flags = 0;
+    int      done  = 0;
+    int      error = 0;
+    int i = 0;
+
+    pool = V3_Malloc(sizeof(struct xfer_pool));
+
+    if (pool == NULL) {
+	PrintError("Could not allocate checkpoint transfer pool\n");
+	return -1;
+    }
+
+    memset(pool, 0, sizeof(struct xfer_pool));
+
+    pool->chkpt    = chkpt;
+    pool->mode     = mode;
+    pool->jobs     = jobs;
+    pool->num_jobs = num_jobs;
+    pool->refs     = 1;       /* Ours */
+
+    v3_spinlock_init(&(pool->lock));
+
+    if ((chkpt->interface->concurrent) && (num_jobs > 1)) {
+	for (i = 0; i < chkpt_state->num_xfer_threads; i++) {
+	    void * thread = NULL;
+
+	    flags = v3_spin_lock_irqsave(&(pool->lock));
+	    pool->active_threads++;
+	    pool->refs++;
+	    v3_spin_unlock_irqrestore(&(pool->lock), flags);
+
+	    thread = V3_CREATE_THREAD_ON_CPU(chkpt_state->xfer_cpus[i], xfer_worker, 
+					     pool, "palacios-chkpt-xfer");
+
+	    if (thread == NULL) {
+		PrintError("Could not start checkpoint transfer thread on CPU %d\n", 
+			   chkpt_state->xfer_cpus[i]);
+
+		flags = v3_spin_lock_irqsave(&(pool->lock));
+		pool->active_threads--;
+		pool->refs--;
+		v3_spin_unlock_irqrestore(&(pool->lock), flags);
+		continue;
+	    }
+
+	    V3_START_THREAD(thread);
+	}
+    }
+
+    flags = v3_spin_lock_irqsave(&(pool->lock));
+
+    if (pool->active_threads == 0) {
+	// No workers, do it ourselves (the worker drops the reference it is given)
+	pool->active_threads = 1;
+	pool->refs++;
+	v3_spin_unlock_irqrestore(&(pool->lock), flags);
+
+	xfer_worker(pool);
+    } else {
+	v3_spin_unlock_irqrestore(&(pool->lock), flags);
+    }
+
+    while (!done) {
+	flags = v3_spin_lock_irqsave(&(pool->lock));
+	done  = (pool->active_threads == 0);
+	error = pool->error;
+	v3_spin_unlock_irqrestore(&(pool->lock), flags);
+
+	if (!done) {
+	    V3_Yield();
+	}
+    }
+
+    put_xfer_pool(pool);
+
+    return (error) ? -1 : 0;
+}
+
+
+/* Moves every guest memory block through the transfer pool */
+static int 
+xfer_guest_mem(struct v3_vm_info * vm, 
+	       struct v3_chkpt   * chkpt, 
+	       chkpt_mode_t        mode) 
+{
+    struct v3_chkpt_state * chkpt_state = &(vm->chkpt_state);
+    struct chkpt_block    * block       = NULL;
+    struct xfer_job       * jobs        = NULL;
+    int num_jobs = 0;
+    int ret      = 0;
+
+    list_for_each_entry(block, &(chkpt_state->block_list), node) {
+	num_jobs += block->guest_mem;
+    }
+
+    if (num_jobs == 0) {
+	return 0;
+    }
+
+    jobs = V3_Malloc(sizeof(struct xfer_job) * num_jobs);
+
+    if (jobs == NULL) {
+	PrintError("Could not allocate guest memory transfer list\n");
+	return -1;
+    }
+
+    memset(jobs, 0, sizeof(struct xfer_job) * num_jobs);
+
+    num_jobs = 0;
+
+    list_for_each_entry(block, &(chkpt_state->block_list), node) {
+	if (block->guest_mem == 0) {
+	    continue;
+	}
+
+	strncpy(jobs[num_jobs].name, block->name, CHKPT_KEY_LEN - 1);
+	jobs[num_jobs].buf  = block->block_ptr;
+	jobs[num_jobs].size = block->size;
+	num_jobs++;
+    }
+
+    ret = xfer_jobs(chkpt, mode, jobs, num_jobs);
+
+    V3_Free(jobs);
+
+    return ret;
+}
+
+
 int 
 v3_chkpt_save_vm(struct v3_vm_info * vm, 
 		 char              * store, 
@@ -416,6 +736,13 @@ v3_chkpt_save_vm(struct v3_vm_info * vm,
 	return -1;
     }
 
+    /* Lazily allocated memory blocks only register themselves once they are populated */
+    if (v3_populate_mem_map(vm) == -1) {
+	PrintError("Could not populate guest memory for checkpoint\n");
+	chkpt_close(chkpt);
+	return -1;
+    }
+
     /* If this guest is running we need to block it while the checkpoint occurs */
     if (vm->run_state == VM_RUNNING) {
 	while (v3_raise_barrier(vm, NULL) == -1);
@@ -425,6 +752,10 @@ v3_chkpt_save_vm(struct v3_vm_info * vm,
 	struct chkpt_block * block = NULL;
 
 	list_for_each_entry(block, &(chkpt_state->block_list), node) {
+	    if (block->guest_mem) {
+		continue;
+	    }
+
 	    ret = chkpt->interface->save_block(block, chkpt->store_data);
 
 	    if (ret == -1) {
@@ -434,6 +765,13 @@ v3_chkpt_save_vm(struct v3_vm_info * vm,
 	}
     }
 
+    ret = xfer_guest_mem(vm, chkpt, SAVE);
+
+    if (ret == -1) {
+	PrintError("Error saving guest memory\n");
+	goto out;
+    }
+
  out:
     /* Resume the guest if it was running */
     if (vm->run_state == VM_RUNNING) {
@@ -445,6 +783,211 @@ v3_chkpt_save_vm(struct v3_vm_info * vm,
     return ret;
 }
 
+/* 
+ * Lazy (post-copy) restore
+ *  Only the core and device state is loaded before the VM resumes. 
+ *  Every base memory region is marked unpopulated, and is read from the checkpoint 
+ *  on its first access, while a background thread pulls in the regions nobody has touched.
+ *  The checkpoint stays open until every region has been restored.
+ */
+struct chkpt_restore {
+    struct v3_chkpt * chkpt;
+    char            * url;
+
+    int               stop;
+    int               active;    /* Prefetch thread is running */
+};
+
+
+/* Called with the memory map's populate lock held */
+static int 
+restore_base_region(struct v3_vm_info    * vm, 
+		    struct v3_mem_region * region, 
+		    void                 * priv) 
+{
+    struct chkpt_restore * restore = priv;
+    char name[CHKPT_KEY_LEN] = {[0 ... CHKPT_KEY_LEN - 1] = 0};
+
+    snprintf(name, CHKPT_KEY_LEN, "mem-region-%d", (int)(region - vm->mem_map.base_regions));
+
+    PrintDebug("Restoring %s\n", name);
+
+    return xfer_buf(restore->chkpt, LOAD, name, 
+		    V3_VAddr((void *)region->host_addr), 
+		    region->guest_end - region->guest_start, 1);
+}
+
+
+static int 
+restore_prefetcher(void * arg) 
+{
+    struct v3_vm_info    * vm      = arg;
+    struct v3_mem_map    * map     = &(vm->mem_map);
+    struct chkpt_restore * restore = vm->chkpt_state.restore;
+    int i = 0;
+
+    for (i = 0; i < map->num_base_blocks; i++) {
+	if (restore->stop) {
+	    break;
+	}
+
+	if (map->base_regions[i].flags.alloced == 1) {
+	    continue;
+	}
+
+	if (v3_populate_base_region(vm, map->base_regions[i].guest_start) == -1) {
+	    // Leave the checkpoint open, so the region can still be loaded on demand
+	    PrintError("Could not prefetch memory region %d\n", i);
+	    break;
+	}
+    }
+
+    if (i == map->num_base_blocks) {
+	V3_Print("Lazy restore complete (%d memory regions)\n", map->num_base_blocks);
+
+	v3_clear_mem_populate_fn(vm);
+	chkpt_close(restore->chkpt);
+	restore->chkpt = NULL;
+    }
+
+    restore->active = 0;
+
+    return 0;
+}
+
+
+int 
+v3_chkpt_cancel_restore(struct v3_vm_info * vm) 
+{
+    struct v3_chkpt_state * chkpt_state = &(vm->chkpt_state);
+    struct chkpt_restore  * restore     = chkpt_state->restore;
+
+    if (restore == NULL) {
+	return 0;
+    }
+
+    restore->stop = 1;
+
+    while (restore->active) {
+	V3_Yield();
+    }
+
+    if (restore->chkpt) {
+	v3_clear_mem_populate_fn(vm);
+	chkpt_close(restore->chkpt);
+    }
+
+    chkpt_state->restore = NULL;
+
+    V3_Free(restore->url);
+    V3_Free(restore);
+
+    return 0;
+}
+
+
+static int 
+lazy_load_vm(struct v3_vm_info * vm, 
+	     char              * store, 
+	     char              * url) 
+{
+    struct v3_chkpt_state * chkpt_state = &(vm->chkpt_state);
+    struct chkpt_restore  * restore     = NULL;
+    struct chkpt_block    * block       = NULL;
+    void                  * thread      = NULL;
+    int cpu = 0;
+    int i   = 0;
+
+    /* Guest memory must not be mapped yet, or accesses would never reach the populate path */
+    for (i = 0; i < vm->num_cores; i++) {
+	if (vm->cores[i].num_exits != 0) {
+	    PrintError("Lazy restore is only possible before the VM is launched\n");
+	    return -1;
+	}
+    }
+
+    if ((chkpt_state->restore) && (chkpt_state->restore->active)) {
+	PrintError("A lazy restore is already in progress\n");
+	return -1;
+    }
+
+    v3_chkpt_cancel_restore(vm);
+
+    restore = V3_Malloc(sizeof(struct chkpt_restore));
+
+    if (restore == NULL) {
+	PrintError("Could not allocate lazy restore state\n");
+	return -1;
+    }
+
+    memset(restore, 0, sizeof(struct chkpt_restore));
+
+    /* The store may hold on to the url until it is closed */
+    restore->url = V3_Malloc(strlen(url) + 1);
+
+    if (restore->url == NULL) {
+	PrintError("Could not allocate lazy restore url\n");
+	V3_Free(restore);
+	return -1;
+    }
+
+    strcpy(restore->url, url);
+
+    restore->chkpt = chkpt_open(vm, store, restore->url, LOAD);
+
+    if (restore->chkpt == NULL) {
+	PrintError("Error creating checkpoint store\n");
+	goto err;
+    }
+
+    list_for_each_entry(block, &(chkpt_state->block_list), node) {
+	if (block->guest_mem) {
+	    continue;
+	}
+
+	if (restore->chkpt->interface->load_block(block, restore->chkpt->store_data) == -1) {
+	    PrintError("Error loading block (%s)\n", block->name);
+	    goto err;
+	}
+    }
+
+    if (v3_set_mem_populate_fn(vm, restore_base_region, restore) == -1) {
+	PrintError("Could not defer guest memory restore\n");
+	goto err;
+    }
+
+    chkpt_state->restore = restore;
+
+    cpu = (chkpt_state->num_xfer_threads > 0) ? chkpt_state->xfer_cpus[0] : V3_Get_CPU();
+
+    restore->active = 1;
+
+    thread = V3_CREATE_THREAD_ON_CPU(cpu, restore_prefetcher, vm, "palacios-restore");
+
+    if (thread == NULL) {
+	PrintError("Could not start memory prefetch thread, memory will only be restored on demand\n");
+	restore->active = 0;
+    } else {
+	V3_START_THREAD(thread);
+    }
+
+    V3_Print("Restored VM state, guest memory (%d regions) will be restored lazily\n", 
+	     vm->mem_map.num_base_blocks);
+
+    return 0;
+
+ err:
+    if (restore->chkpt) {
+	chkpt_close(restore->chkpt);
+    }
+
+    V3_Free(restore->url);
+    V3_Free(restore);
+
+    return -1;
+}
+
+
 int 
 v3_chkpt_load_vm(struct v3_vm_info * vm,
 		 char              * store, 
@@ -453,6 +996,16 @@ v3_chkpt_load_vm(struct v3_vm_info * vm,
     struct v3_chkpt_state * chkpt_state = &(vm->chkpt_state);
     struct v3_chkpt       * chkpt       = NULL;
     int ret = 0;
+
+    /* Shadow page table walks read guest memory from lookups that cannot restore it */
+    if ((chkpt_state->lazy_restore) && (vm->cores[0].shdw_pg_mode != NESTED_PAGING)) {
+	V3_Print("Lazy restore requires nested paging, restoring all of guest memory\n");
+    } else if (chkpt_state->lazy_restore) {
+	return lazy_load_vm(vm, store, url);
+    }
+
+    /* A full restore overwrites whatever a previous lazy restore has not gotten to yet */
+    v3_chkpt_cancel_restore(vm);
     
     chkpt = chkpt_open(vm, store, url, LOAD);
 
@@ -461,6 +1014,13 @@ v3_chkpt_load_vm(struct v3_vm_info * vm,
 	return -1;
     }
 
+    /* Lazily allocated memory blocks only register themselves once they are populated */
+    if (v3_populate_mem_map(vm) == -1) {
+	PrintError("Could not populate guest memory for checkpoint\n");
+	chkpt_close(chkpt);
+	return -1;
+    }
+
     /* If this guest is running we need to block it while the checkpoint occurs */
     if (vm->run_state == VM_RUNNING) {
 	while (v3_raise_barrier(vm, NULL) == -1);
@@ -470,15 +1030,26 @@ v3_chkpt_load_vm(struct v3_vm_info * vm,
 	struct chkpt_block * block = NULL;
 
 	list_for_each_entry(block, &(chkpt_state->block_list), node) {
+	    if (block->guest_mem) {
+		continue;
+	    }
+
 	    ret = chkpt->interface->load_block(block, chkpt->store_data);
 
 	    if (ret == -1) {
-		PrintError("Error saving block (%s)\n", block->name);
+		PrintError("Error loading block (%s)\n", block->name);
 		goto out;
 	    }
 	}
     }
 
+    ret = xfer_guest_mem(vm, chkpt, LOAD);
+
+    if (ret == -1) {
+	PrintError("Error loading guest memory\n");
+	goto out;
+    }
+
  out:
     /* Resume the guest if it was running and we didn't just trash the state*/
     if (vm->run_state == VM_RUNNING) {
@@ -526,75 +1097,166 @@ v3_chkpt_load_vm(struct v3_vm_info * vm,
 
 #ifdef V3_CONFIG_LIVE_MIGRATION
 
-struct mem_migration_state {
-    struct v3_vm_info *vm;
-    struct v3_bitmap  modified_pages; 
-};
+/* 
+ * Live migration streams guest memory through the checkpoint store in rounds.
+ * Each round sends a bitmap of the pages it contains ("mig-<round>-bitmap"), 
+ * followed by those pages batched into runs of contiguous pages 
+ * ("mig-<round>-run-<first page index>"), which are spread across the transfer threads.
+ * A round with an empty bitmap ends the memory transfer, after which every 
+ * non-memory checkpoint block is sent under its usual name.
+ */
 
+#define MOD_THRESHOLD      200  // pages below which we declare victory
+#define ITER_THRESHOLD     32   // iters below which we declare victory
+#define MIG_MAX_RUN_PAGES  256  // largest number of pages sent as one block (1MB)
 
 
+/* Transfers every registered block that is not guest memory */
+static int 
+xfer_vm_state(struct v3_vm_info * vm, 
+	      struct v3_chkpt   * chkpt, 
+	      chkpt_mode_t        mode) 
+{
+    struct v3_chkpt_state * chkpt_state = &(vm->chkpt_state);
+    struct chkpt_block    * block       = NULL;
 
-//
-// Returns
-//  negative: error
-//  zero: done with this round
-static int save_inc_memory(struct v3_vm_info * vm, 
-                           struct v3_bitmap * mod_pgs_to_send, 
-                           struct v3_chkpt * chkpt) {
-    int page_size_bytes = 1 << 12; // assuming 4k pages right now
-    void * ctx = NULL;
-    int i = 0; 
-    void * guest_mem_base = NULL;
-    int bitmap_num_bytes = (mod_pgs_to_send->num_bits / 8) 
-                           + ((mod_pgs_to_send->num_bits % 8) > 0);
-
-   
-    guest_mem_base = V3_VAddr((void *)vm->mem_map.base_region.host_addr);
-    
-    PrintDebug("Saving incremental memory.\n");
+    list_for_each_entry(block, &(chkpt_state->block_list), node) {
+	int ret = 0;
 
-    ctx = v3_chkpt_open_ctx(chkpt, NULL,"memory_bitmap_bits");
+	if (block->guest_mem) {
+	    continue;
+	}
 
-    if (!ctx) { 
-	PrintError("Cannot open context for dirty memory bitmap\n");
-	return -1;
+	if (mode == SAVE) {
+	    ret = chkpt->interface->save_block(block, chkpt->store_data);
+	} else {
+	    ret = chkpt->interface->load_block(block, chkpt->store_data);
+	}
+
+	if (ret == -1) {
+	    PrintError("Error transferring block (%s)\n", block->name);
+	    return -1;
+	}
     }
-	
 
-    if (v3_chkpt_save(ctx,
-		      "memory_bitmap_bits",
-		      bitmap_num_bytes,
-		      mod_pgs_to_send->bits) == -1) {
-	PrintError("Unable to write all of the dirty memory bitmap\n");
-	v3_chkpt_close_ctx(ctx);
+    return 0;
+}
+
+
+/* 
+ * Splits the pages marked in a round's bitmap into runs of contiguous pages.
+ *  Runs never cross a base region, so they are contiguous in host memory as well,
+ *  and the receiver derives exactly the same runs from the same bitmap.
+ *  If jobs is NULL the runs are only counted
+ */
+static int 
+build_page_runs(struct v3_vm_info * vm, 
+		struct v3_bitmap  * pages, 
+		int                 iter, 
+		struct xfer_job   * jobs) 
+{
+    int num_runs = 0;
+    int i = 0;
+
+    while (i < pages->num_bits) {
+	struct v3_mem_region * reg = NULL;
+	addr_t gpa       = (addr_t)i << 12;
+	int    run_start = i;
+	int    run_len   = 0;
+
+	if (v3_bitmap_check(pages, i) == 0) {
+	    i++;
+	    continue;
+	}
+
+	reg = v3_get_base_region(vm, gpa);
+
+	if (reg == NULL) {
+	    PrintError("Could not find memory page %d\n", i);
+	    return -1;
+	}
+
+	while ((i < pages->num_bits) && 
+	       (run_len < MIG_MAX_RUN_PAGES) && 
+	       (((addr_t)i << 12) < reg->guest_end) &&
+	       (v3_bitmap_check(pages, i) == 1)) {
+	    run_len++;
+	    i++;
+	}
+
+	if (jobs) {
+	    snprintf(jobs[num_runs].name, CHKPT_KEY_LEN, "mig-%d-run-%d", iter, run_start);
+	    jobs[num_runs].buf  = V3_VAddr((void *)(reg->host_addr + (gpa - reg->guest_start)));
+	    jobs[num_runs].size = run_len * PAGE_SIZE_4KB;
+	}
+
+	num_runs++;
+    }
+
+    return num_runs;
+}
+
+
+static int 
+xfer_page_runs(struct v3_vm_info * vm, 
+	       struct v3_bitmap  * pages, 
+	       struct v3_chkpt   * chkpt, 
+	       chkpt_mode_t        mode,
+	       int                 iter) 
+{
+    struct xfer_job * jobs     = NULL;
+    int               num_runs = 0;
+    int               ret      = 0;
+
+    num_runs = build_page_runs(vm, pages, iter, NULL);
+
+    if (num_runs <= 0) {
+	return num_runs;
+    }
+
+    jobs = V3_Malloc(sizeof(struct xfer_job) * num_runs);
+
+    if (jobs == NULL) {
+	PrintError("Could not allocate page run list (%d runs)\n", num_runs);
 	return -1;
     }
 
-    v3_chkpt_close_ctx(ctx);
+    memset(jobs, 0, sizeof(struct xfer_job) * num_runs);
 
-    PrintDebug("Sent bitmap bits.\n");
+    build_page_runs(vm, pages, iter, jobs);
 
-    // Dirty memory pages are sent in bitmap order
-    for (i = 0; i < mod_pgs_to_send->num_bits; i++) {
-        if (v3_bitmap_check(mod_pgs_to_send, i)) {
-           // PrintDebug("Sending memory page %d.\n",i);
-            ctx = v3_chkpt_open_ctx(chkpt, NULL,"memory_page");
-	    if (!ctx) { 
-		PrintError("Unable to open context to send memory page\n");
-		return -1;
-	    }
-            if (v3_chkpt_save(ctx, 
-			      "memory_page", 
-			      page_size_bytes,
-			      guest_mem_base + (page_size_bytes * i)) == -1) {
-		PrintError("Unable to send a memory page\n");
-		v3_chkpt_close_ctx(ctx);
-		return -1;
-	    }
-	    
-            v3_chkpt_close_ctx(ctx);
-        }
-    } 
+    PrintDebug("Transferring %d page runs (round %d)\n", num_runs, iter);
+
+    ret = xfer_jobs(chkpt, mode, jobs, num_runs);
+
+    V3_Free(jobs);
+
+    return ret;
+}
+
+
+static int 
+save_inc_memory(struct v3_vm_info * vm, 
+		struct v3_bitmap  * mod_pgs_to_send, 
+		struct v3_chkpt   * chkpt, 
+		int                 iter) 
+{
+    char key[CHKPT_KEY_LEN] = {[0 ... CHKPT_KEY_LEN - 1] = 0};
+    int  bitmap_num_bytes   = (mod_pgs_to_send->num_bits / 8) + ((mod_pgs_to_send->num_bits % 8) > 0);
+
+    PrintDebug("Saving incremental memory (round %d).\n", iter);
+
+    snprintf(key, CHKPT_KEY_LEN, "mig-%d-bitmap", iter);
+
+    if (xfer_buf(chkpt, SAVE, key, mod_pgs_to_send->bits, bitmap_num_bytes, 0) == -1) {
+	PrintError("Unable to write all of the dirty memory bitmap\n");
+	return -1;
+    }
+
+    if (xfer_page_runs(vm, mod_pgs_to_send, chkpt, SAVE, iter) == -1) {
+	PrintError("Unable to send dirty memory pages\n");
+	return -1;
+    }
     
     return 0;
 }
@@ -605,260 +1267,222 @@ static int save_inc_memory(struct v3_vm_info * vm,
 //  negative: error
 //  zero: ok, but not done
 //  positive: ok, and also done
-static int load_inc_memory(struct v3_vm_info * vm, 
-                           struct v3_bitmap * mod_pgs,
-                           struct v3_chkpt * chkpt) {
-    int page_size_bytes = 1 << 12; // assuming 4k pages right now
-    void * ctx = NULL;
-    int i = 0; 
-    void * guest_mem_base = NULL;
-    bool empty_bitmap = true;
-    int bitmap_num_bytes = (mod_pgs->num_bits / 8) 
-                           + ((mod_pgs->num_bits % 8) > 0);
-
-
-    guest_mem_base = V3_VAddr((void *)vm->mem_map.base_region.host_addr);
+static int 
+load_inc_memory(struct v3_vm_info * vm, 
+		struct v3_bitmap  * mod_pgs,
+		struct v3_chkpt   * chkpt, 
+		int                 iter) 
+{
+    char key[CHKPT_KEY_LEN] = {[0 ... CHKPT_KEY_LEN - 1] = 0};
+    int  bitmap_num_bytes   = (mod_pgs->num_bits / 8) + ((mod_pgs->num_bits % 8) > 0);
 
-    ctx = v3_chkpt_open_ctx(chkpt, NULL,"memory_bitmap_bits");
+    snprintf(key, CHKPT_KEY_LEN, "mig-%d-bitmap", iter);
 
-    if (!ctx) { 
-	PrintError("Cannot open context to receive memory bitmap\n");
-	return -1;
-    }
-
-    if (v3_chkpt_load(ctx,
-		      "memory_bitmap_bits",
-		      bitmap_num_bytes,
-		      mod_pgs->bits) == -1) {
+    if (xfer_buf(chkpt, LOAD, key, mod_pgs->bits, bitmap_num_bytes, 0) == -1) {
 	PrintError("Did not receive all of memory bitmap\n");
-	v3_chkpt_close_ctx(ctx);
 	return -1;
     }
-    
-    v3_chkpt_close_ctx(ctx);
-
-    // Receive also follows bitmap order
-    for (i = 0; i < mod_pgs->num_bits; i ++) {
-        if (v3_bitmap_check(mod_pgs, i)) {
-            PrintDebug("Loading page %d\n", i);
-            empty_bitmap = false;
-            ctx = v3_chkpt_open_ctx(chkpt, NULL,"memory_page");
-	    if (!ctx) { 
-		PrintError("Cannot open context to receive memory page\n");
-		return -1;
-	    }
-	    
-            if (v3_chkpt_load(ctx, 
-			      "memory_page", 
-			      page_size_bytes,
-			      guest_mem_base + (page_size_bytes * i)) == -1) {
-		PrintError("Did not receive all of memory page\n");
-		v3_chkpt_close_ctx(ctx);
-		return -1;
-	    }
-            v3_chkpt_close_ctx(ctx);
-        }
-    }
-    
-    if (empty_bitmap) {
-        // signal end of receiving pages
-        PrintDebug("Finished receiving pages.\n");
+
+    if (v3_bitmap_count(mod_pgs) == 0) {
+	// signal end of receiving pages
+	PrintDebug("Finished receiving pages.\n");
 	return 1;
-    } else {
-	// need to run again
-	return 0;
     }
 
-}
-
+    if (xfer_page_runs(vm, mod_pgs, chkpt, LOAD, iter) == -1) {
+	PrintError("Did not receive all of the memory pages\n");
+	return -1;
+    }
 
-#define MOD_THRESHOLD   200  // pages below which we declare victory
-#define ITER_THRESHOLD  32   // iters below which we declare victory
+    // need to run again
+    return 0;
+}
 
 
 
-int v3_chkpt_send_vm(struct v3_vm_info * vm, char * store, char * url) {
+int 
+v3_chkpt_send_vm(struct v3_vm_info * vm, 
+		 char              * store, 
+		 char              * url) 
+{
     struct v3_chkpt * chkpt = NULL;
-    int ret = 0;;
-    int iter = 0;
-    bool last_modpage_iteration=false;
-    struct v3_bitmap modified_pages_to_send;
-    uint64_t start_time;
-    uint64_t stop_time;
-    int num_mod_pages=0;
-    struct mem_migration_state *mm_state;
-    int i;
-
-    // Currently will work only for shadow paging
-    for (i=0;i<vm->num_cores;i++) { 
-	if (vm->cores[i].shdw_pg_mode!=SHADOW_PAGING) { 
-	    PrintError("Cannot currently handle nested paging\n");
-	    return -1;
-	}
+    struct v3_bitmap  modified_pages_to_send;
+    uint64_t start_time    = 0;
+    uint64_t stop_time     = 0;
+    int      num_mod_pages = 0;
+    int      last_modpage_iteration = 0;
+    int      iter = 0;
+    int      ret  = 0;
+    int      i    = 0;
+
+    if (vm->run_state != VM_RUNNING) {
+	PrintError("Only running VMs can be migrated\n");
+	return -1;
     }
-    
-    
+
     chkpt = chkpt_open(vm, store, url, SAVE);
     
     if (chkpt == NULL) {
 	PrintError("Error creating checkpoint store\n");
+	return -1;
+    }
+
+    /* Every page is sent, so lazily allocated memory must be backed first */
+    if (v3_populate_mem_map(vm) == -1) {
+	PrintError("Could not populate guest memory for migration\n");
 	chkpt_close(chkpt);
 	return -1;
     }
     
     // In a send, the memory is copied incrementally first,
     // followed by the remainder of the state
-    
-    if (v3_bitmap_init(&modified_pages_to_send,
-		       vm->mem_size>>12 // number of pages in main region
-		       ) == -1) {
-        PrintError("Could not intialize bitmap.\n");
-        return -1;
+    if (v3_bitmap_init(&modified_pages_to_send, vm->mem_size >> 12) == -1) {
+	PrintError("Could not intialize bitmap.\n");
+	chkpt_close(chkpt);
+	return -1;
     }
 
-    // 0. Initialize bitmap to all 1s
-    for (i=0; i < modified_pages_to_send.num_bits; i++) {
-        v3_bitmap_set(&modified_pages_to_send,i);
+    // The first round sends every page
+    for (i = 0; i < modified_pages_to_send.num_bits; i++) {
+	v3_bitmap_set(&modified_pages_to_send, i);
     }
 
-    iter = 0;
     while (!last_modpage_iteration) {
-        PrintDebug("Modified memory page iteration %d\n",i++);
+	PrintDebug("Modified memory page iteration %d\n", iter);
         
-        start_time = v3_get_host_time(&(vm->cores[0].time_state));
+	start_time = v3_get_host_time(&(vm->cores[0].time_state));
         
 	// We will pause the VM for a short while
 	// so that we can collect the set of changed pages
-        if (v3_pause_vm(vm) == -1) {
-            PrintError("Could not pause VM\n");
-            ret = -1;
-            goto out;
-        }
-        
-	if (iter==0) { 
-	    // special case, we already have the pages to send (all of them)
-	    // they are already in modified_pages_to_send
-	} else {
-	    // normally, we are in the middle of a round
-	    // We need to copy from the current tracking bitmap
-	    // to our send bitmap
-	    v3_bitmap_copy(&modified_pages_to_send,&(mm_state->modified_pages));
-	    // and now we need to remove our tracking
-	    stop_page_tracking(mm_state);
+	if (v3_pause_vm(vm) == -1) {
+	    PrintError("Could not pause VM\n");
+	    ret = -1;
+	    goto out;
+	}
+
+	if (iter == 0) { 
+	    // All pages are already marked, so we only need to 
+	    // start logging the writes that happen during the first copy
+	    if (v3_start_dirty_tracking(vm) == -1) {
+		PrintError("Error enabling dirty page tracking.\n");
+		v3_continue_vm(vm);
+		ret = -1;
+		goto out;
+	    }
+	} else if (v3_collect_dirty_pages(vm, &modified_pages_to_send) == -1) {
+	    PrintError("Error collecting dirty pages.\n");
+	    v3_continue_vm(vm);
+	    ret = -1;
+	    goto out;
 	}
 
 	// are we done? (note that we are still paused)
-        num_mod_pages = v3_bitmap_count(&modified_pages_to_send);
-	if (num_mod_pages<MOD_THRESHOLD || iter>ITER_THRESHOLD) {
-	    // we are done, so we will not restart page tracking
-	    // the vm is paused, and so we should be able
-	    // to just send the data
-            PrintDebug("Last modified memory page iteration.\n");
-            last_modpage_iteration = true;
+	num_mod_pages = v3_bitmap_count(&modified_pages_to_send);
+
+	if ((iter > 0) && 
+	    ((num_mod_pages < MOD_THRESHOLD) || (iter > ITER_THRESHOLD))) {
+	    // we are done, so the VM stays paused while we send the last chunk
+	    PrintDebug("Last modified memory page iteration.\n");
+	    last_modpage_iteration = 1;
 	} else {
-	    // we are not done, so we will restart page tracking
-	    // to prepare for a second round of pages
-	    // we will resume the VM as this happens
-	    if (!(mm_state=start_page_tracking(vm))) { 
-		PrintError("Error enabling page tracking.\n");
+	    // we are not done, so the guest runs (and is tracked) while we copy this round
+	    if (v3_continue_vm(vm) == -1) {
+		PrintError("Error resuming the VM\n");
 		ret = -1;
 		goto out;
 	    }
-            if (v3_continue_vm(vm) == -1) {
-                PrintError("Error resuming the VM\n");
-		stop_page_tracking(mm_state);
-                ret = -1;
-                goto out;
-            }
 	    
-            stop_time = v3_get_host_time(&(vm->cores[0].time_state));
-            PrintDebug("num_mod_pages=%d\ndowntime=%llu\n",num_mod_pages,stop_time-start_time);
-        }
-	
+	    stop_time = v3_get_host_time(&(vm->cores[0].time_state));
+	    PrintDebug("num_mod_pages=%d\ndowntime=%llu\n", num_mod_pages, stop_time - start_time);
+	}
 
-	// At this point, we are either paused and about to copy
-	// the last chunk, or we are running, and will copy the last
-	// round in parallel with current execution
-	if (num_mod_pages>0) { 
-	    if (save_inc_memory(vm, &modified_pages_to_send, chkpt) == -1) {
+	if (num_mod_pages > 0) { 
+	    if (save_inc_memory(vm, &modified_pages_to_send, chkpt, iter) == -1) {
 		PrintError("Error sending incremental memory.\n");
 		ret = -1;
 		goto out;
 	    }
-	} // we don't want to copy an empty bitmap here
+	}
 	
 	iter++;
     }        
     
-    if (v3_bitmap_reset(&modified_pages_to_send) == -1) {
-        PrintError("Error reseting bitmap.\n");
-        ret = -1;
-        goto out;
-    }    
-    
     // send bitmap of 0s to signal end of modpages
-    if (save_inc_memory(vm, &modified_pages_to_send, chkpt) == -1) {
-        PrintError("Error sending incremental memory.\n");
-        ret = -1;
-        goto out;
-    }
-    
-    // save the non-memory state
-    if ((ret = v3_save_vm_devices(vm, chkpt)) == -1) {
-	PrintError("Unable to save devices\n");
-	goto out;
-    }
-    
+    v3_bitmap_reset(&modified_pages_to_send);
 
-    if ((ret = save_header(vm, chkpt)) == -1) {
-	PrintError("Unable to save header\n");
+    if (save_inc_memory(vm, &modified_pages_to_send, chkpt, iter) == -1) {
+	PrintError("Error sending incremental memory.\n");
+	ret = -1;
 	goto out;
     }
     
-    for (i = 0; i < vm->num_cores; i++){
-	if ((ret = save_core(&(vm->cores[i]), chkpt)) == -1) {
-	    PrintError("chkpt of core %d failed\n", i);
-	    goto out;
-	}
+    // save the non-memory state
+    if (xfer_vm_state(vm, chkpt, SAVE) == -1) {
+	PrintError("Unable to save VM state\n");
+	ret = -1;
+	goto out;
     }
     
     stop_time = v3_get_host_time(&(vm->cores[0].time_state));
-    PrintDebug("num_mod_pages=%d\ndowntime=%llu\n",num_mod_pages,stop_time-start_time);
+    PrintDebug("num_mod_pages=%d\ndowntime=%llu\n", num_mod_pages, stop_time - start_time);
     PrintDebug("Done sending VM!\n"); 
+
  out:
+    if (vm->mem_map.track_dirty) {
+	int paused = (vm->run_state == VM_PAUSED);
+
+	if ((paused) || (v3_pause_vm(vm) == 0)) {
+	    v3_stop_dirty_tracking(vm);
+
+	    if (!paused) {
+		v3_continue_vm(vm);
+	    }
+	}
+    }
+
+    // A failed migration leaves the guest running here
+    if ((ret == -1) && (vm->run_state == VM_PAUSED)) {
+	v3_continue_vm(vm);
+    }
+
     v3_bitmap_deinit(&modified_pages_to_send);
     chkpt_close(chkpt);
     
     return ret;
-
 }
 
-int v3_chkpt_receive_vm(struct v3_vm_info * vm, char * store, char * url) {
+
+int 
+v3_chkpt_receive_vm(struct v3_vm_info * vm, 
+		    char              * store, 
+		    char              * url) 
+{
     struct v3_chkpt * chkpt = NULL;
-    int i = 0;
-    int ret = 0;
-    struct v3_bitmap mod_pgs;
+    struct v3_bitmap  mod_pgs;
+    int iter = 0;
+    int ret  = 0;
+
+    /* The incoming state replaces whatever a lazy restore was still filling in */
+    v3_chkpt_cancel_restore(vm);
  
-    // Currently will work only for shadow paging
-    for (i=0;i<vm->num_cores;i++) { 
-	if (vm->cores[i].shdw_pg_mode!=SHADOW_PAGING) { 
-	    PrintError("Cannot currently handle nested paging\n");
-	    return -1;
-	}
-    }
-    
     chkpt = chkpt_open(vm, store, url, LOAD);
     
     if (chkpt == NULL) {
 	PrintError("Error creating checkpoint store\n");
+	return -1;
+    }
+
+    /* Incoming pages are written straight into the base regions */
+    if (v3_populate_mem_map(vm) == -1) {
+	PrintError("Could not populate guest memory for migration\n");
 	chkpt_close(chkpt);
 	return -1;
     }
     
-    if (v3_bitmap_init(&mod_pgs,vm->mem_size>>12) == -1) {
+    if (v3_bitmap_init(&mod_pgs, vm->mem_size >> 12) == -1) {
+	PrintError("Could not intialize bitmap.\n");
 	chkpt_close(chkpt);
-        PrintError("Could not intialize bitmap.\n");
-        return -1;
+	return -1;
     }
     
     /* If this guest is running we need to block it while the checkpoint occurs */
@@ -866,51 +1490,40 @@ int v3_chkpt_receive_vm(struct v3_vm_info * vm, char * store, char * url) {
 	while (v3_raise_barrier(vm, NULL) == -1);
     }
     
-    i = 0;
-    while(true) {
-        // 1. Receive copy of bitmap
-        // 2. Receive pages
-        PrintDebug("Memory page iteration %d\n",i++);
-        int retval = load_inc_memory(vm, &mod_pgs, chkpt);
-        if (retval == 1) {
-            // end of receiving memory pages
-            break;        
-        } else if (retval == -1) {
-            PrintError("Error receiving incremental memory.\n");
-            ret = -1;
-            goto out;
+    while (1) {
+	// 1. Receive copy of bitmap
+	// 2. Receive pages
+	int retval = 0;
+
+	PrintDebug("Memory page iteration %d\n", iter);
+
+	retval = load_inc_memory(vm, &mod_pgs, chkpt, iter);
+
+	if (retval == 1) {
+	    // end of receiving memory pages
+	    break;        
+	} else if (retval == -1) {
+	    PrintError("Error receiving incremental memory.\n");
+	    ret = -1;
+	    goto out;
 	}
+
+	iter++;
     }        
     
-    if ((ret = v3_load_vm_devices(vm, chkpt)) == -1) {
-	PrintError("Unable to load devices\n");
-	ret = -1;
-	goto out;
-    }
-    
-    
-    if ((ret = load_header(vm, chkpt)) == -1) {
-	PrintError("Unable to load header\n");
+    if (xfer_vm_state(vm, chkpt, LOAD) == -1) {
+	PrintError("Unable to load VM state\n");
 	ret = -1;
 	goto out;
     }
     
-    //per core cloning
-    for (i = 0; i < vm->num_cores; i++) {
-	if ((ret = load_core(&(vm->cores[i]), chkpt)) == -1) {
-	    PrintError("Error loading core state (core=%d)\n", i);
-	    goto out;
-	}
-    }
-    
  out:
-    if (ret==-1) { 
+    if (ret == -1) { 
 	PrintError("Unable to receive VM\n");
     } else {
 	PrintDebug("Done receving the VM\n");
     }
 	
-	
     /* Resume the guest if it was running and we didn't just trash the state*/
     if (vm->run_state == VM_RUNNING) { 
 	if (ret == -1) {
@@ -176,7 +176,336 @@ register_chkpt_store(debug_store);
 #ifdef V3_CONFIG_FILE
 #include <interfaces/vmm_file.h>
 
-   
+
+
+static int 
+__dir_write(v3_file_t file, uint8_t * buf, uint64_t len, loff_t offset) 
+{
+    uint64_t bytes_written = 0;
+
+    while (bytes_written < len) {
+	ssize_t tmp_bytes = v3_file_write(file, 
+					  buf    + bytes_written, 
+					  len    - bytes_written, 
+					  offset + bytes_written);
+	if (tmp_bytes <= 0) {
+	    return -1;
+	}
+
+	bytes_written += tmp_bytes;
+    }
+
+    return 0;
+}
+
+static int 
+__dir_read(v3_file_t file, uint8_t * buf, uint64_t len, loff_t offset) 
+{
+    uint64_t bytes_read = 0;
+
+    while (bytes_read < len) {
+	ssize_t tmp_bytes = v3_file_read(file, 
+					 buf    + bytes_read, 
+					 len    - bytes_read, 
+					 offset + bytes_read);
+	if (tmp_bytes <= 0) {
+	    return -1;
+	}
+
+	bytes_read += tmp_bytes;
+    }
+
+    return 0;
+}
+
+
+
+/* 
+ * Guest memory blocks are stored one page at a time:
+ *
+ *     struct page_enc_hdr
+ *     uint64_t page_map[num_pages]
+ *     data pages, in page order
+ *
+ * Each page map entry holds the page type in its top 2 bits. 
+ *  Data pages hold their index into the data section, 
+ *  zero pages take no space in the file,
+ *  and duplicate pages (only with dedup enabled) hold the index of 
+ *  the first identical page in the same block.
+ */
+#define PAGE_ENC_MAGIC         0x47503356   /* "V3PG" */
+
+#define PAGE_ENC_DATA          0x0ULL
+#define PAGE_ENC_ZERO          0x1ULL
+#define PAGE_ENC_DUP           0x2ULL
+
+#define PAGE_ENC_ENTRY(type, idx)  (((type) << 62) | (idx))
+#define PAGE_ENC_TYPE(entry)       ((entry) >> 62)
+#define PAGE_ENC_IDX(entry)        ((entry) & ((1ULL << 62) - 1))
+
+struct page_enc_hdr {
+    uint32_t magic;
+    uint32_t page_size;
+    uint64_t num_pages;
+    uint64_t num_data_pages;
+} __attribute__((packed));
+
+
+/* Word-wise scan, bailing out at the first non-zero cache line */
+static inline int 
+__page_is_zero(uint8_t * page) 
+{
+    uint64_t * words = (uint64_t *)page;
+    int i = 0;
+
+    for (i = 0; i < (PAGE_SIZE_4KB / sizeof(uint64_t)); i += 8) {
+	if ((words[i]     | words[i + 1] | words[i + 2] | words[i + 3] | 
+	     words[i + 4] | words[i + 5] | words[i + 6] | words[i + 7]) != 0) {
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+/* 64 bit FNV-1a over the page's words */
+static inline uint64_t
+__page_hash(uint8_t * page) 
+{
+    uint64_t * words = (uint64_t *)page;
+    uint64_t   hash  = 0xcbf29ce484222325ULL;
+    int i = 0;
+
+    for (i = 0; i < (PAGE_SIZE_4KB / sizeof(uint64_t)); i++) {
+	hash ^= words[i];
+	hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint_t 
+__page_hash_fn(addr_t key) 
+{
+    return (uint_t)(key ^ (key >> 32));
+}
+
+static int 
+__page_eq_fn(addr_t key1, addr_t key2) 
+{
+    return (key1 == key2);
+}
+
+
+static int
+dir_save_pages(struct chkpt_block * block, v3_file_t file) 
+{
+    struct page_enc_hdr hdr;
+    struct hashtable  * dedup_table = NULL;
+    uint64_t          * page_map    = NULL;
+    uint64_t            num_pages   = block->size / PAGE_SIZE_4KB;
+    loff_t              data_offset = sizeof(struct page_enc_hdr) + (num_pages * sizeof(uint64_t));
+    uint64_t            i           = 0;
+    int                 ret         = 0;
+
+    memset(&hdr, 0, sizeof(struct page_enc_hdr));
+
+    page_map = V3_Malloc(num_pages * sizeof(uint64_t));
+
+    if (page_map == NULL) {
+	PrintError("Could not allocate page map for (%s)\n", block->name);
+	return -1;
+    }
+
+    if (block->dedup) {
+	dedup_table = v3_create_htable(0, __page_hash_fn, __page_eq_fn);
+
+	if (dedup_table == NULL) {
+	    PrintError("Could not allocate page dedup table for (%s)\n", block->name);
+	    ret = -1;
+	    goto out;
+	}
+    }
+
+    for (i = 0; i < num_pages; i++) {
+	uint8_t * page = block->block_ptr + (i * PAGE_SIZE_4KB);
+
+	if (__page_is_zero(page)) {
+	    page_map[i] = PAGE_ENC_ENTRY(PAGE_ENC_ZERO, 0);
+	    continue;
+	}
+
+	if (dedup_table) {
+	    uint64_t hash = __page_hash(page);
+	    uint64_t ref  = v3_htable_search(dedup_table, (addr_t)hash);   // stored as page index + 1
+
+	    if ((ref != 0) && 
+		(memcmp(block->block_ptr + ((ref - 1) * PAGE_SIZE_4KB), page, PAGE_SIZE_4KB) == 0)) {
+		page_map[i] = PAGE_ENC_ENTRY(PAGE_ENC_DUP, ref - 1);
+		continue;
+	    } 
+
+	    if (ref == 0) {
+		v3_htable_insert(dedup_table, (addr_t)hash, (addr_t)(i + 1));
+	    }
+	}
+
+	page_map[i] = PAGE_ENC_ENTRY(PAGE_ENC_DATA, hdr.num_data_pages);
+	hdr.num_data_pages++;
+    }
+
+    hdr.magic     = PAGE_ENC_MAGIC;
+    hdr.page_size = PAGE_SIZE_4KB;
+    hdr.num_pages = num_pages;
+
+    if ((__dir_write(file, (uint8_t *)&hdr, sizeof(struct page_enc_hdr), 0) == -1) ||
+	(__dir_write(file, (uint8_t *)page_map, num_pages * sizeof(uint64_t), sizeof(struct page_enc_hdr)) == -1)) {
+	PrintError("Could not write page map for (%s)\n", block->name);
+	ret = -1;
+	goto out;
+    }
+
+    /* Write out the data pages, coalescing runs of adjacent ones */
+    i = 0;
+
+    while (i < num_pages) {
+	uint64_t run_start = i;
+
+	if (PAGE_ENC_TYPE(page_map[i]) != PAGE_ENC_DATA) {
+	    i++;
+	    continue;
+	}
+
+	while ((i < num_pages) && (PAGE_ENC_TYPE(page_map[i]) == PAGE_ENC_DATA)) {
+	    i++;
+	}
+
+	if (__dir_write(file, 
+			block->block_ptr + (run_start * PAGE_SIZE_4KB), 
+			(i - run_start) * PAGE_SIZE_4KB,
+			data_offset + (PAGE_ENC_IDX(page_map[run_start]) * PAGE_SIZE_4KB)) == -1) {
+	    PrintError("Could not write pages of (%s)\n", block->name);
+	    ret = -1;
+	    goto out;
+	}
+    }
+
+    PrintDebug("Saved (%s): %llu pages, %llu stored\n", block->name, 
+	       (unsigned long long)num_pages, (unsigned long long)hdr.num_data_pages);
+
+ out:
+    if (dedup_table) {
+	v3_free_htable(dedup_table, 0, 0);
+    }
+
+    V3_Free(page_map);
+
+    return ret;
+}
+
+
+static int
+dir_load_pages(struct chkpt_block * block, v3_file_t file) 
+{
+    struct page_enc_hdr hdr;
+    uint64_t          * page_map    = NULL;
+    uint64_t            num_pages   = block->size / PAGE_SIZE_4KB;
+    loff_t              data_offset = sizeof(struct page_enc_hdr) + (num_pages * sizeof(uint64_t));
+    uint64_t            i           = 0;
+    int                 ret         = 0;
+
+    if (__dir_read(file, (uint8_t *)&hdr, sizeof(struct page_enc_hdr), 0) == -1) {
+	PrintError("Could not read page header of (%s)\n", block->name);
+	return -1;
+    }
+
+    if (hdr.magic != PAGE_ENC_MAGIC) {
+	// Checkpoint predates the page encoding, the block was stored verbatim
+	return __dir_read(file, block->block_ptr, block->size, 0);
+    }
+
+    if ((hdr.page_size != PAGE_SIZE_4KB) || 
+	(hdr.num_pages != num_pages) || 
+	(hdr.num_data_pages > num_pages)) {
+	PrintError("Page encoding of (%s) does not match block (%llu pages)\n", 
+		   block->name, (unsigned long long)num_pages);
+	return -1;
+    }
+
+    page_map = V3_Malloc(num_pages * sizeof(uint64_t));
+
+    if (page_map == NULL) {
+	PrintError("Could not allocate page map for (%s)\n", block->name);
+	return -1;
+    }
+
+    if (__dir_read(file, (uint8_t *)page_map, num_pages * sizeof(uint64_t), sizeof(struct page_enc_hdr)) == -1) {
+	PrintError("Could not read page map of (%s)\n", block->name);
+	ret = -1;
+	goto out;
+    }
+
+    /* Data and zero pages first, so every duplicate's source is in place */
+    i = 0;
+
+    while (i < num_pages) {
+	uint64_t run_start = i;
+
+	if (PAGE_ENC_TYPE(page_map[i]) == PAGE_ENC_ZERO) {
+	    memset(block->block_ptr + (i * PAGE_SIZE_4KB), 0, PAGE_SIZE_4KB);
+	    i++;
+	    continue;
+	} else if (PAGE_ENC_TYPE(page_map[i]) != PAGE_ENC_DATA) {
+	    i++;
+	    continue;
+	}
+
+	while ((i < num_pages) && 
+	       (PAGE_ENC_TYPE(page_map[i]) == PAGE_ENC_DATA) && 
+	       (PAGE_ENC_IDX(page_map[i]) == PAGE_ENC_IDX(page_map[run_start]) + (i - run_start))) {
+	    i++;
+	}
+
+	if (PAGE_ENC_IDX(page_map[i - 1]) >= hdr.num_data_pages) {
+	    PrintError("Corrupt page map in (%s)\n", block->name);
+	    ret = -1;
+	    goto out;
+	}
+
+	if (__dir_read(file, 
+		       block->block_ptr + (run_start * PAGE_SIZE_4KB), 
+		       (i - run_start) * PAGE_SIZE_4KB, 
+		       data_offset + (PAGE_ENC_IDX(page_map[run_start]) * PAGE_SIZE_4KB)) == -1) {
+	    PrintError("Could not read pages of (%s)\n", block->name);
+	    ret = -1;
+	    goto out;
+	}
+    }
+
+    for (i = 0; i < num_pages; i++) {
+	uint64_t src = PAGE_ENC_IDX(page_map[i]);
+
+	if (PAGE_ENC_TYPE(page_map[i]) != PAGE_ENC_DUP) {
+	    continue;
+	}
+
+	if ((src >= i) || (PAGE_ENC_TYPE(page_map[src]) != PAGE_ENC_DATA)) {
+	    PrintError("Invalid duplicate page reference in (%s)\n", block->name);
+	    ret = -1;
+	    goto out;
+	}
+
+	memcpy(block->block_ptr + (i * PAGE_SIZE_4KB), 
+	       block->block_ptr + (src * PAGE_SIZE_4KB), 
+	       PAGE_SIZE_4KB);
+    }
+
+ out:
+    V3_Free(page_map);
+
+    return ret;
+}
+
 
 static void * 
 dir_open_chkpt(struct v3_vm_info * vm,
@@ -246,23 +575,15 @@ dir_save_block(struct chkpt_block * block,
 	goto out2;
     }
 
-    {
-	uint64_t bytes_written = 0;
-	loff_t   offset        = 0;
-	
-	while (bytes_written < block->size) {
-	    ssize_t tmp_bytes = v3_file_write(file, 
-					      block->block_ptr  + bytes_written,
-					      block->size - bytes_written, 
-					      offset            + bytes_written);
-	    if (tmp_bytes <= 0) {
-		PrintError("Error Writing to checkpoint file (%s)\n", filename);
-		ret = -1;
-		goto out1;
-	    }
-    
-	    bytes_written += tmp_bytes;
-	}
+    if ((block->guest_mem) && ((block->size % PAGE_SIZE_4KB) == 0)) {
+	ret = dir_save_pages(block, file);
+    } else {
+	ret = __dir_write(file, block->block_ptr, block->size, 0);
+    }
+
+    if (ret == -1) {
+	PrintError("Error Writing to checkpoint file (%s)\n", filename);
+	goto out1;
     }
 
  out1:
@@ -318,23 +639,15 @@ dir_load_block(struct chkpt_block * block,
 	goto out2;
     }
 
-    {
-	uint64_t bytes_read = 0;
-	loff_t   offset     = 0;
-	
-	while (bytes_read < block->size) {
-	    ssize_t tmp_bytes = v3_file_read(file, 
-					     block->block_ptr  + bytes_read,
-					     block->size       - bytes_read, 
-					     offset            + bytes_read);
-	    if (tmp_bytes <= 0) {
-		PrintError("Error Reading from checkpoint file (%s)\n", filename);
-		ret = -1;
-		goto out1;
-	    }
-    
-	    bytes_read += tmp_bytes;
-	}
+    if ((block->guest_mem) && ((block->size % PAGE_SIZE_4KB) == 0)) {
+	ret = dir_load_pages(block, file);
+    } else {
+	ret = __dir_read(file, block->block_ptr, block->size, 0);
+    }
+
+    if (ret == -1) {
+	PrintError("Error Reading from checkpoint file (%s)\n", filename);
+	goto out1;
     }
 
 
@@ -364,6 +677,7 @@ dir_load_block(struct chkpt_block * block,
 
 static struct chkpt_interface dir_store = {
     .name        = "DIR",
+    .concurrent  = 1,
     .open_chkpt  = dir_open_chkpt,
     .close_chkpt = dir_close_chkpt,
     .save_block  = dir_save_block,
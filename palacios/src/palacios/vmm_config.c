@@ -341,6 +341,13 @@ determine_paging_mode(struct v3_core_info * core,
 	    PrintDebug("Use of large pages in memory virtualization enabled.\n");
 	}
     }
+
+    if (v3_cfg_val(pg_tree, "giant_pages") != NULL) {
+	if (strcasecmp(v3_cfg_val(pg_tree, "giant_pages"), "true") == 0) {
+	    core->use_giant_pages = 1;
+	    PrintDebug("Use of giant pages in memory virtualization enabled.\n");
+	}
+    }
     return 0;
 }
 
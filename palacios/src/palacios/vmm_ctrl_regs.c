@@ -43,16 +43,8 @@ int
 v3_handle_cr0_write(struct v3_core_info * core) 
 {
     struct x86_instr dec_instr;
-    uint8_t          instr[15];
-    int ret;
     
-    if (core->mem_mode == PHYSICAL_MEM) { 
-	ret = v3_read_gpa(core, get_addr_linear(core, core->rip, V3_SEG_CS), 15, instr);
-    } else { 
-	ret = v3_read_gva(core, get_addr_linear(core, core->rip, V3_SEG_CS), 15, instr);
-    }
-    
-    if (v3_decode(core, (addr_t)instr, &dec_instr) == -1) {
+    if (v3_decode_rip(core, &dec_instr) == -1) {
 	PrintError("Could not decode instruction\n");
 	return -1;
     }
@@ -254,18 +246,9 @@ int
 v3_handle_cr0_read(struct v3_core_info * core)
 {
     struct x86_instr dec_instr;
-    uint8_t          instr[15] = {[0 ... 14] = 0};
-    int ret;
 
     
-    if (core->mem_mode == PHYSICAL_MEM) { 
-	ret = v3_read_gpa(core, get_addr_linear(core, core->rip, V3_SEG_CS), 15, instr);
-    } else { 
-	ret = v3_read_gva(core, get_addr_linear(core, core->rip, V3_SEG_CS), 15, instr);
-    }
-    
-    
-    if (v3_decode(core, (addr_t)instr, &dec_instr) == -1) {
+    if (v3_decode_rip(core, &dec_instr) == -1) {
 	PrintError("Could not decode instruction\n");
 	return -1;
     }
@@ -319,16 +302,8 @@ int
 v3_handle_cr3_write(struct v3_core_info * core) 
 {
     struct x86_instr dec_instr;
-    uint8_t          instr[15] = {[0 ... 14] = 0};
-    int ret;
     
-    if (core->mem_mode == PHYSICAL_MEM) { 
-	ret = v3_read_gpa(core, get_addr_linear(core, core->rip, V3_SEG_CS), 15, instr);
-    } else { 
-	ret = v3_read_gva(core, get_addr_linear(core, core->rip, V3_SEG_CS), 15, instr);
-    }
-    
-    if (v3_decode(core, (addr_t)instr, &dec_instr) == -1) {
+    if (v3_decode_rip(core, &dec_instr) == -1) {
 	PrintError("Could not decode instruction\n");
 	return -1;
     }
@@ -395,16 +370,8 @@ int
 v3_handle_cr3_read(struct v3_core_info * core)
 {
     struct x86_instr dec_instr;
-    uint8_t          instr[15] = {[0 ... 14] = 0};
-    int ret;
-    
-    if (core->mem_mode == PHYSICAL_MEM) { 
-	ret = v3_read_gpa(core, get_addr_linear(core, core->rip, V3_SEG_CS), 15, instr);
-    } else { 
-	ret = v3_read_gva(core, get_addr_linear(core, core->rip, V3_SEG_CS), 15, instr);
-    }
     
-    if (v3_decode(core, (addr_t)instr, &dec_instr) == -1) {
+    if (v3_decode_rip(core, &dec_instr) == -1) {
 	PrintError("Could not decode instruction\n");
 	return -1;
     }
@@ -464,19 +431,11 @@ int
 v3_handle_cr4_write(struct v3_core_info * core) 
 {
     v3_cpu_mode_t    cpu_mode  = v3_get_vm_cpu_mode(core);
-    uint8_t          instr[15] = {[0 ... 14] = 0};
     int              flush_tlb = 0;
     struct x86_instr dec_instr;
-    int ret = 0;
  
     
-    if (core->mem_mode == PHYSICAL_MEM) { 
-	ret = v3_read_gpa(core, get_addr_linear(core, core->rip, V3_SEG_CS), 15, instr);
-    } else { 
-	ret = v3_read_gva(core, get_addr_linear(core, core->rip, V3_SEG_CS), 15, instr);
-    }
-    
-    if (v3_decode(core, (addr_t)instr, &dec_instr) == -1) {
+    if (v3_decode_rip(core, &dec_instr) == -1) {
 	PrintError("Could not decode instruction\n");
 	return -1;
     }
@@ -0,0 +1,311 @@
+/* 
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National 
+ * Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at 
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2008, Jack Lange <jarusl@cs.northwestern.edu> 
+ * Copyright (c) 2008, The V3VEE Project <http://www.v3vee.org> 
+ * All rights reserved.
+ *
+ * Author: Jack Lange <jarusl@cs.northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#include <palacios/vmm_decode_cache.h>
+#include <palacios/vmm_decoder.h>
+#include <palacios/vm_guest_mem.h>
+#include <palacios/vm.h>
+#include <palacios/vmm.h>
+
+#ifndef V3_CONFIG_DEBUG_DECODER
+#undef PrintDebug
+#define PrintDebug(fmt, args...)
+#endif
+
+
+#define DEFAULT_CACHE_ENTRIES 256
+#define MAX_INSTR_LEN         15
+
+
+/* 
+ * Entries are written under a sequence count (odd while a core is filling it in),
+ * readers copy the entry out and treat a torn read as a miss.
+ */
+struct v3_decode_entry {
+    uint32_t         seq;
+    uint32_t         mode;                   /* 0 if the entry is empty */
+    addr_t           hpa;
+    uint8_t          bytes[MAX_INSTR_LEN];
+    struct x86_instr instr;                  /* Register operands are offsets into struct v3_core_info */
+};
+
+
+static inline void 
+cache_barrier(void) 
+{
+    __asm__ __volatile__ ("" : : : "memory");
+}
+
+static inline uint32_t 
+decode_mode(struct v3_core_info * core) 
+{
+    return (v3_get_vm_cpu_mode(core) + 1) | (core->segments.cs.db << 8);
+}
+
+static inline struct v3_decode_entry * 
+get_entry(struct v3_decode_cache * cache, addr_t hpa) 
+{
+    return &(cache->entries[(hpa ^ (hpa >> 12) ^ (hpa >> 24)) & (cache->num_entries - 1)]);
+}
+
+
+/* Register operands point into the core that decoded them */
+static int 
+operand_to_offset(struct v3_core_info * core, struct x86_operand * operand) 
+{
+    if (operand->type != REG_OPERAND) {
+	return 0;
+    }
+
+    if ((operand->operand < (addr_t)core) || 
+	(operand->operand >= (addr_t)core + sizeof(struct v3_core_info))) {
+	return -1;
+    }
+
+    operand->operand -= (addr_t)core;
+
+    return 0;
+}
+
+static void 
+operand_from_offset(struct v3_core_info * core, struct x86_operand * operand) 
+{
+    if (operand->type == REG_OPERAND) {
+	operand->operand += (addr_t)core;
+    }
+}
+
+static void 
+instr_from_offsets(struct v3_core_info * core, struct x86_instr * instr) 
+{
+    operand_from_offset(core, &(instr->src_operand));
+    operand_from_offset(core, &(instr->dst_operand));
+    operand_from_offset(core, &(instr->third_operand));
+}
+
+
+static int 
+cache_lookup(struct v3_decode_cache * cache, 
+	     struct v3_core_info    * core, 
+	     addr_t                   hpa, 
+	     struct x86_instr       * instr) 
+{
+    struct v3_decode_entry * entry = get_entry(cache, hpa);
+    uint8_t  bytes[MAX_INSTR_LEN];
+    uint32_t seq   = *(volatile uint32_t *)&(entry->seq);
+    uint32_t mode  = 0;
+    addr_t   e_hpa = 0;
+
+    if (seq & 0x1) {
+	return -1;
+    }
+
+    cache_barrier();
+
+    mode  = entry->mode;
+    e_hpa = entry->hpa;
+    memcpy(bytes, entry->bytes, MAX_INSTR_LEN);
+    memcpy(instr, &(entry->instr), sizeof(struct x86_instr));
+
+    cache_barrier();
+
+    if ((*(volatile uint32_t *)&(entry->seq) != seq) || 
+	(mode != decode_mode(core)) || 
+	(e_hpa != hpa)) {
+	return -1;
+    }
+
+    // The code may have changed since it was decoded
+    if (memcmp(bytes, V3_VAddr((void *)hpa), instr->instr_length) != 0) {
+	return -1;
+    }
+
+    instr_from_offsets(core, instr);
+
+    return v3_decode_refresh(core, instr);
+}
+
+
+static void 
+cache_insert(struct v3_decode_cache * cache, 
+	     struct v3_core_info    * core, 
+	     addr_t                   hpa, 
+	     uint8_t                * bytes, 
+	     struct x86_instr       * instr) 
+{
+    struct v3_decode_entry * entry = get_entry(cache, hpa);
+    struct x86_instr cached;
+    struct x86_instr check;
+    uint32_t seq = 0;
+
+    // Only instructions wholly inside one page can be checked in place on a hit
+    if ((instr->instr_length == 0) || 
+	(instr->instr_length > MAX_INSTR_LEN) || 
+	((hpa & (PAGE_SIZE - 1)) + instr->instr_length > PAGE_SIZE)) {
+	return;
+    }
+
+    memcpy(&cached, instr, sizeof(struct x86_instr));
+
+    if ((operand_to_offset(core, &(cached.src_operand)) == -1) || 
+	(operand_to_offset(core, &(cached.dst_operand)) == -1) || 
+	(operand_to_offset(core, &(cached.third_operand)) == -1)) {
+	return;
+    }
+
+    // A hit has to rebuild exactly what was just decoded, or the decoder can't refresh this one
+    memcpy(&check, &cached, sizeof(struct x86_instr));
+    instr_from_offsets(core, &check);
+
+    if ((v3_decode_refresh(core, &check) == -1) || 
+	(memcmp(&check, instr, sizeof(struct x86_instr)) != 0)) {
+	return;
+    }
+
+    seq = *(volatile uint32_t *)&(entry->seq);
+
+    // Somebody else is filling this slot
+    if ((seq & 0x1) || (!__sync_bool_compare_and_swap(&(entry->seq), seq, seq + 1))) {
+	return;
+    }
+
+    cache_barrier();
+
+    entry->mode = decode_mode(core);
+    entry->hpa  = hpa;
+    memcpy(entry->bytes, bytes, instr->instr_length);
+    memcpy(&(entry->instr), &cached, sizeof(struct x86_instr));
+
+    cache_barrier();
+
+    entry->seq = seq + 2;
+}
+
+
+int 
+v3_decode_rip(struct v3_core_info * core, 
+	      struct x86_instr    * instr) 
+{
+    struct v3_decode_cache * cache = &(core->vm_info->decode_cache);
+    addr_t    rip_linear = get_addr_linear(core, core->rip, V3_SEG_CS);
+    addr_t    hpa        = 0;
+    uint8_t   bytes[MAX_INSTR_LEN] = {[0 ... MAX_INSTR_LEN - 1] = 0};
+    uint8_t * instr_ptr  = NULL;
+    int       ret        = 0;
+
+    // The instruction may be in memory that has not been allocated or restored yet
+    if (v3_populate_gva_range(core, rip_linear, MAX_INSTR_LEN) == -1) {
+	PrintError("Could not populate Instruction Address (%p)\n", (void *)(addr_t)core->rip);
+	return -1;
+    }
+
+    if (core->mem_mode == PHYSICAL_MEM) { 
+	ret = v3_gpa_to_hpa(core, rip_linear, &hpa);
+    } else { 
+	ret = v3_gva_to_hpa(core, rip_linear, &hpa);
+    }
+
+    if (ret == -1) {
+	PrintError("Could not translate Instruction Address (%p)\n", (void *)(addr_t)core->rip);
+	return -1;
+    }
+
+    if ((cache->num_entries > 0) && 
+	(cache_lookup(cache, core, hpa, instr) == 0)) {
+	return 0;
+    }
+
+    // Decode in place unless the instruction could run into the next page
+    if ((hpa & (PAGE_SIZE - 1)) + MAX_INSTR_LEN <= PAGE_SIZE) {
+	instr_ptr = (uint8_t *)V3_VAddr((void *)hpa);
+    } else {
+	if (core->mem_mode == PHYSICAL_MEM) { 
+	    v3_read_gpa(core, rip_linear, MAX_INSTR_LEN, bytes);
+	} else { 
+	    v3_read_gva(core, rip_linear, MAX_INSTR_LEN, bytes);
+	}
+
+	instr_ptr = bytes;
+    }
+
+    if (v3_decode(core, (addr_t)instr_ptr, instr) == -1) {
+	return -1;
+    }
+
+    if (cache->num_entries > 0) {
+	cache_insert(cache, core, hpa, instr_ptr, instr);
+    }
+
+    return 0;
+}
+
+
+int 
+v3_init_decode_cache(struct v3_vm_info * vm) 
+{
+    struct v3_decode_cache * cache       = &(vm->decode_cache);
+    v3_cfg_tree_t          * cache_cfg   = v3_cfg_subtree(vm->cfg_data->cfg, "decode_cache");
+    char                   * entries_str = v3_cfg_val(cache_cfg, "entries");
+    uint32_t num_entries = DEFAULT_CACHE_ENTRIES;
+
+    memset(cache, 0, sizeof(struct v3_decode_cache));
+
+    if (entries_str) {
+	num_entries = atoi(entries_str);
+    }
+
+    if (num_entries == 0) {
+	V3_Print("Decode cache disabled\n");
+	return 0;
+    }
+
+    // Round down to a power of 2
+    while (num_entries & (num_entries - 1)) {
+	num_entries &= (num_entries - 1);
+    }
+
+    cache->entries = V3_Malloc(sizeof(struct v3_decode_entry) * num_entries);
+
+    if (cache->entries == NULL) {
+	PrintError("Could not allocate decode cache (%u entries)\n", num_entries);
+	return -1;
+    }
+
+    memset(cache->entries, 0, sizeof(struct v3_decode_entry) * num_entries);
+    cache->num_entries = num_entries;
+
+    V3_Print("Decode cache: %u entries\n", num_entries);
+
+    return 0;
+}
+
+
+int 
+v3_deinit_decode_cache(struct v3_vm_info * vm) 
+{
+    struct v3_decode_cache * cache = &(vm->decode_cache);
+
+    if (cache->entries) {
+	V3_Free(cache->entries);
+    }
+
+    memset(cache, 0, sizeof(struct v3_decode_cache));
+
+    return 0;
+}
@@ -286,6 +286,16 @@ v3_dev_hook_io(struct vm_device * dev,
 }
 
 
+int 
+v3_dev_hook_io_string(struct vm_device * dev, 
+		      uint16_t           port,
+		      int (*read_string) (struct v3_core_info * core, uint16_t port, void * dst, uint_t length, uint_t count, void * priv_data),
+		      int (*write_string)(struct v3_core_info * core, uint16_t port, void * src, uint_t length, uint_t count, void * priv_data)) 
+{
+    return v3_hook_io_port_string(dev->vm, port, read_string, write_string);
+}
+
+
 int 
 v3_dev_unhook_io(struct vm_device * dev, 
 		 uint16_t           port) 
@@ -25,6 +25,10 @@
 #include <palacios/vm.h>
 #include <palacios/vmm_telemetry.h>
 
+#ifdef V3_CONFIG_VMX
+#include <palacios/vmx_ept.h>
+#endif
+
 #ifndef V3_CONFIG_DEBUG_NESTED_PAGING
 #undef PrintDebug
 #define PrintDebug(fmt, args...)
@@ -62,6 +66,137 @@ v3_init_passthrough_pts(struct v3_core_info * core)
 }
 
 
+int 
+v3_init_nested_pts(struct v3_vm_info * vm) 
+{
+    memset(&(vm->nested_pts), 0, sizeof(struct v3_nested_pts));
+
+    vm->nested_pts.lock = v3_mutex_init();
+
+    if (vm->nested_pts.lock == NULL) {
+	PrintError("Could not allocate nested page table lock\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+
+int 
+v3_deinit_nested_pts(struct v3_vm_info * vm) 
+{
+    // The cores have already been freed, so nothing references the shared table anymore
+    if (vm->nested_pts.root != 0) {
+	v3_delete_pgtables_64((pml4e64_t *)CR3_TO_PML4E64_VA(vm->nested_pts.root));
+	vm->nested_pts.root = 0;
+    }
+
+    if (vm->nested_pts.lock) {
+	v3_mutex_deinit(vm->nested_pts.lock);
+	vm->nested_pts.lock = NULL;
+    }
+
+    return 0;
+}
+
+
+/* Points an SVM core at the VM's shared nested page table, the first core creates it */
+int 
+v3_init_nested_pt_core(struct v3_core_info * core) 
+{
+    struct v3_nested_pts * npts = &(core->vm_info->nested_pts);
+
+    // Only the 64 bit nested fault handler knows how to share its tables
+    if (v3_get_host_cpu_mode() != LONG) {
+	return v3_init_passthrough_pts(core);
+    }
+
+    if (npts->root == 0) {
+	addr_t root = create_generic_pt_page();
+
+	if (root == 0) {
+	    PrintError("Could not allocate shared nested page table\n");
+	    return -1;
+	}
+
+	npts->root = (addr_t)V3_PAddr((void *)root);
+    }
+
+    core->direct_map_pt = npts->root;
+
+    return 0;
+}
+
+
+int 
+v3_nested_pt_is_shared(struct v3_core_info * core) 
+{
+    return ((core->vm_info->nested_pts.root != 0) && 
+	    (core->direct_map_pt == core->vm_info->nested_pts.root));
+}
+
+
+/* 
+ * Shrinks page_size until the page containing fault_addr maps to the same region on every core
+ *  Returns 0 if even the 4KiB page differs between cores, in which case it can't go in the shared table
+ */
+static uint32_t 
+get_shared_page_size(struct v3_core_info * core, 
+		     addr_t                fault_addr, 
+		     uint32_t              page_size) 
+{
+    while (page_size != 0) {
+	addr_t pg_start = fault_addr & ~((addr_t)page_size - 1);
+
+	if (v3_get_uniform_region(core->vm_info, pg_start, pg_start + page_size) != NULL) {
+	    return page_size;
+	}
+
+	switch (page_size) {
+	    case PAGE_SIZE_1GB:
+		page_size = PAGE_SIZE_2MB;
+		break;
+	    case PAGE_SIZE_2MB:
+		page_size = PAGE_SIZE_4KB;
+		break;
+	    default:
+		page_size = 0;
+		break;
+	}
+    }
+
+    return 0;
+}
+
+
+/* 
+ * Picks the page size used to map gpa in the core's nested page table
+ *  Returns 0 if the page can't go in the shared table, meaning the core needs a private one
+ */
+uint32_t 
+v3_get_nested_page_size(struct v3_core_info * core, 
+			addr_t                gpa) 
+{
+    uint32_t page_size = PAGE_SIZE_4KB;
+
+    /*  Check if:
+     *  1. the guest is configured to use large pages and 
+     * 	2. the memory regions can be referenced by a large page
+     *  3. writes are not being tracked at page granularity
+     */
+    if (((core->use_large_pages == 1) || (core->use_giant_pages == 1)) && 
+	(core->vm_info->mem_map.track_dirty == 0)) {
+	page_size = v3_get_max_page_size(core, gpa, LONG);
+    }
+
+    if (v3_nested_pt_is_shared(core)) {
+	return get_shared_page_size(core, gpa, page_size);
+    }
+
+    return page_size;
+}
+
+
 int 
 v3_free_passthrough_pts(struct v3_core_info * core) 
 {
@@ -95,6 +230,12 @@ v3_free_nested_pts(struct v3_core_info * core)
 {
     v3_cpu_mode_t mode = v3_get_host_cpu_mode();
 
+    // The shared table is freed with the VM
+    if (v3_nested_pt_is_shared(core)) {
+	core->direct_map_pt = 0;
+	return 0;
+    }
+
     // Delete the old direct map page tables
     switch(mode) {
 	case PROTECTED:
@@ -151,6 +292,12 @@ v3_handle_passthrough_pagefault(struct v3_core_info * core,
 {
     v3_cpu_mode_t mode = v3_get_vm_cpu_mode(core);
 
+    // Paging is off, so the fault address is a guest physical address
+    if (v3_populate_base_region(core->vm_info, fault_addr) == -1) {
+	PrintError("Could not populate guest memory at %p\n", (void *)fault_addr);
+	return -1;
+    }
+
     switch(mode) {
 	case REAL:
 	case PROTECTED:
@@ -181,6 +328,11 @@ v3_handle_nested_pagefault(struct v3_core_info * core,
 
     PrintDebug("Nested PageFault: fault_addr=%p, error_code=%u\n", (void *)fault_addr, *(uint_t *)&error_code);
 
+    if (v3_populate_base_region(core->vm_info, fault_addr) == -1) {
+	PrintError("Could not populate guest memory at %p\n", (void *)fault_addr);
+	return -1;
+    }
+
     switch(mode) {
 	case REAL:
 	case PROTECTED:
@@ -246,6 +398,8 @@ v3_invalidate_nested_addr(struct v3_core_info * core,
 
 	case LONG:
 	case LONG_32_COMPAT:
+	    // The hardware may still hold the old (possibly 1GiB) translation
+	    core->flush_direct_map = 1;
 	    return invalidate_addr_64(core, inv_addr);	    
 	
 	default:
@@ -255,3 +409,172 @@ v3_invalidate_nested_addr(struct v3_core_info * core,
 
     return -1;
 }
+
+
+/* 
+ * Invalidates [start, end) in every nested page table of the VM
+ *  The shared table is only walked once, and every core flushes its cached translations on its next entry
+ */
+int 
+v3_invalidate_nested_range(struct v3_vm_info * vm, 
+			   addr_t              start, 
+			   addr_t              end) 
+{
+    struct v3_nested_pts * npts = &(vm->nested_pts);
+    int      shared_done = 0;
+    addr_t   cur_addr    = 0;
+    int i = 0;
+
+    for (i = 0; i < vm->num_cores; i++) {
+	struct v3_core_info * core = &(vm->cores[i]);
+	int shared = 0;
+
+	// Cores without a table yet have nothing to invalidate
+	if ((core->shdw_pg_mode != NESTED_PAGING) || (core->direct_map_pt == 0)) {
+	    continue;
+	}
+
+	shared = v3_nested_pt_is_shared(core);
+
+	if ((shared) && (shared_done)) {
+	    core->flush_direct_map = 1;
+	    continue;
+	}
+
+	if (shared) {
+	    v3_mutex_lock(npts->lock);
+	}
+
+	for (cur_addr = start; cur_addr < end; cur_addr += PAGE_SIZE_4KB) {
+	    v3_invalidate_nested_addr(core, cur_addr);
+	}
+
+	if (shared) {
+	    v3_mutex_unlock(npts->lock);
+	    shared_done = 1;
+	}
+    }
+
+    return 0;
+}
+
+
+int 
+v3_write_protect_nested_pts(struct v3_vm_info * vm) 
+{
+    v3_cpu_mode_t mode = v3_get_host_cpu_mode();
+    struct v3_nested_pts * npts = &(vm->nested_pts);
+    int      shared_done = 0;
+    int i = 0;
+
+    if ((mode != LONG) && (mode != LONG_32_COMPAT)) {
+	PrintError("Write protecting nested page tables is only supported on 64 bit hosts\n");
+	return -1;
+    }
+
+    for (i = 0; i < vm->num_cores; i++) {
+	struct v3_core_info * core = &(vm->cores[i]);
+	int shared = v3_nested_pt_is_shared(core);
+
+	if ((shared == 0) || (shared_done == 0)) {
+	    if (shared) {
+		v3_mutex_lock(npts->lock);
+	    }
+
+	    write_protect_pts_64(core);
+
+	    if (shared) {
+		v3_mutex_unlock(npts->lock);
+		shared_done = 1;
+	    }
+	}
+
+	// Stale writable translations may still be cached
+	core->flush_direct_map = 1;
+    }
+
+    return 0;
+}
+
+
+static int 
+prefault_page(struct v3_core_info * core, 
+	      addr_t                gpa) 
+{
+    extern v3_cpu_arch_t v3_mach_type;
+
+    switch (v3_mach_type) {
+#ifdef V3_CONFIG_SVM
+	case V3_SVM_REV3_CPU:
+	    return prefault_nested_pt_64(core, gpa);
+#endif
+#ifdef V3_CONFIG_VMX
+	case V3_VMX_EPT_CPU:
+	case V3_VMX_EPT_UG_CPU:
+	    return v3_prefault_ept(core, gpa);
+#endif
+	default:
+	    PrintError("Nested page tables can't be prefaulted on this CPU\n");
+	    return -1;
+    }
+}
+
+
+/* 
+ * Builds the nested page table entries for all of base memory in one pass, using the largest pages allowed
+ *  The shared table is only filled once, anything skipped here is still handled by the fault path
+ */
+int 
+v3_prefault_nested_pts(struct v3_vm_info * vm) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+    int      shared_done = 0;
+    uint64_t num_pages   = 0;
+    int i = 0;
+    int j = 0;
+
+    if (v3_get_host_cpu_mode() != LONG) {
+	PrintError("Prefaulting nested page tables is only supported on 64 bit hosts\n");
+	return -1;
+    }
+
+    for (i = 0; i < vm->num_cores; i++) {
+	struct v3_core_info * core = &(vm->cores[i]);
+	int shared = 0;
+
+	if (core->shdw_pg_mode != NESTED_PAGING) {
+	    continue;
+	}
+
+	shared = v3_nested_pt_is_shared(core);
+
+	if ((shared) && (shared_done)) {
+	    continue;
+	}
+
+	for (j = 0; j < map->num_base_blocks; j++) {
+	    struct v3_mem_region * region = &(map->base_regions[j]);
+	    addr_t gpa = region->guest_start;
+
+	    while (gpa < region->guest_end) {
+		int page_size = prefault_page(core, gpa);
+
+		if (page_size == -1) {
+		    PrintError("Could not prefault nested page table of core %d (gpa=%p)\n", i, (void *)gpa);
+		    return -1;
+		}
+
+		gpa = (gpa & ~((addr_t)page_size - 1)) + page_size;
+		num_pages++;
+	    }
+	}
+
+	if (shared) {
+	    shared_done = 1;
+	}
+    }
+
+    V3_Print("Prefaulted nested page tables (%llu mappings)\n", num_pages);
+
+    return 0;
+}
@@ -29,10 +29,16 @@
 
 // Reference: AMD Software Developer Manual Vol.2 Ch.5 "Page Translation and Protection"
 
+/* Returned by fill_passthrough_pt_64() when the fault has to be passed on to the region's handler */
+#define DIRECT_PF_UNHANDLED 1
+
 static inline int 
-handle_passthrough_pagefault_64(struct v3_core_info * core, 
-				addr_t                fault_addr, 
-				pf_error_t            error_code) 
+fill_passthrough_pt_64(struct v3_core_info  * core, 
+		       addr_t                 fault_addr, 
+		       pf_error_t             error_code, 
+		       struct v3_mem_region * region, 
+		       int                    page_size, 
+		       int                    track_dirty) 
 {
     pml4e64_t   * pml    = NULL;
     pdpe64_t    * pdpe   = NULL;
@@ -46,22 +52,6 @@ handle_passthrough_pagefault_64(struct v3_core_info * core,
     int pde_index  = PDE64_INDEX(fault_addr);
     int pte_index  = PTE64_INDEX(fault_addr);
 
-    struct v3_mem_region * region =  v3_get_mem_region(core->vm_info, core->vcpu_id, fault_addr);
-    int page_size = PAGE_SIZE_4KB;
-
-    if (region == NULL) {
-	PrintError("%s: invalid region, addr=%p\n", __FUNCTION__, (void *)fault_addr);
-	return -1;
-    }
-
-    /*  Check if:
-     *  1. the guest is configured to use large pages and 
-     * 	2. the memory regions can be referenced by a large page
-     */
-    if ((core->use_large_pages == 1) || (core->use_giant_pages == 1)) {
-	page_size = v3_get_max_page_size(core, fault_addr, LONG);
-    }
-
     PrintDebug("Using page size of %dKB\n", page_size / 1024);
 
  
@@ -102,6 +92,12 @@ handle_passthrough_pagefault_64(struct v3_core_info * core,
 	pde = V3_VAddr((void*)BASE_TO_PAGE_ADDR_4KB(pdpe[pdpe_index].pd_base_addr));
     }
 
+    // This range was split into 4KiB pages (e.g. while tracking dirty pages), so keep using them
+    if ((page_size == PAGE_SIZE_2MB) && 
+	(pde[pde_index].present == 1) && (pde[pde_index].large_page == 0)) {
+	page_size = PAGE_SIZE_4KB;
+    }
+
     // Fix up the 2MiB PDE and exit here
     if (page_size == PAGE_SIZE_2MB) {
 	pde2mb = (pde64_2MB_t *)pde; // all but these two lines are the same for PTE
@@ -135,15 +131,13 @@ handle_passthrough_pagefault_64(struct v3_core_info * core,
 
 		pde2mb[pde_index].page_base_addr = PAGE_BASE_ADDR_2MB(host_addr);
 	    } else {
-		v3_telemetry_inc_core_counter(core, "NPT_UNHANDLED_PAGE_FAULTS");
-		return region->unhandled(core, fault_addr, fault_addr, region, error_code);
+		return DIRECT_PF_UNHANDLED;
 	    }
 	} else {
 	    // We fix all permissions on the first pass, 
 	    // so we only get here if its an unhandled exception
 
-	    v3_telemetry_inc_core_counter(core, "NPT_UNHANDLED_PAGE_FAULTS");
-	    return region->unhandled(core, fault_addr, fault_addr, region, error_code);
+	    return DIRECT_PF_UNHANDLED;
 	}
 
 	v3_telemetry_inc_core_counter(core, "NPT_LARGE_PAGE_FAULTS");
@@ -175,8 +169,14 @@ handle_passthrough_pagefault_64(struct v3_core_info * core,
 	    // Full access
 	    pte[pte_index].present = 1;
 
-	    if (region->flags.write == 1) {
+	    // While tracking dirty pages, base memory is only writable once it has been written
+	    if ((region->flags.write == 1) && 
+		((track_dirty == 0) || (region->flags.base == 0) || (error_code.write == 1))) {
 		pte[pte_index].writable = 1;
+
+		if (track_dirty && region->flags.base) {
+		    v3_mark_page_dirty(core->vm_info, fault_addr);
+		}
 	    } else {
 		pte[pte_index].writable = 0;
 	    }
@@ -195,20 +195,147 @@ handle_passthrough_pagefault_64(struct v3_core_info * core,
 	    v3_telemetry_inc_core_counter(core, "NPT_SMALL_PAGE_FAULTS");
 	    pte[pte_index].page_base_addr = PAGE_BASE_ADDR_4KB(host_addr);
 	} else {
-	    v3_telemetry_inc_core_counter(core, "NPT_UNHANDLED_PAGE_FAULTS");
-	    return region->unhandled(core, fault_addr, fault_addr, region, error_code);
+	    return DIRECT_PF_UNHANDLED;
 	}
+    } else if ((core->shdw_pg_mode == NESTED_PAGING) && 
+	       (error_code.write == 1) && (pte[pte_index].writable == 0) &&
+	       (region->flags.alloced == 1) && (region->flags.write == 1)) {
+	// First write to a page that was write protected for dirty tracking
+	pte[pte_index].writable = 1;
+
+	if (region->flags.base) {
+	    v3_mark_page_dirty(core->vm_info, fault_addr);
+	}
+
+	v3_telemetry_inc_core_counter(core, "NPT_DIRTY_PAGE_FAULTS");
     } else {
 	// We fix all permissions on the first pass, 
 	// so we only get here if its an unhandled exception
 
+	return DIRECT_PF_UNHANDLED;
+    }
+
+    return 0;
+}
+
+
+static inline int 
+handle_passthrough_pagefault_64(struct v3_core_info * core, 
+				addr_t                fault_addr, 
+				pf_error_t            error_code) 
+{
+    struct v3_nested_pts * npts   = &(core->vm_info->nested_pts);
+    struct v3_mem_region * region = v3_get_mem_region(core->vm_info, core->vcpu_id, fault_addr);
+    int      page_size   = PAGE_SIZE_4KB;
+    int      track_dirty = ((core->shdw_pg_mode == NESTED_PAGING) && 
+			    (core->vm_info->mem_map.track_dirty == 1));
+    int      shared      = 0;
+    int      ret         = 0;
+
+    if (region == NULL) {
+	PrintError("%s: invalid region, addr=%p\n", __FUNCTION__, (void *)fault_addr);
+	return -1;
+    }
+
+    // Pages that aren't mapped never get a page table entry
+    if ((region->flags.alloced == 0) || (region->flags.read == 0)) {
 	v3_telemetry_inc_core_counter(core, "NPT_UNHANDLED_PAGE_FAULTS");
 	return region->unhandled(core, fault_addr, fault_addr, region, error_code);
     }
 
-    return 0;
+    page_size = v3_get_nested_page_size(core, fault_addr);
+
+    if (page_size == 0) {
+	// Another core maps this page through a different region, so this core needs its own table
+	V3_Print("Core %d: switching to a private nested page table (addr=%p)\n", 
+		 core->vcpu_id, (void *)fault_addr);
+
+	if (v3_init_passthrough_pts(core) == -1) {
+	    PrintError("Could not create private nested page table\n");
+	    return -1;
+	}
+
+	page_size = v3_get_nested_page_size(core, fault_addr);
+    }
+
+    // 1GiB nested pages aren't built here, but a 1GiB aligned range can always use 2MiB pages
+    if (page_size == PAGE_SIZE_1GB) {
+	page_size = PAGE_SIZE_2MB;
+    }
+
+    shared = v3_nested_pt_is_shared(core);
+
+    if (shared) {
+	v3_mutex_lock(npts->lock);
+    }
+
+    ret = fill_passthrough_pt_64(core, fault_addr, error_code, region, page_size, track_dirty);
+
+    if (shared) {
+	v3_mutex_unlock(npts->lock);
+    }
+
+    if (ret == DIRECT_PF_UNHANDLED) {
+	v3_telemetry_inc_core_counter(core, "NPT_UNHANDLED_PAGE_FAULTS");
+	return region->unhandled(core, fault_addr, fault_addr, region, error_code);
+    }
+
+    return ret;
+}
+
+/* 
+ * Maps the page containing gpa before the guest touches it
+ *  Returns the size of the range that was covered, or -1 on error
+ */
+static inline int 
+prefault_nested_pt_64(struct v3_core_info * core, 
+		      addr_t                gpa) 
+{
+    struct v3_nested_pts * npts   = &(core->vm_info->nested_pts);
+    struct v3_mem_region * region = v3_get_mem_region(core->vm_info, core->vcpu_id, gpa);
+    pf_error_t error_code = {0};
+    int        page_size  = 0;
+    int        shared     = 0;
+    int        ret        = 0;
+    int        dirty_tracking = core->vm_info->mem_map.track_dirty;
+
+    // Unmapped pages, and pages that differ between cores, are left to the fault path
+    if ((region == NULL) || (region->flags.alloced == 0) || (region->flags.read == 0)) {
+	return PAGE_SIZE_4KB;
+    }
+
+    page_size = v3_get_nested_page_size(core, gpa);
+
+    if (page_size == 0) {
+	return PAGE_SIZE_4KB;
+    }
+
+    if (page_size == PAGE_SIZE_1GB) {
+	page_size = PAGE_SIZE_2MB;
+    }
+
+    shared = v3_nested_pt_is_shared(core);
+
+    if (shared) {
+	v3_mutex_lock(npts->lock);
+    }
+
+    // A page that is already mapped is left alone
+    ret = fill_passthrough_pt_64(core, gpa, error_code, region, page_size, 
+				 dirty_tracking);
+
+    if (shared) {
+	v3_mutex_unlock(npts->lock);
+    }
+
+    if (ret == -1) {
+	return -1;
+    }
+
+    return page_size;
 }
 
+
 static inline int 
 invalidate_addr_64(struct v3_core_info * core,
 		   addr_t                inv_addr) 
@@ -245,9 +372,8 @@ invalidate_addr_64(struct v3_core_info * core,
     if (pdpe[pdpe_index].present == 0) {
 	return 0;
     } else if (pdpe[pdpe_index].large_page == 1) { // 1GiB
-	pdpe[pdpe_index].present   = 0;
-	pdpe[pdpe_index].writable  = 0;
-	pdpe[pdpe_index].user_page = 0;
+	// Clear the whole leaf, so a refault at a smaller page size doesn't inherit the large page bit
+	memset(&(pdpe[pdpe_index]), 0, sizeof(pdpe64_t));
 	return 0;
     }
 
@@ -256,9 +382,7 @@ invalidate_addr_64(struct v3_core_info * core,
     if (pde[pde_index].present == 0) {
 	return 0;
     } else if (pde[pde_index].large_page == 1) { // 2MiB
-	pde[pde_index].present   = 0;
-	pde[pde_index].writable  = 0;
-	pde[pde_index].user_page = 0;
+	memset(&(pde[pde_index]), 0, sizeof(pde64_t));
 	return 0;
     }
 
@@ -273,4 +397,60 @@ invalidate_addr_64(struct v3_core_info * core,
 
 
 
+/* 
+ * Removes write access from every leaf of the direct map 
+ *  Large page leaves are cleared entirely so they are refaulted as 4KiB pages,
+ *  which lets writes be tracked at page granularity.
+ *  EPT entries share the same layout for the bits touched here, so this works for both
+ */
+static inline int 
+write_protect_pts_64(struct v3_core_info * core) 
+{
+    pml4e64_t * pml  = CR3_TO_PML4E64_VA(core->direct_map_pt);
+    pdpe64_t  * pdpe = NULL;
+    pde64_t   * pde  = NULL;
+    pte64_t   * pte  = NULL;
+    int i = 0;
+    int j = 0;
+    int k = 0;
+    int l = 0;
+
+    for (i = 0; i < MAX_PML4E64_ENTRIES; i++) {
+	if (pml[i].present == 0) {
+	    continue;
+	}
+
+	pdpe = V3_VAddr((void *)BASE_TO_PAGE_ADDR(pml[i].pdp_base_addr));
+
+	for (j = 0; j < MAX_PDPE64_ENTRIES; j++) {
+	    if (pdpe[j].present == 0) {
+		continue;
+	    } else if (pdpe[j].large_page == 1) { // 1GiB
+		memset(&(pdpe[j]), 0, sizeof(pdpe64_t));
+		continue;
+	    }
+
+	    pde = V3_VAddr((void *)BASE_TO_PAGE_ADDR(pdpe[j].pd_base_addr));
+
+	    for (k = 0; k < MAX_PDE64_ENTRIES; k++) {
+		if (pde[k].present == 0) {
+		    continue;
+		} else if (pde[k].large_page == 1) { // 2MiB
+		    memset(&(pde[k]), 0, sizeof(pde64_t));
+		    continue;
+		}
+
+		pte = V3_VAddr((void *)BASE_TO_PAGE_ADDR(pde[k].pt_base_addr));
+
+		for (l = 0; l < MAX_PTE64_ENTRIES; l++) {
+		    pte[l].writable = 0;
+		}
+	    }
+	}
+    }
+
+    return 0;
+}
+
+
 #endif
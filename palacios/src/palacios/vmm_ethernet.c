@@ -0,0 +1,423 @@
+/*
+ * This file is part of the Palacios Virtual Machine Monitor developed
+ * by the V3VEE Project with funding from the United States National
+ * Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  You can find out more at
+ * http://www.v3vee.org
+ *
+ * Copyright (c) 2011, The V3VEE Project <http://www.v3vee.org>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "V3VEE_LICENSE".
+ */
+
+#include <palacios/vmm.h>
+#include <palacios/vmm_ethernet.h>
+
+
+#define ETH_TYPE_VLAN   0x8100
+#define ETH_TYPE_IPV4   0x0800
+#define ETH_TYPE_IPV6   0x86dd
+
+#define IP_PROTO_TCP    6
+#define IP_PROTO_UDP    17
+
+#define IPV4_HDR_MIN    20
+#define IPV6_HDR_LEN    40
+#define TCP_HDR_MIN     20
+
+#define TCP_FLAG_FIN    0x01
+#define TCP_FLAG_PSH    0x08
+#define TCP_FLAG_CWR    0x80
+
+
+/* Header layout of a TCP frame */
+struct tcp_frame {
+    uint16_t l3_off;
+    uint16_t l4_off;
+    uint16_t hdr_len;
+    uint8_t  ipv6;
+};
+
+
+static inline uint16_t
+get_be16(uint8_t * buf)
+{
+    return (buf[0] << 8) | buf[1];
+}
+
+static inline void
+put_be16(uint8_t * buf, uint16_t val)
+{
+    buf[0] = val >> 8;
+    buf[1] = val & 0xff;
+}
+
+static inline uint32_t
+get_be32(uint8_t * buf)
+{
+    return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+static inline void
+put_be32(uint8_t * buf, uint32_t val)
+{
+    put_be16(buf,     val >> 16);
+    put_be16(buf + 2, val & 0xffff);
+}
+
+
+/*
+ * One's complement sum of buf, added to sum.
+ * sum and the return value are in host order, unfolded.
+ * The buffer is summed in native 32 bit words and swapped once at the end,
+ * which is valid because the one's complement sum is byte order independent.
+ */
+static uint32_t
+csum_add(uint32_t sum, uint8_t * buf, uint32_t len)
+{
+    uint64_t acc = 0;
+
+    while (len >= 4) {
+	acc += *(uint32_t *)buf;
+	buf += 4;
+	len -= 4;
+    }
+
+    if (len >= 2) {
+	acc += *(uint16_t *)buf;
+	buf += 2;
+	len -= 2;
+    }
+
+    if (len) {
+	// A trailing byte is the high half of a big endian word
+	acc += *buf;
+    }
+
+    while (acc >> 16) {
+	acc = (acc & 0xffff) + (acc >> 16);
+    }
+
+    // native (little endian) to big endian
+    return sum + (((acc & 0xff) << 8) | (acc >> 8));
+}
+
+static uint16_t
+csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+	sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return ~sum & 0xffff;
+}
+
+
+static int
+parse_tcp_frame(uint8_t          * pkt,
+		uint32_t           len,
+		struct tcp_frame * frame)
+{
+    uint16_t eth_type = 0;
+    uint32_t off      = ETHERNET_HEADER_LEN;
+
+    if (len < ETHERNET_HEADER_LEN + IPV4_HDR_MIN + TCP_HDR_MIN) {
+	return -1;
+    }
+
+    eth_type = get_be16(pkt + 12);
+
+    if (eth_type == ETH_TYPE_VLAN) {
+	eth_type = get_be16(pkt + 16);
+	off     += 4;
+    }
+
+    frame->l3_off = off;
+
+    if (eth_type == ETH_TYPE_IPV4) {
+	uint32_t ihl = (pkt[off] & 0xf) * 4;
+
+	if ((ihl < IPV4_HDR_MIN) || (off + ihl + TCP_HDR_MIN > len) ||
+	    (pkt[off + 9] != IP_PROTO_TCP)) {
+	    return -1;
+	}
+
+	frame->ipv6 = 0;
+	off += ihl;
+    } else if (eth_type == ETH_TYPE_IPV6) {
+	// Extension headers are not supported
+	if ((off + IPV6_HDR_LEN + TCP_HDR_MIN > len) ||
+	    (pkt[off + 6] != IP_PROTO_TCP)) {
+	    return -1;
+	}
+
+	frame->ipv6 = 1;
+	off += IPV6_HDR_LEN;
+    } else {
+	return -1;
+    }
+
+    frame->l4_off  = off;
+    frame->hdr_len = off + ((pkt[off + 12] >> 4) * 4);
+
+    if (frame->hdr_len > len) {
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/* Fill in the IP and TCP headers of a segment carrying seg_len bytes of frame */
+static void
+fixup_tcp_segment(uint8_t          * seg,
+		  uint32_t           seg_len,
+		  struct tcp_frame * frame)
+{
+    uint8_t  * ip  = seg + frame->l3_off;
+    uint8_t  * tcp = seg + frame->l4_off;
+    uint32_t   tcp_len = seg_len - frame->l4_off;
+    uint32_t   sum = 0;
+
+    if (frame->ipv6) {
+	put_be16(ip + 4, seg_len - frame->l4_off);
+
+	sum = csum_add(sum, ip + 8, 32);  // src + dst addresses
+    } else {
+	put_be16(ip + 2,  seg_len - frame->l3_off);
+	put_be16(ip + 10, 0);
+	put_be16(ip + 10, csum_fold(csum_add(0, ip, frame->l4_off - frame->l3_off)));
+
+	sum = csum_add(sum, ip + 12, 8);  // src + dst addresses
+    }
+
+    sum += IP_PROTO_TCP;
+    sum += tcp_len;
+
+    put_be16(tcp + 16, 0);
+    put_be16(tcp + 16, csum_fold(csum_add(sum, tcp, tcp_len)));
+}
+
+
+int
+v3_net_finish_csum(uint8_t           * pkt,
+		   uint32_t            len,
+		   struct v3_net_gso * gso)
+{
+    uint32_t csum_pos = gso->csum_start + gso->csum_offset;
+
+    if ((gso->csum_start >= len) || (csum_pos + 2 > len)) {
+	PrintError("Invalid partial checksum (start=%d, offset=%d, len=%d)\n",
+		   gso->csum_start, gso->csum_offset, len);
+	return -1;
+    }
+
+    // The csum field already holds the pseudo header sum
+    put_be16(pkt + csum_pos, csum_fold(csum_add(0, pkt + gso->csum_start, len - gso->csum_start)));
+
+    return 0;
+}
+
+
+int
+v3_net_gso_xmit(uint8_t           * pkt,
+		uint32_t            len,
+		struct v3_net_gso * gso,
+		uint8_t           * scratch,
+		uint32_t            scratch_len,
+		int (*xmit)(uint8_t * buf, uint32_t len, void * private_data),
+		void              * private_data)
+{
+    struct tcp_frame frame;
+    uint32_t seq    = 0;
+    uint16_t ip_id  = 0;
+    uint32_t offset = 0;
+    int      segs   = 0;
+
+    if ((gso->gso_type & ~V3_NET_GSO_ECN) == V3_NET_GSO_NONE) {
+
+	if (!(gso->flags & V3_NET_F_NEEDS_CSUM)) {
+	    return (xmit(pkt, len, private_data) < 0) ? -1 : 1;
+	}
+
+	// Work on a copy, the frame may be shared with other receivers
+	if (len > scratch_len) {
+	    PrintError("Frame too large for checksum offload (%d bytes)\n", len);
+	    return -1;
+	}
+
+	memcpy(scratch, pkt, len);
+
+	if (v3_net_finish_csum(scratch, len, gso) == -1) {
+	    return -1;
+	}
+
+	return (xmit(scratch, len, private_data) < 0) ? -1 : 1;
+    }
+
+    if (((gso->gso_type & ~V3_NET_GSO_ECN) != V3_NET_GSO_TCPV4) &&
+	((gso->gso_type & ~V3_NET_GSO_ECN) != V3_NET_GSO_TCPV6)) {
+	PrintError("Unsupported GSO type %d\n", gso->gso_type);
+	return -1;
+    }
+
+    // The header length supplied by guests is not reliable, so parse the headers ourselves
+    if (parse_tcp_frame(pkt, len, &frame) == -1) {
+	PrintError("Could not parse TCP headers of GSO frame\n");
+	return -1;
+    }
+
+    if ((gso->gso_size == 0) || (frame.hdr_len + gso->gso_size > scratch_len)) {
+	PrintError("Invalid GSO segment size %d (header %d)\n", gso->gso_size, frame.hdr_len);
+	return -1;
+    }
+
+    seq    = get_be32(pkt + frame.l4_off + 4);
+    ip_id  = (frame.ipv6) ? 0 : get_be16(pkt + frame.l3_off + 4);
+    offset = frame.hdr_len;
+
+    do {
+	uint32_t payload = len - offset;
+	uint8_t  tcp_flags = pkt[frame.l4_off + 13];
+
+	if (payload > gso->gso_size) {
+	    payload = gso->gso_size;
+	}
+
+	memcpy(scratch, pkt, frame.hdr_len);
+	memcpy(scratch + frame.hdr_len, pkt + offset, payload);
+
+	put_be32(scratch + frame.l4_off + 4, seq);
+
+	if (!frame.ipv6) {
+	    put_be16(scratch + frame.l3_off + 4, ip_id + segs);
+	}
+
+	// FIN and PSH belong to the last segment, CWR to the first
+	if (offset + payload < len) {
+	    tcp_flags &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+	}
+
+	if (segs > 0) {
+	    tcp_flags &= ~TCP_FLAG_CWR;
+	}
+
+	scratch[frame.l4_off + 13] = tcp_flags;
+
+	fixup_tcp_segment(scratch, frame.hdr_len + payload, &frame);
+
+	if (xmit(scratch, frame.hdr_len + payload, private_data) < 0) {
+	    return -1;
+	}
+
+	seq    += payload;
+	offset += payload;
+	segs++;
+    } while (offset < len);
+
+    return segs;
+}
+
+
+int
+v3_net_gso_probe(uint8_t           * pkt,
+		 uint32_t            len,
+		 uint32_t            mtu,
+		 struct v3_net_gso * gso)
+{
+    struct tcp_frame frame;
+
+    if (parse_tcp_frame(pkt, len, &frame) == -1) {
+	return -1;
+    }
+
+    if (mtu <= (frame.hdr_len - frame.l3_off)) {
+	return -1;
+    }
+
+    memset(gso, 0, sizeof(struct v3_net_gso));
+
+    gso->flags    = V3_NET_F_DATA_VALID;
+    gso->gso_type = (frame.ipv6) ? V3_NET_GSO_TCPV6 : V3_NET_GSO_TCPV4;
+    gso->hdr_len  = frame.hdr_len;
+    gso->gso_size = mtu - (frame.hdr_len - frame.l3_off);
+
+    return 0;
+}
+
+
+uint32_t
+v3_net_flow_hash(uint8_t  * pkt,
+		 uint32_t   len)
+{
+    uint16_t eth_type = 0;
+    uint32_t off      = ETHERNET_HEADER_LEN;
+    uint32_t addrs    = 0;
+    uint32_t ports    = 0;
+    uint8_t  proto    = 0;
+    uint32_t hash     = 0;
+    int i = 0;
+
+    if (len < ETHERNET_HEADER_LEN + IPV4_HDR_MIN) {
+	return 0;
+    }
+
+    eth_type = get_be16(pkt + 12);
+
+    if (eth_type == ETH_TYPE_VLAN) {
+	eth_type = get_be16(pkt + 16);
+	off     += 4;
+    }
+
+    // XOR keeps the hash symmetric in source and destination
+    if (eth_type == ETH_TYPE_IPV4) {
+	uint32_t ihl = (pkt[off] & 0xf) * 4;
+
+	if ((ihl < IPV4_HDR_MIN) || (off + ihl > len)) {
+	    return 0;
+	}
+
+	proto  = pkt[off + 9];
+	addrs  = get_be32(pkt + off + 12) ^ get_be32(pkt + off + 16);
+
+	// Only the first fragment carries the ports
+	if (get_be16(pkt + off + 6) & 0x1fff) {
+	    proto = 0;
+	}
+
+	off   += ihl;
+    } else if (eth_type == ETH_TYPE_IPV6) {
+	if (off + IPV6_HDR_LEN > len) {
+	    return 0;
+	}
+
+	proto = pkt[off + 6];
+
+	for (i = 0; i < 16; i += 4) {
+	    addrs ^= get_be32(pkt + off + 8 + i) ^ get_be32(pkt + off + 24 + i);
+	}
+
+	off  += IPV6_HDR_LEN;
+    } else {
+	return 0;
+    }
+
+    if (((proto == IP_PROTO_TCP) || (proto == IP_PROTO_UDP)) && (off + 4 <= len)) {
+	ports = get_be16(pkt + off) ^ get_be16(pkt + off + 2);
+    }
+
+    hash  = addrs ^ (ports << 16) ^ ports ^ proto;
+
+    // finalizer from murmur3, spreads the bits so any subset can be used as an index
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
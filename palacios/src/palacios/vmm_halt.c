@@ -21,6 +21,7 @@
 #include <palacios/vmm_halt.h>
 #include <palacios/vmm_intr.h>
 #include <palacios/vmm_lowlevel.h> 
+#include <palacios/vmm_telemetry.h>
 
 #ifndef V3_CONFIG_DEBUG_HALT
 #undef PrintDebug
@@ -28,7 +29,102 @@
 #endif
 
 
-#define YIELD_TIME_USEC 1000
+#define YIELD_TIME_USEC      1000    // Polling interval for timers that cannot predict their next event
+#define DEFAULT_MAX_SLEEP_US 1000     // Bounds the delay if the host cannot sleep without missing a wakeup
+
+
+static inline void 
+halt_mb(void) 
+{
+    __asm__ __volatile__ ("mfence" : : : "memory");
+}
+
+
+int 
+v3_init_halt(struct v3_vm_info * vm) 
+{
+    struct v3_halt_state * halt_state = &(vm->halt_state);
+    v3_cfg_tree_t        * halt_cfg   = v3_cfg_subtree(vm->cfg_data->cfg, "halt");
+    char                 * poll_str   = v3_cfg_val(halt_cfg, "poll_us");
+    char                 * sleep_str  = v3_cfg_val(halt_cfg, "max_sleep_us");
+
+    halt_state->max_poll_cycles = 0;
+    halt_state->max_sleep_usec  = DEFAULT_MAX_SLEEP_US;
+
+    if (poll_str) {
+	halt_state->max_poll_cycles = ((uint64_t)atoi(poll_str) * V3_CPU_KHZ()) / 1000;
+    }
+
+    if ((sleep_str) && (atoi(sleep_str) > 0)) {
+	halt_state->max_sleep_usec = atoi(sleep_str);
+    }
+
+    V3_Print("Halt: poll window=%llu cycles, max sleep=%u us\n", 
+	     halt_state->max_poll_cycles, halt_state->max_sleep_usec);
+
+    return 0;
+}
+
+
+/* 
+ * The halting core publishes its state before its final check for interrupts, 
+ * and senders queue their interrupt before checking it here, so one side always sees the other.
+ */
+void 
+v3_wakeup_core(struct v3_core_info * core) 
+{
+    halt_mb();
+
+    if ((core->halt_state.halted) && (core->core_thread)) {
+	V3_Wakeup(core->core_thread);
+    }
+}
+
+
+static int 
+halt_done(void * arg) 
+{
+    struct v3_core_info * core = (struct v3_core_info *)arg;
+
+    return (v3_intr_pending(core) || (core->vm_info->run_state != VM_RUNNING));
+}
+
+
+/* Sleeps until woken, or the next timer event (whichever comes first) */
+static void 
+halt_sleep(struct v3_core_info * core) 
+{
+    struct v3_halt_state * halt_state = &(core->vm_info->halt_state);
+    uint32_t               guest_khz  = core->time_state.guest_cpu_freq;
+    uint64_t               poll       = ((uint64_t)YIELD_TIME_USEC * guest_khz) / 1000;
+    uint64_t               next       = v3_get_next_timer_event(core, poll);
+    uint64_t               usec       = halt_state->max_sleep_usec;
+
+    if ((next != V3_TIMER_NO_EVENT) && (guest_khz != 0)) {
+	next = (next * 1000) / guest_khz;
+
+	if (next < usec) {
+	    usec = next;
+	}
+    }
+
+    if (usec == 0) {
+	// A timer is already due, a zero length sleep would block until woken
+	return;
+    }
+
+    core->halt_state.halted = 1;
+    halt_mb();
+
+    if (!halt_done(core)) {
+	v3_telemetry_inc_core_counter(core, "HALT_SLEEPS");
+
+	// Checks for interrupts again once the core can no longer miss a wakeup
+	V3_SleepUntil(usec, halt_done, core);
+    }
+
+    core->halt_state.halted = 0;
+}
 
 
 //
@@ -42,29 +138,32 @@ v3_handle_halt(struct v3_core_info * core)
     if (core->cpl != 0) { 
 	v3_raise_exception(core, GPF_EXCEPTION);
     } else {
+	struct v3_core_halt_state * halt_state = &(core->halt_state);
+	uint64_t                    max_poll   = core->vm_info->halt_state.max_poll_cycles;
+	uint64_t                    start      = v3_get_host_time(&core->time_state);
+	int                         slept      = 0;
+
 	PrintDebug("CPU Yield\n");
 
 	while (!v3_intr_pending(core) && (core->vm_info->run_state == VM_RUNNING)) {
 	    uint64_t cycles = 0;
             uint64_t t      = 0;
 
-	    /* Yield, allowing time to pass while yielded */
-	    t      = v3_get_host_time(&core->time_state);
-	    v3_yield(core, YIELD_TIME_USEC);
+	    /* Spin for a while before giving up the CPU, then allow time to pass while asleep */
+	    t = v3_get_host_time(&core->time_state);
+
+	    if ((t - start) < halt_state->poll_cycles) {
+		__asm__ __volatile__ ("pause");
+	    } else {
+		halt_sleep(core);
+		slept = 1;
+	    }
+
 	    cycles = v3_get_host_time(&core->time_state) - t;
 
 	    v3_advance_time(core, &cycles);
 
 	    v3_update_timers(core);
-    	    
-	    /* At this point, we either have some combination of 
-	       interrupts, including perhaps a timer interrupt, or 
-	       no interrupt.
-	    */
-	    if (!v3_intr_pending(core)) {
-		/* if no interrupt, then we do halt */
-		/* asm("hlt"); */
-	    }
 
 	    // This is needed to ensure that an idled CPU can be reawoken via IPI
 	    v3_wait_at_barrier(core);
@@ -76,6 +175,23 @@ v3_handle_halt(struct v3_core_info * core)
 
 	}
 
+	if (max_poll) {
+	    uint64_t halt_cycles = v3_get_host_time(&core->time_state) - start;
+
+	    /* Grow the window if spinning a bit longer would have avoided the sleep, 
+	       shrink it if the core slept well past it */
+	    if ((slept) && (halt_cycles <= max_poll)) {
+		halt_state->poll_cycles = (halt_state->poll_cycles == 0) ? 
+		    (max_poll / 8) : (halt_state->poll_cycles * 2);
+
+		if (halt_state->poll_cycles > max_poll) {
+		    halt_state->poll_cycles = max_poll;
+		}
+	    } else if (slept) {
+		halt_state->poll_cycles /= 2;
+	    }
+	}
+
 	/* V3_Print("palacios: done with halt\n"); */
 	
 	core->rip += 1;
@@ -164,6 +164,9 @@ v3_hook_io_port(struct v3_vm_info * vm,
 	io_hook->write = write;
     }
 
+    io_hook->read_string  = NULL;
+    io_hook->write_string = NULL;
+
     io_hook->priv_data = priv_data;
 
     if (insert_io_hook(vm, io_hook)) {
@@ -186,6 +189,26 @@ v3_hook_io_port(struct v3_vm_info * vm,
 }
 
 
+int 
+v3_hook_io_port_string(struct v3_vm_info * vm, 
+		       uint16_t            port, 
+		       int (*read_string)( struct v3_core_info * core, uint16_t port, void * dst, uint_t length, uint_t count, void * priv_data),
+		       int (*write_string)(struct v3_core_info * core, uint16_t port, void * src, uint_t length, uint_t count, void * priv_data))
+{
+    struct v3_io_hook * hook = v3_get_io_hook(vm, port);
+
+    if (hook == NULL) {
+	PrintError("Could not find IO hook for port %u (0x%x) to add string handlers to\n", port, port);
+	return -1;
+    }
+
+    hook->read_string  = read_string;
+    hook->write_string = write_string;
+
+    return 0;
+}
+
+
 static int 
 free_hook(struct v3_vm_info * vm, 
 	  struct v3_io_hook * hook) 
@@ -224,6 +247,139 @@ v3_unhook_io_port(struct v3_vm_info * vm,
 
 
 
+uint_t 
+v3_io_string_count(addr_t   guest_va, 
+		   addr_t   offset, 
+		   uint64_t mask, 
+		   uint_t   length, 
+		   uint64_t max_count, 
+		   int      direction) 
+{
+    uint64_t page_left = 0;    /* Elements that fit after the first one */
+    uint64_t wrap_left = 0;
+    uint64_t count     = max_count;
+
+    if (direction == 1) {
+	page_left = (PAGE_SIZE_4KB - PAGE_OFFSET_4KB(guest_va)) / length;
+	// An element that straddles the page boundary is still done on its own
+	page_left = (page_left > 0) ? (page_left - 1) : 0;
+	wrap_left = (mask - (offset & mask)) / length;
+    } else {
+	page_left = PAGE_OFFSET_4KB(guest_va) / length;
+	wrap_left = (offset & mask) / length;
+    }
+
+    if (count <= 1) {
+	return 1;
+    }
+
+    if (page_left < (count - 1)) {
+	count = page_left + 1;
+    }
+
+    if (wrap_left < (count - 1)) {
+	count = wrap_left + 1;
+    }
+
+    return (uint_t)count;
+}
+
+
+int 
+v3_io_read_string(struct v3_core_info * core, 
+		  struct v3_io_hook   * hook, 
+		  uint16_t              port, 
+		  uint8_t             * dst, 
+		  addr_t                dst_gpa, 
+		  uint_t                length, 
+		  uint_t                count, 
+		  int                   direction) 
+{
+    int    step = length * direction;
+    uint_t done = 0;
+
+    // With DF=1 the elements are stored below dst
+    if (direction == 1) {
+	v3_mark_range_dirty(core->vm_info, dst_gpa, length * count);
+    } else {
+	v3_mark_range_dirty(core->vm_info, dst_gpa - (length * (count - 1)), length * count);
+    }
+
+    if (hook == NULL) {
+	PrintDebug("INS operation on unhooked IO port 0x%x - returning zeros\n", port);
+
+	for (done = 0; done < count; done++, dst += step) {
+	    memset(dst, 0, length);
+	}
+
+	return count;
+    }
+
+    // The string handlers fill the buffer in ascending order, so DF=1 copies go one at a time
+    if ((hook->read_string) && (direction == 1)) {
+	int ret = hook->read_string(core, port, dst, length, count, hook->priv_data);
+
+	if ((ret < 0) || ((uint_t)ret > count)) {
+	    PrintError("Read Failure for string INS on port 0x%x\n", port);
+	    return -1;
+	}
+
+	done  = ret;
+	dst  += done * length;
+    }
+
+    for (; done < count; done++, dst += step) {
+	if (hook->read(core, port, dst, length, hook->priv_data) != length) {
+	    PrintError("Read Failure for INS on port 0x%x\n", port);
+	    return -1;
+	}
+    }
+
+    return count;
+}
+
+
+int 
+v3_io_write_string(struct v3_core_info * core, 
+		   struct v3_io_hook   * hook, 
+		   uint16_t              port, 
+		   uint8_t             * src, 
+		   uint_t                length, 
+		   uint_t                count, 
+		   int                   direction) 
+{
+    int    step = length * direction;
+    uint_t done = 0;
+
+    if (hook == NULL) {
+	PrintDebug("OUTS operation on unhooked IO port 0x%x - ignored\n", port);
+	return count;
+    }
+
+    if ((hook->write_string) && (direction == 1)) {
+	int ret = hook->write_string(core, port, src, length, count, hook->priv_data);
+
+	if ((ret < 0) || ((uint_t)ret > count)) {
+	    PrintError("Write Failure for string OUTS on port 0x%x\n", port);
+	    return -1;
+	}
+
+	done  = ret;
+	src  += done * length;
+    }
+
+    for (; done < count; done++, src += step) {
+	if (hook->write(core, port, src, length, hook->priv_data) != length) {
+	    PrintError("Write Failure for OUTS on port 0x%x\n", port);
+	    return -1;
+	}
+    }
+
+    return count;
+}
+
+
+
 void 
 v3_refresh_io_map(struct v3_vm_info * vm) 
 {
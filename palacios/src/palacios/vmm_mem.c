@@ -31,6 +31,8 @@
 #define MEM_BLOCK_SIZE_BYTES ((uint64_t)(V3_CONFIG_MEM_BLOCK_SIZE_MB * (1024 * 1024)))
 
 
+static int take_reserve_block(struct v3_vm_info * vm, struct v3_mem_region * region);
+
 
 struct v3_mem_region * 
 v3_get_base_region(struct v3_vm_info * vm, 
@@ -54,6 +56,13 @@ v3_get_base_region(struct v3_vm_info * vm,
 	return NULL;
     }
 
+    /* Lookups can come from atomic context, so this only takes a preallocated block */
+    if (map->base_regions[block_index].flags.alloced == 0) {
+	if (take_reserve_block(vm, &(map->base_regions[block_index])) == -1) {
+	    PrintDebug("Base region for gpa %p is not populated\n", (void *)gpa);
+	    return NULL;
+	}
+    }
 
     return &(map->base_regions[block_index]);
 }
@@ -70,6 +79,12 @@ v3_get_guest_memory_regions(struct v3_vm_info * vm,
     
     *num_regions = 0;
 
+    /* The host is going to map these directly, so they must all be backed */
+    if (v3_populate_mem_map(vm) == -1) {
+	PrintError("Could not populate guest memory\n");
+	return NULL;
+    }
+
     reg_arr = V3_Malloc(sizeof(struct v3_guest_mem_region) *  map->num_base_blocks);
 
 
@@ -175,23 +190,724 @@ gpa_to_node_from_cfg(struct v3_vm_info * vm,
 
 
 
+/* Orders the contents of a region before the flag that publishes it */
+#define mem_wmb() __asm__ __volatile__ ("sfence" : : : "memory")
+
+/* Work left for the memory thread on a base region, see map->region_state */
+#define REGION_UNREGISTERED 0x1       /* Backed from a reserve, not yet registered for checkpointing */
+#define REGION_WANTED       0x2       /* A lookup that could not sleep found it unpopulated          */
+
+/* Besides being kicked, the memory thread wakes up now and then to trim the reserves */
+#define MEM_THREAD_SLEEP_US 1000000
+
+
+static addr_t
+alloc_base_block(int numa_id) 
+{
+    addr_t block_pages = MEM_BLOCK_SIZE_BYTES >> 12;
+    addr_t block       = 0;
+
+    if (numa_id != -1) {
+	block = (addr_t)V3_AllocPagesNode(block_pages, numa_id);
+    } else {
+	block = (addr_t)V3_AllocPages(block_pages);
+    }
+
+    if ((void *)block == NULL) { 
+	return 0;
+    }
+
+    // Clear the memory...
+    memset(V3_VAddr((void *)block), 0, MEM_BLOCK_SIZE_BYTES);
+
+    return block;
+}
+
+
+static void
+register_base_region(struct v3_vm_info    * vm, 
+		     struct v3_mem_region * region) 
+{
+#ifdef V3_CONFIG_CHECKPOINT
+    char reg_str[32] = {[0 ... 31] = 0};
+
+    snprintf(reg_str, 32, "mem-region-%d", (int)(region->guest_start / MEM_BLOCK_SIZE_BYTES));
+    v3_checkpoint_register_guest_mem(vm, reg_str, 
+				     V3_VAddr((void *)region->host_addr),
+				     MEM_BLOCK_SIZE_BYTES);
+#endif
+}
+
+
+/* Safe from any context */
+static void 
+kick_mem_thread(struct v3_mem_map * map) 
+{
+    map->mem_thread_kick = 1;
+
+    if (map->mem_thread) {
+	V3_Wakeup(map->mem_thread);
+    }
+}
+
+
+/* 
+ * Called by lookups that find an unpopulated region, without sleeping
+ *  since they are made from exit handlers and device code holding spinlocks.
+ *  The region is backed with a block from its NUMA node's reserve, 
+ *  or from another node's if that one is empty.
+ *  Regions that must be filled in by populate_fn, or that no reserve can back, 
+ *  are left for the memory thread to populate and the lookup fails.
+ */
+static int 
+take_reserve_block(struct v3_vm_info    * vm, 
+		   struct v3_mem_region * region) 
+{
+    struct v3_mem_map     * map         = &(vm->mem_map);
+    struct v3_mem_reserve * reserve     = NULL;
+    uint32_t                block_index = region->guest_start / MEM_BLOCK_SIZE_BYTES;
+    uint64_t                flags       = 0;
+    int                     ret         = -1;
+    int i = 0;
+
+    flags = v3_spin_lock_irqsave(&(map->reserve_lock));
+    {
+	if (region->flags.alloced == 1) {
+	    v3_spin_unlock_irqrestore(&(map->reserve_lock), flags);
+	    return 0;
+	}
+
+	if ((region->host_addr == 0) && (map->populate_fn == NULL)) {
+	    for (i = 0; i < map->num_reserves; i++) {
+		if (map->reserves[i].num_blocks == 0) {
+		    continue;
+		}
+
+		if ((reserve == NULL) || (map->reserves[i].numa_id == region->numa_id)) {
+		    reserve = &(map->reserves[i]);
+		}
+	    }
+	}
+
+	if (reserve) {
+	    reserve->num_blocks--;
+	    region->host_addr = reserve->blocks[reserve->num_blocks];
+	    map->region_state[block_index] |= REGION_UNREGISTERED;
+
+	    mem_wmb();
+	    region->flags.alloced = 1;
+	    ret = 0;
+	} else {
+	    map->region_state[block_index] |= REGION_WANTED;
+	}
+    }
+    v3_spin_unlock_irqrestore(&(map->reserve_lock), flags);
+
+    // Either the reserve needs refilling, or the region populating
+    kick_mem_thread(map);
+
+    return ret;
+}
+
+
+/* 
+ * Allocates and zeroes the host memory backing a base region
+ *  This is called at initialization time for eagerly allocated guests, 
+ *  and from the guest's page faults and the memory thread for lazily allocated ones. 
+ *  It can sleep, so it must never be reached from a lookup.
+ *  Regions unpopulated by v3_set_mem_populate_fn() keep their memory, 
+ *  and only have the populate function run over them.
+ */
+static int
+populate_base_region(struct v3_vm_info    * vm, 
+		     struct v3_mem_region * region) 
+{
+    struct v3_mem_map * map   = &(vm->mem_map);
+    addr_t              block = 0;
+    uint64_t            flags = 0;
+    int                 ret   = 0;
+
+    if (map->lazy_alloc) {
+	v3_mutex_lock(map->populate_lock);
+
+	/* Another core got here first */
+	if (region->flags.alloced == 1) {
+	    v3_mutex_unlock(map->populate_lock);
+	    return 0;
+	}
+    }
+
+    if (region->host_addr == 0) {
+	PrintDebug("Allocating block %d on node %d\n", 
+		   (int)(region->guest_start / MEM_BLOCK_SIZE_BYTES), region->numa_id);
+
+	block = alloc_base_block(region->numa_id);
+
+	if (block == 0) {
+	    PrintError("Could not allocate guest memory\n");
+	    ret = -1;
+	    goto out;
+	}
+
+	flags = v3_spin_lock_irqsave(&(map->reserve_lock));
+	{
+	    if (region->host_addr == 0) {
+		region->host_addr = block;
+		block = 0;
+	    }
+	}
+	v3_spin_unlock_irqrestore(&(map->reserve_lock), flags);
+
+	/* A lookup backed the region from a reserve while this one was cleared */
+	if (block != 0) {
+	    V3_FreePages((void *)block, MEM_BLOCK_SIZE_BYTES >> 12);
+	    goto out;
+	}
+
+	register_base_region(vm, region);
+    }
+
+    if (map->populate_fn) {
+	if (map->populate_fn(vm, region, map->populate_priv) == -1) {
+	    PrintError("Could not fill base region %d\n", 
+		       (int)(region->guest_start / MEM_BLOCK_SIZE_BYTES));
+	    ret = -1;
+	    goto out;
+	}
+    }
+
+    /* This must be set last, it is checked without holding the lock */
+    mem_wmb();
+    region->flags.alloced = 1;
+
+ out:
+    if (map->lazy_alloc) {
+	v3_mutex_unlock(map->populate_lock);
+    }
+
+    return ret;
+}
+
 
 int 
-v3_init_mem_map(struct v3_vm_info * vm) 
+v3_populate_base_region(struct v3_vm_info * vm, 
+			addr_t              gpa) 
+{
+    struct v3_mem_map * map         = &(vm->mem_map);
+    uint64_t            block_index = gpa / MEM_BLOCK_SIZE_BYTES;
+
+    /* Addresses outside of base memory are reported by the lookup */
+    if (block_index >= map->num_base_blocks) {
+	return 0;
+    }
+
+    if (map->base_regions[block_index].flags.alloced == 1) {
+	return 0;
+    }
+
+    return populate_base_region(vm, &(map->base_regions[block_index]));
+}
+
+
+int 
+v3_populate_gpa_range(struct v3_vm_info * vm, 
+		      addr_t              gpa, 
+		      uint64_t            len) 
+{
+    struct v3_mem_map * map       = &(vm->mem_map);
+    uint64_t            start_idx = gpa / MEM_BLOCK_SIZE_BYTES;
+    uint64_t            end_idx   = 0;
+    uint64_t            i         = 0;
+
+    if ((map->lazy_alloc == 0) || (len == 0)) {
+	return 0;
+    }
+
+    end_idx = ((gpa + len - 1) / MEM_BLOCK_SIZE_BYTES) + 1;
+
+    /* Addresses outside of base memory are reported by the lookup */
+    if (end_idx > map->num_base_blocks) {
+	end_idx = map->num_base_blocks;
+    }
+
+    for (i = start_idx; i < end_idx; i++) {
+	if (map->base_regions[i].flags.alloced == 1) {
+	    continue;
+	}
+
+	if (populate_base_region(vm, &(map->base_regions[i])) == -1) {
+	    PrintError("Could not populate base region %d\n", (int)i);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+
+int 
+v3_try_populate_gpa_range(struct v3_vm_info * vm, 
+			  addr_t              gpa, 
+			  uint64_t            len) 
+{
+    struct v3_mem_map * map       = &(vm->mem_map);
+    uint64_t            start_idx = gpa / MEM_BLOCK_SIZE_BYTES;
+    uint64_t            end_idx   = 0;
+    uint64_t            i         = 0;
+    int                 ret       = 0;
+
+    if ((map->lazy_alloc == 0) || (len == 0)) {
+	return 0;
+    }
+
+    end_idx = ((gpa + len - 1) / MEM_BLOCK_SIZE_BYTES) + 1;
+
+    if (end_idx > map->num_base_blocks) {
+	end_idx = map->num_base_blocks;
+    }
+
+    // Ask for every missing region, so the memory thread can get them all in one pass
+    for (i = start_idx; i < end_idx; i++) {
+	if (map->base_regions[i].flags.alloced == 1) {
+	    continue;
+	}
+
+	if (take_reserve_block(vm, &(map->base_regions[i])) == -1) {
+	    ret = -1;
+	}
+    }
+
+    return ret;
+}
+
+
+/* Clears the state bits in mask, returning whether any were set */
+static int 
+test_and_clear_region_state(struct v3_mem_map * map, 
+			    int                 index, 
+			    uint8_t             mask) 
+{
+    uint64_t flags = 0;
+    int      set   = 0;
+
+    flags = v3_spin_lock_irqsave(&(map->reserve_lock));
+    {
+	set = ((map->region_state[index] & mask) != 0);
+	map->region_state[index] &= ~mask;
+    }
+    v3_spin_unlock_irqrestore(&(map->reserve_lock), flags);
+
+    return set;
+}
+
+
+/* Checkpoint registration can sleep, so it is done here for regions backed from a reserve */
+static void 
+register_reserved_regions(struct v3_vm_info * vm) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+    int i = 0;
+
+    if (map->num_reserves == 0) {
+	return;
+    }
+
+    v3_mutex_lock(map->populate_lock);
+
+    for (i = 0; i < map->num_base_blocks; i++) {
+	if (test_and_clear_region_state(map, i, REGION_UNREGISTERED)) {
+	    register_base_region(vm, &(map->base_regions[i]));
+	}
+    }
+
+    v3_mutex_unlock(map->populate_lock);
+}
+
+
+/* 
+ * Tops each reserve up to reserve_depth blocks on its own node, 
+ *  but never beyond the number of regions on that node that still lack memory
+ */
+static void 
+refill_reserves(struct v3_vm_info * vm) 
 {
     struct v3_mem_map * map         = &(vm->mem_map);
     addr_t              block_pages = MEM_BLOCK_SIZE_BYTES >> 12;
+    uint64_t            flags       = 0;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < map->num_reserves; i++) {
+	struct v3_mem_reserve * reserve  = &(map->reserves[i]);
+	int                     unbacked = 0;
+	int                     target   = 0;
+	addr_t                  block    = 0;
+
+	for (j = 0; j < map->num_base_blocks; j++) {
+	    if ((map->base_regions[j].numa_id   == reserve->numa_id) && 
+		(map->base_regions[j].host_addr == 0)) {
+		unbacked++;
+	    }
+	}
+
+	target = (unbacked < map->reserve_depth) ? unbacked : map->reserve_depth;
+
+	// Only this thread adds blocks, lookups can only take them away in the meantime
+	while (reserve->num_blocks < target) {
+	    block = alloc_base_block(reserve->numa_id);
+
+	    if (block == 0) {
+		PrintError("Could not refill guest memory reserve on node %d\n", reserve->numa_id);
+		break;
+	    }
+
+	    flags = v3_spin_lock_irqsave(&(map->reserve_lock));
+	    reserve->blocks[reserve->num_blocks++] = block;
+	    v3_spin_unlock_irqrestore(&(map->reserve_lock), flags);
+	}
+
+	// Faults populated regions on their own, so give back what can no longer be used
+	while (reserve->num_blocks > target) {
+	    block = 0;
+
+	    flags = v3_spin_lock_irqsave(&(map->reserve_lock));
+	    if (reserve->num_blocks > target) {
+		block = reserve->blocks[--reserve->num_blocks];
+	    }
+	    v3_spin_unlock_irqrestore(&(map->reserve_lock), flags);
+
+	    if (block) {
+		V3_FreePages((void *)block, block_pages);
+	    }
+	}
+    }
+}
+
+
+static int 
+mem_thread_woken(void * arg) 
+{
+    struct v3_mem_map * map = (struct v3_mem_map *)arg;
+
+    return ((*(volatile int *)&(map->mem_thread_kick)) || 
+	    (*(volatile int *)&(map->mem_thread_stop)));
+}
+
+
+static int 
+mem_thread_fn(void * arg) 
+{
+    struct v3_vm_info * vm  = (struct v3_vm_info *)arg;
+    struct v3_mem_map * map = &(vm->mem_map);
+    int i = 0;
+
+    while (*(volatile int *)&(map->mem_thread_stop) == 0) {
+	// Cleared before looking for work, so kicks made during it are not lost
+	map->mem_thread_kick = 0;
+
+	for (i = 0; i < map->num_base_blocks; i++) {
+	    if (test_and_clear_region_state(map, i, REGION_WANTED) == 0) {
+		continue;
+	    }
+
+	    // A lookup will ask again if this fails
+	    if (populate_base_region(vm, &(map->base_regions[i])) == -1) {
+		PrintError("Could not populate base region %d\n", i);
+	    }
+	}
+
+	register_reserved_regions(vm);
+	refill_reserves(vm);
+
+	V3_SleepUntil(MEM_THREAD_SLEEP_US, mem_thread_woken, map);
+    }
+
+    map->mem_thread_active = 0;
+
+    return 0;
+}
+
+
+static int 
+start_mem_thread(struct v3_vm_info * vm) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+
+    if (map->mem_thread) {
+	return 0;
+    }
+
+    map->mem_thread_stop   = 0;
+    map->mem_thread_active = 1;
+
+    map->mem_thread = V3_CREATE_THREAD_ON_CPU(V3_Get_CPU(), mem_thread_fn, vm, "palacios-mem");
+
+    if (map->mem_thread == NULL) {
+	PrintError("Could not start guest memory thread\n");
+	map->mem_thread_active = 0;
+	return -1;
+    }
+
+    V3_START_THREAD(map->mem_thread);
+
+    return 0;
+}
+
+
+static void 
+stop_mem_thread(struct v3_vm_info * vm) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+
+    if (map->mem_thread == NULL) {
+	return;
+    }
+
+    map->mem_thread_stop = 1;
+    kick_mem_thread(map);
+
+    while (*(volatile int *)&(map->mem_thread_active)) {
+	V3_Yield();
+    }
+
+    map->mem_thread = NULL;
+}
+
+
+/* One reserve for each NUMA node that holds guest memory */
+static int 
+init_reserves(struct v3_vm_info * vm, 
+	      v3_cfg_tree_t     * mem_cfg) 
+{
+    struct v3_mem_map * map         = &(vm->mem_map);
+    char              * reserve_str = v3_cfg_val(mem_cfg, "reserve");
+    int i = 0;
+    int j = 0;
+
+    // Each core can be in the middle of one lookup that cannot sleep
+    map->reserve_depth = (reserve_str) ? atoi(reserve_str) : vm->num_cores;
+
+    if (map->reserve_depth <= 0) {
+	map->reserve_depth = 0;
+	return 0;
+    }
+
+    map->reserves = V3_Malloc(sizeof(struct v3_mem_reserve) * map->num_base_blocks);
+
+    if (map->reserves == NULL) {
+	PrintError("Could not allocate guest memory reserves\n");
+	return -1;
+    }
+
+    memset(map->reserves, 0, sizeof(struct v3_mem_reserve) * map->num_base_blocks);
+
+    for (i = 0; i < map->num_base_blocks; i++) {
+	int numa_id = map->base_regions[i].numa_id;
+
+	for (j = 0; j < map->num_reserves; j++) {
+	    if (map->reserves[j].numa_id == numa_id) {
+		break;
+	    }
+	}
+
+	if (j < map->num_reserves) {
+	    continue;
+	}
+
+	map->reserves[j].numa_id = numa_id;
+	map->reserves[j].blocks  = V3_Malloc(sizeof(addr_t) * map->reserve_depth);
+
+	if (map->reserves[j].blocks == NULL) {
+	    PrintError("Could not allocate guest memory reserve for node %d\n", numa_id);
+	    return -1;
+	}
+
+	map->num_reserves++;
+    }
+
+    return 0;
+}
+
+
+static void 
+free_reserves(struct v3_vm_info * vm) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+    int i = 0;
+    int j = 0;
+
+    if (map->reserves == NULL) {
+	return;
+    }
+
+    for (i = 0; i < map->num_reserves; i++) {
+	for (j = 0; j < map->reserves[i].num_blocks; j++) {
+	    V3_FreePages((void *)(map->reserves[i].blocks[j]), MEM_BLOCK_SIZE_BYTES >> 12);
+	}
+
+	V3_Free(map->reserves[i].blocks);
+    }
+
+    V3_Free(map->reserves);
+
+    map->reserves     = NULL;
+    map->num_reserves = 0;
+}
+
+
+int 
+v3_populate_mem_map(struct v3_vm_info * vm) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+    int i = 0;
+
+    /* Regions backed from a reserve may not have been registered yet */
+    register_reserved_regions(vm);
+
+    for (i = 0; i < map->num_base_blocks; i++) {
+	struct v3_mem_region * region = &(map->base_regions[i]);
+
+	if (region->flags.alloced == 1) {
+	    continue;
+	}
+
+	if (populate_base_region(vm, region) == -1) {
+	    PrintError("Could not populate base region %d\n", i);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+
+/* 
+ * The VM must not have run yet, since existing guest mappings of the regions 
+ *  would bypass the populate path. The map is switched to lazy mode, 
+ *  so first accesses from several cores are serialized on the populate lock.
+ */
+int 
+v3_set_mem_populate_fn(struct v3_vm_info * vm, 
+		       int (*fn)(struct v3_vm_info * vm, struct v3_mem_region * region, void * priv), 
+		       void * priv) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+    int i = 0;
+
+    if (map->populate_fn) {
+	PrintError("Memory populate function is already set\n");
+	return -1;
+    }
+
+    if (map->populate_lock == NULL) {
+	map->populate_lock = v3_mutex_init();
+
+	if (map->populate_lock == NULL) {
+	    PrintError("Could not allocate memory population lock\n");
+	    return -1;
+	}
+    }
+
+    // Regions that lookups cannot wait for are restored in the background
+    if (start_mem_thread(vm) == -1) {
+	return -1;
+    }
+
+    map->lazy_alloc    = 1;
+    map->populate_fn   = fn;
+    map->populate_priv = priv;
+
+    for (i = 0; i < map->num_base_blocks; i++) {
+	map->base_regions[i].flags.alloced = 0;
+    }
+
+    map->generation++;
+
+    return 0;
+}
+
+
+int 
+v3_clear_mem_populate_fn(struct v3_vm_info * vm) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+
+    if (map->populate_lock == NULL) {
+	return 0;
+    }
+
+    v3_mutex_lock(map->populate_lock);
+    {
+	map->populate_fn   = NULL;
+	map->populate_priv = NULL;
+    }
+    v3_mutex_unlock(map->populate_lock);
+
+    return 0;
+}
+
+
+int 
+v3_init_mem_map(struct v3_vm_info * vm) 
+{
+    struct v3_mem_map * map          = &(vm->mem_map);
+    v3_cfg_tree_t     * mem_cfg      = v3_cfg_subtree(vm->cfg_data->cfg, "memory");
+    char              * alloc_str    = v3_cfg_val(mem_cfg, "alloc");
+    char              * prefault_str = v3_cfg_val(mem_cfg, "prefault");
     int i = 0;
 
     map->mem_regions.rb_node = NULL;    
+    map->generation          = 1;
     map->num_base_blocks     = (vm->mem_size / MEM_BLOCK_SIZE_BYTES) + \
 	                       ((vm->mem_size % MEM_BLOCK_SIZE_BYTES) > 0);
 
     map->base_regions        = V3_Malloc(sizeof(struct v3_mem_region) * map->num_base_blocks);
 
+    if (map->base_regions == NULL) {
+	PrintError("Could not allocate base region array\n");
+	return -1;
+    }
+
     memset(map->base_regions, 0, sizeof(struct v3_mem_region) * map->num_base_blocks);
+
+    map->region_state = V3_Malloc(map->num_base_blocks);
+
+    if (map->region_state == NULL) {
+	PrintError("Could not allocate base region state\n");
+	return -1;
+    }
+
+    memset(map->region_state, 0, map->num_base_blocks);
+
+    if (v3_spinlock_init(&(map->reserve_lock)) == -1) {
+	PrintError("Could not initialize memory reserve lock\n");
+	return -1;
+    }
+
+    if ((alloc_str) && (strcasecmp(alloc_str, "lazy") == 0)) {
+	map->lazy_alloc    = 1;
+	map->populate_lock = v3_mutex_init();
+
+	if (map->populate_lock == NULL) {
+	    PrintError("Could not allocate memory population lock\n");
+	    return -1;
+	}
+    } else if ((alloc_str) && (strcasecmp(alloc_str, "eager") != 0)) {
+	PrintError("Invalid memory allocation mode (%s)\n", alloc_str);
+	return -1;
+    }
 	
-    V3_Print("Initializing memory map with %d mem blocks\n", map->num_base_blocks);
+    // Prefaulting would populate all of memory, defeating lazy allocation
+    if ((prefault_str) && (strcasecmp(prefault_str, "true") == 0)) {
+	if (map->lazy_alloc) {
+	    V3_Print("Ignoring nested page table prefault with lazy memory allocation\n");
+	} else {
+	    map->prefault = 1;
+	}
+    }
+
+    V3_Print("Initializing memory map with %d mem blocks (%s allocation)\n", 
+	     map->num_base_blocks, (map->lazy_alloc) ? "lazy" : "eager");
 
     for (i = 0; i < map->num_base_blocks; i++) {
 	struct v3_mem_region * region  = &(map->base_regions[i]);
@@ -201,44 +917,41 @@ v3_init_mem_map(struct v3_vm_info * vm)
 	region->guest_end   = region->guest_start + MEM_BLOCK_SIZE_BYTES;
 	region->numa_id     = gpa_to_node_from_cfg(vm, region->guest_start);
 	
-	V3_Print("Allocating block %d on node %d\n", i, region->numa_id);
-	
-	if (region->numa_id != -1) {
-	    region->host_addr = (addr_t)V3_AllocPagesNode(block_pages, region->numa_id);
-	} else {
-	    region->host_addr = (addr_t)V3_AllocPages(block_pages);
-	}
-
-	if ((void *)region->host_addr == NULL) { 
-	    PrintError("Could not allocate guest memory\n");
-	    return -1;
-	}
-	
-	// Clear the memory...
-	memset(V3_VAddr((void *)region->host_addr), 0, MEM_BLOCK_SIZE_BYTES);
-	
 	region->flags.read     = 1;
 	region->flags.write    = 1;
 	region->flags.exec     = 1;
 	region->flags.base     = 1;
-	region->flags.alloced  = 1;
+	region->flags.alloced  = 0;
 
 	region->unhandled      = unhandled_err;
 	region->translate      = NULL;
 
-	
-#ifdef V3_CONFIG_CHECKPOINT
-	{
-	    char reg_str[32] = {[0 ... 31] = 0};
-	    snprintf(reg_str, 32, "mem-region-%d", i);
-	    v3_checkpoint_register_nocopy(vm, reg_str, 
-					  V3_VAddr((void *)region->host_addr),
-					  MEM_BLOCK_SIZE_BYTES);
+	// The first block holds the BIOS images that are copied in during setup
+	if ((map->lazy_alloc) && (i > 0)) {
+	    continue;
+	}
+
+	V3_Print("Allocating block %d on node %d\n", i, region->numa_id);
+
+	if (populate_base_region(vm, region) == -1) {
+	    return -1;
 	}
-#endif
     }
 
 
+    // Backs regions first touched by lookups that cannot sleep
+    if (map->lazy_alloc) {
+	if (init_reserves(vm, mem_cfg) == -1) {
+	    return -1;
+	}
+
+	refill_reserves(vm);
+
+	if (start_mem_thread(vm) == -1) {
+	    return -1;
+	}
+    }
+
     v3_register_hypercall(vm, MEM_OFFSET_HCALL, mem_offset_hypercall, NULL);
 
     return 0;
@@ -256,6 +969,8 @@ v3_delete_mem_map(struct v3_vm_info * vm)
     int    i = 0;
     
 
+    stop_mem_thread(vm);
+
     while (node) {
 	reg      = rb_entry(node, struct v3_mem_region, tree_node);
 	tmp_node = node;
@@ -267,10 +982,26 @@ v3_delete_mem_map(struct v3_vm_info * vm)
     
     for (i = 0; i < map->num_base_blocks; i++) {
 	struct v3_mem_region * region = &(map->base_regions[i]);
+
+	if (region->host_addr == 0) {
+	    continue;
+	}
+
 	V3_FreePages((void *)(region->host_addr), block_pages);
     }
 
+    free_reserves(vm);
+
+    v3_spinlock_deinit(&(map->reserve_lock));
+
+    V3_Free(map->region_state);
     V3_Free(map->base_regions);
+
+    v3_stop_dirty_tracking(vm);
+
+    if (map->populate_lock) {
+	v3_mutex_deinit(map->populate_lock);
+    }
 }
 
 
@@ -394,6 +1125,7 @@ v3_insert_mem_region(struct v3_vm_info    * vm,
 
     v3_rb_insert_color(&(region->tree_node), &(vm->mem_map.mem_regions));
 
+    vm->mem_map.generation++;
 
 
     for (i = 0; i < vm->num_cores; i++) {
@@ -417,18 +1149,12 @@ v3_insert_mem_region(struct v3_vm_info    * vm,
 		v3_invalidate_shadow_pts(core);
 	    }
 	    
-	} else if (core->shdw_pg_mode == NESTED_PAGING) {
-	    addr_t cur_addr;
-	    
-	    for (cur_addr = region->guest_start;
-		 cur_addr < region->guest_end;
-		 cur_addr += PAGE_SIZE_4KB) {
-		
-		v3_invalidate_nested_addr(core, cur_addr);
-	    }
 	}
     }
 
+    // Nested page tables are invalidated once for the whole VM
+    v3_invalidate_nested_range(vm, region->guest_start, region->guest_end);
+
     return 0;
 }
 						 
@@ -600,6 +1326,29 @@ get_overlapping_region(struct v3_vm_info * vm,
 }
 
 
+struct v3_mem_region * 
+v3_get_uniform_region(struct v3_vm_info * vm, 
+		      addr_t              start_gpa, 
+		      addr_t              end_gpa) 
+{
+    struct v3_mem_region * reg = get_overlapping_region(vm, 0, start_gpa, end_gpa);
+    int i = 0;
+
+    if (reg == NULL) {
+	return NULL;
+    }
+
+    // Core specific regions can shadow parts of the range on other cores
+    for (i = 1; i < vm->num_cores; i++) {
+	if (get_overlapping_region(vm, i, start_gpa, end_gpa) != reg) {
+	    return NULL;
+	}
+    }
+
+    return reg;
+}
+
+
 
 
 
@@ -616,6 +1365,8 @@ v3_delete_mem_region(struct v3_vm_info    * vm,
 
     v3_rb_erase(&(reg->tree_node), &(vm->mem_map.mem_regions));
 
+    vm->mem_map.generation++;
+
     // If the guest isn't running then there shouldn't be anything to invalidate. 
     // Page tables should __always__ be created on demand during execution
     // NOTE: This is a sanity check, and can be removed if that assumption changes
@@ -645,18 +1396,12 @@ v3_delete_mem_region(struct v3_vm_info    * vm,
 		v3_invalidate_shadow_pts(core);
 	    }
 	    
-	} else if (core->shdw_pg_mode == NESTED_PAGING) {
-	    addr_t cur_addr;
-	    
-	    for (cur_addr = reg->guest_start;
-		 cur_addr < reg->guest_end;
-		 cur_addr += PAGE_SIZE_4KB) {
-		
-		v3_invalidate_nested_addr(core, cur_addr);
-	    }
 	}
     }
 
+    // Nested page tables are invalidated once for the whole VM
+    v3_invalidate_nested_range(vm, reg->guest_start, reg->guest_end);
+
     V3_Free(reg);
 
     // flush virtual page tables 
@@ -664,6 +1409,130 @@ v3_delete_mem_region(struct v3_vm_info    * vm,
 
 }
 
+
+
+int 
+v3_start_dirty_tracking(struct v3_vm_info * vm) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+    int i = 0;
+
+    if (map->track_dirty) {
+	PrintError("Dirty page tracking is already active\n");
+	return -1;
+    }
+
+    for (i = 0; i < vm->num_cores; i++) {
+	if (vm->cores[i].shdw_pg_mode != NESTED_PAGING) {
+	    PrintError("Dirty page tracking requires nested paging (core %d)\n", i);
+	    return -1;
+	}
+    }
+
+    if (v3_bitmap_init(&(map->dirty_pages), vm->mem_size >> 12) == -1) {
+	PrintError("Could not allocate dirty page bitmap\n");
+	return -1;
+    }
+
+    map->track_dirty = 1;
+
+    if (v3_write_protect_nested_pts(vm) == -1) {
+	PrintError("Could not write protect nested page tables\n");
+	v3_stop_dirty_tracking(vm);
+	return -1;
+    }
+
+    return 0;
+}
+
+
+int 
+v3_stop_dirty_tracking(struct v3_vm_info * vm) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+
+    if (map->track_dirty == 0) {
+	return 0;
+    }
+
+    /* Pages that are still write protected are fixed up by the next write fault */
+    map->track_dirty = 0;
+    v3_bitmap_deinit(&(map->dirty_pages));
+
+    return 0;
+}
+
+
+int 
+v3_collect_dirty_pages(struct v3_vm_info * vm, 
+		       struct v3_bitmap  * dirty) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+
+    if (map->track_dirty == 0) {
+	PrintError("Dirty page tracking is not active\n");
+	return -1;
+    }
+
+    if (v3_bitmap_drain(dirty, &(map->dirty_pages)) == -1) {
+	PrintError("Could not collect dirty page bitmap\n");
+	return -1;
+    }
+
+    if (v3_write_protect_nested_pts(vm) == -1) {
+	PrintError("Could not write protect nested page tables\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+
+void 
+v3_mark_page_dirty(struct v3_vm_info * vm, 
+		   addr_t              gpa) 
+{
+    struct v3_mem_map * map = &(vm->mem_map);
+
+    if (map->track_dirty == 0) {
+	return;
+    }
+
+    if ((gpa >> 12) >= map->dirty_pages.num_bits) {
+	return;
+    }
+
+    v3_bitmap_set(&(map->dirty_pages), gpa >> 12);
+}
+
+
+void 
+v3_mark_range_dirty(struct v3_vm_info * vm, 
+		    addr_t              gpa, 
+		    uint64_t            len) 
+{
+    struct v3_mem_map * map     = &(vm->mem_map);
+    uint64_t            num_pgs = map->dirty_pages.num_bits;
+    uint64_t            start   = gpa >> 12;
+    uint64_t            end     = 0;
+
+    if ((map->track_dirty == 0) || (len == 0) || (start >= num_pgs)) {
+	return;
+    }
+
+    // Only base memory is tracked, so clip the range there rather than walking past it
+    end = (len >= (num_pgs << 12)) ? num_pgs : ((gpa + len - 1) >> 12) + 1;
+
+    if (end > num_pgs) {
+	end = num_pgs;
+    }
+
+    for (; start < end; start++) {
+	v3_bitmap_set(&(map->dirty_pages), start);
+    }
+}
+
+
 // Determine if a given address can be handled by a large page of the requested size
 uint32_t 
 v3_get_max_page_size(struct v3_core_info * core, 
@@ -147,11 +147,9 @@ handle_mem_hook(struct v3_core_info  * core,
 {
     struct v3_mem_hooks * hooks     = &(core->vm_info->mem_hooks);
     struct x86_instr      instr;
-    void                * instr_ptr = NULL;
 
     int bytes_emulated = 0;
     int mem_op_size    = 0;
-    int ret            = 0;
 
     struct mem_hook * src_hook = NULL;
     addr_t src_mem_op_hva      = 0;
@@ -174,18 +172,7 @@ handle_mem_hook(struct v3_core_info  * core,
     }
 
     /* Find and decode hooked instruction */
-    if (core->mem_mode == PHYSICAL_MEM) { 
-	ret = v3_gpa_to_hva(core, get_addr_linear(core, core->rip, V3_SEG_CS), (addr_t *)&instr_ptr);
-    } else { 
-	ret = v3_gva_to_hva(core, get_addr_linear(core, core->rip, V3_SEG_CS), (addr_t *)&instr_ptr);
-    }
-
-    if (ret == -1) {
-      PrintError("Could not translate Instruction Address (%p)\n", (void *)(addr_t)core->rip);
-	return -1;
-    }
-
-    if (v3_decode(core, (addr_t)instr_ptr, &instr) == -1) {
+    if (v3_decode_rip(core, &instr) == -1) {
 	PrintError("Decoding Error\n");
 	return -1;
     }
@@ -210,6 +197,12 @@ handle_mem_hook(struct v3_core_info  * core,
 	    }
 	}
 
+	// Memory not yet allocated or restored would otherwise resolve to the scratch page below
+	if (v3_populate_gpa_range(core->vm_info, PAGE_ADDR(src_mem_op_gpa), PAGE_SIZE) == -1) {
+	    PrintError("Could not populate source operand memory (addr=%p)\n", (void *)src_mem_op_gpa);
+	    return -1;
+	}
+
 	if ((src_mem_op_gpa >= reg->guest_start) && 
 	    (src_mem_op_gpa <  reg->guest_end)) {   
 	    // Src address corresponds to faulted region
@@ -257,6 +250,12 @@ handle_mem_hook(struct v3_core_info  * core,
 	    }
 	}
 
+	// Memory not yet allocated or restored would otherwise resolve to the scratch page below
+	if (v3_populate_gpa_range(core->vm_info, PAGE_ADDR(dst_mem_op_gpa), PAGE_SIZE) == -1) {
+	    PrintError("Could not populate destination operand memory (addr=%p)\n", (void *)dst_mem_op_gpa);
+	    return -1;
+	}
+
 	if ((dst_mem_op_gpa >= reg->guest_start) && 
 	    (dst_mem_op_gpa <  reg->guest_end)) {
 	    // Dst address corresponds to faulted region
@@ -324,6 +323,15 @@ handle_mem_hook(struct v3_core_info  * core,
 	return -1;
     }
 
+    // An operand that is not hooked is ordinary guest memory we just wrote to
+    if ((src_hook == NULL) && (instr.src_operand.type == MEM_OPERAND) && (instr.src_operand.write == 1)) {
+	v3_mark_range_dirty(core->vm_info, src_mem_op_gpa, bytes_emulated);
+    }
+
+    if ((dst_hook == NULL) && (instr.dst_operand.type == MEM_OPERAND) && (instr.dst_operand.write == 1)) {
+	v3_mark_range_dirty(core->vm_info, dst_mem_op_gpa, bytes_emulated);
+    }
+
 
     if ( (src_hook != NULL) && (src_hook->write != NULL) &&
 	 (instr.src_operand.write == 1) ) {
@@ -228,6 +228,11 @@ static inline int qx86_op_to_v3_op(struct v3_core_info *info, qx86_insn *qx86_in
     return 0;
 }
 
+/* quix86 operands are not recorded in a form that can be re-evaluated */
+int v3_decode_refresh(struct v3_core_info * core, struct x86_instr * instr) {
+    return -1;
+}
+
 int v3_decode(struct v3_core_info * core, addr_t instr_ptr, struct x86_instr * instr) {
     int proc_mode;
     qx86_insn qx86_inst;
@@ -273,7 +273,17 @@ v3_handle_shadow_pagefault(struct v3_core_info * core,
     } else if (v3_get_vm_mem_mode(core) == VIRTUAL_MEM) {
 	struct v3_shdw_impl_state * state = &(core->vm_info->shdw_impl);
 	struct v3_shdw_pg_impl    * impl  = state->current_impl;
+	addr_t                      fault_gpa = 0;
 	
+	// Back the target page now, the handler's own lookups cannot sleep
+	if ((core->vm_info->mem_map.lazy_alloc) && 
+	    (v3_gva_to_gpa(core, fault_addr, &fault_gpa) == 0)) {
+	    if (v3_populate_base_region(core->vm_info, fault_gpa) == -1) {
+		PrintError("Could not populate guest memory at %p\n", (void *)fault_gpa);
+		return -1;
+	    }
+	}
+
 	return impl->handle_pagefault(core, fault_addr, error_code);
     } else {
 	PrintError("Invalid Memory mode\n");
@@ -23,6 +23,8 @@
 #include <palacios/vmx_handler.h>
 #include <palacios/vmm_rbtree.h>
 #include <palacios/vmm_sprintf.h>
+#include <palacios/vmm_lock.h>
+#include <palacios/vm.h>
 
 
 
@@ -32,6 +34,12 @@
 #define DEFAULT_GRANULARITY 50000
 #endif
 
+#define DEFAULT_RING_SIZE 4096
+#define MAX_RING_SIZE     (1024 * 1024)
+
+/* Latencies at or beyond 2^HIST_MAX_BITS cycles are clamped into the last bucket */
+#define HIST_MAX_BITS     40
+
 
 
 struct telemetry_cb {
@@ -47,11 +55,43 @@ struct exit_event {
     uint32_t  exit_code;
     uint32_t  cnt;
     uint64_t  handler_time;
+    uint64_t  guest_time;
+    uint64_t  max_time;
+
+    uint32_t  hist[V3_TELEM_HIST_BUCKETS];
 
     struct rb_node tree_node;
 };
 
 
+/* 
+ * Single producer trace ring. 
+ * The core thread is the only writer and never blocks: when the ring is full it overwrites the
+ * oldest records. Readers serialize among themselves with read_lock and detect records that were
+ * overwritten underneath them by re-checking head after copying.
+ */
+struct telem_ring {
+    uint32_t size;          /* power of 2 */
+    uint32_t num_pages;
+
+    volatile uint64_t head; /* next record to be written, only modified by the core */
+    uint64_t tail;          /* next record to be read, protected by read_lock */
+    uint64_t lost;
+
+    v3_spinlock_t read_lock;
+
+    struct v3_telem_record * recs;
+};
+
+/* x86 does not reorder stores with other stores or loads with other loads, 
+ * so ordering the ring only requires keeping the compiler in check */
+static inline void 
+telem_barrier(void) 
+{
+    __asm__ __volatile__ ("" : : : "memory");
+}
+
+
 
 
 struct telem_counter {
@@ -79,6 +119,46 @@ static int telem_eq_fn(addr_t key1, addr_t key2) {
 static int free_callback(struct v3_vm_info * vm, struct telemetry_cb * cb);
 static int free_exit(struct v3_core_info * core, struct exit_event * event);
 
+
+static struct telem_ring * 
+create_ring(uint32_t size) 
+{
+    struct telem_ring * ring = V3_Malloc(sizeof(struct telem_ring));
+    addr_t              pages = 0;
+
+    if (!ring) {
+	PrintError("Cannot allocate telemetry ring\n");
+	return NULL;
+    }
+
+    memset(ring, 0, sizeof(struct telem_ring));
+
+    ring->size      = size;
+    ring->num_pages = ((size * sizeof(struct v3_telem_record)) + PAGE_SIZE_4KB - 1) / PAGE_SIZE_4KB;
+
+    pages = (addr_t)V3_AllocPages(ring->num_pages);
+
+    if (!pages) {
+	PrintError("Cannot allocate %d pages for telemetry ring\n", ring->num_pages);
+	V3_Free(ring);
+	return NULL;
+    }
+
+    ring->recs = (struct v3_telem_record *)V3_VAddr((void *)pages);
+
+    v3_spinlock_init(&(ring->read_lock));
+
+    return ring;
+}
+
+static void 
+free_ring(struct telem_ring * ring) 
+{
+    v3_spinlock_deinit(&(ring->read_lock));
+    V3_FreePages(V3_PAddr(ring->recs), ring->num_pages);
+    V3_Free(ring);
+}
+
 static int 
 telemetry_hcall(struct v3_core_info * core,
 		hcall_id_t            hcall_id, 
@@ -96,6 +176,22 @@ v3_init_telemetry(struct v3_vm_info * vm)
     telemetry->invoke_cnt  = 0;
     telemetry->granularity = DEFAULT_GRANULARITY;
     telemetry->prev_tsc    = 0;
+    telemetry->ring_size   = DEFAULT_RING_SIZE;
+
+    if (vm->cfg_data) {
+	char * ring_str = v3_cfg_val(vm->cfg_data->cfg, "telemetry_ring");
+
+	if (ring_str) {
+	    uint32_t ring_size = atoi(ring_str);
+
+	    if ((ring_size > MAX_RING_SIZE) || (ring_size & (ring_size - 1))) {
+		PrintError("Invalid telemetry ring size (%s), must be a power of 2 up to %d. Using %d\n", 
+			   ring_str, MAX_RING_SIZE, DEFAULT_RING_SIZE);
+	    } else {
+		telemetry->ring_size = ring_size;
+	    }
+	}
+    }
 
     INIT_LIST_HEAD(&(telemetry->cb_list));
 
@@ -121,10 +217,23 @@ v3_init_core_telemetry(struct v3_core_info * core)
 
     telemetry->exit_cnt          = 0;
     telemetry->vmm_start_tsc     = 0;
+    telemetry->vmm_end_tsc       = 0;
+    telemetry->guest_time        = 0;
+    telemetry->host_time         = 0;
+    telemetry->num_exit_slots    = 0;
+    telemetry->ring              = NULL;
     telemetry->vm_telem          = &(core->vm_info->telemetry);
     telemetry->exit_root.rb_node = NULL;
 
     telemetry->counter_table = v3_create_htable(0, telem_hash_fn, telem_eq_fn);
+
+    if ((core->vm_info->enable_telemetry) && (telemetry->vm_telem->ring_size > 0)) {
+	telemetry->ring = create_ring(telemetry->vm_telem->ring_size);
+
+	if (!telemetry->ring) {
+	    PrintError("Could not allocate telemetry trace ring, exit tracing disabled\n");
+	}
+    }
 }
 
 void 
@@ -142,6 +251,11 @@ v3_deinit_core_telemetry(struct v3_core_info * core)
     }
     
     v3_free_htable(telemetry->counter_table, 1, 0);
+
+    if (telemetry->ring) {
+	free_ring(telemetry->ring);
+	telemetry->ring = NULL;
+    }
 }
 
 
@@ -269,19 +383,85 @@ create_exit(uint_t exit_code)
 	return NULL;
     }
 
+    memset(evt, 0, sizeof(struct exit_event));
+
     evt->exit_code    = exit_code;
-    evt->cnt          = 0;
-    evt->handler_time = 0;
 
     return evt;
 }
 
 
+static inline uint32_t 
+hist_bucket(uint64_t cycles) 
+{
+    uint32_t msb = 0;
+
+    if (cycles < 4) {
+	return cycles;
+    }
+
+    if (cycles >= (1ULL << HIST_MAX_BITS)) {
+	return V3_TELEM_HIST_BUCKETS - 1;
+    }
+
+    msb = 63 - __builtin_clzll(cycles);
+
+    // msb >= 2 here: 4 buckets per power of two, indexed by the 2 bits below the msb
+    return ((msb - 1) * 4) + ((cycles >> (msb - 2)) & 0x3);
+}
+
+/* Smallest latency that falls into a bucket */
+static inline uint64_t 
+hist_bucket_base(uint32_t bucket) 
+{
+    if (bucket < 4) {
+	return bucket;
+    }
+
+    return (4ULL | (bucket & 0x3)) << ((bucket / 4) - 1);
+}
+
+/* Upper bound of the bucket holding the requested fraction (in parts per thousand) of the samples */
+static uint64_t 
+hist_percentile(uint32_t * hist, uint32_t cnt, uint64_t max_time, uint32_t per_mille) 
+{
+    uint64_t target = ((uint64_t)cnt * per_mille + 999) / 1000;
+    uint64_t sum    = 0;
+    int i = 0;
+
+    if (cnt == 0) {
+	return 0;
+    }
+
+    for (i = 0; i < V3_TELEM_HIST_BUCKETS - 1; i++) {
+	sum += hist[i];
+
+	if (sum >= target) {
+	    uint64_t bound = hist_bucket_base(i + 1) - 1;
+	    return (bound < max_time) ? bound : max_time;
+	}
+    }
+
+    return max_time;
+}
+
+
 
 static int 
 free_exit(struct v3_core_info * core, 
 	  struct exit_event   * evt) 
 {
+    struct v3_core_telemetry * telemetry = &(core->core_telem);
+    int i = 0;
+
+    for (i = 0; i < telemetry->num_exit_slots; i++) {
+	if (telemetry->exit_slots[i] == evt) {
+	    telemetry->exit_slots[i] = telemetry->exit_slots[telemetry->num_exit_slots - 1];
+	    telemetry->num_exit_slots--;
+	    break;
+	}
+    }
+
     v3_rb_erase(&(evt->tree_node), &(core->core_telem.exit_root));
     V3_Free(evt);
     return 0;
@@ -299,23 +479,65 @@ void
 v3_telemetry_end_exit(struct v3_core_info * core, 
 		      uint_t                exit_code) 
 {
-    struct v3_core_telemetry * telemetry = &(core->core_telem);
-    struct exit_event        * evt       = NULL;
-    uint64_t                   end_tsc   = 0;
+    struct v3_core_telemetry * telemetry  = &(core->core_telem);
+    struct exit_event        * evt        = NULL;
+    uint64_t                   end_tsc    = 0;
+    uint64_t                   host_time  = 0;
+    uint64_t                   guest_time = 0;
 
     rdtscll(end_tsc);
 
+    host_time = end_tsc - telemetry->vmm_start_tsc;
+
+    // The first exit has no previous exit to measure guest time from
+    if (telemetry->vmm_end_tsc) {
+	guest_time = telemetry->vmm_start_tsc - telemetry->vmm_end_tsc;
+    }
+
     evt = get_exit(core, exit_code);
 
     if (evt == NULL) {
 	evt = create_exit(exit_code);
+
+	if (!evt) {
+	    return;
+	}
+
 	insert_event(core, evt);
+
+	if (telemetry->num_exit_slots < V3_TELEM_MAX_EXITS) {
+	    telemetry->exit_slots[telemetry->num_exit_slots] = evt;
+	    telem_barrier();
+	    telemetry->num_exit_slots++;
+	}
     }
 
-    evt->handler_time += end_tsc - telemetry->vmm_start_tsc;
+    evt->handler_time += host_time;
+    evt->guest_time   += guest_time;
+    evt->hist[hist_bucket(host_time)]++;
+
+    if (host_time > evt->max_time) {
+	evt->max_time = host_time;
+    }
 
     evt->cnt++;
     telemetry->exit_cnt++;
+    telemetry->host_time  += host_time;
+    telemetry->guest_time += guest_time;
+
+    if (telemetry->ring) {
+	struct telem_ring      * ring = telemetry->ring;
+	struct v3_telem_record * rec  = &(ring->recs[ring->head & (ring->size - 1)]);
+
+	rec->tsc          = telemetry->vmm_start_tsc;
+	rec->guest_cycles = guest_time;
+	rec->host_cycles  = host_time;
+	rec->exit_code    = exit_code;
+	rec->vcore        = core->vcpu_id;
+
+	telem_barrier();
+	ring->head++;
+    }
 
 
 
@@ -325,6 +547,9 @@ v3_telemetry_end_exit(struct v3_core_info * core,
 	    v3_print_telemetry(core->vm_info, core);
 	}
     }
+
+    // Re-read the TSC so the time spent printing is not charged to the guest
+    rdtscll(telemetry->vmm_end_tsc);
 }
 
 
@@ -340,15 +565,22 @@ v3_telemetry_reset(struct v3_core_info * core)
 	struct exit_event * evt  = NULL;
 	struct rb_node    * node = v3_rb_first(&(telemetry->exit_root));
 
-	do {
+	while (node) {
 	    evt = rb_entry(node, struct exit_event, tree_node);
 	    
 	    evt->cnt          = 0;
 	    evt->handler_time = 0;
-	    
-	} while ((node = v3_rb_next(node)));
+	    evt->guest_time   = 0;
+	    evt->max_time     = 0;
+	    memset(evt->hist, 0, sizeof(evt->hist));
+
+	    node = v3_rb_next(node);
+	}
     }
 
+    telemetry->guest_time = 0;
+    telemetry->host_time  = 0;
+
     /* Clear Counter values */
     {
 	struct hashtable_iter * iter = v3_create_htable_iter(telemetry->counter_table);
@@ -449,6 +681,10 @@ print_core_telemetry(struct v3_core_info * core,
 
     V3_Print("Exit Count=%llu\n", core->num_exits);
 
+    V3_Print("%sExit Time Breakdown: Host=%llu, Guest=%llu\n", hdr_buf,
+	     telemetry->host_time, 
+	     telemetry->guest_time);
+
     V3_Print("%sTime Breakdown: Host=%llu, Guest=%llu\n", hdr_buf,
 	     core->time_state.time_in_host, 
 	     core->time_state.time_in_guest);
@@ -484,12 +720,21 @@ print_core_telemetry(struct v3_core_info * core,
 		continue;
 	}
 
-	V3_Print("%s%s:%sCnt=%u,%sAvg. Time=%llu\n", 
+	if (evt->cnt == 0) {
+	    continue;
+	}
+
+	V3_Print("%s%s:%sCnt=%u,%sAvg. Time=%llu, p50=%llu, p99=%llu, p999=%llu, Max=%llu, Avg. Guest Time=%llu\n", 
 		 hdr_buf, code_str,
 		 (strlen(code_str) > 13)   ? "\t" : "\t\t",
 		 evt->cnt,
 		 (evt->cnt         >= 100) ? "\t" : "\t\t",
-		 (uint64_t)(evt->handler_time / evt->cnt));
+		 (uint64_t)(evt->handler_time / evt->cnt),
+		 hist_percentile(evt->hist, evt->cnt, evt->max_time, 500),
+		 hist_percentile(evt->hist, evt->cnt, evt->max_time, 990),
+		 hist_percentile(evt->hist, evt->cnt, evt->max_time, 999),
+		 evt->max_time,
+		 (uint64_t)(evt->guest_time / evt->cnt));
     } while ((node = v3_rb_next(node)));
 
 
@@ -578,3 +823,160 @@ v3_print_telemetry(struct v3_vm_info   * vm,
 
     return;
 }
+
+
+
+/* 
+ * Host interface 
+ * These are called from host context while the core may be running, 
+ * the returned values are a best effort snapshot.
+ */
+
+static struct v3_core_telemetry * 
+get_core_telem(struct v3_vm_info * vm, 
+	       int                 vcore) 
+{
+    if (!vm->enable_telemetry) {
+	PrintError("Telemetry is not enabled for VM %s\n", vm->name);
+	return NULL;
+    }
+
+    if ((vcore < 0) || (vcore >= vm->num_cores)) {
+	PrintError("Invalid core (%d) for telemetry request\n", vcore);
+	return NULL;
+    }
+
+    return &(vm->cores[vcore].core_telem);
+}
+
+
+int 
+v3_get_telemetry_core(struct v3_vm_info          * vm, 
+		      int                          vcore, 
+		      struct v3_telem_core_stats * stats) 
+{
+    struct v3_core_telemetry * telemetry = get_core_telem(vm, vcore);
+
+    if (!telemetry) {
+	return -1;
+    }
+
+    stats->exit_cnt     = telemetry->exit_cnt;
+    stats->guest_cycles = telemetry->guest_time;
+    stats->host_cycles  = telemetry->host_time;
+    stats->lost         = (telemetry->ring) ? telemetry->ring->lost : 0;
+
+    return 0;
+}
+
+
+int 
+v3_get_telemetry_exits(struct v3_vm_info          * vm, 
+		       int                          vcore, 
+		       struct v3_telem_exit_stats * stats, 
+		       int                          max_stats) 
+{
+    struct v3_core_telemetry * telemetry = get_core_telem(vm, vcore);
+    uint32_t num_slots = 0;
+    int i = 0;
+
+    if (!telemetry) {
+	return -1;
+    }
+
+    num_slots = telemetry->num_exit_slots;
+    telem_barrier();
+
+    for (i = 0; (i < num_slots) && (i < max_stats); i++) {
+	struct exit_event          * evt = telemetry->exit_slots[i];
+	struct v3_telem_exit_stats * out = &(stats[i]);
+
+	out->exit_code      = evt->exit_code;
+	out->cnt            = evt->cnt;
+	out->handler_cycles = evt->handler_time;
+	out->guest_cycles   = evt->guest_time;
+	out->max_cycles     = evt->max_time;
+	memcpy(out->hist, evt->hist, sizeof(out->hist));
+
+	out->p50  = hist_percentile(out->hist, out->cnt, out->max_cycles, 500);
+	out->p99  = hist_percentile(out->hist, out->cnt, out->max_cycles, 990);
+	out->p999 = hist_percentile(out->hist, out->cnt, out->max_cycles, 999);
+    }
+
+    return i;
+}
+
+
+/* Consumes up to max_recs records from the core's trace ring, oldest first */
+int 
+v3_get_telemetry_records(struct v3_vm_info      * vm, 
+			 int                      vcore, 
+			 struct v3_telem_record * recs, 
+			 int                      max_recs) 
+{
+    struct v3_core_telemetry * telemetry = get_core_telem(vm, vcore);
+    struct telem_ring        * ring      = NULL;
+    addr_t   flags = 0;
+    uint64_t head  = 0;
+    uint64_t stale = 0;
+    uint64_t cnt   = 0;
+    uint64_t i     = 0;
+
+    if (!telemetry) {
+	return -1;
+    }
+
+    ring = telemetry->ring;
+
+    if (!ring) {
+	PrintError("Telemetry tracing is disabled for core %d\n", vcore);
+	return -1;
+    }
+
+    if (max_recs <= 0) {
+	return 0;
+    }
+
+    flags = v3_spin_lock_irqsave(&(ring->read_lock));
+
+    head = ring->head;
+    telem_barrier();
+
+    // Skip over anything the core has already overwritten
+    if ((head - ring->tail) > ring->size) {
+	ring->lost += (head - ring->tail) - ring->size;
+	ring->tail  = head - ring->size;
+    }
+
+    cnt = head - ring->tail;
+
+    if (cnt > max_recs) {
+	cnt = max_recs;
+    }
+
+    for (i = 0; i < cnt; i++) {
+	recs[i] = ring->recs[(ring->tail + i) & (ring->size - 1)];
+    }
+
+    telem_barrier();
+    head = ring->head;
+
+    /* The core may have lapped us while copying. Record n is unsafe once 
+     * the core has started writing record n + size, i.e. head + 1 > n + size */
+    if ((head + 1 - ring->tail) > ring->size) {
+	stale = (head + 1 - ring->tail) - ring->size;
+
+	if (stale > cnt) {
+	    stale = cnt;
+	}
+
+	memmove(recs, &(recs[stale]), (cnt - stale) * sizeof(struct v3_telem_record));
+	ring->lost += stale;
+    }
+
+    ring->tail += cnt;
+
+    v3_spin_unlock_irqrestore(&(ring->read_lock), flags);
+
+    return cnt - stale;
+}
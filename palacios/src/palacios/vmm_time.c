@@ -239,6 +239,36 @@ v3_update_timers(struct v3_core_info * core)
 }
 
 
+uint64_t 
+v3_get_next_timer_event(struct v3_core_info * core, 
+			uint64_t              poll_cycles) 
+{
+    struct vm_core_time * time_state = &core->time_state;
+    struct v3_timer     * tmp_timer  = NULL;
+    uint64_t              next       = V3_TIMER_NO_EVENT;
+    uint64_t              elapsed    = v3_get_guest_time(time_state) - time_state->last_update;
+
+    list_for_each_entry(tmp_timer, &(time_state->timers), timer_link) {
+	uint64_t tmr_next = poll_cycles;
+
+	if (tmp_timer->ops->next_event) {
+	    tmr_next = tmp_timer->ops->next_event(core, time_state->guest_cpu_freq, tmp_timer->private_data);
+	}
+
+	if (tmr_next < next) {
+	    next = tmr_next;
+	}
+    }
+
+    // Timers last saw the time at the previous update
+    if (next == V3_TIMER_NO_EVENT) {
+	return next;
+    }
+
+    return (next > elapsed) ? (next - elapsed) : 0;
+}
+
+
 /* 
  * Handle full virtualization of the time stamp counter.  As noted
  * above, we don't store the actual value of the TSC, only the guest's
@@ -148,6 +148,91 @@ v3_decode(struct v3_core_info * core,
 }
 
 
+static addr_t 
+gpr_value(struct v3_gprs * gprs, int reg_num) 
+{
+    switch (reg_num) {
+	case 0:  return gprs->rax;
+	case 1:  return gprs->rcx;
+	case 2:  return gprs->rdx;
+	case 3:  return gprs->rbx;
+	case 4:  return gprs->rsp;
+	case 5:  return gprs->rbp;
+	case 6:  return gprs->rsi;
+	case 7:  return gprs->rdi;
+	case 8:  return gprs->r8;
+	case 9:  return gprs->r9;
+	case 10: return gprs->r10;
+	case 11: return gprs->r11;
+	case 12: return gprs->r12;
+	case 13: return gprs->r13;
+	case 14: return gprs->r14;
+	case 15: return gprs->r15;
+	default: return 0;
+    }
+}
+
+
+static int 
+refresh_mem_operand(struct v3_core_info * core, 
+		    struct x86_instr    * instr, 
+		    struct x86_operand  * operand, 
+		    struct x86_mem_ref  * ref) 
+{
+    struct v3_gprs * gprs       = &(core->vm_regs);
+    uint8_t          addr_width = get_addr_width(core, instr);
+    addr_t           addr       = 0;
+    addr_t           val        = 0;
+
+    if (operand->type != MEM_OPERAND) {
+	return 0;
+    }
+
+    if (ref->valid == 0) {
+	return -1;
+    }
+
+    if (ref->str_op) {
+	operand->operand = get_addr_linear(core, MASK(gpr_value(gprs, ref->base), addr_width), ref->seg);
+	return 0;
+    }
+
+    if (ref->index != -1) {
+	val  = gpr_value(gprs, ref->index);
+	addr = ((ref->mask_index) ? ADDR_MASK(val, get_addr_width(core, instr)) : val) * ref->scale;
+    }
+
+    if (ref->base != -1) {
+	val   = gpr_value(gprs, ref->base);
+	addr += (ref->mask_base) ? ADDR_MASK(val, get_addr_width(core, instr)) : val;
+    }
+
+    addr += ref->disp;
+
+    operand->operand = ADDR_MASK(get_addr_linear(core, addr, ref->seg), 
+				 get_addr_width(core, instr));
+
+    return 0;
+}
+
+
+int 
+v3_decode_refresh(struct v3_core_info * core, 
+		  struct x86_instr    * instr) 
+{
+    if ((refresh_mem_operand(core, instr, &(instr->src_operand), &(instr->src_ref)) == -1) || 
+	(refresh_mem_operand(core, instr, &(instr->dst_operand), &(instr->dst_ref)) == -1)) {
+	return -1;
+    }
+
+    if ((instr->is_str_op) && (instr->prefixes.rep == 1)) {
+	instr->str_op_length = MASK(core->vm_regs.rcx, get_addr_width(core, instr));
+    }
+
+    return 0;
+}
+
+
 static int 
 parse_operands(struct v3_core_info * core, 
 	       uint8_t             * instr_ptr, 
@@ -323,6 +408,8 @@ parse_operands(struct v3_core_info * core,
 	    instr->src_operand.type    = MEM_OPERAND;
 	    instr->src_operand.size    = addr_width;
 
+	    set_mem_ref(instr, &(instr->src_operand), -1, 0, -1, 0, 1, offset, src_seg);
+
 	    instr_ptr += addr_width;
 
 	    break;
@@ -363,6 +450,8 @@ parse_operands(struct v3_core_info * core,
 	    instr->dst_operand.type    = MEM_OPERAND;
 	    instr->dst_operand.size    = addr_width;
 
+	    set_mem_ref(instr, &(instr->dst_operand), -1, 0, -1, 0, 1, offset, dst_seg);
+
 	    instr_ptr += addr_width;
 
 	    break;
@@ -467,11 +556,17 @@ parse_operands(struct v3_core_info * core,
 	    instr->src_operand.size    = operand_width;
 	    instr->src_operand.operand = get_addr_linear(core,  MASK(core->vm_regs.rsi, addr_width), V3_SEG_DS);
 
+	    set_mem_ref(instr, &(instr->src_operand), 6, 0, -1, 0, 1, 0, V3_SEG_DS);
+	    instr->src_ref.str_op      = 1;
+
 
 	    instr->dst_operand.type    = MEM_OPERAND;
 	    instr->dst_operand.size    = operand_width;
 	    instr->dst_operand.operand = get_addr_linear(core,  MASK(core->vm_regs.rdi, addr_width), V3_SEG_ES);
 
+	    set_mem_ref(instr, &(instr->dst_operand), 7, 0, -1, 0, 1, 0, V3_SEG_ES);
+	    instr->dst_ref.str_op      = 1;
+
 
 	    instr->src_operand.read    = 1;
 	    instr->dst_operand.write   = 1;
@@ -549,6 +644,9 @@ parse_operands(struct v3_core_info * core,
 	    instr->dst_operand.size    = operand_width;
 	    instr->dst_operand.operand = get_addr_linear(core, MASK(core->vm_regs.rdi, addr_width), V3_SEG_ES);
 
+	    set_mem_ref(instr, &(instr->dst_operand), 7, 0, -1, 0, 1, 0, V3_SEG_ES);
+	    instr->dst_ref.str_op      = 1;
+
 	    instr->src_operand.read    = 1;
 	    instr->dst_operand.write   = 1;
 
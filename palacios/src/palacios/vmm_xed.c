@@ -330,6 +330,14 @@ v3_disasm(struct v3_core_info * core, void * instr_ptr, addr_t * rip, int mark)
 
 
 
+/* XED operands are not recorded in a form that can be re-evaluated */
+int 
+v3_decode_refresh(struct v3_core_info * core, struct x86_instr * instr)
+{
+    return -1;
+}
+
+
 int 
 v3_decode(struct v3_core_info * core, addr_t instr_ptr, struct x86_instr * instr)
 {
@@ -279,9 +279,8 @@ init_vmcs(struct v3_core_info * core)
     }
 
     /* 
-     * Set the VPID
+     * The VPID is assigned on entry (see v3_vmx_enter)
      */
-    check_vmcs_write(VMCS_VPID, 2);
   
 
     /* 
@@ -586,7 +585,12 @@ v3_init_vmx_core(struct v3_core_info * core,
 	/* Enable EPT */
 	vmx_state->pri_proc_ctrls.sec_ctrls    = 1; // Enable secondary proc controls
 	vmx_state->sec_proc_ctrls.enable_ept   = 1; // enable EPT paging
-	vmx_state->sec_proc_ctrls.enable_vpid  = 1;
+
+	/* Tag the guest's TLB entries, unless we would have no way of flushing them */
+	if ((hw_info.ept_info.INVVPID_avail) && 
+	    (hw_info.ept_info.INVVPID_all_ctx_avail)) {
+	    vmx_state->sec_proc_ctrls.enable_vpid  = 1;
+	}
 
 
 	if (v3_init_ept(core, &hw_info) == -1) {
@@ -1128,6 +1132,37 @@ v3_vmx_enter(struct v3_core_info * core)
 	vmx_info->state = VMX_UNLAUNCHED;
     }
 
+    // Nested page table permissions were reduced, so drop any cached EPT translations
+    //   (this is also how a core that moved off the shared EPT picks up its private one)
+    //   (a request set after the exchange is picked up on the next entry)
+    if (__sync_lock_test_and_set(&(core->flush_direct_map), 0)) {
+	if (core->shdw_pg_mode == NESTED_PAGING) {
+	    check_vmcs_write(VMCS_EPT_PTR, core->direct_map_pt);
+
+	    // Fall back to flushing every EPT context if the single context flush fails
+	    if ((vmx_invept(INVEPT_SINGLE_CONTEXT, core->direct_map_pt) != VMX_SUCCESS) &&
+		(vmx_invept(INVEPT_ALL_CONTEXT, 0) != VMX_SUCCESS)) {
+		v3_enable_ints();
+		PrintError("Could not flush EPT translations (eptp=%p)\n", (void *)core->direct_map_pt);
+		return -1;
+	    }
+	}
+    }
+
+    // Pick up this CPU's VPID for the core, the first core of a new generation flushes the stale ones
+    //   (cores without a VPID run with VPID 0, which is flushed on every entry and exit)
+    if (vmx_info->sec_proc_ctrls.enable_vpid) {
+	int flush_all = 0;
+
+	if (v3_update_asid(core, &flush_all) == 1) {
+	    check_vmcs_write(VMCS_VPID, core->asid_state.asid);
+	}
+
+	if (flush_all) {
+	    vmx_invvpid(INVVPID_ALL_CONTEXT, 0, 0);
+	}
+    }
+
     // Update FPU state, this must come before the guest state is serialized back to the VMCS
     v3_fpu_on_entry(core);
 
@@ -1521,7 +1556,9 @@ v3_init_vmx_cpu(int cpu_id)
 	    v3_cpu_types[cpu_id] = V3_VMX_EPT_UG_CPU;
 	}
     }
-    
+
+    // VPIDs are 16 bits, VPID 0 is the host's
+    v3_init_asid_pool(cpu_id, 0xffff);
 }
 
 
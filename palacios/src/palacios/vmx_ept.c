@@ -46,68 +46,87 @@ static addr_t create_ept_page() {
 
 
 
+/* Builds the EPT pointer of a new, empty EPT */
+static addr_t 
+create_ept_root() 
+{
+    addr_t     ept_va = create_ept_page();
+    vmx_eptp_t ept_ptr;
+
+    if (ept_va == 0) {
+	return 0;
+    }
+
+    memset(&ept_ptr, 0, sizeof(vmx_eptp_t));
+
+    ept_ptr.psmt          = 6;
+    ept_ptr.pwl1          = 3;
+    ept_ptr.pml_base_addr = PAGE_BASE_ADDR((addr_t)V3_PAddr((void *)ept_va));
+
+    return *(addr_t *)&ept_ptr;
+}
+
+
 int 
 v3_init_ept(struct v3_core_info * core, 
 	    struct vmx_hw_info  * hw_info) 
 {
-    addr_t       ept_pa  = (addr_t)V3_PAddr((void *)create_ept_page());    
-    vmx_eptp_t * ept_ptr = (vmx_eptp_t *)&(core->direct_map_pt);
+    struct v3_nested_pts * npts = &(core->vm_info->nested_pts);
 
+    ept_info = &(hw_info->ept_info);
 
-    ept_info      = &(hw_info->ept_info);
-    ept_ptr->psmt = 6;
-
-    if (ept_info->pg_walk_len4) {
-	ept_ptr->pwl1 = 3;
-    } else {
+    if (ept_info->pg_walk_len4 == 0) {
 	PrintError("Unsupported EPT Table depth\n");
 	return -1;
     }
 
-    ept_ptr->pml_base_addr = PAGE_BASE_ADDR(ept_pa);
+    if ((core->use_giant_pages == 1) && (ept_info->ept_1GB_ok == 0)) {
+	V3_Print("1GB EPT pages not supported by hardware, falling back to smaller pages\n");
+	core->use_giant_pages = 0;
+    }
+
+    // The first core creates the EPT that the VM's cores share
+    if (npts->root == 0) {
+	npts->root = create_ept_root();
+
+	if (npts->root == 0) {
+	    PrintError("Could not allocate EPT\n");
+	    return -1;
+	}
+    }
+
+    core->direct_map_pt = npts->root;
 
     return 0;
 }
 
 
+/* Returned by fill_ept() when the fault has to be passed on to the region's handler */
+#define EPT_PF_UNHANDLED 1
+
 /* We can use the default paging macros, since the formats are close enough to allow it */
 
-int 
-v3_handle_ept_fault(struct v3_core_info  * core, 
-		    addr_t                 fault_addr, 
-		    struct ept_exit_qual * ept_qual) 
+static int 
+fill_ept(struct v3_core_info  * core, 
+	 addr_t                 fault_addr, 
+	 struct ept_exit_qual * ept_qual, 
+	 struct v3_mem_region * region, 
+	 int                    page_size) 
 {
     ept_pml4_t    * pml     = NULL;
     ept_pdp_t     * pdpe    = NULL;
+    ept_pdp_1GB_t * pdpe1gb = NULL;
     ept_pde_2MB_t * pde2mb  = NULL;
     ept_pde_t     * pde     = NULL;
     ept_pte_t     * pte     = NULL;
-    int    page_size        = PAGE_SIZE_4KB;
     addr_t host_addr        = 0;
+    int    track_dirty      = core->vm_info->mem_map.track_dirty;
 
     int pml_index  = PML4E64_INDEX(fault_addr);
     int pdpe_index = PDPE64_INDEX(fault_addr);
     int pde_index  = PDE64_INDEX(fault_addr);
     int pte_index  = PTE64_INDEX(fault_addr);
 
-    struct v3_mem_region * region = v3_get_mem_region(core->vm_info, core->vcpu_id, fault_addr);
-
-    pf_error_t error_code = {0};
-    error_code.present    = ept_qual->present;
-    error_code.write      = ept_qual->write;
-    
-    if (region == NULL) {
-	PrintError("invalid region, addr=%p\n", (void *)fault_addr);
-	return -1;
-    }
-
-    if ((core->use_large_pages == 1) || 
-	(core->use_giant_pages == 1)) {
-	page_size = v3_get_max_page_size(core, fault_addr, LONG);
-    }
-
-
-
     pml = (ept_pml4_t *)CR3_TO_PML4E64_VA(core->direct_map_pt);
 
 
@@ -128,6 +147,65 @@ v3_handle_ept_fault(struct v3_core_info  * core,
     }
 
 
+    // This range was split into smaller pages, so keep using them
+    if ((page_size == PAGE_SIZE_1GB) && 
+	(pdpe[pdpe_index].read == 1) && (pdpe[pdpe_index].large_page == 0)) {
+	page_size = PAGE_SIZE_2MB;
+    }
+
+    // Fix up the 1GiB PDPE and exit here
+    if (page_size == PAGE_SIZE_1GB) {
+	pdpe1gb = (ept_pdp_1GB_t *)pdpe;
+
+	if (pdpe1gb[pdpe_index].read == 0) {
+
+	    if ( (region->flags.alloced == 1) && 
+		 (region->flags.read    == 1)) {
+		memset(&(pdpe1gb[pdpe_index]), 0, sizeof(ept_pdp_1GB_t));
+
+		// Full access
+		pdpe1gb[pdpe_index].large_page = 1;
+		pdpe1gb[pdpe_index].ipat       = 1;
+		pdpe1gb[pdpe_index].read       = 1;
+
+		if (region->flags.exec == 1) {
+		    pdpe1gb[pdpe_index].exec = 1;
+		}
+
+		if (region->flags.uncached == 1) {
+		    pdpe1gb[pdpe_index].mt = 0;
+		} else {
+		    pdpe1gb[pdpe_index].mt = 6;
+		}
+
+		if (region->flags.write == 1) {
+		    pdpe1gb[pdpe_index].write = 1;
+		}
+
+		if (v3_gpa_to_hpa(core, fault_addr, &host_addr) == -1) {
+		    PrintError("Error: Could not translate fault addr (%p)\n", (void *)fault_addr);
+		    return -1;
+		}
+
+		pdpe1gb[pdpe_index].page_base_addr = PAGE_BASE_ADDR_1GB(host_addr);
+	    } else {
+		return EPT_PF_UNHANDLED;
+	    }
+	} else {
+	    // We fix all permissions on the first pass, 
+	    // so we only get here if its an unhandled exception
+
+	    return EPT_PF_UNHANDLED;
+	}
+
+	return 0;
+    }
+
+    // A 1GiB leaf already covers this address, so this is a permission fault
+    if ((pdpe[pdpe_index].read == 1) && (pdpe[pdpe_index].large_page == 1)) {
+	return EPT_PF_UNHANDLED;
+    }
+
     // Fix up the PDPE entry
     if (pdpe[pdpe_index].read == 0) {
 	v3_telemetry_inc_core_counter(core, "ALLOC_EPT_PAGE");
@@ -145,6 +223,12 @@ v3_handle_ept_fault(struct v3_core_info  * core,
 
 
 
+    // This range was split into 4KiB pages (e.g. while tracking dirty pages), so keep using them
+    if ((page_size == PAGE_SIZE_2MB) && 
+	(pde[pde_index].read == 1) && (pde[pde_index].large_page == 0)) {
+	page_size = PAGE_SIZE_4KB;
+    }
+
     // Fix up the 2MiB PDE and exit here
     if (page_size == PAGE_SIZE_2MB) {
 	pde2mb = (ept_pde_2MB_t *)pde; // all but these two lines are the same for PTE
@@ -184,13 +268,13 @@ v3_handle_ept_fault(struct v3_core_info  * core,
 
 		pde2mb[pde_index].page_base_addr = PAGE_BASE_ADDR_2MB(host_addr);
 	    } else {
-		return region->unhandled(core, fault_addr, fault_addr, region, error_code);
+		return EPT_PF_UNHANDLED;
 	    }
 	} else {
 	    // We fix all permissions on the first pass, 
 	    // so we only get here if its an unhandled exception
 
-	    return region->unhandled(core, fault_addr, fault_addr, region, error_code);
+	    return EPT_PF_UNHANDLED;
 	}
 
 	return 0;
@@ -238,8 +322,14 @@ v3_handle_ept_fault(struct v3_core_info  * core,
 		pte[pte_index].mt = 6;
 	    }
 
-	    if (region->flags.write == 1) {
+	    // While tracking dirty pages, base memory is only writable once it has been written
+	    if ((region->flags.write == 1) && 
+		((track_dirty == 0) || (region->flags.base == 0) || (ept_qual->wr_op == 1))) {
 		pte[pte_index].write = 1;
+
+		if (track_dirty && region->flags.base) {
+		    v3_mark_page_dirty(core->vm_info, fault_addr);
+		}
 	    } else {
 		pte[pte_index].write = 0;
 	    }
@@ -252,15 +342,147 @@ v3_handle_ept_fault(struct v3_core_info  * core,
 
 	    pte[pte_index].page_base_addr = PAGE_BASE_ADDR_4KB(host_addr);
 	} else {
-	    return region->unhandled(core, fault_addr, fault_addr, region, error_code);
+	    return EPT_PF_UNHANDLED;
 	}
+    } else if ((ept_qual->wr_op == 1) && (pte[pte_index].write == 0) &&
+	       (region->flags.alloced == 1) && (region->flags.write == 1)) {
+	// First write to a page that was write protected for dirty tracking
+	pte[pte_index].write = 1;
+
+	if (region->flags.base) {
+	    v3_mark_page_dirty(core->vm_info, fault_addr);
+	}
+
+	v3_telemetry_inc_core_counter(core, "EPT_DIRTY_PAGE_FAULTS");
     } else {
 	// We fix all permissions on the first pass, 
 	// so we only get here if its an unhandled exception
 
-	return region->unhandled(core, fault_addr, fault_addr, region, error_code);
+	return EPT_PF_UNHANDLED;
     }
 
 
     return 0;
 }
+
+
+int 
+v3_handle_ept_fault(struct v3_core_info  * core, 
+		    addr_t                 fault_addr, 
+		    struct ept_exit_qual * ept_qual) 
+{
+    struct v3_nested_pts * npts   = &(core->vm_info->nested_pts);
+    struct v3_mem_region * region = NULL;
+    int      page_size = PAGE_SIZE_4KB;
+    int      shared    = 0;
+    int      ret       = 0;
+
+    pf_error_t error_code = {0};
+    error_code.present    = ept_qual->present;
+    error_code.write      = ept_qual->write;
+    
+    if (v3_populate_base_region(core->vm_info, fault_addr) == -1) {
+	PrintError("Could not populate guest memory at %p\n", (void *)fault_addr);
+	return -1;
+    }
+
+    region = v3_get_mem_region(core->vm_info, core->vcpu_id, fault_addr);
+
+    if (region == NULL) {
+	PrintError("invalid region, addr=%p\n", (void *)fault_addr);
+	return -1;
+    }
+
+    // Pages that aren't mapped never get an EPT entry
+    if ((region->flags.alloced == 0) || (region->flags.read == 0)) {
+	return region->unhandled(core, fault_addr, fault_addr, region, error_code);
+    }
+
+    page_size = v3_get_nested_page_size(core, fault_addr);
+
+    if (page_size == 0) {
+	// Another core maps this page through a different region, so this core needs its own EPT
+	V3_Print("Core %d: switching to a private EPT (addr=%p)\n", core->vcpu_id, (void *)fault_addr);
+
+	core->direct_map_pt = create_ept_root();
+
+	if (core->direct_map_pt == 0) {
+	    PrintError("Could not allocate private EPT\n");
+	    core->direct_map_pt = npts->root;
+	    return -1;
+	}
+
+	// Loads the new EPT pointer before the next entry
+	core->flush_direct_map = 1;
+
+	page_size = v3_get_nested_page_size(core, fault_addr);
+    }
+
+    shared = v3_nested_pt_is_shared(core);
+
+    if (shared) {
+	v3_mutex_lock(npts->lock);
+    }
+
+    ret = fill_ept(core, fault_addr, ept_qual, region, page_size);
+
+    if (shared) {
+	v3_mutex_unlock(npts->lock);
+    }
+
+    if (ret == EPT_PF_UNHANDLED) {
+	return region->unhandled(core, fault_addr, fault_addr, region, error_code);
+    }
+
+    return ret;
+}
+
+
+/* 
+ * Maps the page containing gpa before the guest touches it
+ *  Returns the size of the range that was covered, or -1 on error
+ */
+int 
+v3_prefault_ept(struct v3_core_info * core, 
+		addr_t                gpa) 
+{
+    struct v3_nested_pts * npts   = &(core->vm_info->nested_pts);
+    struct v3_mem_region * region = v3_get_mem_region(core->vm_info, core->vcpu_id, gpa);
+    struct ept_exit_qual   ept_qual;
+    int page_size = 0;
+    int shared    = 0;
+    int ret       = 0;
+
+    memset(&ept_qual, 0, sizeof(struct ept_exit_qual));
+    ept_qual.rd_op = 1;
+
+    // Unmapped pages, and pages that differ between cores, are left to the fault path
+    if ((region == NULL) || (region->flags.alloced == 0) || (region->flags.read == 0)) {
+	return PAGE_SIZE_4KB;
+    }
+
+    page_size = v3_get_nested_page_size(core, gpa);
+
+    if (page_size == 0) {
+	return PAGE_SIZE_4KB;
+    }
+
+    shared = v3_nested_pt_is_shared(core);
+
+    if (shared) {
+	v3_mutex_lock(npts->lock);
+    }
+
+    // A page that is already mapped is left alone
+    ret = fill_ept(core, gpa, &ept_qual, region, page_size);
+
+    if (shared) {
+	v3_mutex_unlock(npts->lock);
+    }
+
+    if (ret == -1) {
+	return -1;
+    }
+
+    return page_size;
+}
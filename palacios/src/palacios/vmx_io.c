@@ -121,10 +121,13 @@ v3_handle_vmx_io_ins(struct v3_core_info  * core,
     addr_t                    guest_va = exit_info->guest_linear_addr;
     struct v3_io_hook       * hook     = NULL;
 
+    addr_t   guest_pa   = 0;
     addr_t   host_addr  = 0;
-    int      rdi_change = 0;
+    addr_t   seg_base   = 0;
+    uint64_t mask       = 0xffffffffffffffffULL;
+    int      direction  = 1;
     int      read_size  = 0;
-    uint32_t rep_num    = 1;
+    uint64_t rep_num    = 1;
 
     PrintDebug("INS on port 0x%x\n", io_qual.port);
 
@@ -135,51 +138,61 @@ v3_handle_vmx_io_ins(struct v3_core_info  * core,
         struct vmx_exit_io_instr_info instr_info = *(struct vmx_exit_io_instr_info *)&(exit_info->instr_info);
 
         if (instr_info.addr_size       == 0) {
-            rep_num = core->vm_regs.rcx & 0xffff;
+            mask = 0xffff;
         } else if(instr_info.addr_size == 1) {
-            rep_num = core->vm_regs.rcx & 0xffffffff;
+            mask = 0xffffffff;
         } else if(instr_info.addr_size == 2) {
-            rep_num = core->vm_regs.rcx & 0xffffffffffffffffLL;
+            mask = 0xffffffffffffffffLL;
         } else {
             PrintDebug("Unknown INS address size!\n");
             return -1;
         }
+
+        rep_num = core->vm_regs.rcx & mask;
     }
     
     if (flags->df) {
-        rdi_change = -read_size;
-    } else {
-        rdi_change =  read_size;
+        direction = -1;
     }
 
-    PrintDebug("INS size=%d for %d steps\n", read_size, rep_num);
+    // The linear address is ES.base + rDI, recompute it as rDI moves (and wraps)
+    seg_base = guest_va - (core->vm_regs.rdi & mask);
 
-    if (v3_gva_to_hva(core, guest_va, &host_addr) == -1) {
-        PrintError("Could not convert Guest VA to host VA\n");
-        return -1;
-    }
+    PrintDebug("INS size=%d for %d steps\n", read_size, (uint32_t)rep_num);
+
+    // One guest page at a time
+    while (rep_num > 0) {
+	uint_t count = 0;
 
-    do {
-	if (hook == NULL) {
-	    PrintDebug("INS operation on unhooked IO port 0x%x - returning zeros\n", io_qual.port);
-	    memset((uint8_t *)host_addr, 0, read_size);
+	guest_va = seg_base + (core->vm_regs.rdi & mask);
 
-	} else {
-	    if (hook->read(core, io_qual.port, (uint8_t *)host_addr, read_size, hook->priv_data) != read_size) {
-		PrintError("Read Failure for INS on port 0x%x\n", io_qual.port);
-		return -1;
-	    }
+	// The page may not have been allocated or restored yet
+	if (v3_populate_gva_range(core, PAGE_ADDR(guest_va), PAGE_SIZE) == -1) {
+	    PrintError("Could not populate INS destination\n");
+	    return -1;
 	}
-	
 
-        host_addr         += rdi_change;
-        core->vm_regs.rdi += rdi_change;
+	if ((v3_gva_to_gpa(core, guest_va, &guest_pa) == -1) || 
+	    (v3_gpa_to_hva(core, guest_pa, &host_addr) == -1)) {
+	    PrintError("Could not convert Guest VA to host VA\n");
+	    return -1;
+	}
 
-        if (io_qual.rep) {
-            core->vm_regs.rcx--;
-        }
-        
-    } while (--rep_num > 0);
+	count = v3_io_string_count(guest_va, core->vm_regs.rdi, mask, read_size, rep_num, direction);
+
+	if (v3_io_read_string(core, hook, io_qual.port, (uint8_t *)host_addr, guest_pa, read_size, count, direction) == -1) {
+	    PrintError("Read Failure for INS on port 0x%x\n", io_qual.port);
+	    return -1;
+	}
+
+	core->vm_regs.rdi += ((int)(read_size * count) * direction);
+
+	if (io_qual.rep) {
+	    core->vm_regs.rcx -= count;
+	}
+
+	rep_num -= count;
+    }
 
 
     core->rip += exit_info->instr_len;
@@ -230,8 +243,10 @@ v3_handle_vmx_io_outs(struct v3_core_info  * core,
 
     int      write_size = 0;
     addr_t   host_addr  = 0;
-    int      rsi_change = 0;
-    uint32_t rep_num    = 1;
+    addr_t   seg_base   = 0;
+    uint64_t mask       = 0xffffffffffffffffULL;
+    int      direction  = 1;
+    uint64_t rep_num    = 1;
  
     PrintDebug("OUTS on port 0x%x\n", io_qual.port);
 
@@ -243,52 +258,61 @@ v3_handle_vmx_io_outs(struct v3_core_info  * core,
         struct vmx_exit_io_instr_info instr_info = *(struct vmx_exit_io_instr_info *)&(exit_info->instr_info);
 
         if (instr_info.addr_size       == 0) {
-            rep_num = core->vm_regs.rcx & 0xffff;
+            mask = 0xffff;
         } else if(instr_info.addr_size == 1) {
-            rep_num = core->vm_regs.rcx & 0xffffffff;
+            mask = 0xffffffff;
         } else if(instr_info.addr_size == 2) {
-            rep_num = core->vm_regs.rcx & 0xffffffffffffffffLL;
+            mask = 0xffffffffffffffffLL;
         } else {
             PrintDebug("Unknown INS address size!\n");
             return -1;
         }
+
+        rep_num = core->vm_regs.rcx & mask;
     }
 
     if (flags->df) {
-        rsi_change = -write_size;
-    } else {
-        rsi_change =  write_size;
+        direction = -1;
     }
 
+    // The linear address is seg.base + rSI, recompute it as rSI moves (and wraps)
+    seg_base = guest_va - (core->vm_regs.rsi & mask);
 
 
-    PrintDebug("OUTS size=%d for %d steps\n", write_size, rep_num);
+    PrintDebug("OUTS size=%d for %d steps\n", write_size, (uint32_t)rep_num);
 
-    if (v3_gva_to_hva(core, guest_va, &host_addr) == -1) {
-        PrintError("Could not convert guest VA to host VA\n");
-        return -1;
-    }
+    // One guest page at a time
+    while (rep_num > 0) {
+	uint_t count = 0;
+
+	guest_va = seg_base + (core->vm_regs.rsi & mask);
+
+	// The page may not have been allocated or restored yet
+	if (v3_populate_gva_range(core, PAGE_ADDR(guest_va), PAGE_SIZE) == -1) {
+	    PrintError("Could not populate OUTS source\n");
+	    return -1;
+	}
+
+	if (v3_gva_to_hva(core, guest_va, &host_addr) == -1) {
+	    PrintError("Could not convert guest VA to host VA\n");
+	    return -1;
+	}
 
-    do {
+	count = v3_io_string_count(guest_va, core->vm_regs.rsi, mask, write_size, rep_num, direction);
 
-	if (hook == NULL) {
-	    PrintDebug("OUTS operation on unhooked IO port 0x%x - ignored\n", io_qual.port);
-	} else {
-	    if (hook->write(core, io_qual.port, (uint8_t *)host_addr, write_size, hook->priv_data) != write_size) {
-		PrintError("Read failure for INS on port 0x%x\n", io_qual.port);
-		return -1;
-	    }
+	if (v3_io_write_string(core, hook, io_qual.port, (uint8_t *)host_addr, write_size, count, direction) == -1) {
+	    PrintError("Write failure for OUTS on port 0x%x\n", io_qual.port);
+	    return -1;
 	}
-	
 
-       host_addr         += rsi_change;
-       core->vm_regs.rsi += rsi_change;
+	core->vm_regs.rsi += ((int)(write_size * count) * direction);
 
-       if (io_qual.rep) {
-           --core->vm_regs.rcx;
-       }
+	if (io_qual.rep) {
+	    core->vm_regs.rcx -= count;
+	}
 
-    } while (--rep_num > 0);
+	rep_num -= count;
+    }
 
 
     core->rip += exit_info->instr_len;
@@ -24,14 +24,20 @@
 #include <vnet/vnet_host.h>
 #include <vnet/vnet_vmm.h>
 
-#include <palacios/vmm_queue.h>
-
 #ifndef V3_CONFIG_DEBUG_VNET
 #undef PrintDebug
 #define PrintDebug(fmt, args...)
 #endif
 
-#define VNET_YIELD_USEC 1000
+/* 
+ * TX flush workers. Each pollable device is assigned to one worker, 
+ * which only polls it after it has been queued by a kick (or by itself while 
+ * the device reports more work). An idle worker spins for a while before it sleeps.
+ */
+#define VNET_MAX_WORKERS     V3_CONFIG_MAX_CPUS
+#define VNET_SPIN_ROUNDS     2000   /* Empty checks of the work queue before sleeping */
+#define VNET_SPIN_USEC       1
+#define VNET_IDLE_TIMEOUT    1      /* Host ticks, catches devices that never kick */
 
 int net_debug = 0;
 
@@ -55,8 +61,27 @@ struct vnet_dev {
 	
     void * private_data;
 
+    struct vnet_worker * worker;
+    struct vnet_dev * work_next;   /* Link in the worker's queue */
+    uint32_t work_queued;          /* Set while the device is on the queue */
+
     struct list_head node;
-} __attribute__((packed));
+};
+
+
+struct vnet_worker {
+    /* Devices with work pending. Any CPU pushes, only the worker takes them (all at once) */
+    struct vnet_dev * work;
+
+    uint32_t sleeping;
+
+    int idx;
+    int cpu;                       /* Host CPU the thread is bound to, -1 if not bound */
+    uint32_t num_devs;
+
+    char name[32];
+    struct vnet_thread * thread;
+} __attribute__((aligned(64)));
 
 
 struct vnet_brg_dev {
@@ -78,19 +103,74 @@ struct vnet_route_info {
 
     uint32_t idx;
 
+    /* Match rank indexed by [src MAC equal][dst MAC equal], 0 = no match */
+    uint8_t rank[2][2];
+
     struct list_head node;
-    struct list_head match_node; // used for route matching
 };
 
 
 struct route_list {
     uint8_t hash_buf[VNET_HASH_SIZE];
 
+    struct route_list * next_retired;   /* Replaced in the cache, freed with the table */
+
     uint32_t num_routes;
     struct vnet_route_info * routes[0];
 } __attribute__((packed));
 
 
+/* 
+ * The packet path reads an immutable snapshot of the route list without locking.
+ * Route and device changes build a new table under vnet_state.lock, publish it, 
+ * and free the old one (and anything it referenced) once every CPU has left 
+ * the read sections that could still see it.
+ * Each table carries its own route cache, so a route change simply starts with an empty one.
+ * A full cache replaces entries, which are kept until the table itself is freed.
+ */
+#define VNET_CACHE_SIZE        1024   /* Must be a power of 2 */
+#define VNET_CACHE_PROBES      4
+#define VNET_CACHE_MAX_RETIRED 4096   /* Past this the cache stops replacing entries */
+
+/* 
+ * A route's rank only depends on whether its src and dst MACs equal the packet's.
+ * The classifier files each route under the MAC comparisons that can give it a rank,
+ * so a lookup only visits routes that can match:
+ *   pair  - both MACs equal,  hashed on (src, dst)
+ *   src   - only src equal,   hashed on src
+ *   dst   - only dst equal,   hashed on dst
+ *   wildcards - neither equal (ANY/NOT qualifiers)
+ */
+struct route_node {
+    struct vnet_route_info * route;
+    struct route_node * next;
+};
+
+struct route_table {
+    struct route_list * cache[VNET_CACHE_SIZE];   /* Slots are never emptied, only replaced */
+    struct route_list * retired;                  /* Lists replaced in the cache */
+    uint32_t num_retired;
+
+    uint32_t num_routes;
+
+    uint32_t num_buckets;                         /* Power of 2 */
+    struct route_node ** pair_buckets;
+    struct route_node ** src_buckets;
+    struct route_node ** dst_buckets;
+    struct route_node * wildcards;
+
+    /* The buckets and nodes are allocated behind the table */
+    uint8_t data[0];
+};
+
+
+struct vnet_cpu_state {
+    uint32_t readers[2];         /* Route table read sections active on this CPU, per epoch */
+
+    struct vnet_stat stats;
+} __attribute__((aligned(64)));
+
+
 struct queue_entry{
     uint8_t use;
     struct v3_vnet_pkt pkt;
@@ -112,15 +192,17 @@ static struct {
 
     struct vnet_brg_dev * bridge;
 
-    vnet_lock_t lock;
-    struct vnet_stat stats;
+    vnet_lock_t lock;            /* Serializes updates, the packet path does not take it */
+
+    uint32_t epoch;              /* New read sections count against readers[epoch & 1] */
+    uint32_t sync_busy;          /* Serializes vnet_synchronize() */
 
-   /* device queue that are waiting to be polled */
-    struct v3_queue * poll_devs;
+    struct vnet_worker workers[VNET_MAX_WORKERS];
+    uint32_t num_workers;
 
-    struct vnet_thread * pkt_flush_thread;
+    struct route_table * route_table;
 
-    struct hashtable * route_cache;
+    struct vnet_cpu_state cpus[V3_CONFIG_MAX_CPUS];
 } vnet_state;
 	
 
@@ -171,42 +253,317 @@ static void dump_routes(){
 #endif
 
 
+static inline void vnet_mb(void) {
+    __asm__ __volatile__ ("mfence" : : : "memory");
+}
+
+/* Returns the CPU slot and fills in the epoch to pass to vnet_read_unlock() */
+static inline int vnet_read_lock(int * epoch) {
+    int cpu = V3_Get_CPU() % V3_CONFIG_MAX_CPUS;
+
+    *epoch = *(volatile uint32_t *)&(vnet_state.epoch) & 1;
+
+    // The locked add orders the count before our read of the route table
+    __sync_fetch_and_add(&(vnet_state.cpus[cpu].readers[*epoch]), 1);
+
+    return cpu;
+}
+
+static inline void vnet_read_unlock(int cpu, int epoch) {
+    __sync_fetch_and_sub(&(vnet_state.cpus[cpu].readers[epoch]), 1);
+}
+
+/* Waits until no read section that started before the call is still running. 
+ * New sections count against the other epoch, so they cannot hold the wait up. 
+ * A section that read the old epoch just before the switch increments its count 
+ * before reading the table, so it is either waited for or sees the new table. */
+static void vnet_synchronize(void) {
+    uint32_t old_epoch = 0;
+    int i = 0;
+
+    while (__sync_lock_test_and_set(&(vnet_state.sync_busy), 1) == 1) {
+	Vnet_Yield();
+    }
+
+    // The locked add also orders the caller's updates before the counts are read
+    old_epoch = __sync_fetch_and_add(&(vnet_state.epoch), 1) & 1;
+
+    for (i = 0; i < V3_CONFIG_MAX_CPUS; i++) {
+	while (*(volatile uint32_t *)&(vnet_state.cpus[i].readers[old_epoch]) != 0) {
+	    Vnet_Yield();
+	}
+    }
+
+    __sync_lock_release(&(vnet_state.sync_busy));
+}
+
+
+/* Queue a device on its worker. Callers must hold a read section or vnet_state.lock */
+static void vnet_queue_dev(struct vnet_dev * dev) {
+    struct vnet_worker * worker = dev->worker;
+    struct vnet_dev * head = NULL;
+
+    if ((worker == NULL) || (dev->poll == 0)) {
+	return;
+    }
+
+    if (__sync_lock_test_and_set(&(dev->work_queued), 1) == 1) {
+	// Already pending
+	return;
+    }
+
+    do {
+	head = *(struct vnet_dev * volatile *)&(worker->work);
+	dev->work_next = head;
+    } while (!__sync_bool_compare_and_swap(&(worker->work), head, dev));
+
+    if ((*(volatile uint32_t *)&(worker->sleeping)) && 
+	(__sync_bool_compare_and_swap(&(worker->sleeping), 1, 0))) {
+	vnet_thread_wakeup(worker->thread);
+    }
+}
+
+/* Takes every queued device, oldest first */
+static struct vnet_dev * vnet_take_work(struct vnet_worker * worker) {
+    struct vnet_dev * dev = __sync_lock_test_and_set(&(worker->work), NULL);
+    struct vnet_dev * list = NULL;
+    struct vnet_dev * next = NULL;
+
+    while (dev) {
+	next = dev->work_next;
+	dev->work_next = list;
+	list = dev;
+	dev = next;
+    }
+
+    return list;
+}
+
+
+static void free_route_table(struct route_table * table) {
+    int i = 0;
+
+    if (table == NULL) {
+	return;
+    }
+
+    for (i = 0; i < VNET_CACHE_SIZE; i++) {
+	if (table->cache[i]) {
+	    Vnet_Free(table->cache[i]);
+	}
+    }
+
+    while (table->retired) {
+	struct route_list * routes = table->retired;
+
+	table->retired = routes->next_retired;
+	Vnet_Free(routes);
+    }
+
+    Vnet_Free(table);
+}
+
+
+static inline uint32_t mac_hash(const uint8_t * mac) {
+    return vnet_hash_buffer((uint8_t *)mac, ETH_ALEN);
+}
+
+static inline uint32_t pair_hash(const uint8_t * src_mac, const uint8_t * dst_mac) {
+    return mac_hash(src_mac) ^ (mac_hash(dst_mac) * 31);
+}
+
+static inline void add_route_node(struct route_node ** head, 
+				  struct route_node * node, 
+				  struct vnet_route_info * route) {
+    node->route = route;
+    node->next = *head;
+    *head = node;
+}
+
+/* Routes are added in reverse so each bucket keeps the route list order */
+static void build_classifier(struct route_table * table, 
+			     struct vnet_route_info ** routes) {
+    struct route_node * nodes = NULL;
+    uint32_t mask = 0;
+    int i = 0;
+
+    table->pair_buckets = (struct route_node **)(table->data);
+    table->src_buckets  = table->pair_buckets + table->num_buckets;
+    table->dst_buckets  = table->src_buckets + table->num_buckets;
+    nodes = (struct route_node *)(table->dst_buckets + table->num_buckets);
+
+    mask = table->num_buckets - 1;
+
+    for (i = table->num_routes - 1; i >= 0; i--) {
+	struct vnet_route_info * route = routes[i];
+	uint8_t * src_mac = route->route_def.src_mac;
+	uint8_t * dst_mac = route->route_def.dst_mac;
+
+	if (route->rank[1][1]) {
+	    add_route_node(&(table->pair_buckets[pair_hash(src_mac, dst_mac) & mask]), nodes++, route);
+	}
+
+	if (route->rank[1][0]) {
+	    add_route_node(&(table->src_buckets[mac_hash(src_mac) & mask]), nodes++, route);
+	}
+
+	if (route->rank[0][1]) {
+	    add_route_node(&(table->dst_buckets[mac_hash(dst_mac) & mask]), nodes++, route);
+	}
+
+	if (route->rank[0][0]) {
+	    add_route_node(&(table->wildcards), nodes++, route);
+	}
+    }
+}
+
+
+/* 
+ * Snapshots the route list into a new table and publishes it. 
+ * On return no packet can still be using the previous table, 
+ * so routes and devices unlinked before the call may be freed.
+ */
+static int update_route_table(void) {
+    struct route_table     * new_table = NULL;
+    struct route_table     * old_table = NULL;
+    struct vnet_route_info * route     = NULL;
+    struct vnet_route_info ** routes   = NULL;
+    vnet_intr_flags_t flags;
+    uint32_t num_routes = 0;
+    uint32_t num_buckets = 0;
+    int i = 0;
+
+    // Allocate outside the lock, retrying if the route list changed in the meantime
+    while (1) {
+	num_routes = vnet_state.num_routes;
+
+	for (num_buckets = 1; num_buckets < num_routes; num_buckets <<= 1);
+
+	// Each route can sit in all four indexes
+	new_table = (struct route_table *)Vnet_Malloc(sizeof(struct route_table) + 
+						      (sizeof(struct route_node *) * num_buckets * 3) +
+						      (sizeof(struct route_node) * num_routes * 4));
+	routes = (struct vnet_route_info **)Vnet_Malloc(sizeof(struct vnet_route_info *) * (num_routes + 1));
+
+	if ((new_table == NULL) || (routes == NULL)) {
+	    PrintError("VNET/P Core: Cannot allocate route table\n");
+
+	    if (new_table) {
+		Vnet_Free(new_table);
+	    }
+
+	    if (routes) {
+		Vnet_Free(routes);
+	    }
+
+	    return -1;
+	}
+
+	memset(new_table, 0, sizeof(struct route_table) + (sizeof(struct route_node *) * num_buckets * 3));
+
+	flags = vnet_lock_irqsave(vnet_state.lock);
+
+	if (num_routes == vnet_state.num_routes) {
+	    break;
+	}
+
+	vnet_unlock_irqrestore(vnet_state.lock, flags);
+	Vnet_Free(new_table);
+	Vnet_Free(routes);
+    }
+
+    list_for_each_entry(route, &(vnet_state.routes), node) {
+	routes[i++] = route;
+    }
+
+    new_table->num_routes = i;
+    new_table->num_buckets = num_buckets;
+
+    build_classifier(new_table, routes);
+
+    old_table = vnet_state.route_table;
+
+    // The table contents must be visible before the pointer
+    vnet_mb();
+    vnet_state.route_table = new_table;
+
+    vnet_unlock_irqrestore(vnet_state.lock, flags);
+
+    Vnet_Free(routes);
+
+    vnet_synchronize();
+    free_route_table(old_table);
+
+    return 0;
+}
+
+
 /* 
  * A VNET packet is a packed struct with the hashed fields grouped together.
  * This means we can generate the hash from an offset into the pkt struct
  */
-static inline uint_t hash_fn(addr_t hdr_ptr) {    
-    uint8_t * hdr_buf = (uint8_t *)hdr_ptr;
-
-    return vnet_hash_buffer(hdr_buf, VNET_HASH_SIZE);
+static inline uint32_t cache_slot(const uint8_t * hash_buf) {
+    return vnet_hash_buffer((uint8_t *)hash_buf, VNET_HASH_SIZE) & (VNET_CACHE_SIZE - 1);
 }
 
-static inline int hash_eq(addr_t key1, addr_t key2) {	
-    return (memcmp((uint8_t *)key1, (uint8_t *)key2, VNET_HASH_SIZE) == 0);
+static struct route_list * look_into_cache(struct route_table * table, 
+					   const struct v3_vnet_pkt * pkt) {
+    uint32_t slot = cache_slot(pkt->hash_buf);
+    int i = 0;
+
+    for (i = 0; i < VNET_CACHE_PROBES; i++) {
+	struct route_list * routes = table->cache[(slot + i) & (VNET_CACHE_SIZE - 1)];
+
+	if (routes == NULL) {
+	    break;
+	}
+
+	if (memcmp(routes->hash_buf, pkt->hash_buf, VNET_HASH_SIZE) == 0) {
+	    return routes;
+	}
+    }
+
+    return NULL;
 }
 
-static int add_route_to_cache(const struct v3_vnet_pkt * pkt, struct route_list * routes) {
+/* Returns 0 if the cache now owns the list, -1 if the caller must free it */
+static int add_route_to_cache(struct route_table * table, 
+			      const struct v3_vnet_pkt * pkt, 
+			      struct route_list * routes) {
+    uint32_t slot = cache_slot(pkt->hash_buf);
+    struct route_list * old_routes = NULL;
+    uint32_t retired = 0;
+    int i = 0;
+
     memcpy(routes->hash_buf, pkt->hash_buf, VNET_HASH_SIZE);    
 
-    if (vnet_htable_insert(vnet_state.route_cache, (addr_t)routes->hash_buf, (addr_t)routes) == 0) {
-	PrintError("VNET/P Core: Failed to insert new route entry to the cache\n");
+    for (i = 0; i < VNET_CACHE_PROBES; i++) {
+	struct route_list ** entry = &(table->cache[(slot + i) & (VNET_CACHE_SIZE - 1)]);
+
+	if (__sync_bool_compare_and_swap(entry, NULL, routes)) {
+	    return 0;
+	}
+
+	// Another CPU may have just cached the same flow
+	if (memcmp((*entry)->hash_buf, pkt->hash_buf, VNET_HASH_SIZE) == 0) {
+	    return -1;
+	}
+    }
+
+    // Every probed slot holds another flow, so replace one of them
+    if (*(volatile uint32_t *)&(table->num_retired) >= VNET_CACHE_MAX_RETIRED) {
 	return -1;
     }
-    
-    return 0;
-}
 
-static int clear_hash_cache() {
-    vnet_free_htable(vnet_state.route_cache, 1, 1);
-    vnet_state.route_cache = vnet_create_htable(0, &hash_fn, &hash_eq);
+    retired = __sync_fetch_and_add(&(table->num_retired), 1);
 
-    return 0;
-}
+    old_routes = __sync_lock_test_and_set(&(table->cache[(slot + (retired % VNET_CACHE_PROBES)) & (VNET_CACHE_SIZE - 1)]), routes);
+
+    // Readers may still hold the old list, it is freed along with the table
+    do {
+	old_routes->next_retired = table->retired;
+    } while (!__sync_bool_compare_and_swap(&(table->retired), old_routes->next_retired, old_routes));
 
-static int look_into_cache(const struct v3_vnet_pkt * pkt, 
-			   struct route_list ** routes) {
-    *routes = (struct route_list *)vnet_htable_search(vnet_state.route_cache, (addr_t)(pkt->hash_buf));
-   
     return 0;
 }
 
@@ -249,6 +606,71 @@ int v3_vnet_find_dev(uint8_t  * mac) {
 }
 
 
+/* 
+ * The ranking rules for a route, given whether the packet's MACs equal the route's.
+ * The more specific the match, the higher the rank. Only the highest ranked routes are used.
+ */
+static uint8_t route_rank(struct v3_vnet_route * route_def, int src_eq, int dst_eq) {
+    uint8_t rank = 0;
+
+#define UPDATE_RANK(r) do {			\
+	if (rank < (r)) {			\
+	    rank = (r);				\
+	}					\
+    } while (0)
+
+    if ((route_def->dst_mac_qual == MAC_ANY) &&
+	(route_def->src_mac_qual == MAC_ANY)) {      
+	UPDATE_RANK(3);
+    }
+	
+    if (src_eq) {
+	if (route_def->src_mac_qual != MAC_NOT) {
+	    if (route_def->dst_mac_qual == MAC_ANY) {
+		UPDATE_RANK(6);
+	    } else if (route_def->dst_mac_qual != MAC_NOT && dst_eq) {
+		UPDATE_RANK(8);
+	    }
+	}
+    }
+	    
+    if (dst_eq) {
+	if (route_def->dst_mac_qual != MAC_NOT) {
+	    if (route_def->src_mac_qual == MAC_ANY) {
+		UPDATE_RANK(6);
+	    } else if ((route_def->src_mac_qual != MAC_NOT) && src_eq) {
+		UPDATE_RANK(8);
+	    }
+	}
+    }
+	    
+    if ((route_def->dst_mac_qual == MAC_NOT) && !dst_eq) {
+	if (route_def->src_mac_qual == MAC_ANY) {
+	    UPDATE_RANK(5);
+	} else if ((route_def->src_mac_qual != MAC_NOT) && src_eq) {     
+	    UPDATE_RANK(7);
+	}
+    }
+	
+    if ((route_def->src_mac_qual == MAC_NOT) && !src_eq) {
+	if (route_def->dst_mac_qual == MAC_ANY) {
+	    UPDATE_RANK(5);
+	} else if ((route_def->dst_mac_qual != MAC_NOT) && dst_eq) {
+	    UPDATE_RANK(7);
+	}
+    }
+	
+    // Default route
+    if (src_eq && (route_def->dst_mac_qual == MAC_NONE)) {
+	UPDATE_RANK(4);
+    }
+
+#undef UPDATE_RANK
+
+    return rank;
+}
+
+
 int v3_vnet_add_route(struct v3_vnet_route route) {
     struct vnet_route_info * new_route = NULL;
     vnet_intr_flags_t flags; 
@@ -276,6 +698,15 @@ int v3_vnet_add_route(struct v3_vnet_route route) {
     new_route->route_def.src_id = route.src_id;
     new_route->route_def.dst_id = route.dst_id;
 
+    new_route->rank[0][0] = route_rank(&(new_route->route_def), 0, 0);
+    new_route->rank[0][1] = route_rank(&(new_route->route_def), 0, 1);
+    new_route->rank[1][0] = route_rank(&(new_route->route_def), 1, 0);
+    new_route->rank[1][1] = route_rank(&(new_route->route_def), 1, 1);
+
+
+    flags = vnet_lock_irqsave(vnet_state.lock);
+
+    // Resolve devices under the lock so v3_vnet_del_dev() can't miss this route
     if (new_route->route_def.dst_type == LINK_INTERFACE) {
 	new_route->dst_dev = dev_by_id(new_route->route_def.dst_id);
     }
@@ -284,16 +715,13 @@ int v3_vnet_add_route(struct v3_vnet_route route) {
 	new_route->src_dev = dev_by_id(new_route->route_def.src_id);
     }
 
-
-    flags = vnet_lock_irqsave(vnet_state.lock);
-
     list_add(&(new_route->node), &(vnet_state.routes));
     new_route->idx = ++ vnet_state.route_idx;
     vnet_state.num_routes ++;
 	
     vnet_unlock_irqrestore(vnet_state.lock, flags);
 
-    clear_hash_cache();
+    update_route_table();
 
 #ifdef V3_CONFIG_DEBUG_VNET
     dump_routes();
@@ -305,6 +733,7 @@ int v3_vnet_add_route(struct v3_vnet_route route) {
 
 void v3_vnet_del_route(uint32_t route_idx){
     struct vnet_route_info * route = NULL;
+    struct vnet_route_info * found = NULL;
     vnet_intr_flags_t flags; 
 
     flags = vnet_lock_irqsave(vnet_state.lock);
@@ -313,13 +742,28 @@ void v3_vnet_del_route(uint32_t route_idx){
 	Vnet_Print(0, "v3_vnet_del_route, route idx: %d\n", route->idx);
 	if(route->idx == route_idx){
 	    list_del(&(route->node));
-	    Vnet_Free(route);
+	    vnet_state.num_routes --;
+	    found = route;
 	    break;    
 	}
     }
 
     vnet_unlock_irqrestore(vnet_state.lock, flags);
-    clear_hash_cache();
+
+    if (found) {
+	// Packets may still be forwarding through the route until the old table is retired
+	if (update_route_table() == -1) {
+	    PrintError("VNET/P Core: Could not remove route %d\n", route_idx);
+
+	    // The published table still points at it, so put it back
+	    flags = vnet_lock_irqsave(vnet_state.lock);
+	    list_add(&(found->node), &(vnet_state.routes));
+	    vnet_state.num_routes ++;
+	    vnet_unlock_irqrestore(vnet_state.lock, flags);
+	} else {
+	    Vnet_Free(found);
+	}
+    }
 
 #ifdef V3_CONFIG_DEBUG_VNET
     dump_routes();
@@ -330,8 +774,11 @@ void v3_vnet_del_route(uint32_t route_idx){
 /* delete all route entries with specfied src or dst device id */ 
 static void inline del_routes_by_dev(int dev_id){
     struct vnet_route_info * route, *tmp_route;
+    struct list_head dead_routes;
     vnet_intr_flags_t flags; 
 
+    INIT_LIST_HEAD(&dead_routes);
+
     flags = vnet_lock_irqsave(vnet_state.lock);
 
     list_for_each_entry_safe(route, tmp_route, &(vnet_state.routes), node) {
@@ -340,13 +787,32 @@ static void inline del_routes_by_dev(int dev_id){
 	     (route->route_def.src_type == LINK_INTERFACE &&
 	      route->route_def.src_id == dev_id)){
 	      
-	    list_del(&(route->node));
-	    list_del(&(route->match_node));
-	    Vnet_Free(route);    
+	    list_move(&(route->node), &dead_routes);
+	    vnet_state.num_routes --;
 	}
     }
 
     vnet_unlock_irqrestore(vnet_state.lock, flags);
+
+    if (update_route_table() == -1) {
+	PrintError("VNET/P Core: Could not remove routes of device %d\n", dev_id);
+
+	// The published table still points at them, so put them back
+	flags = vnet_lock_irqsave(vnet_state.lock);
+
+	list_for_each_entry_safe(route, tmp_route, &dead_routes, node) {
+	    list_move(&(route->node), &(vnet_state.routes));
+	    vnet_state.num_routes ++;
+	}
+
+	vnet_unlock_irqrestore(vnet_state.lock, flags);
+	return;
+    }
+
+    list_for_each_entry_safe(route, tmp_route, &dead_routes, node) {
+	list_del(&(route->node));
+	Vnet_Free(route);    
+    }
 }
 
 
@@ -354,16 +820,17 @@ static void inline del_routes_by_dev(int dev_id){
 
 /* At the end allocate a route_list
  * This list will be inserted into the cache so we don't need to free it
+ * A packet without routes gets an empty list, so misses are cached as well
  */
-static struct route_list * match_route(const struct v3_vnet_pkt * pkt) {
-    struct vnet_route_info * route = NULL; 
+static struct route_list * match_route(struct route_table * table, 
+				       const struct v3_vnet_pkt * pkt) {
     struct route_list * matches = NULL;
+    struct route_node * node = NULL;
+    struct eth_hdr * hdr = (struct eth_hdr *)(pkt->data);
+    uint32_t mask = table->num_buckets - 1;
     int num_matches = 0;
     int max_rank = 0;
-    struct list_head match_list;
-    struct eth_hdr * hdr = (struct eth_hdr *)(pkt->data);
-    //  uint8_t src_type = pkt->src_type;
-    //  uint32_t src_link = pkt->src_id;
+    int pass = 0;
 
 #ifdef V3_CONFIG_DEBUG_VNET
     {
@@ -376,113 +843,83 @@ static struct route_list * match_route(const struct v3_vnet_pkt * pkt) {
     }
 #endif
 
-    INIT_LIST_HEAD(&match_list);
-    
-#define UPDATE_MATCHES(rank) do {				\
-	if (max_rank < (rank)) {				\
-	    max_rank = (rank);					\
-	    INIT_LIST_HEAD(&match_list);			\
-	    							\
-	    list_add(&(route->match_node), &match_list);	\
-	    num_matches = 1;					\
-	} else if (max_rank == (rank)) {			\
-	    list_add(&(route->match_node), &match_list);	\
-	    num_matches++;					\
-	}							\
+    /* Each route is filed under one (src equal, dst equal) combination per packet,
+     * so it is seen at most once per pass.
+     * The first pass finds the best rank and number of matches, the second fills in the list 
+     */
+#define UPDATE_MATCHES(rank) do {					\
+	if (pass == 0) {						\
+	    if (max_rank < (rank)) {					\
+		max_rank = (rank);					\
+		num_matches = 0;					\
+	    }								\
+	    if (((rank) != 0) && (max_rank == (rank))) {		\
+		num_matches++;						\
+	    }								\
+	} else if (max_rank == (rank)) {				\
+	    matches->routes[matches->num_routes++] = node->route;	\
+	}								\
     } while (0)
-    
 
-    list_for_each_entry(route, &(vnet_state.routes), node) {
-	struct v3_vnet_route * route_def = &(route->route_def);
-
-/*
-	// CHECK SOURCE TYPE HERE
-	if ( (route_def->src_type != LINK_ANY) && 
-	     ( (route_def->src_type != src_type) || 
-	       ( (route_def->src_id != src_link) &&
-		 (route_def->src_id != -1)))) {
-	    continue;
-	}
-*/
+    for (pass = 0; pass < 2; pass++) {
 
-	if ((route_def->dst_mac_qual == MAC_ANY) &&
-	    (route_def->src_mac_qual == MAC_ANY)) {      
-	    UPDATE_MATCHES(3);
-	}
-	
-	if (memcmp(route_def->src_mac, hdr->src_mac, 6) == 0) {
-	    if (route_def->src_mac_qual != MAC_NOT) {
-		if (route_def->dst_mac_qual == MAC_ANY) {
-		    UPDATE_MATCHES(6);
-		} else if (route_def->dst_mac_qual != MAC_NOT &&
-			   memcmp(route_def->dst_mac, hdr->dst_mac, 6) == 0) {
-		    UPDATE_MATCHES(8);
-		}
-	    }
-	}
-	    
-	if (memcmp(route_def->dst_mac, hdr->dst_mac, 6) == 0) {
-	    if (route_def->dst_mac_qual != MAC_NOT) {
-		if (route_def->src_mac_qual == MAC_ANY) {
-		    UPDATE_MATCHES(6);
-		} else if ((route_def->src_mac_qual != MAC_NOT) && 
-			   (memcmp(route_def->src_mac, hdr->src_mac, 6) == 0)) {
-		    UPDATE_MATCHES(8);
-		}
+	if (pass == 1) {
+	    PrintDebug("VNET/P Core: match_route: Matches=%d\n", num_matches);
+
+	    matches = (struct route_list *)Vnet_Malloc(sizeof(struct route_list) + 
+						       (sizeof(struct vnet_route_info *) * num_matches));
+
+	    if (!matches) {
+		PrintError("VNET/P Core: Unable to allocate matches\n");
+		return NULL;
 	    }
-	}
-	    
-	if ((route_def->dst_mac_qual == MAC_NOT) &&
-	    (memcmp(route_def->dst_mac, hdr->dst_mac, 6) != 0)) {
-	    if (route_def->src_mac_qual == MAC_ANY) {
-		UPDATE_MATCHES(5);
-	    } else if ((route_def->src_mac_qual != MAC_NOT) && 
-		       (memcmp(route_def->src_mac, hdr->src_mac, 6) == 0)) {     
-		UPDATE_MATCHES(7);
+
+	    matches->num_routes = 0;
+
+	    if (num_matches == 0) {
+		break;
 	    }
 	}
-	
-	if ((route_def->src_mac_qual == MAC_NOT) &&
-	    (memcmp(route_def->src_mac, hdr->src_mac, 6) != 0)) {
-	    if (route_def->dst_mac_qual == MAC_ANY) {
-		UPDATE_MATCHES(5);
-	    } else if ((route_def->dst_mac_qual != MAC_NOT) &&
-		       (memcmp(route_def->dst_mac, hdr->dst_mac, 6) == 0)) {
-		UPDATE_MATCHES(7);
+
+	for (node = table->pair_buckets[pair_hash(hdr->src_mac, hdr->dst_mac) & mask]; node; node = node->next) {
+	    struct v3_vnet_route * route_def = &(node->route->route_def);
+
+	    if ((memcmp(route_def->src_mac, hdr->src_mac, ETH_ALEN) == 0) && 
+		(memcmp(route_def->dst_mac, hdr->dst_mac, ETH_ALEN) == 0)) {
+		UPDATE_MATCHES(node->route->rank[1][1]);
 	    }
 	}
-	
-	// Default route
-	if ( (memcmp(route_def->src_mac, hdr->src_mac, 6) == 0) &&
-	     (route_def->dst_mac_qual == MAC_NONE)) {
-	    UPDATE_MATCHES(4);
-	}
-    }
 
-    PrintDebug("VNET/P Core: match_route: Matches=%d\n", num_matches);
+	for (node = table->src_buckets[mac_hash(hdr->src_mac) & mask]; node; node = node->next) {
+	    struct v3_vnet_route * route_def = &(node->route->route_def);
 
-    if (num_matches <= 0) {
-	return NULL;
-    }
-
-    matches = (struct route_list *)Vnet_Malloc(sizeof(struct route_list) + 
-					       (sizeof(struct vnet_route_info *) * num_matches));
+	    if ((memcmp(route_def->src_mac, hdr->src_mac, ETH_ALEN) == 0) && 
+		(memcmp(route_def->dst_mac, hdr->dst_mac, ETH_ALEN) != 0)) {
+		UPDATE_MATCHES(node->route->rank[1][0]);
+	    }
+	}
 
+	for (node = table->dst_buckets[mac_hash(hdr->dst_mac) & mask]; node; node = node->next) {
+	    struct v3_vnet_route * route_def = &(node->route->route_def);
 
-    if (!matches) {
-	PrintError("VNET/P Core: Unable to allocate matches\n");
-	return NULL;
-    }
+	    if ((memcmp(route_def->src_mac, hdr->src_mac, ETH_ALEN) != 0) && 
+		(memcmp(route_def->dst_mac, hdr->dst_mac, ETH_ALEN) == 0)) {
+		UPDATE_MATCHES(node->route->rank[0][1]);
+	    }
+	}
 
-    matches->num_routes = num_matches;
+	for (node = table->wildcards; node; node = node->next) {
+	    struct v3_vnet_route * route_def = &(node->route->route_def);
 
-    {
-	int i = 0;
-	list_for_each_entry(route, &match_list, match_node) {
-	    matches->routes[i++] = route;
+	    if ((memcmp(route_def->src_mac, hdr->src_mac, ETH_ALEN) != 0) && 
+		(memcmp(route_def->dst_mac, hdr->dst_mac, ETH_ALEN) != 0)) {
+		UPDATE_MATCHES(node->route->rank[0][0]);
+	    }
 	}
     }
 
+#undef UPDATE_MATCHES
+
     return matches;
 }
 
@@ -491,9 +928,14 @@ int v3_vnet_query_header(uint8_t src_mac[6],
 			 int     recv,         // 0 = send, 1=recv
 			 struct v3_vnet_header *header)
 {
+    struct route_table *table;
     struct route_list *routes;
     struct vnet_route_info *r;
     struct v3_vnet_pkt p;
+    int cached = 1;
+    int ret = 0;
+    int cpu;
+    int epoch = 0;
 
     p.size=14;
     p.data=p.header;
@@ -508,17 +950,21 @@ int v3_vnet_query_header(uint8_t src_mac[6],
     memcpy(header->dst_mac,dest_mac,6);
 
     
-    look_into_cache(&p,&routes);
+    cpu = vnet_read_lock(&epoch);
+    table = vnet_state.route_table;
+
+    routes = look_into_cache(table, &p);
 
     if (!routes) { 
-	routes = match_route(&p);
+	routes = match_route(table, &p);
 	if (!routes) { 
 	    PrintError("Cannot match route\n");
+	    vnet_read_unlock(cpu, epoch);
 	    header->header_type=VNET_HEADER_NOMATCH;
 	    header->header_len=0;
 	    return -1;
-	} else {
-	    add_route_to_cache(&p,routes);
+	} else if (add_route_to_cache(table, &p, routes) == -1) {
+	    cached = 0;
 	}
     }
     
@@ -526,7 +972,8 @@ int v3_vnet_query_header(uint8_t src_mac[6],
 	PrintError("Less than one route\n");
 	header->header_type=VNET_HEADER_NOMATCH;
 	header->header_len=0;
-	return -1;
+	ret = -1;
+	goto out;
     }
 
     if (routes->num_routes>1) { 
@@ -550,7 +997,6 @@ int v3_vnet_query_header(uint8_t src_mac[6],
 	    
 	}
 	    
-	    return 0;
 	    break;
 	    
 
@@ -562,61 +1008,67 @@ int v3_vnet_query_header(uint8_t src_mac[6],
 	    header->src_mac_qual=r->route_def.src_mac_qual;
 	    header->dst_mac_qual=r->route_def.dst_mac_qual;
 
-	    return 0;
 	    break;
 
 	default:
 	    PrintError("Unknown destination type\n");
-	    return -1;
+	    ret = -1;
 	    break;
 
     }
-    
-}
-
 
+ out:
+    vnet_read_unlock(cpu, epoch);
 
+    if (!cached) {
+	Vnet_Free(routes);
+    }
 
-int v3_vnet_send_pkt(struct v3_vnet_pkt * pkt, void * private_data) {
-    struct route_list * matched_routes = NULL;
-    vnet_intr_flags_t flags;
-    int i;
+    return ret;
+}
 
-    int cpu = V3_Get_CPU();
 
-    Vnet_Print(2, "VNET/P Core: cpu %d: pkt (size %d, src_id:%d, src_type: %d, dst_id: %d, dst_type: %d)\n",
-	       cpu, pkt->size, pkt->src_id, 
-	       pkt->src_type, pkt->dst_id, pkt->dst_type);
 
-    if(net_debug >= 4){
-	v3_hexdump(pkt->data, pkt->size, NULL, 0);
-    }
 
-    flags = vnet_lock_irqsave(vnet_state.lock);
+/* Returns the routes for a packet, *cached is cleared if the caller has to free them */
+static struct route_list * lookup_routes(struct route_table * table, 
+					 struct v3_vnet_pkt * pkt, 
+					 int * cached) {
+    struct route_list * matched_routes = NULL;
 
-    vnet_state.stats.rx_bytes += pkt->size;
-    vnet_state.stats.rx_pkts++;
+    *cached = 1;
 
-    look_into_cache(pkt, &matched_routes);
+    matched_routes = look_into_cache(table, pkt);
 
     if (matched_routes == NULL) {  
 	PrintDebug("VNET/P Core: sending pkt - matching route\n");
 	
-	matched_routes = match_route(pkt);
+	matched_routes = match_route(table, pkt);
 	
-      	if (matched_routes) {
-	    add_route_to_cache(pkt, matched_routes);
-	} else {
-	    PrintDebug("VNET/P Core: Could not find route for packet... discarding packet\n");
-	    vnet_unlock_irqrestore(vnet_state.lock, flags);
-	    return 0; /* do we return -1 here?*/
+      	if (matched_routes == NULL) {
+	    return NULL;
+	}
+
+	if (add_route_to_cache(table, pkt, matched_routes) == -1) {
+	    *cached = 0;
 	}
     }
 
-    vnet_unlock_irqrestore(vnet_state.lock, flags);
+    if (matched_routes->num_routes == 0) {
+	PrintDebug("VNET/P Core: Could not find route for packet... discarding packet\n");
+    }
 
     PrintDebug("VNET/P Core: send pkt route matches %d\n", matched_routes->num_routes);
 
+    return matched_routes;
+}
+
+
+static void forward_pkt(struct route_list * matched_routes, 
+			struct v3_vnet_pkt * pkt, 
+			struct vnet_stat * stats) {
+    int i;
+
     for (i = 0; i < matched_routes->num_routes; i++) {
 	struct vnet_route_info * route = matched_routes->routes[i];
 	
@@ -634,29 +1086,250 @@ int v3_vnet_send_pkt(struct v3_vnet_pkt * pkt, void * private_data) {
                 Vnet_Print(2, "VNET/P Core: Packet not sent properly to bridge\n");
                 continue;
 	    }         
-	    vnet_state.stats.tx_bytes += pkt->size;
-	    vnet_state.stats.tx_pkts ++;
+	    stats->tx_bytes += pkt->size;
+	    stats->tx_pkts ++;
         } else if (route->route_def.dst_type == LINK_INTERFACE) {
-            if (route->dst_dev == NULL){
+	    struct vnet_dev * dst_dev = route->dst_dev;
+
+            if (dst_dev == NULL){
 	 	  Vnet_Print(2, "VNET/P Core: No active device to sent data to\n");
 	        continue;
             }
 
-	    if(route->dst_dev->dev_ops.input(route->dst_dev->vm, pkt, route->dst_dev->private_data) < 0) {
+	    if(dst_dev->dev_ops.input(dst_dev->vm, pkt, dst_dev->private_data) < 0) {
                 Vnet_Print(2, "VNET/P Core: Packet not sent properly\n");
                 continue;
 	    }
-	    vnet_state.stats.tx_bytes += pkt->size;
-	    vnet_state.stats.tx_pkts ++;
+	    stats->tx_bytes += pkt->size;
+	    stats->tx_pkts ++;
         } else {
             Vnet_Print(0, "VNET/P Core: Wrong dst type\n");
         }
     }
+}
+
+
+int v3_vnet_send_pkt(struct v3_vnet_pkt * pkt, void * private_data) {
+    struct route_list * matched_routes = NULL;
+    struct vnet_stat * stats = NULL;
+    int cached = 1;
+
+    int cpu = V3_Get_CPU();
+    int epoch = 0;
+
+    Vnet_Print(2, "VNET/P Core: cpu %d: pkt (size %d, src_id:%d, src_type: %d, dst_id: %d, dst_type: %d)\n",
+	       cpu, pkt->size, pkt->src_id, 
+	       pkt->src_type, pkt->dst_id, pkt->dst_type);
+
+    if(net_debug >= 4){
+	v3_hexdump(pkt->data, pkt->size, NULL, 0);
+    }
+
+    cpu = vnet_read_lock(&epoch);
+    stats = &(vnet_state.cpus[cpu].stats);
+
+    stats->rx_bytes += pkt->size;
+    stats->rx_pkts++;
+
+    matched_routes = lookup_routes(vnet_state.route_table, pkt, &cached);
+
+    if (matched_routes == NULL) {
+	vnet_read_unlock(cpu, epoch);
+	return 0; /* do we return -1 here?*/
+    }
+
+    forward_pkt(matched_routes, pkt, stats);
+
+    vnet_read_unlock(cpu, epoch);
+
+    if (!cached) {
+	Vnet_Free(matched_routes);
+    }
     
     return 0;
 }
 
 
+/* Hand a group of packets for one destination to its batch input, or one at a time */
+static void deliver_batch(struct v3_vnet_pkt ** pkts, 
+			  uint32_t num_pkts, 
+			  void * dst, 
+			  struct vnet_stat * stats) {
+    struct vnet_brg_dev * bridge = NULL;
+    struct vnet_dev * dev = NULL;
+    int batched = 0;
+    int sent = 0;
+    uint32_t i = 0;
+
+    if (pkts[0]->dst_type == LINK_EDGE) {
+	bridge = (struct vnet_brg_dev *)dst;
+
+	if (bridge->brg_ops.input_batch) {
+	    sent = bridge->brg_ops.input_batch(bridge->vm, pkts, num_pkts, bridge->private_data);
+	    batched = 1;
+	}
+    } else {
+	dev = (struct vnet_dev *)dst;
+
+	if (dev->dev_ops.input_batch) {
+	    sent = dev->dev_ops.input_batch(dev->vm, pkts, num_pkts, dev->private_data);
+	    batched = 1;
+	}
+    }
+
+    for (i = 0; i < num_pkts; i++) {
+	if (!batched) {
+	    // No batch input, send them one at a time
+	    if (bridge) {
+		if (bridge->brg_ops.input(bridge->vm, pkts[i], bridge->private_data) < 0) {
+		    Vnet_Print(2, "VNET/P Core: Packet not sent properly to bridge\n");
+		    continue;
+		}
+	    } else if (dev->dev_ops.input(dev->vm, pkts[i], dev->private_data) < 0) {
+		Vnet_Print(2, "VNET/P Core: Packet not sent properly\n");
+		continue;
+	    }
+	} else if ((int)i >= sent) {
+	    Vnet_Print(2, "VNET/P Core: %d batched packets not sent\n", num_pkts - i);
+	    break;
+	}
+
+	stats->tx_bytes += pkts[i]->size;
+	stats->tx_pkts ++;
+    }
+}
+
+/* Deliver the staged packets in [start, end), grouped by destination in arrival order */
+static void flush_staged_pkts(struct v3_vnet_pkt * pkts, 
+			      void ** dsts, 
+			      uint32_t start, 
+			      uint32_t end, 
+			      struct vnet_stat * stats) {
+    struct v3_vnet_pkt * batch[VNET_MAX_BATCH];
+    uint32_t num_batch = 0;
+    uint32_t i = 0;
+    uint32_t j = 0;
+
+    for (i = start; i < end; i++) {
+	if (dsts[i] == NULL) {
+	    continue;
+	}
+
+	num_batch = 0;
+
+	for (j = i; j < end; j++) {
+	    if (dsts[j] == dsts[i]) {
+		batch[num_batch++] = &(pkts[j]);
+
+		if (j != i) {
+		    dsts[j] = NULL;
+		}
+	    }
+	}
+
+	deliver_batch(batch, num_batch, dsts[i], stats);
+	dsts[i] = NULL;
+    }
+}
+
+/* 
+ * Forwards up to VNET_MAX_BATCH packets under a single read section.
+ * Packets with a single route are staged and handed to each destination as a batch, 
+ * anything else flushes the staged packets first so per destination ordering is kept.
+ */
+static void send_pkt_batch(struct v3_vnet_pkt * pkts, uint32_t num_pkts) {
+    struct route_table * table = NULL;
+    struct vnet_brg_dev * bridge = NULL;
+    struct vnet_stat * stats = NULL;
+    void * dsts[VNET_MAX_BATCH];
+    uint32_t staged = 0;
+    uint32_t i = 0;
+    int cpu = 0;
+    int epoch = 0;
+
+    cpu = vnet_read_lock(&epoch);
+    stats = &(vnet_state.cpus[cpu].stats);
+    table = vnet_state.route_table;
+    bridge = vnet_state.bridge;
+
+    for (i = 0; i < num_pkts; i++) {
+	struct v3_vnet_pkt * pkt = &(pkts[i]);
+	struct route_list * matched_routes = NULL;
+	int cached = 1;
+
+	dsts[i] = NULL;
+
+	stats->rx_bytes += pkt->size;
+	stats->rx_pkts++;
+
+	matched_routes = lookup_routes(table, pkt, &cached);
+
+	if (matched_routes == NULL) {
+	    continue;
+	}
+
+	if (matched_routes->num_routes == 1) {
+	    struct vnet_route_info * route = matched_routes->routes[0];
+
+	    if (route->route_def.dst_type == LINK_EDGE) {
+		pkt->dst_type = LINK_EDGE;
+		pkt->dst_id = route->route_def.dst_id;
+		dsts[i] = bridge;
+	    } else if (route->route_def.dst_type == LINK_INTERFACE) {
+		pkt->dst_type = LINK_INTERFACE;
+		dsts[i] = route->dst_dev;
+	    }
+
+	    if (dsts[i] == NULL) {
+		Vnet_Print(2, "VNET/P Core: No active device to sent data to\n");
+	    }
+	} else if (matched_routes->num_routes > 1) {
+	    flush_staged_pkts(pkts, dsts, staged, i, stats);
+	    staged = i + 1;
+
+	    forward_pkt(matched_routes, pkt, stats);
+	}
+
+	if (!cached) {
+	    Vnet_Free(matched_routes);
+	}
+    }
+
+    flush_staged_pkts(pkts, dsts, staged, num_pkts, stats);
+
+    vnet_read_unlock(cpu, epoch);
+}
+
+
+int v3_vnet_send_pkts(struct v3_vnet_pkt * pkts, uint32_t num_pkts, void * private_data) {
+    uint32_t i = 0;
+
+    Vnet_Print(2, "VNET/P Core: cpu %d: batch of %d pkts\n", V3_Get_CPU(), num_pkts);
+
+    for (i = 0; i < num_pkts; i += VNET_MAX_BATCH) {
+	send_pkt_batch(&(pkts[i]), 
+		       ((num_pkts - i) > VNET_MAX_BATCH) ? VNET_MAX_BATCH : (num_pkts - i));
+    }
+
+    return 0;
+}
+
+
+/* Least loaded worker, with vnet_state.lock held */
+static struct vnet_worker * pick_worker(void) {
+    struct vnet_worker * worker = NULL;
+    int i = 0;
+
+    for (i = 0; i < vnet_state.num_workers; i++) {
+	if ((worker == NULL) || (vnet_state.workers[i].num_devs < worker->num_devs)) {
+	    worker = &(vnet_state.workers[i]);
+	}
+    }
+
+    return worker;
+}
+
+
 int v3_vnet_add_dev(struct v3_vm_info * vm, uint8_t * mac, 
 		    struct v3_vnet_dev_ops * ops, int quote, int poll_state,
 		    void * priv_data){
@@ -669,9 +1342,12 @@ int v3_vnet_add_dev(struct v3_vm_info * vm, uint8_t * mac,
 	Vnet_Print(0, "VNET/P Core: Unable to allocate a new device\n");
 	return -1;
     }
+
+    memset(new_dev, 0, sizeof(struct vnet_dev));
    
     memcpy(new_dev->mac_addr, mac, 6);
     new_dev->dev_ops.input = ops->input;
+    new_dev->dev_ops.input_batch = ops->input_batch;
     new_dev->dev_ops.poll = ops->poll;
     new_dev->private_data = priv_data;
     new_dev->vm = vm;
@@ -686,8 +1362,14 @@ int v3_vnet_add_dev(struct v3_vm_info * vm, uint8_t * mac,
 	new_dev->dev_id = ++ vnet_state.dev_idx;
 	vnet_state.num_devs ++;
 
-	if(new_dev->poll) {
-	    v3_enqueue(vnet_state.poll_devs, (addr_t)new_dev);
+	if (new_dev->poll) {
+	    new_dev->worker = pick_worker();
+
+	    if (new_dev->worker) {
+		new_dev->worker->num_devs ++;
+	    }
+
+	    vnet_queue_dev(new_dev);
 	}
     } else {
 	PrintError("VNET/P: Device with the same MAC has already been added\n");
@@ -709,6 +1391,7 @@ int v3_vnet_add_dev(struct v3_vm_info * vm, uint8_t * mac,
 
 int v3_vnet_del_dev(int dev_id){
     struct vnet_dev * dev = NULL;
+    struct vnet_route_info * route = NULL;
     vnet_intr_flags_t flags;
 
     flags = vnet_lock_irqsave(vnet_state.lock);
@@ -718,11 +1401,39 @@ int v3_vnet_del_dev(int dev_id){
     	list_del(&(dev->node));
 	//del_routes_by_dev(dev_id);
 	vnet_state.num_devs --;
+
+	// Stop the device from being queued again
+	dev->poll = 0;
+
+	if (dev->worker) {
+	    dev->worker->num_devs --;
+	}
+
+	list_for_each_entry(route, &(vnet_state.routes), node) {
+	    if (route->dst_dev == dev) {
+		route->dst_dev = NULL;
+	    }
+
+	    if (route->src_dev == dev) {
+		route->src_dev = NULL;
+	    }
+	}
     }
 	
     vnet_unlock_irqrestore(vnet_state.lock, flags);
 
-    Vnet_Free(dev);
+    if (dev != NULL) {
+	// Its worker may still have it queued, it will be dropped there.
+	// The flag is cleared inside the worker's read section, so wait for it first
+	while (*(volatile uint32_t *)&(dev->work_queued)) {
+	    Vnet_Yield();
+	}
+
+	// Then wait for packets and polls that already picked up the device
+	vnet_synchronize();
+
+	Vnet_Free(dev);
+    }
 
     PrintDebug("VNET/P Core: Removed Device: dev_id %d\n", dev_id);
 
@@ -730,11 +1441,74 @@ int v3_vnet_del_dev(int dev_id){
 }
 
 
+/* A device has TX work for its worker */
+int v3_vnet_kick_dev(int dev_id) {
+    struct vnet_dev * dev = NULL;
+    vnet_intr_flags_t flags;
+
+    flags = vnet_lock_irqsave(vnet_state.lock);
+
+    dev = dev_by_id(dev_id);
+
+    if (dev != NULL) {
+	vnet_queue_dev(dev);
+    }
+
+    vnet_unlock_irqrestore(vnet_state.lock, flags);
+
+    return (dev == NULL) ? -1 : 0;
+}
+
+
+/* Move a device to the worker bound to host CPU cpu */
+int v3_vnet_set_dev_cpu(int dev_id, int cpu) {
+    struct vnet_worker * worker = NULL;
+    struct vnet_dev * dev = NULL;
+    vnet_intr_flags_t flags;
+    int i = 0;
+
+    flags = vnet_lock_irqsave(vnet_state.lock);
+
+    for (i = 0; i < vnet_state.num_workers; i++) {
+	if (vnet_state.workers[i].cpu == cpu) {
+	    worker = &(vnet_state.workers[i]);
+	    break;
+	}
+    }
+
+    dev = dev_by_id(dev_id);
+
+    if ((dev != NULL) && (worker != NULL) && (dev->worker != NULL)) {
+	// A queued device finishes on its old worker, later kicks go to the new one
+	dev->worker->num_devs --;
+	dev->worker = worker;
+	worker->num_devs ++;
+
+	vnet_queue_dev(dev);
+    }
+
+    vnet_unlock_irqrestore(vnet_state.lock, flags);
+
+    if ((dev == NULL) || (worker == NULL)) {
+	PrintError("VNET/P Core: No device %d or no flush worker on CPU %d\n", dev_id, cpu);
+	return -1;
+    }
+
+    return 0;
+}
+
+
 int v3_vnet_stat(struct vnet_stat * stats){
-    stats->rx_bytes = vnet_state.stats.rx_bytes;
-    stats->rx_pkts = vnet_state.stats.rx_pkts;
-    stats->tx_bytes = vnet_state.stats.tx_bytes;
-    stats->tx_pkts = vnet_state.stats.tx_pkts;
+    int i = 0;
+
+    memset(stats, 0, sizeof(struct vnet_stat));
+
+    for (i = 0; i < V3_CONFIG_MAX_CPUS; i++) {
+	stats->rx_bytes += vnet_state.cpus[i].stats.rx_bytes;
+	stats->rx_pkts += vnet_state.cpus[i].stats.rx_pkts;
+	stats->tx_bytes += vnet_state.cpus[i].stats.tx_bytes;
+	stats->tx_pkts += vnet_state.cpus[i].stats.tx_pkts;
+    }
 
     return 0;
 }
@@ -753,7 +1527,6 @@ static void deinit_routes_list(){
 
     list_for_each_entry_safe(route, tmp, &(vnet_state.routes), node) {
 	list_del(&(route->node));
-	list_del(&(route->match_node));
 	Vnet_Free(route);
     }
 }
@@ -765,38 +1538,36 @@ int v3_vnet_add_bridge(struct v3_vm_info * vm,
     vnet_intr_flags_t flags;
     int bridge_free = 0;
     struct vnet_brg_dev * tmp_bridge = NULL;    
-    
-    flags = vnet_lock_irqsave(vnet_state.lock);
-    if (vnet_state.bridge == NULL) {
-	bridge_free = 1;
-	vnet_state.bridge = (void *)1;
-    }
-    vnet_unlock_irqrestore(vnet_state.lock, flags);
-
-    if (bridge_free == 0) {
-	PrintError("VNET/P Core: Bridge already set\n");
-	return -1;
-    }
 
+    // The packet path reads the bridge without locking, so it must be complete before it is visible
     tmp_bridge = (struct vnet_brg_dev *)Vnet_Malloc(sizeof(struct vnet_brg_dev));
 
     if (tmp_bridge == NULL) {
 	PrintError("VNET/P Core: Unable to allocate new bridge\n");
-	vnet_state.bridge = NULL;
 	return -1;
     }
     
     tmp_bridge->vm = vm;
     tmp_bridge->brg_ops.input = ops->input;
     tmp_bridge->brg_ops.poll = ops->poll;
+    tmp_bridge->brg_ops.input_batch = ops->input_batch;
     tmp_bridge->private_data = priv_data;
     tmp_bridge->type = type;
 	
-    /* make this atomic to avoid possible race conditions */
     flags = vnet_lock_irqsave(vnet_state.lock);
-    vnet_state.bridge = tmp_bridge;
+    if (vnet_state.bridge == NULL) {
+	bridge_free = 1;
+	vnet_mb();
+	vnet_state.bridge = tmp_bridge;
+    }
     vnet_unlock_irqrestore(vnet_state.lock, flags);
 
+    if (bridge_free == 0) {
+	PrintError("VNET/P Core: Bridge already set\n");
+	Vnet_Free(tmp_bridge);
+	return -1;
+    }
+
     return 0;
 }
 
@@ -815,82 +1586,123 @@ void v3_vnet_del_bridge(uint8_t type) {
     vnet_unlock_irqrestore(vnet_state.lock, flags);
 
     if (tmp_bridge) {
+	vnet_synchronize();
 	Vnet_Free(tmp_bridge);
     }
 }
 
 
-/* can be instanieoued to multiple threads
-  * that runs on multiple cores 
-  * or it could be running on a dedicated side core
-  */
+/* Queue every pollable device of a worker, for devices that did not kick */
+static void requeue_worker_devs(struct vnet_worker * worker) {
+    struct vnet_dev * dev = NULL;
+    vnet_intr_flags_t flags;
+
+    flags = vnet_lock_irqsave(vnet_state.lock);
+
+    list_for_each_entry(dev, &(vnet_state.devs), node) {
+	if (dev->worker == worker) {
+	    vnet_queue_dev(dev);
+	}
+    }
+
+    vnet_unlock_irqrestore(vnet_state.lock, flags);
+}
+
+
+/* Ends a worker's idle sleep, checked by the host after it marks the thread as sleeping */
+static int vnet_worker_has_work(void * arg) {
+    struct vnet_worker * worker = (struct vnet_worker *)arg;
+
+    return ((*(struct vnet_dev * volatile *)&(worker->work) != NULL) || 
+	    (*(volatile uint32_t *)&(worker->sleeping) == 0) ||
+	    (vnet_thread_should_stop()));
+}
+
+
+/* One instance runs per worker, optionally bound to a host core.
+ * A device is only ever on one worker's queue, so it is never polled concurrently.
+ */
 static int vnet_tx_flush(void * args){
+    struct vnet_worker * worker = (struct vnet_worker *)args;
     struct vnet_dev * dev = NULL;
-    int more;
+    struct vnet_dev * next = NULL;
+    int spins = 0;
+    int cpu;
+    int epoch = 0;
     int rc;
 
-    Vnet_Print(0, "VNET/P Polling Thread Starting ....\n");
+    Vnet_Print(0, "VNET/P Polling Thread %d Starting ....\n", worker->idx);
 
-    // since there are multiple instances of this thread, and only
-    // one queue of pollable devices, our model here will be to synchronize
-    // on that queue, removing devices as we go, and keeping them
-    // then putting them back on the queue when we are done
-    // in this way, multiple instances of this function will never
-    // be polling the same device at the same time
+    while (!vnet_thread_should_stop()) {
 
-    struct v3_queue * tq = v3_create_queue();
+	// A device being deleted waits for this section to finish, 
+	//  so it must not be taken off the queue outside of it
+	cpu = vnet_read_lock(&epoch);
 
-    if (!tq) { 
-	PrintError("VNET/P polling thread cannot allocate queue\n");
-	return -1;
-    }
+	dev = vnet_take_work(worker);
 
+	if (dev == NULL) {
+	    vnet_read_unlock(cpu, epoch);
 
-    while (!vnet_thread_should_stop()) {
+	    if (spins < VNET_SPIN_ROUNDS) {
+		spins ++;
+		vnet_udelay(VNET_SPIN_USEC);
+		continue;
+	    }
 
-	more=0; // will indicate if any device has more work for us to do
+	    // Publish that we sleep, the host looks at the queue again once we are marked as sleeping
+	    worker->sleeping = 1;
+	    vnet_mb();
 
-	while ((dev = (struct vnet_dev *)v3_dequeue(vnet_state.poll_devs))) { 
-	    // we are handling this device
-	    v3_enqueue(tq,(addr_t)dev);
-	    
-	    if (dev->poll && dev->dev_ops.poll) {
-		// The device's poll function MUST NOT BLOCK
-		rc = dev->dev_ops.poll(dev->vm, dev->quote, dev->private_data);
-
-		if (rc<0) { 
-		    Vnet_Print(0, "VNET/P: poll from device %p error (ignoring) !\n", dev);
-		} else {
-		    more |= rc;  
-		}
+	    vnet_thread_sleep_until(VNET_IDLE_TIMEOUT, vnet_worker_has_work, worker);
+
+	    if (__sync_bool_compare_and_swap(&(worker->sleeping), 1, 0)) {
+		// Nobody woke us
+		requeue_worker_devs(worker);
 	    }
-	}
-	
-	while ((dev = (struct vnet_dev *)v3_dequeue(tq))) { 
-	    // now someone else can handle it
-	    v3_enqueue(vnet_state.poll_devs, (addr_t)dev); 
+
+	    spins = 0;
+	    continue;
 	}
 
-	// Yield regardless of whether we handled any devices - need
-	// to allow other threads to run
-	if (more) { 
-	    // we have more to do, so we want to get back asap
-	    V3_Yield();
-	} else {
-	    // put ourselves briefly to sleep if we we don't have more
-	    V3_Yield_Timed(VNET_YIELD_USEC);
+	spins = 0;
+
+	for (; dev != NULL; dev = next) {
+	    next = dev->work_next;
+
+	    // Clear the flag first so a kick during the poll queues it again
+	    __sync_lock_release(&(dev->work_queued));
+	    vnet_mb();
+
+	    if ((dev->poll == 0) || (dev->dev_ops.poll == NULL)) {
+		continue;
+	    }
+
+	    // The device's poll function MUST NOT BLOCK
+	    rc = dev->dev_ops.poll(dev->vm, dev->quote, dev->private_data);
+
+	    if (rc < 0) { 
+		Vnet_Print(0, "VNET/P: poll from device %p error (ignoring) !\n", dev);
+	    } else if (rc > 0) {
+		vnet_queue_dev(dev);
+	    }
 	}
 
+	vnet_read_unlock(cpu, epoch);
+
+	// Let other threads on this core run between passes
+	Vnet_Yield();
     }
 
-    Vnet_Free(tq);
-    
-    Vnet_Print(0, "VNET/P Polling Thread Done.\n");
+    Vnet_Print(0, "VNET/P Polling Thread %d Done.\n", worker->idx);
 
     return 0;
 }
 
-int v3_init_vnet() {
+int v3_init_vnet(int * worker_cpus, int num_workers) {
+    struct vnet_worker * worker = NULL;
+    int i = 0;
+
     memset(&vnet_state, 0, sizeof(vnet_state));
 	
     INIT_LIST_HEAD(&(vnet_state.routes));
@@ -903,15 +1715,35 @@ int v3_init_vnet() {
         PrintError("VNET/P: Fails to initiate lock\n");
     }
 
-    vnet_state.route_cache = vnet_create_htable(0, &hash_fn, &hash_eq);
-    if (vnet_state.route_cache == NULL) {
-        PrintError("VNET/P: Fails to initiate route cache\n");
+    if (update_route_table() == -1) {
+        PrintError("VNET/P: Fails to initiate route table\n");
         return -1;
     }
 
-    vnet_state.poll_devs = v3_create_queue();
+    // Without a CPU list a single unbound worker does all the polling
+    if (num_workers <= 0) {
+	worker_cpus = NULL;
+	num_workers = 1;
+    } else if (num_workers > VNET_MAX_WORKERS) {
+	num_workers = VNET_MAX_WORKERS;
+    }
+
+    for (i = 0; i < num_workers; i++) {
+	worker = &(vnet_state.workers[i]);
 
-    vnet_state.pkt_flush_thread = vnet_start_thread(vnet_tx_flush, NULL, "vnetd-1");
+	worker->idx = i;
+	worker->cpu = (worker_cpus) ? worker_cpus[i] : -1;
+	snprintf(worker->name, sizeof(worker->name), "vnetd-%d", i + 1);
+
+	worker->thread = vnet_start_thread_on_cpu(worker->cpu, vnet_tx_flush, worker, worker->name);
+
+	if (worker->thread == NULL) {
+	    PrintError("VNET/P: Fails to start flush worker %d\n", i);
+	    break;
+	}
+
+	vnet_state.num_workers ++;
+    }
 
     PrintDebug("VNET/P is initiated\n");
 
@@ -920,17 +1752,16 @@ int v3_init_vnet() {
 
 
 void v3_deinit_vnet() {
+    int i = 0;
 
-    v3_deinit_queue(vnet_state.poll_devs);
-    Vnet_Free(vnet_state.poll_devs);
-
-    PrintDebug("Stopping flush thread\n");
-    // This will pause until the flush thread is gone
-    vnet_thread_stop(vnet_state.pkt_flush_thread);
+    PrintDebug("Stopping flush threads\n");
+    // This will pause until the flush threads are gone
+    for (i = 0; i < vnet_state.num_workers; i++) {
+	vnet_thread_stop(vnet_state.workers[i].thread);
+	Vnet_Free(vnet_state.workers[i].thread);
+    }
     // At this point there should be no lock-holder
 
-    Vnet_Free(vnet_state.poll_devs);
-
 
     PrintDebug("Deiniting Device List\n");
     // close any devices we have open
@@ -940,9 +1771,10 @@ void v3_deinit_vnet() {
     // remove any routes we have
     deinit_routes_list();
 
-    PrintDebug("Freeing hash table\n");
-    // remove the hash table
-    vnet_free_htable(vnet_state.route_cache, 1, 1);
+    PrintDebug("Freeing route table\n");
+    // remove the route table and its cache
+    free_route_table(vnet_state.route_table);
+    vnet_state.route_table = NULL;
 
     
     PrintDebug("Removing Bridge\n");
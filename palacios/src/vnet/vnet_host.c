@@ -44,6 +44,31 @@ struct vnet_thread * vnet_start_thread(int (*func)(void *), void *arg, char * na
 }
 
 
+/* Falls back to an unbound thread if the host cannot bind it or cpu is -1 */
+struct vnet_thread * vnet_start_thread_on_cpu(int cpu, int (*func)(void *), void *arg, char * name){
+    if ((cpu < 0) || (host_hooks == NULL) || (host_hooks->thread_start_on_cpu == NULL)) {
+	return vnet_start_thread(func, arg, name);
+    }
+
+    struct vnet_thread * thread = Vnet_Malloc(sizeof(struct vnet_thread));
+
+    if (!thread) {
+	PrintError("Cannot allocate space to create a vnet thread\n");
+	return NULL;
+    }
+
+    thread->host_thread = host_hooks->thread_start_on_cpu(cpu, func, arg, name);
+
+    if (thread->host_thread) {
+	return thread;
+    }
+
+    Vnet_Free(thread);
+
+    return NULL;
+}
+
+
 struct vnet_timer * vnet_create_timer(unsigned long interval, 
 				      void (* timer_fun)(void * priv_data), 
 				      void * priv_data){
@@ -64,9 +89,9 @@ struct vnet_timer * vnet_create_timer(unsigned long interval,
  }
 
 
-void init_vnet(struct vnet_host_hooks * hooks){
+void init_vnet(struct vnet_host_hooks * hooks, int * worker_cpus, int num_workers){
     host_hooks = hooks;
-    v3_init_vnet();
+    v3_init_vnet(worker_cpus, num_workers);
 }
 
 
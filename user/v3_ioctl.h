@@ -43,6 +43,9 @@
 #define V3_VM_KEYBOARD_EVENT     142
 #define V3_VM_STREAM_CONNECT     145
 
+#define V3_VM_TELEMETRY_EXITS    146
+#define V3_VM_TELEMETRY_TRACE    147
+
 
 #define V3_VM_XPMEM_CONNECT      12000
 
@@ -103,6 +106,42 @@ struct v3_debug_cmd {
 } __attribute__((packed));
 
 
+#define V3_TELEM_HIST_BUCKETS 160
+#define V3_TELEM_MAX_EXITS    128
+
+struct v3_telem_exit_stats {
+    u32 exit_code;
+    u32 cnt;
+    u64 handler_cycles;
+    u64 guest_cycles;
+    u64 max_cycles;
+    u64 p50;
+    u64 p99;
+    u64 p999;
+    u32 hist[V3_TELEM_HIST_BUCKETS];
+} __attribute__((packed));
+
+struct v3_telem_record {
+    u64 tsc;
+    u64 guest_cycles;
+    u64 host_cycles;
+    u32 exit_code;
+    u32 vcore;
+} __attribute__((packed));
+
+struct v3_telemetry_cmd {
+    u32 core;
+    u32 max_entries;
+    u32 num_entries;
+    u32 rsvd;
+    u64 exit_cnt;
+    u64 guest_cycles;
+    u64 host_cycles;
+    u64 lost;
+    u64 buf;
+} __attribute__((packed));
+
+
 #define MAX_CHKPT_STORE_LEN 128
 #define MAX_CHKPT_URL_LEN   256
 
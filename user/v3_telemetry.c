@@ -0,0 +1,215 @@
+/*
+ * V3 telemetry interface
+ * Reads per exit latency histograms and the exit trace ring of a VM core
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#include "v3_ioctl.h"
+#include "v3vee.h"
+
+
+#define TRACE_BATCH 4096
+
+
+void usage() {
+
+	printf("usage: v3_telemetry [-t] [-i interval_us] [-H] <vm_device> <vm core>\n");
+	printf("\tDefault: Print per exit latency percentiles (in cycles)\n");
+	printf("\t-H: Also print the raw latency histogram for each exit\n");
+	printf("\t-t: Continuously drain the exit trace ring as CSV\n");
+	printf("\t-i: Polling interval for trace mode (default 100000us)\n");
+	return;
+
+}
+
+
+/* Inverse of the bucket mapping in vmm_telemetry.c */
+static unsigned long long
+bucket_base(int bucket)
+{
+    if (bucket < 4) {
+	return bucket;
+    }
+
+    return (4ULL | (bucket & 0x3)) << ((bucket / 4) - 1);
+}
+
+
+static int
+print_exits(int vm_id, u32 core, int print_hist)
+{
+    struct v3_telem_exit_stats * stats = NULL;
+    struct v3_telemetry_cmd      cmd;
+    int num_exits = 0;
+    int i = 0;
+    int j = 0;
+
+    stats = calloc(V3_TELEM_MAX_EXITS, sizeof(struct v3_telem_exit_stats));
+
+    if (!stats) {
+	printf("Error: Could not allocate exit buffer\n");
+	return -1;
+    }
+
+    memset(&cmd, 0, sizeof(struct v3_telemetry_cmd));
+
+    cmd.core        = core;
+    cmd.max_entries = V3_TELEM_MAX_EXITS;
+    cmd.buf         = (uintptr_t)stats;
+
+    num_exits = v3_get_telemetry_exits(vm_id, &cmd);
+
+    if (num_exits < 0) {
+	printf("Error: Could not read telemetry from VM\n");
+	free(stats);
+	return -1;
+    }
+
+    printf("Core %u: %llu exits, Host=%llu cycles, Guest=%llu cycles\n", core,
+	   (unsigned long long)cmd.exit_cnt,
+	   (unsigned long long)cmd.host_cycles,
+	   (unsigned long long)cmd.guest_cycles);
+
+    printf("%-10s %12s %12s %12s %12s %12s %12s %14s\n",
+	   "Exit", "Count", "Avg", "p50", "p99", "p999", "Max", "Avg. Guest");
+
+    for (i = 0; i < num_exits; i++) {
+	struct v3_telem_exit_stats * evt = &(stats[i]);
+
+	if (evt->cnt == 0) {
+	    continue;
+	}
+
+	printf("0x%-8x %12u %12llu %12llu %12llu %12llu %12llu %14llu\n",
+	       evt->exit_code, evt->cnt,
+	       (unsigned long long)(evt->handler_cycles / evt->cnt),
+	       (unsigned long long)evt->p50,
+	       (unsigned long long)evt->p99,
+	       (unsigned long long)evt->p999,
+	       (unsigned long long)evt->max_cycles,
+	       (unsigned long long)(evt->guest_cycles / evt->cnt));
+
+	if (print_hist) {
+	    for (j = 0; j < V3_TELEM_HIST_BUCKETS; j++) {
+		if (evt->hist[j]) {
+		    printf("\t>= %llu: %u\n", bucket_base(j), evt->hist[j]);
+		}
+	    }
+	}
+    }
+
+    free(stats);
+
+    return 0;
+}
+
+
+static int
+trace_exits(int vm_id, u32 core, unsigned int interval_us)
+{
+    struct v3_telem_record  * recs = NULL;
+    struct v3_telemetry_cmd   cmd;
+    unsigned long long        lost = 0;
+    int num_recs = 0;
+    int i = 0;
+
+    recs = calloc(TRACE_BATCH, sizeof(struct v3_telem_record));
+
+    if (!recs) {
+	printf("Error: Could not allocate trace buffer\n");
+	return -1;
+    }
+
+    printf("tsc,vcore,exit_code,guest_cycles,host_cycles\n");
+
+    while (1) {
+	memset(&cmd, 0, sizeof(struct v3_telemetry_cmd));
+
+	cmd.core        = core;
+	cmd.max_entries = TRACE_BATCH;
+	cmd.buf         = (uintptr_t)recs;
+
+	num_recs = v3_get_telemetry_trace(vm_id, &cmd);
+
+	if (num_recs < 0) {
+	    printf("Error: Could not read exit trace from VM\n");
+	    free(recs);
+	    return -1;
+	}
+
+	for (i = 0; i < num_recs; i++) {
+	    printf("%llu,%u,0x%x,%llu,%llu\n",
+		   (unsigned long long)recs[i].tsc,
+		   recs[i].vcore,
+		   recs[i].exit_code,
+		   (unsigned long long)recs[i].guest_cycles,
+		   (unsigned long long)recs[i].host_cycles);
+	}
+
+	if (cmd.lost != lost) {
+	    fprintf(stderr, "Warning: %llu trace records lost\n", (unsigned long long)(cmd.lost - lost));
+	    lost = cmd.lost;
+	}
+
+	// Only sleep when we've caught up with the core
+	if (num_recs < TRACE_BATCH) {
+	    fflush(stdout);
+	    usleep(interval_us);
+	}
+    }
+
+    free(recs);
+
+    return 0;
+}
+
+
+int main(int argc, char ** argv) {
+    char * vm_dev      = NULL;
+    u32    core        = 0;
+    int    trace       = 0;
+    int    print_hist  = 0;
+    int    interval_us = 100000;
+    int    c           = 0;
+
+    opterr = 0;
+
+    while ((c = getopt(argc, argv, "tHi:")) != -1) {
+	switch (c) {
+	    case 't':
+		trace = 1;
+		break;
+	    case 'H':
+		print_hist = 1;
+		break;
+	    case 'i':
+		interval_us = atoi(optarg);
+		break;
+	    default:
+		usage();
+		return -1;
+	}
+    }
+
+    if (argc - optind < 2) {
+	usage();
+	return -1;
+    }
+
+    vm_dev = argv[optind];
+    core   = atoi(argv[optind + 1]);
+
+    if (trace) {
+	return trace_exits(get_vm_id_from_path(vm_dev), core, interval_us);
+    }
+
+    return print_exits(get_vm_id_from_path(vm_dev), core, print_hist);
+}
@@ -462,6 +462,40 @@ v3_move_vcore(int vm_id,
 
 }
 
+static int
+__get_telemetry(int                       vm_id, 
+		int                       ioctl_num, 
+		struct v3_telemetry_cmd * cmd)
+{
+    char * dev_path = get_vm_dev_path(vm_id);
+    int    ret      = 0;
+
+    ret = pet_ioctl_path(dev_path, ioctl_num, IOCTL_ARG(cmd)); 
+
+    free(dev_path);
+
+    if (ret < 0) {
+	ERROR("Could not read telemetry from VM %d (core %d)\n", vm_id, cmd->core);
+	return -1;
+    }
+
+    return cmd->num_entries;
+}
+
+int
+v3_get_telemetry_exits(int                       vm_id,
+		       struct v3_telemetry_cmd * cmd)
+{
+    return __get_telemetry(vm_id, V3_VM_TELEMETRY_EXITS, cmd);
+}
+
+int
+v3_get_telemetry_trace(int                       vm_id,
+		       struct v3_telemetry_cmd * cmd)
+{
+    return __get_telemetry(vm_id, V3_VM_TELEMETRY_TRACE, cmd);
+}
+
 int
 v3_debug_vm(int vm_id,
 	    u32 core,
@@ -97,6 +97,13 @@ int v3_move_vcore(int vm_id,
 int v3_debug_vm(int vm_id, u32 core, u32 flags);
 
 
+/* Telemetry: the caller fills in core, max_entries and buf. 
+ * Returns the number of entries copied into buf, or -1 on error */
+struct v3_telemetry_cmd;
+int v3_get_telemetry_exits(int vm_id, struct v3_telemetry_cmd * cmd);
+int v3_get_telemetry_trace(int vm_id, struct v3_telemetry_cmd * cmd);
+
+
 /* VM Query functions */
 
 struct v3_vm_info {